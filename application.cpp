@@ -350,6 +350,109 @@ string Application::tempPath(const string aTempFile)
 
 #if ENABLE_JSON_APPLICATION
 
+// MARK: - JsonResourceCache
+
+JsonResourceCache::JsonResourceCache(size_t aMaxEntries) :
+  mMaxEntries(aMaxEntries),
+  mHits(0),
+  mMisses(0),
+  mReloads(0),
+  mEvictions(0)
+{
+}
+
+
+void JsonResourceCache::setMaxEntries(size_t aMaxEntries)
+{
+  mMaxEntries = aMaxEntries;
+  while (mEntries.size()>mMaxEntries) {
+    remove(mEntries.find(mLRU.back()));
+    mEvictions++;
+  }
+}
+
+
+void JsonResourceCache::remove(EntryMap::iterator aPos)
+{
+  mLRU.erase(aPos->second.lruPos);
+  mEntries.erase(aPos);
+}
+
+
+void JsonResourceCache::invalidate(const string &aPath)
+{
+  if (aPath.empty()) {
+    mEntries.clear();
+    mLRU.clear();
+    return;
+  }
+  EntryMap::iterator pos = mEntries.find(aPath);
+  if (pos!=mEntries.end()) remove(pos);
+}
+
+
+JsonObjectPtr JsonResourceCache::get(const string &aPath, ErrorPtr *aErrorP)
+{
+  struct stat st;
+  EntryMap::iterator pos = mEntries.find(aPath);
+  if (stat(aPath.c_str(), &st)!=0) {
+    // gone (or never existed), let objFromFile report the error
+    if (pos!=mEntries.end()) remove(pos);
+    return JsonObject::objFromFile(aPath.c_str(), aErrorP, true);
+  }
+  #if defined(__APPLE__)
+  int64_t mtimeNs = (int64_t)st.st_mtimespec.tv_sec*1000000000+st.st_mtimespec.tv_nsec;
+  #else
+  int64_t mtimeNs = (int64_t)st.st_mtim.tv_sec*1000000000+st.st_mtim.tv_nsec;
+  #endif
+  if (pos!=mEntries.end()) {
+    Entry &e = pos->second;
+    if (e.dev==(uint64_t)st.st_dev && e.ino==(uint64_t)st.st_ino && e.size==(uint64_t)st.st_size && e.mtimeNs==mtimeNs) {
+      // unchanged
+      mHits++;
+      mLRU.splice(mLRU.begin(), mLRU, e.lruPos);
+      if (aErrorP) aErrorP->reset();
+      return e.json;
+    }
+    // changed on disk
+    mReloads++;
+    remove(pos);
+  }
+  else {
+    mMisses++;
+  }
+  JsonObjectPtr json = JsonObject::objFromFile(aPath.c_str(), aErrorP, true);
+  if (json && mMaxEntries>0) {
+    Entry &e = mEntries[aPath];
+    e.json = json;
+    e.dev = st.st_dev;
+    e.ino = st.st_ino;
+    e.size = st.st_size;
+    e.mtimeNs = mtimeNs;
+    mLRU.push_front(aPath);
+    e.lruPos = mLRU.begin();
+    if (mEntries.size()>mMaxEntries) {
+      remove(mEntries.find(mLRU.back()));
+      mEvictions++;
+    }
+  }
+  return json;
+}
+
+
+// MARK: - Application JSON resources
+
+static JsonResourceCache *sharedJsonResourceCacheP = NULL;
+
+JsonResourceCache &Application::jsonResourceCache()
+{
+  if (!sharedJsonResourceCacheP) {
+    sharedJsonResourceCacheP = new JsonResourceCache();
+  }
+  return *sharedJsonResourceCacheP;
+}
+
+
 JsonObjectPtr Application::jsonObjOrResource(const string &aText, ErrorPtr *aErrorP, const string aPrefix)
 {
   JsonObjectPtr obj;
@@ -370,7 +473,7 @@ JsonObjectPtr Application::jsonResource(string aResourceName, ErrorPtr *aErrorP,
   JsonObjectPtr r;
   ErrorPtr err;
   string fn = Application::sharedApplication()->resourcePath(aResourceName, aPrefix);
-  r = JsonObject::objFromFile(fn.c_str(), &err, true);
+  r = jsonResourceCache().get(fn, &err);
   if (aErrorP) *aErrorP = err;
   return r;
 }
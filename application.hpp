@@ -53,6 +53,77 @@ namespace p44 {
 
   class MainLoop;
 
+  #if ENABLE_JSON_APPLICATION
+
+  /// cache for parsed JSON resource files, used by Application::jsonResource()
+  /// - entries are keyed by the resolved file path
+  /// - every access checks the file's device, inode, size and modification time, and re-parses it when changed
+  /// - the least recently used entries are evicted when the entry count limit is exceeded
+  /// - files that cannot be read or parsed are not cached
+  class JsonResourceCache : public P44Obj
+  {
+    typedef std::list<string> LRUList;
+
+    typedef struct {
+      JsonObjectPtr json; ///< the parsed file (shared, must not be modified)
+      uint64_t dev; ///< device of the file
+      uint64_t ino; ///< inode of the file
+      uint64_t size; ///< size of the file
+      int64_t mtimeNs; ///< modification time of the file in nanoseconds
+      LRUList::iterator lruPos; ///< position in the LRU list
+    } Entry;
+    typedef std::map<string, Entry> EntryMap;
+
+    EntryMap mEntries;
+    LRUList mLRU; ///< paths, most recently used first
+    size_t mMaxEntries;
+
+    // statistics
+    long mHits;
+    long mMisses;
+    long mReloads;
+    long mEvictions;
+
+  public:
+
+    /// create a cache
+    /// @param aMaxEntries max number of files kept parsed in memory, 0 to disable caching
+    JsonResourceCache(size_t aMaxEntries = 50);
+
+    /// set max number of entries
+    /// @param aMaxEntries max number of files kept parsed in memory, 0 to disable caching
+    void setMaxEntries(size_t aMaxEntries);
+
+    /// get parsed JSON file
+    /// @param aPath the file path
+    /// @param aErrorP if set, file access or parsing error is stored here
+    /// @return json or NULL if file could not be read or parsed
+    /// @note the returned object is shared with all other users of the same file and must not be modified.
+    ///   Callers that need to modify it must make a copy first (JsonObject copy constructor)
+    JsonObjectPtr get(const string &aPath, ErrorPtr *aErrorP);
+
+    /// invalidate cached files
+    /// @param aPath the file path to forget, or empty to forget all files
+    void invalidate(const string &aPath = "");
+
+    /// @name statistics
+    /// @{
+    long hits() { return mHits; }; ///< number of get() calls answered from cache
+    long misses() { return mMisses; }; ///< number of get() calls for files not in the cache
+    long reloads() { return mReloads; }; ///< number of get() calls for cached files that had changed on disk
+    long evictions() { return mEvictions; }; ///< number of entries evicted due to the entry count limit
+    size_t entries() { return mEntries.size(); }; ///< number of files currently cached
+    /// @}
+
+  private:
+
+    void remove(EntryMap::iterator aPos);
+
+  };
+
+  #endif // ENABLE_JSON_APPLICATION
+
+
   class Application : public P44LoggingObj
   {
     typedef P44LoggingObj inherited;
@@ -187,6 +258,8 @@ namespace p44 {
     /// @param aErrorP if set, parsing error is stored here
     /// @param aPrefix prefix possibly used on resource path (see resourcepath())
     /// @return json or NULL if none found
+    /// @note parsed files are cached (see jsonResourceCache()), so the returned object is shared and must not
+    ///   be modified. Callers that need to modify it must make a copy first (JsonObject copy constructor)
     static JsonObjectPtr jsonResource(string aResourceName, ErrorPtr *aErrorP, const string aPrefix="");
 
     /// parse JSON literal or get json file from resource
@@ -196,6 +269,7 @@ namespace p44 {
     /// @param aErrorP if set, parsing error is stored here
     /// @param aPrefix prefix possibly used on resource path (see resourcepath())
     /// @return json or NULL if none found
+    /// @note JSON from resource files is shared and must not be modified, see jsonResource()
     static JsonObjectPtr jsonObjOrResource(const string &aText, ErrorPtr *aErrorP, const string aPrefix="");
 
     /// parse JSON literal or get json file from resource
@@ -205,8 +279,12 @@ namespace p44 {
     /// @param aErrorP if set, parsing error is stored here
     /// @param aPrefix prefix possibly used on resource path (see resourcepath())
     /// @return json or NULL if none found
+    /// @note JSON from resource files is shared and must not be modified, see jsonResource()
     static JsonObjectPtr jsonObjOrResource(JsonObjectPtr aConfig, ErrorPtr *aErrorP, const string aPrefix="");
 
+    /// @return the cache for parsed JSON resource files (shared by all users of jsonResource() and jsonObjOrResource())
+    static JsonResourceCache &jsonResourceCache();
+
     #endif // ENABLE_JSON_APPLICATION
 
     /// @return version of this application
@@ -0,0 +1,1002 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+#include "dnsresolver.hpp"
+
+#include <net/if.h>
+#include <algorithm>
+#include <ctype.h>
+#ifndef ESP_PLATFORM
+#include <poll.h>
+#include <sys/syscall.h>
+#else
+#include "esp_random.h"
+#endif
+
+using namespace p44;
+
+
+socklen_t p44::sockAddrLen(const struct sockaddr_storage &aAddr)
+{
+  switch (aAddr.ss_family) {
+    case AF_INET: return sizeof(struct sockaddr_in);
+    case AF_INET6: return sizeof(struct sockaddr_in6);
+    #ifndef ESP_PLATFORM
+    case AF_UNIX: return sizeof(struct sockaddr_un);
+    #endif
+    default: return sizeof(struct sockaddr_storage);
+  }
+}
+
+
+#if ENABLE_ASYNC_DNS
+
+#define DNS_PORT 53
+#define DNS_DEFAULT_TIMEOUT (2*Second) // time to wait for an answer from a server before trying the next one
+#define DNS_DEFAULT_ATTEMPTS 2 // rounds through all servers
+#define DNS_MAX_TTL (24*3600) // [seconds] max time to cache a positive answer
+#define DNS_MAX_NEGATIVE_TTL 300 // [seconds] max time to cache a negative answer
+#define DNS_DEFAULT_NEGATIVE_TTL 60 // [seconds] time to cache a negative answer when server does not provide a SOA
+#define DNS_FAILURE_TTL 5 // [seconds] time to cache server failures and timeouts, to avoid hammering a broken server
+#define DNS_CONFIG_CHECK_INTERVAL (5*Second) // how often to check resolv.conf and hosts for changes
+#define DNS_MAX_CACHE_ENTRIES 256
+#define DNS_MAX_MSG_SIZE 4096
+#define DNS_QUERIES_PER_PORT 16 // number of queries sent from one source port before switching to a new random port
+#define DNS_MIN_SOURCE_PORT 1024
+#define DNS_PORT_BIND_ATTEMPTS 10 // number of random ports to try before letting the OS choose
+#define DNS_MAX_CNAME_CHAIN 8 // max number of CNAMEs to follow within one answer
+#define DNS_MAX_ANSWER_RRS 64 // max number of answer records considered
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_FORMERR 1
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_REFUSED 5
+#define DNS_RCODE_TIMEOUT -1 // internal: no answer received
+
+
+// MARK: - DnsQuery
+
+namespace p44 {
+
+  /// a lookup in progress
+  class DnsQuery : public P44Obj
+  {
+  public:
+
+    /// query for one record type
+    typedef struct {
+      uint16_t type; ///< DNS_TYPE_A or DNS_TYPE_AAAA
+      uint16_t id; ///< message ID of the query packet last sent, 0 if none
+      int fd; ///< socket (source port) the query packet was last sent from
+      string question; ///< encoded question section
+      bool done;
+      int rcode;
+      DnsAddressList addresses;
+      uint32_t ttl; ///< TTL of the addresses, or negative TTL
+    } SubQuery;
+
+    string mKey; ///< cache key
+    int mFamily;
+    std::vector<string> mCandidates; ///< names to try (search domains applied)
+    size_t mCandidate; ///< index of candidate currently queried
+    SubQuery mSub[2];
+    int mNumSub;
+    size_t mServerIdx; ///< index of server to send next query to
+    int mSendRounds; ///< number of servers tried for current candidate
+    bool mNameExists; ///< set when at least one candidate name exists (but may have no addresses)
+    std::list<DnsResolveCB> mCallbacks;
+    MLTicket mTimeoutTicket;
+
+    DnsQuery() : mFamily(PF_UNSPEC), mCandidate(0), mNumSub(0), mServerIdx(0), mSendRounds(0), mNameExists(false) {};
+  };
+
+} // namespace p44
+
+
+// MARK: - DNS message helpers
+
+static void splitWords(const string &aText, std::vector<string> &aWords)
+{
+  aWords.clear();
+  size_t i = 0;
+  while (i<aText.size()) {
+    size_t e = aText.find_first_of(" \t,", i);
+    if (e==string::npos) e = aText.size();
+    if (e>i) aWords.push_back(aText.substr(i, e-i));
+    i = e+1;
+  }
+}
+
+
+static bool parseAddress(const string &aText, uint16_t aDefaultPort, struct sockaddr_storage &aAddr)
+{
+  memset(&aAddr, 0, sizeof(aAddr));
+  string host = aText;
+  uint16_t port = aDefaultPort;
+  string scope;
+  if (!host.empty() && host[0]=='[') {
+    // [ipv6]:port
+    size_t e = host.find(']');
+    if (e==string::npos) return false;
+    if (e+1<host.size()) {
+      if (host[e+1]!=':') return false;
+      port = (uint16_t)atoi(host.c_str()+e+2);
+    }
+    host = host.substr(1, e-1);
+  }
+  else if (std::count(host.begin(), host.end(), ':')==1) {
+    // ipv4:port
+    size_t e = host.find(':');
+    port = (uint16_t)atoi(host.c_str()+e+1);
+    host.erase(e);
+  }
+  size_t s = host.find('%');
+  if (s!=string::npos) {
+    scope = host.substr(s+1);
+    host.erase(s);
+  }
+  struct sockaddr_in *sin = (struct sockaddr_in *)&aAddr;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&aAddr;
+  if (inet_pton(AF_INET, host.c_str(), &sin->sin_addr)==1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    return true;
+  }
+  if (inet_pton(AF_INET6, host.c_str(), &sin6->sin6_addr)==1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    if (!scope.empty()) sin6->sin6_scope_id = if_nametoindex(scope.c_str());
+    return true;
+  }
+  return false;
+}
+
+
+static bool sameAddress(const struct sockaddr_storage &aA, const struct sockaddr_storage &aB)
+{
+  if (aA.ss_family!=aB.ss_family) return false;
+  if (aA.ss_family==AF_INET) {
+    const struct sockaddr_in *a = (const struct sockaddr_in *)&aA;
+    const struct sockaddr_in *b = (const struct sockaddr_in *)&aB;
+    return a->sin_port==b->sin_port && a->sin_addr.s_addr==b->sin_addr.s_addr;
+  }
+  if (aA.ss_family==AF_INET6) {
+    const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)&aA;
+    const struct sockaddr_in6 *b = (const struct sockaddr_in6 *)&aB;
+    return a->sin6_port==b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr))==0;
+  }
+  return false;
+}
+
+
+/// encode a question section
+static bool encodeQuestion(const string &aName, uint16_t aType, string &aQuestion)
+{
+  aQuestion.clear();
+  size_t i = 0;
+  while (i<aName.size()) {
+    size_t e = aName.find('.', i);
+    if (e==string::npos) e = aName.size();
+    size_t n = e-i;
+    if (n==0 || n>63) return false; // empty or oversize label
+    aQuestion += (char)n;
+    aQuestion.append(aName, i, n);
+    i = e+1;
+  }
+  if (aQuestion.empty() || aQuestion.size()>254) return false;
+  aQuestion += '\0';
+  aQuestion += (char)(aType>>8);
+  aQuestion += (char)(aType & 0xFF);
+  aQuestion += (char)(DNS_CLASS_IN>>8);
+  aQuestion += (char)(DNS_CLASS_IN & 0xFF);
+  return true;
+}
+
+
+/// skip a (possibly compressed) name
+static bool skipName(const uint8_t *aMsg, size_t aLen, size_t &aPos)
+{
+  while (aPos<aLen) {
+    uint8_t l = aMsg[aPos];
+    if ((l & 0xC0)==0xC0) {
+      // compression pointer ends the name
+      aPos += 2;
+      return aPos<=aLen;
+    }
+    if (l & 0xC0) return false; // unsupported label type
+    aPos += 1+l;
+    if (l==0) return true;
+  }
+  return false;
+}
+
+
+static inline uint16_t get16(const uint8_t *aP) { return (uint16_t)((aP[0]<<8) | aP[1]); }
+static inline uint32_t get32(const uint8_t *aP) { return ((uint32_t)aP[0]<<24) | ((uint32_t)aP[1]<<16) | ((uint32_t)aP[2]<<8) | aP[3]; }
+
+
+/// read a (possibly compressed) name
+/// @param aName will be set to the name in lowercase wire format (length prefixed labels), for comparing names
+/// @return false if name is malformed
+static bool readName(const uint8_t *aMsg, size_t aLen, size_t &aPos, string &aName)
+{
+  aName.clear();
+  size_t p = aPos;
+  int jumps = 0;
+  while (p<aLen) {
+    uint8_t l = aMsg[p];
+    if ((l & 0xC0)==0xC0) {
+      // compression pointer, continue reading elsewhere
+      if (p+2>aLen || ++jumps>DNS_MAX_CNAME_CHAIN*4) return false; // malformed or pointer loop
+      if (jumps==1) aPos = p+2; // name ends here in the record
+      p = ((l & 0x3F)<<8) | aMsg[p+1];
+      continue;
+    }
+    if (l & 0xC0) return false; // unsupported label type
+    if (p+1+l>aLen || aName.size()+1+l>255) return false;
+    aName += (char)l;
+    for (size_t i=0; i<l; i++) aName += (char)tolower(aMsg[p+1+i]);
+    p += 1+l;
+    if (l==0) {
+      if (jumps==0) aPos = p;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// MARK: - DnsResolver
+
+// one resolver per thread, as it is bound to the thread's mainloop
+#if BOOST_DISABLE_THREADS
+static DnsResolver *sharedDnsResolver = NULL;
+#else
+static __thread DnsResolver *sharedDnsResolver = NULL;
+#endif
+
+
+DnsResolver &DnsResolver::sharedResolver()
+{
+  if (!sharedDnsResolver) {
+    sharedDnsResolver = new DnsResolver(MainLoop::currentMainLoop());
+  }
+  return *sharedDnsResolver;
+}
+
+
+DnsResolver::DnsResolver(MainLoop &aMainLoop) :
+  mMainLoop(aMainLoop),
+  mNdots(1),
+  mTimeout(DNS_DEFAULT_TIMEOUT),
+  mAttempts(DNS_DEFAULT_ATTEMPTS),
+  mExplicitConfig(false),
+  mResolvConfMTime(0),
+  mResolvConfChecked(Never),
+  mHostsMTime(0),
+  mHostsChecked(Never),
+  mMaxCacheEntries(DNS_MAX_CACHE_ENTRIES),
+  mRandomUsed(sizeof(mRandomPool)),
+  mSocket4(-1),
+  mSocket6(-1),
+  mSocket4Queries(0),
+  mSocket6Queries(0),
+  mCacheHits(0),
+  mCacheMisses(0),
+  mQueriesSent(0),
+  mTimeouts(0)
+{
+}
+
+
+DnsResolver::~DnsResolver()
+{
+  closeQuerySocket(mSocket4);
+  closeQuerySocket(mSocket6);
+  for (std::list<int>::iterator pos = mRetiredSockets.begin(); pos!=mRetiredSockets.end(); ++pos) {
+    closeQuerySocket(*pos);
+  }
+}
+
+
+ErrorPtr DnsResolver::setNameServers(const string &aNameServers, const string &aSearchDomains)
+{
+  std::vector<string> words;
+  splitWords(aNameServers, words);
+  mNameServers.clear();
+  mSearchDomains.clear();
+  mExplicitConfig = !words.empty();
+  mResolvConfChecked = Never; // re-read resolv.conf when explicit config is removed
+  mResolvConfMTime = 0;
+  for (size_t i=0; i<words.size(); i++) {
+    struct sockaddr_storage sa;
+    if (!parseAddress(words[i], DNS_PORT, sa)) {
+      return TextError::err("invalid name server address '%s'", words[i].c_str());
+    }
+    mNameServers.push_back(sa);
+  }
+  splitWords(lowerCase(aSearchDomains), mSearchDomains);
+  flushCache();
+  return ErrorPtr();
+}
+
+
+void DnsResolver::checkConfig()
+{
+  if (mExplicitConfig) return;
+  MLMicroSeconds now = MainLoop::now();
+  if (mResolvConfChecked!=Never && now<mResolvConfChecked+DNS_CONFIG_CHECK_INTERVAL) return;
+  mResolvConfChecked = now;
+  struct stat st;
+  if (stat("/etc/resolv.conf", &st)!=0) st.st_mtime = 0;
+  if (st.st_mtime==mResolvConfMTime) return; // unchanged
+  mResolvConfMTime = st.st_mtime;
+  mNameServers.clear();
+  mSearchDomains.clear();
+  mNdots = 1;
+  FILE *f = fopen("/etc/resolv.conf", "r");
+  if (!f) return;
+  string line;
+  std::vector<string> words;
+  while (string_fgetline(f, line)) {
+    splitWords(line, words);
+    if (words.size()<2 || words[0][0]=='#' || words[0][0]==';') continue;
+    if (words[0]=="nameserver") {
+      struct sockaddr_storage sa;
+      if (parseAddress(words[1], DNS_PORT, sa)) mNameServers.push_back(sa);
+    }
+    else if (words[0]=="search" || words[0]=="domain") {
+      mSearchDomains.clear();
+      for (size_t i=1; i<words.size(); i++) mSearchDomains.push_back(lowerCase(words[i]));
+    }
+    else if (words[0]=="options") {
+      for (size_t i=1; i<words.size(); i++) {
+        int v;
+        if (sscanf(words[i].c_str(), "ndots:%d", &v)==1) mNdots = v;
+        else if (sscanf(words[i].c_str(), "timeout:%d", &v)==1 && v>0) mTimeout = v*Second;
+        else if (sscanf(words[i].c_str(), "attempts:%d", &v)==1 && v>0) mAttempts = v;
+      }
+    }
+  }
+  fclose(f);
+  LOG(LOG_INFO, "DnsResolver: %zu name server(s) from /etc/resolv.conf", mNameServers.size());
+  flushCache(); // configuration changed
+}
+
+
+void DnsResolver::checkHosts()
+{
+  MLMicroSeconds now = MainLoop::now();
+  if (mHostsChecked!=Never && now<mHostsChecked+DNS_CONFIG_CHECK_INTERVAL) return;
+  mHostsChecked = now;
+  struct stat st;
+  if (stat("/etc/hosts", &st)!=0) st.st_mtime = 0;
+  if (st.st_mtime==mHostsMTime) return; // unchanged
+  mHostsMTime = st.st_mtime;
+  mHosts.clear();
+  FILE *f = fopen("/etc/hosts", "r");
+  if (!f) return;
+  string line;
+  std::vector<string> words;
+  while (string_fgetline(f, line)) {
+    size_t c = line.find('#');
+    if (c!=string::npos) line.erase(c);
+    splitWords(line, words);
+    struct sockaddr_storage sa;
+    if (words.size()<2 || !parseAddress(words[0], 0, sa)) continue;
+    for (size_t i=1; i<words.size(); i++) {
+      mHosts[lowerCase(words[i])].push_back(sa);
+    }
+  }
+  fclose(f);
+}
+
+
+bool DnsResolver::lookupHosts(const string &aName, int aFamily, DnsAddressList &aAddresses)
+{
+  aAddresses.clear();
+  HostsMap::iterator pos = mHosts.find(aName);
+  if (pos!=mHosts.end()) {
+    for (DnsAddressList::iterator a = pos->second.begin(); a!=pos->second.end(); ++a) {
+      if (aFamily==PF_UNSPEC || aFamily==a->ss_family) aAddresses.push_back(*a);
+    }
+  }
+  else if (aName=="localhost" || (aName.size()>10 && aName.compare(aName.size()-10, 10, ".localhost")==0)) {
+    // RFC 6761: localhost is always the loopback, even if not in hosts
+    struct sockaddr_storage sa;
+    if (aFamily!=PF_INET) {
+      parseAddress("::1", 0, sa);
+      aAddresses.push_back(sa);
+    }
+    if (aFamily!=PF_INET6) {
+      parseAddress("127.0.0.1", 0, sa);
+      aAddresses.push_back(sa);
+    }
+  }
+  return !aAddresses.empty();
+}
+
+
+void DnsResolver::resolve(const string &aHostName, int aFamily, DnsResolveCB aResolveCB)
+{
+  DnsAddressList addrs;
+  struct sockaddr_storage sa;
+  // numeric addresses
+  if (parseAddress(aHostName, 0, sa)) {
+    if (aFamily!=PF_UNSPEC && aFamily!=sa.ss_family) {
+      if (aResolveCB) aResolveCB(Error::err<DnsError>(DnsError::NoAddress, "'%s' is not an address of the requested family", aHostName.c_str()), addrs);
+      return;
+    }
+    addrs.push_back(sa);
+    if (aResolveCB) aResolveCB(ErrorPtr(), addrs);
+    return;
+  }
+  string name = lowerCase(aHostName);
+  bool absolute = false;
+  if (!name.empty() && name[name.size()-1]=='.') {
+    name.erase(name.size()-1);
+    absolute = true;
+  }
+  // hosts file
+  checkHosts();
+  if (lookupHosts(name, aFamily, addrs)) {
+    FOCUSLOG("DnsResolver: '%s' found in hosts", name.c_str());
+    if (aResolveCB) aResolveCB(ErrorPtr(), addrs);
+    return;
+  }
+  // cache
+  string key = string_format("%d:", aFamily) + name;
+  CacheMap::iterator pos = mCache.find(key);
+  if (pos!=mCache.end()) {
+    if (pos->second.expires>MainLoop::now()) {
+      mCacheHits++;
+      FOCUSLOG("DnsResolver: '%s' answered from cache", name.c_str());
+      // copy, callback might modify the cache
+      ErrorPtr err = pos->second.error;
+      addrs = pos->second.addresses;
+      if (aResolveCB) aResolveCB(err, addrs);
+      return;
+    }
+    mCache.erase(pos); // expired
+  }
+  mCacheMisses++;
+  // already being looked up?
+  QueryMap::iterator qpos = mQueries.find(key);
+  if (qpos!=mQueries.end()) {
+    qpos->second->mCallbacks.push_back(aResolveCB);
+    return;
+  }
+  // need to query
+  checkConfig();
+  if (mNameServers.empty()) {
+    if (aResolveCB) aResolveCB(Error::err<DnsError>(DnsError::NoNameServer, "no name server configured to resolve '%s'", name.c_str()), addrs);
+    return;
+  }
+  DnsQueryPtr query = DnsQueryPtr(new DnsQuery);
+  query->mKey = key;
+  query->mFamily = aFamily;
+  query->mCallbacks.push_back(aResolveCB);
+  // names to try
+  size_t dots = std::count(name.begin(), name.end(), '.');
+  if (absolute || (int)dots>=mNdots) query->mCandidates.push_back(name);
+  if (!absolute) {
+    for (size_t i=0; i<mSearchDomains.size(); i++) {
+      query->mCandidates.push_back(name + "." + mSearchDomains[i]);
+    }
+    if ((int)dots<mNdots) query->mCandidates.push_back(name);
+  }
+  mQueries[key] = query;
+  startCandidate(query);
+}
+
+
+void DnsResolver::startCandidate(DnsQueryPtr aQuery)
+{
+  const string &name = aQuery->mCandidates[aQuery->mCandidate];
+  FOCUSLOG("DnsResolver: querying '%s'", name.c_str());
+  aQuery->mNumSub = 0;
+  if (aQuery->mFamily!=PF_INET) aQuery->mSub[aQuery->mNumSub++].type = DNS_TYPE_AAAA;
+  if (aQuery->mFamily!=PF_INET6) aQuery->mSub[aQuery->mNumSub++].type = DNS_TYPE_A;
+  for (int i=0; i<aQuery->mNumSub; i++) {
+    DnsQuery::SubQuery &sub = aQuery->mSub[i];
+    sub.id = 0;
+    sub.fd = -1;
+    sub.done = false;
+    sub.rcode = DNS_RCODE_TIMEOUT;
+    sub.addresses.clear();
+    sub.ttl = 0;
+    if (!encodeQuestion(name, sub.type, sub.question)) {
+      sub.done = true;
+      sub.rcode = DNS_RCODE_FORMERR;
+    }
+  }
+  aQuery->mSendRounds = 0;
+  sendQuery(aQuery);
+}
+
+
+/// fill aBuf with unpredictable bytes from the OS' cryptographically secure random generator
+static void secureRandom(void *aBuf, size_t aLen)
+{
+  #ifdef ESP_PLATFORM
+  esp_fill_random(aBuf, aLen);
+  #else
+  size_t got = 0;
+  #ifdef SYS_getrandom
+  while (got<aLen) {
+    long n = syscall(SYS_getrandom, (uint8_t *)aBuf+got, aLen-got, 0);
+    if (n<0) {
+      if (errno==EINTR) continue;
+      break; // not supported by kernel, use /dev/urandom
+    }
+    got += n;
+  }
+  #endif
+  if (got<aLen) {
+    int fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+    if (fd>=0) {
+      while (got<aLen) {
+        ssize_t n = read(fd, (uint8_t *)aBuf+got, aLen-got);
+        if (n<=0) {
+          if (n<0 && errno==EINTR) continue;
+          break;
+        }
+        got += n;
+      }
+      close(fd);
+    }
+  }
+  if (got<aLen) {
+    // should not happen on any sane system, but do not send predictable IDs silently
+    LOG(LOG_ERR, "DnsResolver: no secure random source available, DNS queries might be spoofed");
+    for (size_t i=got; i<aLen; i++) ((uint8_t *)aBuf)[i] = (uint8_t)random();
+  }
+  #endif
+}
+
+
+uint16_t DnsResolver::randomUInt16()
+{
+  if (mRandomUsed+2>sizeof(mRandomPool)) {
+    // refill in batches, to avoid a syscall per query
+    secureRandom(mRandomPool, sizeof(mRandomPool));
+    mRandomUsed = 0;
+  }
+  uint16_t r = (uint16_t)((mRandomPool[mRandomUsed]<<8) | mRandomPool[mRandomUsed+1]);
+  mRandomUsed += 2;
+  return r;
+}
+
+
+uint16_t DnsResolver::newQueryId()
+{
+  uint16_t id;
+  do {
+    id = randomUInt16();
+  } while (id==0 || mQueryIds.find(id)!=mQueryIds.end());
+  return id;
+}
+
+
+int DnsResolver::openQuerySocket(int aFamily)
+{
+  int s = socket(aFamily, SOCK_DGRAM, 0);
+  if (s<0) return -1;
+  int flags = fcntl(s, F_GETFL, 0);
+  fcntl(s, F_SETFL, (flags<0 ? 0 : flags) | O_NONBLOCK);
+  fcntl(s, F_SETFD, FD_CLOEXEC);
+  // random source port, so answers cannot be spoofed by guessing the (16 bit) query ID alone
+  struct sockaddr_storage sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.ss_family = aFamily;
+  for (int i=0; i<DNS_PORT_BIND_ATTEMPTS; i++) {
+    uint16_t port = DNS_MIN_SOURCE_PORT + randomUInt16()%(65536-DNS_MIN_SOURCE_PORT);
+    if (aFamily==AF_INET6) ((struct sockaddr_in6 *)&sa)->sin6_port = htons(port);
+    else ((struct sockaddr_in *)&sa)->sin_port = htons(port);
+    if (::bind(s, (struct sockaddr *)&sa, sockAddrLen(sa))==0) break;
+    // port in use, try another one (if all fail, the OS assigns an ephemeral port when sending)
+  }
+  mMainLoop.registerPollHandler(s, POLLIN, boost::bind(&DnsResolver::socketHandler, this, _1, _2));
+  return s;
+}
+
+
+void DnsResolver::closeQuerySocket(int aFd)
+{
+  if (aFd>=0) {
+    mMainLoop.unregisterPollHandler(aFd);
+    close(aFd);
+  }
+}
+
+
+int DnsResolver::socketFor(int aFamily)
+{
+  int &s = aFamily==AF_INET6 ? mSocket6 : mSocket4;
+  int &queries = aFamily==AF_INET6 ? mSocket6Queries : mSocket4Queries;
+  if (s>=0 && queries>=DNS_QUERIES_PER_PORT) {
+    // switch to a new source port, but keep the old one open for answers to queries still pending
+    mRetiredSockets.push_back(s);
+    s = -1;
+  }
+  if (s<0) {
+    s = openQuerySocket(aFamily);
+    if (s<0) return -1;
+    queries = 0;
+  }
+  queries++;
+  return s;
+}
+
+
+void DnsResolver::closeRetiredSockets()
+{
+  for (std::list<int>::iterator pos = mRetiredSockets.begin(); pos!=mRetiredSockets.end(); ) {
+    bool inUse = false;
+    for (QueryIdMap::iterator q = mQueryIds.begin(); q!=mQueryIds.end() && !inUse; ++q) {
+      for (int i=0; i<q->second->mNumSub; i++) {
+        if (q->second->mSub[i].id==q->first && q->second->mSub[i].fd==*pos) { inUse = true; break; }
+      }
+    }
+    if (inUse) {
+      ++pos;
+    }
+    else {
+      closeQuerySocket(*pos);
+      pos = mRetiredSockets.erase(pos);
+    }
+  }
+}
+
+
+void DnsResolver::sendQuery(DnsQueryPtr aQuery)
+{
+  bool anyPending = false;
+  const struct sockaddr_storage &server = mNameServers[aQuery->mServerIdx % mNameServers.size()];
+  for (int i=0; i<aQuery->mNumSub; i++) {
+    DnsQuery::SubQuery &sub = aQuery->mSub[i];
+    if (sub.done) continue;
+    anyPending = true;
+    if (sub.id) mQueryIds.erase(sub.id);
+    sub.id = newQueryId();
+    mQueryIds[sub.id] = aQuery;
+    // header: ID, flags=RD, QDCOUNT=1, ANCOUNT=NSCOUNT=ARCOUNT=0
+    uint8_t hdr[12] = { (uint8_t)(sub.id>>8), (uint8_t)(sub.id & 0xFF), 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)sub.question.c_str();
+    iov[1].iov_len = sub.question.size();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)&server;
+    msg.msg_namelen = sockAddrLen(server);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    int s = socketFor(server.ss_family);
+    sub.fd = s;
+    if (s>=0 && sendmsg(s, &msg, 0)>=0) {
+      mQueriesSent++;
+    }
+    else {
+      // Note: no need to handle this specially, timeout will just try the next server
+      FOCUSLOG("DnsResolver: cannot send query: %s", strerror(errno));
+    }
+  }
+  if (!anyPending) {
+    queryDone(aQuery);
+    return;
+  }
+  // Note: bind plain pointer, the query must not own itself via its ticket (it is kept alive by mQueries)
+  aQuery->mTimeoutTicket.executeOnce(boost::bind(&DnsResolver::queryTimeout, this, aQuery.get()), mTimeout);
+}
+
+
+void DnsResolver::queryTimeout(DnsQueryPtr aQuery)
+{
+  aQuery->mSendRounds++;
+  if (aQuery->mSendRounds<mAttempts*(int)mNameServers.size()) {
+    // try next server
+    aQuery->mServerIdx++;
+    sendQuery(aQuery);
+    return;
+  }
+  // give up on pending subqueries
+  mTimeouts++;
+  queryDone(aQuery);
+}
+
+
+bool DnsResolver::socketHandler(int aFd, int aPollFlags)
+{
+  if (aPollFlags & POLLIN) {
+    uint8_t buf[DNS_MAX_MSG_SIZE];
+    while (true) {
+      struct sockaddr_storage from;
+      socklen_t fromLen = sizeof(from);
+      ssize_t n = recvfrom(aFd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromLen);
+      if (n<0) break; // EAGAIN or error
+      handleAnswer(aFd, buf, (size_t)n, from);
+    }
+  }
+  return true;
+}
+
+
+void DnsResolver::handleAnswer(int aFd, const uint8_t *aMsg, size_t aLen, const struct sockaddr_storage &aFrom)
+{
+  if (aLen<12) return;
+  uint16_t id = get16(aMsg);
+  QueryIdMap::iterator qpos = mQueryIds.find(id);
+  if (qpos==mQueryIds.end()) return; // unknown or late answer
+  DnsQueryPtr query = qpos->second;
+  DnsQuery::SubQuery *sub = NULL;
+  for (int i=0; i<query->mNumSub; i++) {
+    if (query->mSub[i].id==id && !query->mSub[i].done) sub = &query->mSub[i];
+  }
+  if (!sub) return;
+  if (sub->fd!=aFd) return; // must arrive at the source port the query was sent from
+  // must come from a name server we use
+  bool knownServer = false;
+  for (size_t i=0; i<mNameServers.size() && !knownServer; i++) {
+    knownServer = sameAddress(mNameServers[i], aFrom);
+  }
+  if (!knownServer) return;
+  uint16_t flags = get16(aMsg+2);
+  if ((flags & 0x8000)==0 || get16(aMsg+4)!=1) return; // not a response to a single question
+  string qname;
+  size_t qnamePos = 12;
+  if (!readName(aMsg, aLen, qnamePos, qname)) return; // malformed
+  // must answer our question
+  size_t pos = 12;
+  if (pos+sub->question.size()>aLen || strncasecmp((const char *)aMsg+pos, sub->question.c_str(), sub->question.size())!=0) {
+    // Note: strncasecmp stops at the name's terminating NUL, so also compare type/class
+    return;
+  }
+  if (memcmp(aMsg+pos+sub->question.size()-4, sub->question.c_str()+sub->question.size()-4, 4)!=0) return;
+  pos += sub->question.size();
+  int rcode = flags & 0x0F;
+  if (flags & 0x0200) {
+    // truncated: the records we got might not be all there is, and there is no TCP fallback
+    FOCUSLOG("DnsResolver: truncated answer");
+    rcode = DNS_RCODE_SERVFAIL;
+  }
+  if (rcode!=DNS_RCODE_NOERROR && rcode!=DNS_RCODE_NXDOMAIN) {
+    // this server cannot help (SERVFAIL, REFUSED, FORMERR...)
+    sub->rcode = rcode;
+    FOCUSLOG("DnsResolver: server returned rcode %d", rcode);
+    if (mNameServers.size()>1 && query->mSendRounds+1<mAttempts*(int)mNameServers.size()) {
+      // try next server right away
+      queryTimeout(query);
+    }
+    else {
+      mQueryIds.erase(id);
+      sub->id = 0;
+      sub->done = true;
+      bool allDone = true;
+      for (int i=0; i<query->mNumSub; i++) if (!query->mSub[i].done) allDone = false;
+      if (allDone) queryDone(query);
+    }
+    return;
+  }
+  uint16_t ancount = get16(aMsg+6);
+  uint16_t nscount = get16(aMsg+8);
+  uint32_t ttl = 0xFFFFFFFF;
+  uint32_t negTTL = DNS_DEFAULT_NEGATIVE_TTL;
+  // collect answer records first, as only those belonging to our name (or its CNAME chain) are valid
+  typedef struct { string owner; uint16_t type; uint32_t ttl; size_t rdpos; uint16_t rdlen; } AnswerRR;
+  std::vector<AnswerRR> answers;
+  for (int rr=0; rr<ancount+nscount; rr++) {
+    string owner;
+    if (!readName(aMsg, aLen, pos, owner) || pos+10>aLen) return; // malformed
+    uint16_t type = get16(aMsg+pos);
+    uint16_t cls = get16(aMsg+pos+2);
+    uint32_t rrttl = get32(aMsg+pos+4);
+    uint16_t rdlen = get16(aMsg+pos+8);
+    pos += 10;
+    if (pos+rdlen>aLen) return; // malformed
+    if (cls==DNS_CLASS_IN) {
+      if (rr<ancount) {
+        // answer section: CNAMEs and addresses, evaluated below
+        if (answers.size()<DNS_MAX_ANSWER_RRS) {
+          AnswerRR a = { owner, type, rrttl, pos, rdlen };
+          answers.push_back(a);
+        }
+      }
+      else if (type==DNS_TYPE_SOA) {
+        // authority section: SOA determines negative caching time (RFC 2308)
+        size_t p = pos;
+        if (skipName(aMsg, aLen, p) && skipName(aMsg, aLen, p) && p+20<=pos+rdlen) {
+          uint32_t minimum = get32(aMsg+p+16);
+          negTTL = minimum<rrttl ? minimum : rrttl;
+        }
+      }
+    }
+    pos += rdlen;
+  }
+  // follow the CNAME chain starting at the question name, records of the chain limit the validity
+  string name = qname;
+  for (int chain = 0; chain<=DNS_MAX_CNAME_CHAIN; chain++) {
+    bool found = false;
+    for (size_t i=0; i<answers.size(); i++) {
+      if (answers[i].type==DNS_TYPE_CNAME && answers[i].owner==name) {
+        size_t p = answers[i].rdpos;
+        if (!readName(aMsg, answers[i].rdpos+answers[i].rdlen, p, name)) return; // malformed
+        if (answers[i].ttl<ttl) ttl = answers[i].ttl;
+        found = true;
+        break;
+      }
+    }
+    if (!found) break;
+  }
+  // only addresses of the end of the chain are valid, everything else might be injected
+  DnsAddressList addrs;
+  for (size_t i=0; i<answers.size(); i++) {
+    const AnswerRR &a = answers[i];
+    if (a.owner!=name || a.type!=sub->type) continue;
+    struct sockaddr_storage sa;
+    memset(&sa, 0, sizeof(sa));
+    if (a.type==DNS_TYPE_A && a.rdlen==4) {
+      struct sockaddr_in *sin = (struct sockaddr_in *)&sa;
+      sin->sin_family = AF_INET;
+      memcpy(&sin->sin_addr, aMsg+a.rdpos, 4);
+    }
+    else if (a.type==DNS_TYPE_AAAA && a.rdlen==16) {
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sa;
+      sin6->sin6_family = AF_INET6;
+      memcpy(&sin6->sin6_addr, aMsg+a.rdpos, 16);
+    }
+    else continue;
+    addrs.push_back(sa);
+    if (a.ttl<ttl) ttl = a.ttl;
+  }
+  mQueryIds.erase(id);
+  sub->id = 0;
+  sub->done = true;
+  sub->rcode = rcode;
+  sub->addresses = addrs;
+  sub->ttl = addrs.empty() ? negTTL : ttl;
+  FOCUSLOG("DnsResolver: got %zu addresses, rcode=%d, ttl=%u", addrs.size(), rcode, sub->ttl);
+  for (int i=0; i<query->mNumSub; i++) {
+    if (!query->mSub[i].done) return; // still waiting for other answer
+  }
+  queryDone(query);
+}
+
+
+void DnsResolver::queryDone(DnsQueryPtr aQuery)
+{
+  aQuery->mTimeoutTicket.cancel();
+  DnsAddressList v6, v4;
+  uint32_t ttl = 0xFFFFFFFF;
+  uint32_t negTTL = DNS_MAX_NEGATIVE_TTL;
+  bool failed = false;
+  bool timedOut = false;
+  for (int i=0; i<aQuery->mNumSub; i++) {
+    DnsQuery::SubQuery &sub = aQuery->mSub[i];
+    if (sub.id) {
+      mQueryIds.erase(sub.id);
+      sub.id = 0;
+    }
+    if (!sub.done) sub.rcode = DNS_RCODE_TIMEOUT;
+    if (!sub.addresses.empty()) {
+      if (sub.ttl<ttl) ttl = sub.ttl;
+      (sub.type==DNS_TYPE_AAAA ? v6 : v4) = sub.addresses;
+    }
+    else if (sub.rcode==DNS_RCODE_NOERROR) {
+      aQuery->mNameExists = true;
+      if (sub.ttl<negTTL) negTTL = sub.ttl;
+    }
+    else if (sub.rcode==DNS_RCODE_NXDOMAIN) {
+      if (sub.ttl<negTTL) negTTL = sub.ttl;
+    }
+    else {
+      failed = true;
+      if (sub.rcode==DNS_RCODE_TIMEOUT) timedOut = true;
+    }
+  }
+  if (!mRetiredSockets.empty()) closeRetiredSockets();
+  DnsAddressList addrs;
+  ErrorPtr err;
+  if (!v6.empty() || !v4.empty()) {
+    // interleave families (RFC 8305), IPv6 first
+    size_t n = v6.size()>v4.size() ? v6.size() : v4.size();
+    for (size_t i=0; i<n; i++) {
+      if (i<v6.size()) addrs.push_back(v6[i]);
+      if (i<v4.size()) addrs.push_back(v4[i]);
+    }
+    if (ttl>DNS_MAX_TTL) ttl = DNS_MAX_TTL;
+  }
+  else {
+    if (!failed && aQuery->mCandidate+1<aQuery->mCandidates.size()) {
+      // name (or address family) does not exist, try next candidate
+      aQuery->mCandidate++;
+      startCandidate(aQuery);
+      return;
+    }
+    const char *name = aQuery->mCandidates[aQuery->mCandidate].c_str();
+    if (failed) {
+      if (timedOut) err = Error::err<DnsError>(DnsError::Timeout, "no answer from name server(s) for '%s'", name);
+      else if (aQuery->mSub[0].rcode==DNS_RCODE_REFUSED) err = Error::err<DnsError>(DnsError::Refused, "name server refused query for '%s'", name);
+      else if (aQuery->mSub[0].rcode==DNS_RCODE_FORMERR) err = Error::err<DnsError>(DnsError::FormatError, "cannot query '%s'", name);
+      else err = Error::err<DnsError>(DnsError::ServerFailure, "name server failure for '%s'", name);
+      ttl = DNS_FAILURE_TTL;
+    }
+    else {
+      if (aQuery->mNameExists) err = Error::err<DnsError>(DnsError::NoAddress, "'%s' has no address", name);
+      else err = Error::err<DnsError>(DnsError::NotFound, "'%s' not found", name);
+      ttl = negTTL>DNS_MAX_NEGATIVE_TTL ? DNS_MAX_NEGATIVE_TTL : negTTL;
+    }
+  }
+  FOCUSLOG("DnsResolver: lookup for '%s' done: %zu addresses, %s", aQuery->mKey.c_str(), addrs.size(), Error::text(err));
+  cacheResult(aQuery->mKey, err, addrs, ttl);
+  DnsQueryPtr keepAlive = aQuery;
+  mQueries.erase(aQuery->mKey);
+  // deliver to all waiting callers
+  std::list<DnsResolveCB> callbacks;
+  callbacks.swap(aQuery->mCallbacks);
+  for (std::list<DnsResolveCB>::iterator cb = callbacks.begin(); cb!=callbacks.end(); ++cb) {
+    if (*cb) (*cb)(err, addrs);
+  }
+}
+
+
+void DnsResolver::cacheResult(const string &aKey, ErrorPtr aError, const DnsAddressList &aAddresses, uint32_t aTTL)
+{
+  if (aTTL==0) return; // must not be cached
+  MLMicroSeconds now = MainLoop::now();
+  if (mCache.size()>=mMaxCacheEntries) {
+    // prune expired entries
+    for (CacheMap::iterator pos = mCache.begin(); pos!=mCache.end(); ) {
+      if (pos->second.expires<=now) pos = mCache.erase(pos);
+      else ++pos;
+    }
+    // still full: drop the entry that expires first
+    if (mCache.size()>=mMaxCacheEntries) {
+      CacheMap::iterator oldest = mCache.begin();
+      for (CacheMap::iterator pos = mCache.begin(); pos!=mCache.end(); ++pos) {
+        if (pos->second.expires<oldest->second.expires) oldest = pos;
+      }
+      mCache.erase(oldest);
+    }
+  }
+  CacheEntry &e = mCache[aKey];
+  e.addresses = aAddresses;
+  e.error = aError;
+  e.expires = now+aTTL*Second;
+}
+
+#endif // ENABLE_ASYNC_DNS
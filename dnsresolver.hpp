@@ -0,0 +1,227 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44utils__dnsresolver__
+#define __p44utils__dnsresolver__
+
+#include "p44utils_main.hpp"
+
+#include "fdcomm.hpp" // includes all unix/linux I/O and network includes
+
+#ifndef ESP_PLATFORM
+  #include <sys/un.h>
+#endif
+
+#ifndef ENABLE_ASYNC_DNS
+  #ifdef ESP_PLATFORM
+    #define ENABLE_ASYNC_DNS 0 // lwIP has its own resolver
+  #else
+    #define ENABLE_ASYNC_DNS 1 // non-blocking DNS resolution for SocketComm
+  #endif
+#endif
+
+
+using namespace std;
+
+namespace p44 {
+
+  /// list of socket addresses (as resolved from a host name, port not set)
+  typedef std::vector<struct sockaddr_storage> DnsAddressList;
+
+  /// @return length of the socket address (depending on its family)
+  socklen_t sockAddrLen(const struct sockaddr_storage &aAddr);
+
+
+  #if ENABLE_ASYNC_DNS
+
+  class DnsError : public Error
+  {
+  public:
+    // Errors
+    typedef enum {
+      OK,
+      BadName, ///< name cannot be encoded for a DNS query
+      NoNameServer, ///< no name server configured
+      Timeout, ///< no answer from any name server
+      FormatError, ///< malformed request or answer
+      ServerFailure, ///< name server failed to process the query
+      NotFound, ///< name does not exist (NXDOMAIN)
+      NoAddress, ///< name exists, but has no address of the requested family
+      Refused, ///< name server refused to answer
+      numErrorCodes
+    } ErrorCodes;
+
+    static const char *domain() { return "DNS"; }
+    virtual const char *getErrorDomain() const P44_OVERRIDE { return DnsError::domain(); };
+    DnsError(ErrorCodes aError) : Error(ErrorCode(aError)) {};
+    #if ENABLE_NAMED_ERRORS
+  protected:
+    virtual const char* errorName() const P44_OVERRIDE { return errNames[getErrorCode()]; };
+  private:
+    static constexpr const char* const errNames[numErrorCodes] = {
+      "OK",
+      "BadName",
+      "NoNameServer",
+      "Timeout",
+      "FormatError",
+      "ServerFailure",
+      "NotFound",
+      "NoAddress",
+      "Refused",
+    };
+    #endif // ENABLE_NAMED_ERRORS
+  };
+
+
+  /// callback for delivering resolved addresses
+  /// @param aError error if name could not be resolved
+  /// @param aAddresses the addresses (IPv6 and IPv4 interleaved, IPv6 first if available)
+  typedef boost::function<void (ErrorPtr aError, const DnsAddressList &aAddresses)> DnsResolveCB;
+
+  class DnsQuery;
+  typedef boost::intrusive_ptr<DnsQuery> DnsQueryPtr;
+
+  /// Asynchronous DNS stub resolver
+  /// - queries the name servers from /etc/resolv.conf (or set explicitly) via UDP, without blocking the mainloop
+  /// - looks up /etc/hosts and numeric addresses directly
+  /// - keeps a cache of positive and negative answers, respecting the TTLs, shared by all users
+  /// - concurrent requests for the same name are served by a single query
+  /// - query IDs and source ports (changed every few queries) are randomized using the OS' secure random generator
+  class DnsResolver : public P44Obj
+  {
+    friend class DnsQuery;
+
+    MainLoop &mMainLoop;
+
+    // configuration
+    DnsAddressList mNameServers;
+    std::vector<string> mSearchDomains;
+    int mNdots;
+    MLMicroSeconds mTimeout; ///< time to wait for an answer before trying next server
+    int mAttempts; ///< number of rounds through all name servers
+    bool mExplicitConfig; ///< if set, configuration was set explicitly and resolv.conf is not consulted
+    time_t mResolvConfMTime;
+    MLMicroSeconds mResolvConfChecked;
+
+    // hosts file
+    typedef std::map<string, DnsAddressList> HostsMap;
+    HostsMap mHosts;
+    time_t mHostsMTime;
+    MLMicroSeconds mHostsChecked;
+
+    // cache
+    typedef struct {
+      DnsAddressList addresses;
+      ErrorPtr error;
+      MLMicroSeconds expires;
+    } CacheEntry;
+    typedef std::map<string, CacheEntry> CacheMap;
+    CacheMap mCache;
+    size_t mMaxCacheEntries;
+
+    // queries in progress
+    typedef std::map<string, DnsQueryPtr> QueryMap;
+    QueryMap mQueries; ///< by cache key
+    typedef std::map<uint16_t, DnsQueryPtr> QueryIdMap;
+    QueryIdMap mQueryIds; ///< by DNS message ID
+    uint8_t mRandomPool[64]; ///< random bytes for query IDs and source ports
+    size_t mRandomUsed; ///< number of bytes already used from mRandomPool
+    int mSocket4; ///< current IPv4 query socket
+    int mSocket6; ///< current IPv6 query socket
+    int mSocket4Queries; ///< number of queries sent from current IPv4 socket
+    int mSocket6Queries; ///< number of queries sent from current IPv6 socket
+    std::list<int> mRetiredSockets; ///< sockets with previous source ports, closed when no query sent from them is pending
+
+    // statistics
+    long mCacheHits;
+    long mCacheMisses;
+    long mQueriesSent;
+    long mTimeouts;
+
+    DnsResolver(MainLoop &aMainLoop);
+
+  public:
+
+    virtual ~DnsResolver();
+
+    /// get shared instance of resolver
+    /// @note there is one shared resolver per thread, bound to the thread's current mainloop
+    static DnsResolver &sharedResolver();
+
+    /// resolve host name to addresses
+    /// @param aHostName the host name (or numeric address) to resolve
+    /// @param aFamily PF_INET, PF_INET6 or PF_UNSPEC for both
+    /// @param aResolveCB will be called with the result
+    /// @note for numeric addresses, names found in /etc/hosts and cached names, aResolveCB is called
+    ///   immediately, before resolve() returns.
+    void resolve(const string &aHostName, int aFamily, DnsResolveCB aResolveCB);
+
+    /// set name servers to use instead of those from /etc/resolv.conf
+    /// @param aNameServers space or comma separated list of addresses, optionally with port (1.2.3.4:5353, [::1]:5353)
+    /// @param aSearchDomains space or comma separated list of domains to append to names with less than ndots dots
+    /// @note passing an empty aNameServers string reverts to using /etc/resolv.conf
+    /// @return error if the name server list could not be parsed
+    ErrorPtr setNameServers(const string &aNameServers, const string &aSearchDomains = "");
+
+    /// set timing parameters
+    /// @param aTimeout time to wait for an answer from one server
+    /// @param aAttempts number of rounds through all name servers
+    void setTimeout(MLMicroSeconds aTimeout, int aAttempts) { mTimeout = aTimeout; mAttempts = aAttempts; };
+
+    /// forget all cached answers
+    void flushCache() { mCache.clear(); };
+
+    /// @name statistics
+    /// @{
+    long cacheHits() { return mCacheHits; }; ///< number of resolve() calls answered from cache
+    long cacheMisses() { return mCacheMisses; }; ///< number of resolve() calls that needed a query
+    long queriesSent() { return mQueriesSent; }; ///< number of DNS query packets sent
+    long timeouts() { return mTimeouts; }; ///< number of lookups that failed because no server answered
+    /// @}
+
+  private:
+
+    void checkConfig();
+    void checkHosts();
+    bool lookupHosts(const string &aName, int aFamily, DnsAddressList &aAddresses);
+    void cacheResult(const string &aKey, ErrorPtr aError, const DnsAddressList &aAddresses, uint32_t aTTL);
+    int socketFor(int aFamily);
+    bool socketHandler(int aFd, int aPollFlags);
+    void handleAnswer(int aFd, const uint8_t *aMsg, size_t aLen, const struct sockaddr_storage &aFrom);
+    uint16_t randomUInt16();
+    uint16_t newQueryId();
+    int openQuerySocket(int aFamily);
+    void closeQuerySocket(int aFd);
+    void closeRetiredSockets();
+    void sendQuery(DnsQueryPtr aQuery);
+    void queryTimeout(DnsQueryPtr aQuery);
+    void queryDone(DnsQueryPtr aQuery);
+    void startCandidate(DnsQueryPtr aQuery);
+
+  };
+
+  #endif // ENABLE_ASYNC_DNS
+
+} // namespace p44
+
+
+#endif /* defined(__p44utils__dnsresolver__) */
@@ -32,15 +32,36 @@
 #ifndef ESP_PLATFORM
 #include <poll.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 using namespace p44;
 
+#define RX_BUFFER_MIN_SIZE 1024 // initial size of delimited receive buffer, also the chunk size for reading when FIONREAD is not available
+#define RX_BUFFER_KEEP_SIZE 65536 // when empty, a receive buffer larger than this is released
+#define TX_MAX_IOV 64 // max number of queued buffers to pass to a single writev()
+#define TX_FILE_CHUNK_SIZE 16384 // buffer size for sending files where sendfile() is not available
+
 FdComm::FdComm(MainLoop &aMainLoop) :
   mDataFd(-1),
   mMainLoop(aMainLoop),
   mDelimiter(0),
+  mRxBuf(NULL),
+  mRxBufSize(0),
+  mRxHead(0),
+  mRxTail(0),
+  mRxScanPos(0),
   mDelimiterPos(string::npos),
-  mUnknownReadyBytes(false)
+  mTxOffset(0),
+  mTxQueuedBytes(0),
+  mTxHighWatermark(0),
+  mTxLowWatermark(0),
+  mTxAboveHighWatermark(false),
+  mTxBatchCount(0),
+  mTxImmediate(false),
+  mUnknownReadyBytes(false),
+  mInReceiveHandler(false)
 {
 }
 
@@ -49,6 +70,7 @@ FdComm::~FdComm()
 {
   // unregister handlers
   setFd(-1);
+  if (mRxBuf) free(mRxBuf);
 }
 
 
@@ -67,7 +89,7 @@ void FdComm::setFd(int aFd, bool aUnknownReadyBytes)
       mMainLoop.registerPollHandler(
         mDataFd,
         (mReceiveHandler ? POLLIN : 0) | // report ready to read if we have a handler
-        (mTransmitHandler ? POLLOUT : 0), // report ready to transmit if we have a handler
+        (mTransmitHandler || !mTxQueue.empty() ? POLLOUT : 0), // report ready to transmit if we have a handler or queued data
         boost::bind(&FdComm::dataMonitorHandler, this, _1, _2)
       );
     }
@@ -112,7 +134,7 @@ bool FdComm::dataMonitorHandler(int aFd, int aPollFlags)
       // check if in delimited mode (e.g. line by line)
       if (mDelimiter) {
         // receive into buffer
-        receiveAndAppendToString(mReceiveBuffer);
+        receiveIntoBuffer();
         // check data and call back if we have collected a delimited string already
         checkReceiveData();
       }
@@ -149,66 +171,235 @@ bool FdComm::dataMonitorHandler(int aFd, int aPollFlags)
 }
 
 
+ErrorPtr FdComm::receiveIntoBuffer()
+{
+  ErrorPtr err;
+  size_t max = mUnknownReadyBytes ? RX_BUFFER_MIN_SIZE : numBytesReady();
+  if (max==0) return err;
+  if (mRxHead==mRxTail) {
+    // everything consumed, restart at beginning of buffer
+    // Note: no delimiter can be pending here, as it would be part of the unconsumed data
+    mRxHead = 0; mRxTail = 0; mRxScanPos = 0;
+    if (mRxBufSize>RX_BUFFER_KEEP_SIZE) {
+      // do not keep large buffer from a burst around
+      free(mRxBuf);
+      mRxBuf = NULL;
+      mRxBufSize = 0;
+    }
+  }
+  if (mRxBufSize-mRxTail<max) {
+    // not enough room at the end
+    if (mRxHead>0) {
+      // move unconsumed data to the front (once per read, not once per record)
+      size_t n = mRxTail-mRxHead;
+      memmove(mRxBuf, mRxBuf+mRxHead, n);
+      mRxScanPos -= mRxHead;
+      if (mDelimiterPos!=string::npos) mDelimiterPos -= mRxHead;
+      mRxTail = n;
+      mRxHead = 0;
+    }
+    if (mRxBufSize-mRxTail<max) {
+      // still not enough room, grow buffer
+      size_t newSize = mRxBufSize>0 ? mRxBufSize : RX_BUFFER_MIN_SIZE;
+      while (newSize-mRxTail<max) newSize *= 2;
+      char *newBuf = (char *)realloc(mRxBuf, newSize);
+      if (!newBuf) return SysError::err(ENOMEM, "FdComm: cannot grow receive buffer: ");
+      mRxBuf = newBuf;
+      mRxBufSize = newSize;
+    }
+  }
+  // when size is unknown, just read as much as fits
+  if (mUnknownReadyBytes) max = mRxBufSize-mRxTail;
+  mRxTail += receiveBytes(max, (uint8_t *)mRxBuf+mRxTail, err);
+  return err;
+}
+
+
 void FdComm::checkReceiveData()
 {
-  if (mDelimiterPos==string::npos) {
-    // no delimiter pending
-    mDelimiterPos = mReceiveBuffer.find(mDelimiter);
-    if (mDelimiterPos!=string::npos) {
-      FOCUSLOG("- found delimiter, calling receive handler");
-      mReceiveHandler(ErrorPtr());
+  if (mDelimiterPos!=string::npos || mInReceiveHandler) return; // delimited record still pending or being delivered right now
+  FdCommPtr keepMeAlive(this); // make sure this object lives until routine terminates
+  mInReceiveHandler = true;
+  // deliver all records that are already complete in the buffer, as long as the handler consumes them
+  while (mDelimiter && mReceiveHandler && mRxScanPos<mRxTail) {
+    // only scan bytes not yet scanned before
+    const char *d = (const char *)memchr(mRxBuf+mRxScanPos, mDelimiter, mRxTail-mRxScanPos);
+    if (!d) {
+      mRxScanPos = mRxTail;
+      break;
     }
+    mDelimiterPos = d-mRxBuf;
+    mRxScanPos = mDelimiterPos+1;
+    FOCUSLOG("- found delimiter, calling receive handler");
+    mReceiveHandler(ErrorPtr());
+    if (mDelimiterPos!=string::npos) break; // not consumed by handler, next check when it gets consumed
+  }
+  mInReceiveHandler = false;
+}
+
+
+void FdComm::scheduleReceiveCheck()
+{
+  // when consumed from within the receive handler, checkReceiveData() continues delivering by itself
+  if (!mInReceiveHandler) {
+    mMainLoop.executeNow(boost::bind(&FdComm::checkReceiveData, this));
   }
 }
 
 
 bool FdComm::sendBufferedData()
 {
-  size_t toSend = mTransmitBuffer.size();
-  if (toSend==0) {
+  if (mTxQueue.empty()) {
     if (mTransmitHandler.empty())
       mMainLoop.changePollFlags(mDataFd, 0, POLLOUT); // done, we don't need POLLOUT any more
     return false;
   }
   // send as much as possible
-  ErrorPtr err;
-  size_t sent = transmitBytes(toSend, (const uint8_t *)mTransmitBuffer.c_str(), err);
-  if (sent<toSend)
-    mTransmitBuffer.erase(0,sent);
-  else
-    mTransmitBuffer.clear();
+  sendQueuedData();
   return true; // buffered send still in progress
 }
 
 
-bool FdComm::receiveDelimitedString(string &aString)
+ErrorPtr FdComm::sendQueuedData()
+{
+  ErrorPtr err;
+  if (mTxQueue.empty()) return err;
+  FdCommPtr keepMeAlive(this); // make sure this object lives until routine terminates
+  while (!mTxQueue.empty()) {
+    size_t sent;
+    size_t toSend = 0;
+    int fileFd = mTxQueue.front()->fileFd();
+    if (fileFd>=0) {
+      // file buffer: send directly from the file
+      toSend = mTxQueue.front()->size()-mTxOffset;
+      sent = transmitFile(fileFd, mTxQueue.front()->fileOffset()+mTxOffset, toSend, err);
+    }
+    else {
+      // gather as many queued memory buffers as possible
+      struct iovec iov[TX_MAX_IOV];
+      int cnt = 0;
+      size_t offs = mTxOffset;
+      for (TxBufferList::iterator pos = mTxQueue.begin(); pos!=mTxQueue.end() && cnt<TX_MAX_IOV && (*pos)->fileFd()<0; ++pos) {
+        iov[cnt].iov_base = (void *)((*pos)->data()+offs);
+        iov[cnt].iov_len = (*pos)->size()-offs;
+        toSend += iov[cnt].iov_len;
+        offs = 0;
+        cnt++;
+      }
+      sent = transmitBuffers(iov, cnt, err);
+    }
+    mTxQueuedBytes -= sent;
+    // release completely sent buffers, remember offset into partially sent one
+    sent += mTxOffset;
+    while (!mTxQueue.empty() && sent>=mTxQueue.front()->size()) {
+      sent -= mTxQueue.front()->size();
+      mTxQueue.pop_front();
+    }
+    mTxOffset = sent;
+    if (Error::notOK(err) || sent<toSend) break; // error or fd does not accept more data right now
+  }
+  FOCUSLOG("FdComm: transmit queue has %zu buffers, %zu bytes left to send", mTxQueue.size(), mTxQueuedBytes);
+  checkTxFlow();
+  if (mTxQueue.empty()) transmitQueueEmptied();
+  return err;
+}
+
+
+void FdComm::checkTxFlow()
+{
+  if (!mTxFlowHandler) return;
+  if (!mTxAboveHighWatermark) {
+    if (mTxQueuedBytes>mTxHighWatermark) {
+      mTxAboveHighWatermark = true;
+      mTxFlowHandler(true);
+    }
+  }
+  else if (mTxQueuedBytes<=mTxLowWatermark) {
+    mTxAboveHighWatermark = false;
+    mTxFlowHandler(false);
+  }
+}
+
+
+void FdComm::setTransmitFlowHandler(size_t aHighWatermark, size_t aLowWatermark, TxFlowCB aFlowHandler)
+{
+  mTxHighWatermark = aHighWatermark;
+  mTxLowWatermark = aLowWatermark;
+  mTxFlowHandler = aFlowHandler;
+  mTxAboveHighWatermark = false;
+  checkTxFlow();
+}
+
+
+ErrorPtr FdComm::sendBuffer(TxBufferPtr aBuffer, bool aMore)
+{
+  ErrorPtr err;
+  if (aBuffer && aBuffer->size()>0) {
+    if (mTxQueue.empty()) mTxImmediate = true; // nothing waiting, can try to send right away
+    mTxQueue.push_back(aBuffer);
+    mTxQueuedBytes += aBuffer->size();
+    mTxBatchCount++;
+  }
+  if (aMore) return err; // more buffers to come
+  size_t batch = mTxBatchCount;
+  mTxBatchCount = 0;
+  if (mTxImmediate) {
+    mTxImmediate = false;
+    err = sendQueuedData();
+    if (!mTxQueue.empty() && mTransmitHandler.empty() && mDataFd>=0)
+      mMainLoop.changePollFlags(mDataFd, POLLOUT, 0); // we need POLLOUT even if no transmit handler is set
+  }
+  // non-persistent data of this batch that could not be sent must be copied now
+  // Note: older buffers in the queue are all persistent
+  if (batch>mTxQueue.size()) batch = mTxQueue.size();
+  TxBufferList::reverse_iterator pos = mTxQueue.rbegin();
+  while (batch-->0) {
+    if (!(*pos)->persistent()) {
+      size_t offs = 0;
+      if (&(*pos)==&mTxQueue.front()) {
+        offs = mTxOffset;
+        mTxOffset = 0;
+      }
+      *pos = TxBufferPtr(new StringTxBuffer(string((const char *)(*pos)->data()+offs, (*pos)->size()-offs)));
+    }
+    ++pos;
+  }
+  checkTxFlow();
+  return err;
+}
+
+
+bool FdComm::receiveDelimitedRecord(const char *&aRecord, size_t &aLength)
 {
   if (mDelimiterPos==string::npos) return false; // none ready
+  aRecord = mRxBuf+mRxHead;
+  aLength = mDelimiterPos-mRxHead;
   // also remove CR if delimiter is LF
-  size_t eraseSz = mDelimiterPos+1;
-  if (mDelimiter=='\n' && mDelimiterPos>0 && mReceiveBuffer[mDelimiterPos-1]=='\r') {
-    mDelimiterPos--;
+  if (mDelimiter=='\n' && aLength>0 && aRecord[aLength-1]=='\r') {
+    aLength--;
   }
-  aString.assign(mReceiveBuffer, 0, mDelimiterPos);
-  mReceiveBuffer.erase(0, eraseSz);
-  mDelimiterPos = string::npos; // consumed this one, ready for next
+  mRxHead = mDelimiterPos+1; // consumed this one (data stays in place until next read)
+  mDelimiterPos = string::npos; // ready for next
   // check for more delimited strings that might already be in the buffer
-  mMainLoop.executeNow(boost::bind(&FdComm::checkReceiveData, this));
+  scheduleReceiveCheck();
+  return true;
+}
+
+
+bool FdComm::receiveDelimitedString(string &aString)
+{
+  const char *rec;
+  size_t len;
+  if (!receiveDelimitedRecord(rec, len)) return false;
+  aString.assign(rec, len);
   return true;
 }
 
 
 void FdComm::sendString(const string &aString)
 {
-  if (mTransmitBuffer.empty()) {
-    if (mTransmitHandler.empty())
-      mMainLoop.changePollFlags(mDataFd, POLLOUT, 0); // we need POLLOUT even if no transmit handler is set
-    mTransmitBuffer = aString;
-    sendBufferedData();
-  }
-  else {
-    mTransmitBuffer.append(aString);
-  }
+  // Note: string is only copied if it cannot be sent immediately
+  sendBuffer(TxBufferPtr(new StaticTxBuffer(aString.c_str(), aString.size(), false)));
 }
 
 
@@ -228,6 +419,7 @@ void FdComm::setReceiveHandler(StatusCB aReceiveHandler, char aDelimiter)
   }
   mDelimiter = aDelimiter;
   mDelimiterPos = string::npos;
+  mRxScanPos = mRxHead; // delimiter might have changed, rescan unconsumed data
   mReceiveHandler = aReceiveHandler;
 }
 
@@ -265,6 +457,50 @@ size_t FdComm::transmitBytes(size_t aNumBytes, const uint8_t *aBytes, ErrorPtr &
 }
 
 
+size_t FdComm::transmitBuffers(const struct iovec *aIov, int aIovCnt, ErrorPtr &aError)
+{
+  // if not connected now, we can't write
+  if (mDataFd<0) {
+    // waiting for connection to open
+    return 0; // cannot transmit data yet
+  }
+  ssize_t res = writev(mDataFd, aIov, aIovCnt);
+  if (res<0) {
+    if (errno==EAGAIN || errno==EWOULDBLOCK)
+      return 0; // not ready to accept data, is not an error
+    aError = SysError::errNo("FdComm::transmitBuffers: ");
+    return 0; // nothing transmitted
+  }
+  return (size_t)res;
+}
+
+
+size_t FdComm::transmitFile(int aFileFd, off_t aOffset, size_t aNumBytes, ErrorPtr &aError)
+{
+  if (mDataFd<0) {
+    return 0; // cannot transmit data yet
+  }
+  #ifdef __linux__
+  off_t offs = aOffset;
+  ssize_t res = sendfile(mDataFd, aFileFd, &offs, aNumBytes);
+  #else
+  uint8_t buf[TX_FILE_CHUNK_SIZE];
+  ssize_t res = pread(aFileFd, buf, aNumBytes<sizeof(buf) ? aNumBytes : sizeof(buf), aOffset);
+  if (res>0) res = write(mDataFd, buf, res); // unsent part will be read again next time
+  #endif
+  if (res<0) {
+    if (errno==EAGAIN || errno==EWOULDBLOCK)
+      return 0; // not ready to accept data, is not an error
+    aError = SysError::errNo("FdComm::transmitFile: ");
+    return 0;
+  }
+  if (res==0 && aNumBytes>0) {
+    aError = SysError::err(EIO, "FdComm::transmitFile: file ended prematurely");
+  }
+  return (size_t)res;
+}
+
+
 bool FdComm::transmitString(const string &aString)
 {
   ErrorPtr err;
@@ -33,6 +33,7 @@
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -55,6 +56,87 @@ namespace p44 {
   class FdComm;
 
 
+  /// callback for transmit queue flow control
+  /// @param aAboveHighWatermark true when the queue has grown beyond the high watermark,
+  ///   false when it has drained below the low watermark again
+  typedef boost::function<void (bool aAboveHighWatermark)> TxFlowCB;
+
+
+  /// refcounted buffer to be queued for transmission with FdComm::sendBuffer()
+  class TxBuffer : public P44Obj
+  {
+  public:
+    /// @return pointer to the data to send
+    virtual const uint8_t *data() = 0;
+    /// @return number of bytes to send
+    virtual size_t size() = 0;
+    /// @return true if data() remains valid for the lifetime of this buffer object.
+    ///   If not, the data is only guaranteed valid while being passed to sendBuffer(),
+    ///   and the unsent remainder will be copied when it needs to be queued.
+    virtual bool persistent() { return true; }
+    /// @return file descriptor to send the data from instead of data(), or -1 for memory buffers
+    virtual int fileFd() { return -1; }
+    /// @return offset of the data within the file (only relevant when fileFd() is >=0)
+    virtual off_t fileOffset() { return 0; }
+  };
+  typedef boost::intrusive_ptr<TxBuffer> TxBufferPtr;
+
+
+  /// transmit buffer owning a string
+  class StringTxBuffer : public TxBuffer
+  {
+    string mData;
+  public:
+    /// @param aData the data to send. Will be copied.
+    StringTxBuffer(const string &aData) : mData(aData) {};
+    /// @param aData the data to send, will be swapped into the buffer (aData will be empty afterwards)
+    /// @param aSwap must be true
+    StringTxBuffer(string &aData, bool aSwap) { mData.swap(aData); };
+    virtual const uint8_t *data() P44_OVERRIDE { return (const uint8_t *)mData.c_str(); };
+    virtual size_t size() P44_OVERRIDE { return mData.size(); };
+  };
+
+
+  /// transmit buffer referencing static (or otherwise long lived, constant) data
+  class StaticTxBuffer : public TxBuffer
+  {
+    const uint8_t *mData;
+    size_t mSize;
+    bool mPersistent;
+  public:
+    /// @param aData the data to send. Must remain valid and unchanged until sent.
+    /// @param aSize number of bytes to send
+    /// @param aPersistent if set to false, aData only needs to remain valid during the call to sendBuffer();
+    ///   the unsent remainder, if any, will be copied.
+    StaticTxBuffer(const void *aData, size_t aSize, bool aPersistent = true) : mData((const uint8_t *)aData), mSize(aSize), mPersistent(aPersistent) {};
+    virtual const uint8_t *data() P44_OVERRIDE { return mData; };
+    virtual size_t size() P44_OVERRIDE { return mSize; };
+    virtual bool persistent() P44_OVERRIDE { return mPersistent; };
+  };
+
+
+  /// transmit buffer referencing a range of an open file.
+  /// The file contents are sent with sendfile() where available, without copying them through user space.
+  class FileTxBuffer : public TxBuffer
+  {
+    int mFd;
+    off_t mOffset;
+    size_t mSize;
+    bool mOwnsFd;
+  public:
+    /// @param aFd open file descriptor
+    /// @param aOffset offset of the first byte to send
+    /// @param aSize number of bytes to send
+    /// @param aOwnsFd if set, aFd is closed when the buffer is deleted
+    FileTxBuffer(int aFd, off_t aOffset, size_t aSize, bool aOwnsFd = true) : mFd(aFd), mOffset(aOffset), mSize(aSize), mOwnsFd(aOwnsFd) {};
+    virtual ~FileTxBuffer() { if (mOwnsFd && mFd>=0) close(mFd); };
+    virtual const uint8_t *data() P44_OVERRIDE { return NULL; };
+    virtual size_t size() P44_OVERRIDE { return mSize; };
+    virtual int fileFd() P44_OVERRIDE { return mFd; };
+    virtual off_t fileOffset() P44_OVERRIDE { return mOffset; };
+  };
+
+
   typedef boost::intrusive_ptr<FdComm> FdCommPtr;
 
   /// wrapper for non-blocking I/O on a file descriptor
@@ -68,10 +150,28 @@ namespace p44 {
     int mDataFd;
     MainLoop &mMainLoop;
     char mDelimiter;
-    string mReceiveBuffer;
-    string mTransmitBuffer;
-    size_t mDelimiterPos;
+    // delimited receive buffer: contiguous chunk, consumed from the front, appended at the end.
+    // Unconsumed data is moved to the front only when more space is needed for the next read,
+    // so consuming a record is O(1) and every byte is scanned for the delimiter only once.
+    char *mRxBuf; ///< receive buffer (malloc'ed)
+    size_t mRxBufSize; ///< allocated size of mRxBuf
+    size_t mRxHead; ///< offset of first unconsumed byte
+    size_t mRxTail; ///< offset past last received byte
+    size_t mRxScanPos; ///< offset of next byte to be scanned for the delimiter
+    size_t mDelimiterPos; ///< offset of found delimiter not yet consumed, string::npos if none
+    // transmit queue: sent with writev() as far as the fd accepts data, partial writes tracked by offset
+    typedef std::list<TxBufferPtr> TxBufferList;
+    TxBufferList mTxQueue; ///< buffers waiting to be sent
+    size_t mTxOffset; ///< number of bytes of the first buffer in mTxQueue already sent
+    size_t mTxQueuedBytes; ///< total number of bytes not yet sent
+    size_t mTxHighWatermark; ///< flow handler is called with true when mTxQueuedBytes exceeds this
+    size_t mTxLowWatermark; ///< flow handler is called with false when mTxQueuedBytes drops to or below this again
+    bool mTxAboveHighWatermark;
+    size_t mTxBatchCount; ///< number of buffers queued by sendBuffer() calls with aMore set so far
+    bool mTxImmediate; ///< set when current batch was queued into an empty queue and can be sent right away
+    TxFlowCB mTxFlowHandler;
     bool mUnknownReadyBytes;
+    bool mInReceiveHandler; ///< set while checkReceiveData() is delivering records
 
   public:
 
@@ -103,6 +203,23 @@ namespace p44 {
     /// @return number ob bytes actually written, can be 0 (e.g. if connection is still in process of opening)
     virtual size_t transmitBytes(size_t aNumBytes, const uint8_t *aBytes, ErrorPtr &aError);
 
+    /// write data from multiple buffers at once (non-blocking)
+    /// @param aIov array of buffer pointers/sizes
+    /// @param aIovCnt number of entries in aIov
+    /// @param aError reference to ErrorPtr. Will be left untouched if no error occurs
+    /// @return number ob bytes actually written, can be 0 (e.g. if connection is still in process of opening)
+    /// @note in contrast to transmitBytes(), the fd not being ready to accept data (EAGAIN) is not considered an error
+    virtual size_t transmitBuffers(const struct iovec *aIov, int aIovCnt, ErrorPtr &aError);
+
+    /// write data from a file (non-blocking)
+    /// @param aFileFd the file descriptor to read from
+    /// @param aOffset offset in the file to start reading at
+    /// @param aNumBytes number of bytes to transfer
+    /// @param aError reference to ErrorPtr. Will be left untouched if no error occurs
+    /// @return number ob bytes actually written, can be 0 (fd not ready, like transmitBuffers())
+    /// @note uses sendfile() on Linux, reads through a buffer on other platforms
+    virtual size_t transmitFile(int aFileFd, off_t aOffset, size_t aNumBytes, ErrorPtr &aError);
+
     /// transmit string
     /// @param aString string to transmit
     /// @note intended for datagrams. Use transmitBytes to be able to handle partial transmission or
@@ -129,10 +246,44 @@ namespace p44 {
     /// @return true if a delimited string could be returned
     bool receiveDelimitedString(string &aString);
 
+    /// Zero-copy variant of receiveDelimitedString()
+    /// @param aRecord will be set to point to the first byte of the delimited record within the receive buffer
+    /// @param aLength will be set to the length of the record, without delimiters included
+    /// @return true if a delimited record could be returned
+    /// @note the record is consumed by this call, but the data remains valid until the receive handler returns
+    ///   (more precisely: until the next read from the file descriptor into the receive buffer).
+    ///   The record is NOT null terminated.
+    bool receiveDelimitedRecord(const char *&aRecord, size_t &aLength);
+
+    /// @return number of bytes received in delimited mode but not yet consumed
+    size_t delimitedBytesPending() { return mRxTail-mRxHead; }
+
     /// Send string, buffer and transmit later if needed
     /// @param aString string to send
     void sendString(const string &aString);
 
+    /// Send buffer, queue it and transmit later if needed
+    /// @param aBuffer the buffer to send. Will be retained until completely sent
+    /// @param aMore if set, more buffers will follow immediately, and transmission is deferred until
+    ///   sendBuffer() is called with aMore==false. This allows sending multiple buffers with a single writev().
+    ///   Non-persistent buffers must remain valid until then.
+    /// @return error from immediate transmission attempt, if any.
+    /// @note when the fd is not ready to accept all the data, the buffer is appended to the
+    ///   transmit queue without copying it (unless it is not persistent()), and sent out with
+    ///   as few writev() calls as possible when the fd becomes writable.
+    ErrorPtr sendBuffer(TxBufferPtr aBuffer, bool aMore = false);
+
+    /// @return number of bytes queued for transmission, but not yet sent
+    size_t transmitQueueBytes() { return mTxQueuedBytes; }
+
+    /// set up transmit queue flow control
+    /// @param aHighWatermark when the number of queued bytes grows beyond this, aFlowHandler is called with true
+    /// @param aLowWatermark after exceeding the high watermark, aFlowHandler is called with false when the number
+    ///   of queued bytes drops to or below this level
+    /// @param aFlowHandler the handler to call, NoOP to disable flow control callbacks
+    /// @note aFlowHandler might get called from within sendString()/sendBuffer()
+    void setTransmitFlowHandler(size_t aHighWatermark, size_t aLowWatermark, TxFlowCB aFlowHandler);
+
     /// read data into string
     ErrorPtr receiveIntoString(string &aString, ssize_t aMaxBytes = -1);
 
@@ -156,18 +307,26 @@ namespace p44 {
 
     /// clear all callbacks
     /// @note this is important because handlers might cause retain cycles when they have smart ptr arguments
-    virtual void clearCallbacks() { mReceiveHandler = NoOP; mTransmitHandler = NoOP; }
+    virtual void clearCallbacks() { mReceiveHandler = NoOP; mTransmitHandler = NoOP; mTxFlowHandler = NoOP; }
 
   protected:
     /// this is intended to be overridden in subclases, and is called when
     /// an exception (HUP or error) occurs on the file descriptor
     virtual void dataExceptionHandler(int aFd, int aPollFlags);
 
+    /// this is intended to be overridden in subclasses, and is called when
+    /// the transmit queue has been completely sent out after having had data queued
+    virtual void transmitQueueEmptied() { /* NOP in base class */ };
+
   private:
 
     bool dataMonitorHandler(int aFd, int aPollFlags);
     void checkReceiveData();
+    void scheduleReceiveCheck();
+    ErrorPtr receiveIntoBuffer();
     bool sendBufferedData();
+    ErrorPtr sendQueuedData();
+    void checkTxFlow();
 
   };
 
@@ -43,9 +43,264 @@ const char* HttpCommError::errorName() const
 #endif // ENABLE_NAMED_ERRORS
 
 typedef enum {
-  httpThreadSignalDataReady = threadSignalUserSignal
+  httpThreadSignalDataReady = threadSignalUserSignal,
+  httpThreadSignalSinkData
 } HttpThreadSignals;
 
+// adaptive buffer sizing for downloads: buffer grows when filling it takes less than half,
+// and shrinks when it takes more than twice the target interval
+#define DOWNLOAD_CHUNK_INTERVAL (100*MilliSecond)
+#define DEFAULT_MAX_BUFFER_SIZE (64*1024)
+
+
+static void unlockMutex(void *aMutex)
+{
+  // cleanup handler, in case a thread gets cancelled while waiting on a condition
+  pthread_mutex_unlock((pthread_mutex_t *)aMutex);
+}
+
+
+
+#if !USE_LIBMONGOOSE
+
+// MARK: - HttpConnectionPool
+
+#define DEFAULT_MAX_CONNECTIONS_PER_HOST 4
+#define DEFAULT_IDLE_TIMEOUT (30*Second)
+
+HttpConnectionPool::HttpConnectionPool() :
+  mMaxPerHost(DEFAULT_MAX_CONNECTIONS_PER_HOST),
+  mIdleTimeout(DEFAULT_IDLE_TIMEOUT),
+  mRequests(0),
+  mReusedConnections(0),
+  mNewConnections(0),
+  mHandshakeTimeSaved(0)
+{
+  pthread_mutex_init(&mMutex, NULL);
+  pthread_cond_init(&mSlotReleased, NULL);
+}
+
+
+HttpConnectionPool::~HttpConnectionPool()
+{
+  closeIdleConnections();
+  pthread_cond_destroy(&mSlotReleased);
+  pthread_mutex_destroy(&mMutex);
+}
+
+
+HttpConnectionPool &HttpConnectionPool::sharedPool()
+{
+  // Note: intentionally never destroyed, as closing connections and cancelling the cleanup ticket
+  //   must not happen during static destruction (mainloop and SSL might be gone already)
+  static HttpConnectionPool* sharedHttpConnectionPool = new HttpConnectionPool;
+  return *sharedHttpConnectionPool;
+}
+
+
+void HttpConnectionPool::setLimits(int aMaxPerHost, MLMicroSeconds aIdleTimeout)
+{
+  pthread_mutex_lock(&mMutex);
+  mMaxPerHost = aMaxPerHost>0 ? aMaxPerHost : 1;
+  mIdleTimeout = aIdleTimeout;
+  closeExpiredLocked(MainLoop::now());
+  pthread_mutex_unlock(&mMutex);
+  pthread_cond_broadcast(&mSlotReleased); // waiting requests might get a slot now
+}
+
+
+ErrorPtr HttpConnectionPool::acquire(const string &aHostKey, struct mg_connection *&aIdleConn, bool &aSlotAcquired, MLMicroSeconds aMaxWait)
+{
+  ErrorPtr err;
+  aIdleConn = NULL;
+  struct timespec deadline;
+  if (aMaxWait!=Never) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long ns = (long long)deadline.tv_nsec + (long long)(aMaxWait%Second)*1000;
+    deadline.tv_sec += aMaxWait/Second + ns/1000000000;
+    deadline.tv_nsec = ns%1000000000;
+  }
+  pthread_mutex_lock(&mMutex);
+  pthread_cleanup_push(unlockMutex, &mMutex);
+  while (true) {
+    closeExpiredLocked(MainLoop::now());
+    HostConnections &hc = mHosts[aHostKey];
+    // drop idle connections the server has closed in the meantime, as a failing
+    // non-idempotent request cannot be retried on a new connection
+    while (!hc.idle.empty() && !mg_client_connection_alive(hc.idle.front().conn)) {
+      LOG(LOG_DEBUG, "HttpConnectionPool: idle connection to %s was closed by server", aHostKey.c_str());
+      mg_close_connection(hc.idle.front().conn);
+      hc.idle.pop_front();
+    }
+    if (!hc.idle.empty()) {
+      // reuse most recently used idle connection
+      aIdleConn = hc.idle.front().conn;
+      hc.idle.pop_front();
+      hc.inUse++;
+      aSlotAcquired = true;
+      break;
+    }
+    if (hc.inUse<mMaxPerHost) {
+      // new connection needed
+      hc.inUse++;
+      aSlotAcquired = true;
+      break;
+    }
+    // all connections to this host are in use, wait for one to be released
+    if (aMaxWait==Never) {
+      pthread_cond_wait(&mSlotReleased, &mMutex);
+    }
+    else if (pthread_cond_timedwait(&mSlotReleased, &mMutex, &deadline)==ETIMEDOUT) {
+      err = Error::err<HttpCommError>(HttpCommError::noConnection, "all %d connections to server are busy", mMaxPerHost);
+      break;
+    }
+  }
+  pthread_cleanup_pop(1); // unlock
+  return err;
+}
+
+
+void HttpConnectionPool::release(const string &aHostKey, struct mg_connection *aConn, bool aReused, double aConnectTime)
+{
+  pthread_mutex_lock(&mMutex);
+  HostConnections &hc = mHosts[aHostKey];
+  if (hc.inUse>0) hc.inUse--;
+  mRequests++;
+  if (aReused) {
+    mReusedConnections++;
+    // the connection time we did not have to spend
+    if (hc.connects>0) mHandshakeTimeSaved += (MLMicroSeconds)(hc.connectTime/hc.connects*Second);
+  }
+  else if (aConnectTime>0) {
+    mNewConnections++;
+    hc.connects++;
+    hc.connectTime += aConnectTime;
+  }
+  if (aConn) {
+    if (hc.inUse+(int)hc.idle.size()<mMaxPerHost && mIdleTimeout>0) {
+      IdleConnection ic;
+      ic.conn = aConn;
+      ic.idleSince = MainLoop::now();
+      hc.idle.push_front(ic);
+      aConn = NULL;
+    }
+  }
+  bool haveIdle = false;
+  for (HostMap::iterator pos = mHosts.begin(); pos!=mHosts.end(); ++pos) {
+    if (!pos->second.idle.empty()) { haveIdle = true; break; }
+  }
+  pthread_mutex_unlock(&mMutex);
+  pthread_cond_broadcast(&mSlotReleased);
+  if (aConn) mg_close_connection(aConn); // not kept
+  if (haveIdle) {
+    mCleanupTicket.executeOnce(boost::bind(&HttpConnectionPool::closeExpired, this, _1), mIdleTimeout);
+  }
+}
+
+
+void HttpConnectionPool::closeExpired(MLTimer &aTimer)
+{
+  pthread_mutex_lock(&mMutex);
+  closeExpiredLocked(MainLoop::now());
+  MLMicroSeconds oldest = Never;
+  for (HostMap::iterator pos = mHosts.begin(); pos!=mHosts.end(); ++pos) {
+    if (!pos->second.idle.empty()) {
+      MLMicroSeconds since = pos->second.idle.back().idleSince;
+      if (oldest==Never || since<oldest) oldest = since;
+    }
+  }
+  pthread_mutex_unlock(&mMutex);
+  if (oldest!=Never) {
+    // check again when the oldest idle connection expires
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, oldest+mIdleTimeout-MainLoop::now());
+  }
+}
+
+
+void HttpConnectionPool::closeExpiredLocked(MLMicroSeconds aNow)
+{
+  for (HostMap::iterator pos = mHosts.begin(); pos!=mHosts.end(); ++pos) {
+    IdleList &idle = pos->second.idle;
+    // least recently used are at the end
+    while (!idle.empty() && (aNow-idle.back().idleSince>=mIdleTimeout || (int)idle.size()+pos->second.inUse>mMaxPerHost)) {
+      mg_close_connection(idle.back().conn);
+      idle.pop_back();
+    }
+  }
+}
+
+
+void HttpConnectionPool::closeIdleConnections()
+{
+  pthread_mutex_lock(&mMutex);
+  for (HostMap::iterator pos = mHosts.begin(); pos!=mHosts.end(); ++pos) {
+    IdleList &idle = pos->second.idle;
+    while (!idle.empty()) {
+      mg_close_connection(idle.front().conn);
+      idle.pop_front();
+    }
+  }
+  pthread_mutex_unlock(&mMutex);
+  mCleanupTicket.cancel();
+}
+
+
+size_t HttpConnectionPool::idleConnections()
+{
+  size_t n = 0;
+  pthread_mutex_lock(&mMutex);
+  for (HostMap::iterator pos = mHosts.begin(); pos!=mHosts.end(); ++pos) n += pos->second.idle.size();
+  pthread_mutex_unlock(&mMutex);
+  return n;
+}
+
+#endif // !USE_LIBMONGOOSE
+
+
+// MARK: - body sinks
+
+bool HttpCallbackSink::bodyData(const uint8_t *aData, size_t aSize, ErrorPtr &aError)
+{
+  if (!mDataCB) return true;
+  return mDataCB(aData, aSize);
+}
+
+
+HttpFdSink::~HttpFdSink()
+{
+  if (mCloseAtEnd && mFd>=0) close(mFd);
+}
+
+
+bool HttpFdSink::bodyData(const uint8_t *aData, size_t aSize, ErrorPtr &aError)
+{
+  while (aSize>0) {
+    ssize_t n = write(mFd, aData, aSize);
+    if (n<0) {
+      if (errno==EINTR) continue;
+      aError = SysError::errNo("HttpFdSink write: ");
+      return true;
+    }
+    aData += n;
+    aSize -= (size_t)n;
+    mBytesWritten += (size_t)n;
+  }
+  return true;
+}
+
+
+ErrorPtr HttpFdSink::bodyEnd()
+{
+  if (fsync(mFd)<0 && errno!=EINVAL && errno!=EROFS) {
+    // Note: pipes, sockets etc. cannot be synced, that's ok
+    return SysError::errNo("HttpFdSink sync: ");
+  }
+  return ErrorPtr();
+}
+
+
+// MARK: - HttpComm
+
 
 
 HttpComm::HttpComm(MainLoop &aMainLoop) :
@@ -53,14 +308,32 @@ HttpComm::HttpComm(MainLoop &aMainLoop) :
   mRequestInProgress(false),
   mMgConn(NULL),
   mHttpAuthInfo(NULL),
+  mKeepAlive(false),
+  mPoolSlotAcquired(false),
+  mKeepConn(NULL),
+  mConnReused(false),
+  mConnectTime(0),
+  mEngine(engine_thread),
+  mParserState(0),
+  mBodyRemaining(0),
+  mNoResponseBody(false),
   mAuthMode(digest_only),
   mTimeout(Never),
   mBufferSz(2048),
+  mMaxBufferSz(DEFAULT_MAX_BUFFER_SIZE),
+  mChunkData(NULL),
+  mChunkSize(0),
+  mAbortBody(false),
+  mBodyPaused(false),
+  mServerClosed(false),
+  mRxLimit(0),
   mServerCertVfyDir("*"), // default to platform's generic certificate checking method / root cert store
   mResponseDataFd(-1),
   mStreamResult(false),
   mDataProcessingPending(false)
 {
+  pthread_mutex_init(&mHandoverMutex, NULL);
+  pthread_cond_init(&mHandoverCond, NULL);
 }
 
 
@@ -68,6 +341,8 @@ HttpComm::~HttpComm()
 {
   if (mHttpAuthInfo) free(mHttpAuthInfo); // we own this
   terminate();
+  pthread_cond_destroy(&mHandoverCond);
+  pthread_mutex_destroy(&mHandoverMutex);
 }
 
 
@@ -116,11 +391,22 @@ void HttpComm::requestThread(ChildThreadWrapper &aThread)
     copts.client_cert = mClientCertFile.empty() ? NULL : mClientCertFile.c_str();
     copts.server_cert = mServerCertVfyDir.empty() ? NULL : mServerCertVfyDir.c_str();
     copts.timeout = mTimeout==Never ? -2 : (double)mTimeout/Second;
+    struct mg_keepalive_info ka;
+    ka.reuse_conn = NULL;
+    ka.reused = 0;
+    ka.connect_time = 0;
+    if (mKeepAlive) {
+      // get a connection slot (and possibly an idle connection) from the pool
+      mPoolKey = string_format("%s://%s:%d|%s|%s", protocol.c_str(), host.c_str(), port, mClientCertFile.c_str(), mServerCertVfyDir.c_str());
+      mRequestError = HttpConnectionPool::sharedPool().acquire(mPoolKey, ka.reuse_conn, mPoolSlotAcquired, mTimeout);
+      if (Error::notOK(mRequestError)) return;
+    }
     if (mRequestBody.length()>0) {
       // is a request which sends data in the HTTP message body (e.g. POST)
-      mMgConn = mg_download_secure(
+      mMgConn = mg_download_keepalive(
         &copts,
         useSSL,
+        mKeepAlive ? &ka : NULL,
         mMethod.c_str(),
         doc.c_str(),
         mUsername.empty() ? NULL : mUsername.c_str(),
@@ -141,9 +427,10 @@ void HttpComm::requestThread(ChildThreadWrapper &aThread)
     }
     else {
       // no request body (e.g. GET, DELETE)
-      mMgConn = mg_download_secure(
+      mMgConn = mg_download_keepalive(
         &copts,
         useSSL,
+        mKeepAlive ? &ka : NULL,
         mMethod.c_str(),
         doc.c_str(),
         mUsername.empty() ? NULL : mUsername.c_str(),
@@ -157,6 +444,8 @@ void HttpComm::requestThread(ChildThreadWrapper &aThread)
         extraHeaders.c_str()
       );
     }
+    mConnReused = ka.reused;
+    mConnectTime = ka.connect_time;
     #else
     int tmo = timeout==Never ? -1 : (int)(timeout/MilliSecond);
     if (requestBody.length()>0) {
@@ -234,14 +523,17 @@ void HttpComm::requestThread(ChildThreadWrapper &aThread)
       }
       if (Error::isOK(mRequestError) || mRequestError->isDomain(WebError::domain())) {
         // - read data
-        uint8_t *bufferP = new uint8_t[mBufferSz];
+        size_t bufSz = mBufferSz;
+        size_t maxBufSz = mSink && mMaxBufferSz>mBufferSz ? mMaxBufferSz : mBufferSz; // only sinks use adaptive buffer sizing
+        uint8_t *bufferP = (uint8_t *)malloc(bufSz);
         int errCause;
         #if !USE_LIBMONGOOSE
         double to = mStreamResult ? TMO_SOMETHING : copts.timeout;
         #endif
         while (true) {
           #if !USE_LIBMONGOOSE
-          ssize_t res = mg_read_ex(mMgConn, bufferP, mBufferSz, to, &errCause);
+          MLMicroSeconds readStart = MainLoop::now();
+          ssize_t res = mg_read_ex(mMgConn, bufferP, bufSz, to, &errCause);
           if (mStreamResult && res<0 && errCause==EC_TIMEOUT) {
             continue;
           }
@@ -276,20 +568,37 @@ void HttpComm::requestThread(ChildThreadWrapper &aThread)
           #endif
           else {
             // data read
-            if (mResponseDataFd>=0) {
+            if (mSink) {
+              // adapt buffer size to the data rate
+              MLMicroSeconds fillTime = MainLoop::now()-readStart;
+              size_t newSz = bufSz;
+              if ((size_t)res==bufSz && fillTime<DOWNLOAD_CHUNK_INTERVAL/2 && bufSz<maxBufSz) newSz = bufSz*2>maxBufSz ? maxBufSz : bufSz*2;
+              else if (fillTime>DOWNLOAD_CHUNK_INTERVAL*2 && bufSz>mBufferSz) newSz = bufSz/2<mBufferSz ? mBufferSz : bufSz/2;
+              // deliver
+              if (mSink->inRequestThread()) {
+                mSink->bodyData(bufferP, (size_t)res, mRequestError);
+              }
+              else {
+                // zero copy: main thread accesses our buffer while we wait
+                mChunkData = bufferP;
+                mChunkSize = (size_t)res;
+                handOverToMainThread(aThread, httpThreadSignalSinkData);
+              }
+              if (mAbortBody || (Error::notOK(mRequestError) && !mRequestError->isDomain(WebError::domain()))) break;
+              if (newSz!=bufSz) {
+                uint8_t *nb = (uint8_t *)realloc(bufferP, newSz);
+                if (nb) { bufferP = nb; bufSz = newSz; }
+              }
+            }
+            else if (mResponseDataFd>=0) {
               // write to fd
               write(mResponseDataFd, bufferP, res);
             }
             else if (mStreamResult) {
               // pass back the data chunk now
               mResponse.assign((const char *)bufferP, (size_t)res);
-              mDataProcessingPending = true;
-              aThread.signalParentThread(httpThreadSignalDataReady);
               // now wait until data has been processed in main thread
-              while (mDataProcessingPending) {
-                // FIXME: ugly - add better thread signalling here
-                usleep(50000); // 50mS
-              }
+              handOverToMainThread(aThread, httpThreadSignalDataReady);
             }
             else {
               // just collect entire response in string
@@ -297,12 +606,21 @@ void HttpComm::requestThread(ChildThreadWrapper &aThread)
             }
           }
         }
-        delete[] bufferP;
+        free(bufferP);
       } // if content to read
-      // done, close connection
+      // done, close connection (or keep it for the next request)
       if (mMgConn) {
-        mg_close_connection(mMgConn);
-        mMgConn = NULL;
+        #if !USE_LIBMONGOOSE
+        if (mPoolSlotAcquired && mg_client_connection_reusable(mMgConn)) {
+          mKeepConn = mMgConn;
+          mMgConn = NULL;
+        }
+        else
+        #endif
+        {
+          mg_close_connection(mMgConn);
+          mMgConn = NULL;
+        }
       }
     }
   }
@@ -310,6 +628,31 @@ void HttpComm::requestThread(ChildThreadWrapper &aThread)
 }
 
 
+void HttpComm::handOverToMainThread(ChildThreadWrapper &aThread, ThreadSignals aSignalCode)
+{
+  pthread_mutex_lock(&mHandoverMutex);
+  mDataProcessingPending = true;
+  pthread_mutex_unlock(&mHandoverMutex);
+  aThread.signalParentThread(aSignalCode);
+  // wait until main thread has processed the data
+  pthread_mutex_lock(&mHandoverMutex);
+  pthread_cleanup_push(unlockMutex, &mHandoverMutex);
+  while (mDataProcessingPending) {
+    pthread_cond_wait(&mHandoverCond, &mHandoverMutex);
+  }
+  pthread_cleanup_pop(1); // unlock
+}
+
+
+void HttpComm::dataProcessed()
+{
+  pthread_mutex_lock(&mHandoverMutex);
+  mDataProcessingPending = false; // child thread can go on reading
+  pthread_cond_signal(&mHandoverCond);
+  pthread_mutex_unlock(&mHandoverMutex);
+}
+
+
 
 void HttpComm::requestThreadSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode)
 {
@@ -317,16 +660,29 @@ void HttpComm::requestThreadSignal(ChildThreadWrapper &aChildThread, ThreadSigna
   if (aSignalCode==threadSignalCompleted) {
     DBGLOG(LOG_DEBUG, "- HTTP subthread exited - request completed");
     mRequestInProgress = false; // thread completed
-    // call back with result of request
-    // Note: as this callback might initiate another request already and overwrite the callback, copy it here
-    HttpCommCB cb = mResponseCallback;
-    string resp = mResponse;
-    ErrorPtr reqErr = mRequestError;
+    releasePoolConnection();
     // release child thread object now
-    mResponseCallback.clear();
     mChildThread.reset();
-    // now execute callback
-    if (cb) cb(resp, reqErr);
+    if (mSink) {
+      ErrorPtr err = finishSink();
+      if (Error::notOK(err)) mRequestError = err;
+    }
+    requestCompleted();
+  }
+  else if (aSignalCode==httpThreadSignalSinkData) {
+    // data chunk ready for sink
+    bool more = true;
+    if (mSink) {
+      ErrorPtr err;
+      more = mSink->bodyData(mChunkData, mChunkSize, err);
+      if (Error::notOK(err)) {
+        mRequestError = err;
+        mAbortBody = true;
+        more = true;
+      }
+    }
+    if (more) dataProcessed();
+    else mBodyPaused = true; // child thread waits until resumeBody()
   }
   else if (aSignalCode==httpThreadSignalDataReady) {
     // data chunk ready in streamResult mode
@@ -334,7 +690,7 @@ void HttpComm::requestThreadSignal(ChildThreadWrapper &aChildThread, ThreadSigna
     //DBGLOG(LOG_DEBUG, "- data: %s", response.c_str());
     // callback may NOT issue another request on this httpComm, so no need to copy it
     if (mResponseCallback) mResponseCallback(mResponse, mRequestError);
-    mDataProcessingPending = false; // child thread can go on reading
+    dataProcessed();
   }
   else if (aSignalCode==threadSignalCancelled) {
     // Note: mgConn is owned by child thread and should NOT be accessed from other threads, normally.
@@ -344,7 +700,49 @@ void HttpComm::requestThreadSignal(ChildThreadWrapper &aChildThread, ThreadSigna
       mg_close_connection(mMgConn);
       mMgConn = NULL;
     }
+    releasePoolConnection();
+  }
+}
+
+
+ErrorPtr HttpComm::finishSink()
+{
+  HttpBodySinkPtr sink = mSink;
+  mSink.reset();
+  if (Error::isOK(mRequestError) || mRequestError->isDomain(WebError::domain())) {
+    return sink->bodyEnd();
   }
+  return ErrorPtr();
+}
+
+
+void HttpComm::requestCompleted()
+{
+  // call back with result of request
+  // Note: as this callback might initiate another request already and overwrite the callback, copy it here
+  HttpCommCB cb = mResponseCallback;
+  string resp = mResponse;
+  ErrorPtr reqErr = mRequestError;
+  mResponseCallback.clear();
+  // now execute callback
+  if (cb) cb(resp, reqErr);
+}
+
+
+void HttpComm::releasePoolConnection()
+{
+  #if !USE_LIBMONGOOSE
+  if (mPoolSlotAcquired) {
+    mPoolSlotAcquired = false;
+    HttpConnectionPool::sharedPool().release(mPoolKey, mKeepConn, mConnReused, mConnectTime);
+  }
+  else if (mKeepConn) {
+    mg_close_connection(mKeepConn);
+  }
+  mKeepConn = NULL;
+  mConnReused = false;
+  mConnectTime = 0;
+  #endif
 }
 
 
@@ -359,9 +757,28 @@ bool HttpComm::httpRequest(
   bool aSaveHeaders,
   bool aStreamResult
 )
+{
+  return startRequest(aURL, aResponseCallback, aMethod, aRequestBody, aContentType, aResponseDataFd, aSaveHeaders, aStreamResult, HttpBodySinkPtr());
+}
+
+
+bool HttpComm::startRequest(
+  const char *aURL,
+  HttpCommCB aResponseCallback,
+  const char *aMethod,
+  const char* aRequestBody,
+  const char* aContentType,
+  int aResponseDataFd,
+  bool aSaveHeaders,
+  bool aStreamResult,
+  HttpBodySinkPtr aSink
+)
 {
   if (mRequestInProgress || !aURL)
     return false; // blocked or no URL
+  mSink = aSink;
+  mAbortBody = false;
+  mBodyPaused = false;
   mResponseDataFd = aResponseDataFd;
   mResponseHeaders.reset();
   mRequestError.reset();
@@ -376,8 +793,11 @@ bool HttpComm::httpRequest(
   else
     mContentType = defaultContentType(); // use default for the class
   mStreamResult = aStreamResult;
-  // now let subthread handle this
   mRequestInProgress = true;
+  if (mEngine==engine_mainloop && startMainloopRequest()) {
+    return true; // handled on the mainloop
+  }
+  // now let subthread handle this
   mChildThread = MainLoop::currentMainLoop().executeInThread(
     boost::bind(&HttpComm::requestThread, this, _1),
     boost::bind(&HttpComm::requestThreadSignal, this, _1, _2)
@@ -386,12 +806,414 @@ bool HttpComm::httpRequest(
 }
 
 
+bool HttpComm::httpDownload(
+  const char *aURL,
+  HttpBodySinkPtr aSink,
+  HttpCommCB aDoneCallback,
+  const char *aMethod,
+  const char* aRequestBody,
+  const char* aContentType,
+  bool aSaveHeaders
+)
+{
+  if (!aSink) return false;
+  return startRequest(aURL, aDoneCallback, aMethod, aRequestBody, aContentType, -1, aSaveHeaders, false, aSink);
+}
+
+
+void HttpComm::resumeBody()
+{
+  if (!mBodyPaused) return;
+  mBodyPaused = false;
+  if (mChildThread) {
+    dataProcessed(); // let request thread go on reading
+  }
+  else if (mSocket) {
+    // continue on mainloop (not from within caller's context, which might be the sink itself)
+    mResumeTicket.executeOnce(boost::bind(&HttpComm::resumeMainloopBody, this));
+  }
+}
+
+
 void HttpComm::cancelRequest()
 {
   if (mRequestInProgress && mChildThread) {
     mChildThread->cancel();
     mRequestInProgress = false; // prevent cancelling multiple times
   }
+  else if (mRequestInProgress && (mSocket || mRequestTicket)) {
+    closeMainloopRequest();
+    mRequestInProgress = false;
+  }
+}
+
+
+// MARK: - mainloop based request engine
+
+// response parser states
+enum {
+  rs_status, ///< waiting for status line and headers
+  rs_length, ///< body with known length
+  rs_chunkSize, ///< waiting for chunk size line
+  rs_chunkData, ///< within chunk data
+  rs_chunkEnd, ///< waiting for CRLF after chunk data
+  rs_trailer, ///< waiting for end of trailer (empty line)
+  rs_untilClose, ///< body ends when server closes the connection
+  rs_done ///< response complete
+};
+
+#define MAX_RESPONSE_HEADER_SIZE (16*1024)
+
+
+static string base64Encode(const string &aData)
+{
+  static const char *b64chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string res;
+  size_t i = 0;
+  while (i<aData.size()) {
+    uint32_t v = (uint8_t)aData[i]<<16;
+    if (i+1<aData.size()) v |= (uint8_t)aData[i+1]<<8;
+    if (i+2<aData.size()) v |= (uint8_t)aData[i+2];
+    res += b64chars[(v>>18)&0x3F];
+    res += b64chars[(v>>12)&0x3F];
+    res += i+1<aData.size() ? b64chars[(v>>6)&0x3F] : '=';
+    res += i+2<aData.size() ? b64chars[v&0x3F] : '=';
+    i += 3;
+  }
+  return res;
+}
+
+
+bool HttpComm::startMainloopRequest()
+{
+  string protocol, hostSpec, host, doc;
+  uint16_t port = 80;
+  splitURL(mRequestURL.c_str(), &protocol, &hostSpec, &doc, NULL, NULL);
+  if (protocol!="http") return false; // no TLS here, use thread engine
+  if (!mUsername.empty() && mAuthMode!=basic_first) return false; // digest auth needs thread engine
+  splitHost(hostSpec.c_str(), &host, &port);
+  if (doc.empty()) doc = "/";
+  mResponse.clear();
+  mResponseStatus = 0;
+  mRxBuffer.clear();
+  mParserState = rs_status;
+  mNoResponseBody = uequals(mMethod, "HEAD");
+  // assemble request
+  string req = string_format("%s %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n", mMethod.c_str(), doc.c_str(), hostSpec.c_str());
+  if (!mUsername.empty()) {
+    string_format_append(req, "Authorization: Basic %s\r\n", base64Encode(mUsername+":"+mPassword).c_str());
+  }
+  if (mRequestBody.length()>0) {
+    string_format_append(req, "Content-Type: %s\r\n", mContentType.c_str());
+  }
+  string_format_append(req, "Content-Length: %ld\r\n", (long)mRequestBody.length());
+  for (HttpHeaderMap::iterator pos=mRequestHeaders.begin(); pos!=mRequestHeaders.end(); ++pos) {
+    string_format_append(req, "%s: %s\r\n", pos->first.c_str(), pos->second.c_str());
+  }
+  req += "\r\n";
+  req += mRequestBody;
+  // connect
+  mSocket = SocketCommPtr(new SocketComm(mMainLoop));
+  mSocket->setConnectionParams(host.c_str(), string_format("%d", port).c_str(), SOCK_STREAM);
+  mSocket->setConnectionStatusHandler(boost::bind(&HttpComm::mainloopRequestConnected, this, _1, _2));
+  mSocket->setReceiveHandler(boost::bind(&HttpComm::mainloopRequestData, this, _1));
+  mSocket->sendString(req); // queued until connected
+  if (mTimeout!=Never) {
+    mRequestTicket.executeOnce(boost::bind(&HttpComm::mainloopRequestTimeout, this), mTimeout);
+  }
+  ErrorPtr err = mSocket->initiateConnection();
+  if (Error::notOK(err)) {
+    // report error asynchronously, like thread engine does
+    mRequestTicket.executeOnce(boost::bind(&HttpComm::endMainloopRequest, this, err));
+  }
+  return true;
+}
+
+
+void HttpComm::mainloopRequestConnected(SocketCommPtr aSocketComm, ErrorPtr aError)
+{
+  if (Error::isOK(aError)) {
+    DBGLOG(LOG_DEBUG, "HttpComm: connected to %s", mRequestURL.c_str());
+    return; // request is sent from transmit queue
+  }
+  HttpCommPtr keepMeAlive(this); // callbacks might release us
+  if (aError->isError(SocketCommError::domain(), SocketCommError::HungUp)) {
+    // server has closed the connection
+    if (mBodyPaused) {
+      // process rest of buffered data when sink resumes
+      mServerClosed = true;
+      return;
+    }
+    mainloopRequestData(ErrorPtr()); // make sure we got everything
+    if (!mSocket) return; // request already ended
+    if (parseResponse(true)) {
+      endMainloopRequest(ErrorPtr());
+      return;
+    }
+    aError = Error::err<HttpCommError>(HttpCommError::read, "HTTP connection closed before response was complete");
+  }
+  endMainloopRequest(aError);
+}
+
+
+void HttpComm::mainloopRequestData(ErrorPtr aError)
+{
+  if (!mSocket || mBodyPaused) return;
+  HttpCommPtr keepMeAlive(this); // callbacks might release us
+  if (Error::isOK(aError)) {
+    size_t n = mSocket->numBytesReady();
+    if (mSink) {
+      // bounded memory: read at most mRxLimit, adapting it to the amount of data waiting
+      size_t maxSz = mMaxBufferSz>mBufferSz ? mMaxBufferSz : mBufferSz;
+      if (mRxLimit==0) mRxLimit = mBufferSz;
+      if (n>mRxLimit) {
+        n = mRxLimit;
+        if (mRxLimit<maxSz) mRxLimit = mRxLimit*2>maxSz ? maxSz : mRxLimit*2;
+      }
+      else if (n<mRxLimit/4 && mRxLimit>mBufferSz) {
+        mRxLimit = mRxLimit/2<mBufferSz ? mBufferSz : mRxLimit/2;
+      }
+    }
+    // read directly into the parsing buffer
+    size_t old = mRxBuffer.size();
+    mRxBuffer.resize(old+n);
+    n = mSocket->receiveBytes(n, (uint8_t *)&mRxBuffer[old], aError);
+    mRxBuffer.resize(old+n);
+  }
+  if (Error::notOK(aError)) {
+    endMainloopRequest(aError);
+    return;
+  }
+  if (mTimeout!=Never && !(mStreamResult && mParserState!=rs_status)) {
+    // inactivity timeout (not applied to streams, which may pause indefinitely)
+    mRequestTicket.executeOnce(boost::bind(&HttpComm::mainloopRequestTimeout, this), mTimeout);
+  }
+  else {
+    mRequestTicket.cancel();
+  }
+  if (parseResponse(false) && mSocket) {
+    endMainloopRequest(ErrorPtr());
+  }
+}
+
+
+/// @return true if response is complete
+bool HttpComm::parseResponse(bool aClosed)
+{
+  size_t pos = 0;
+  bool complete = false;
+  while (mSocket) {
+    if (mParserState==rs_status) {
+      size_t e = mRxBuffer.find("\r\n\r\n", pos);
+      if (e==string::npos) {
+        if (mRxBuffer.size()-pos>MAX_RESPONSE_HEADER_SIZE) {
+          endMainloopRequest(Error::err<HttpCommError>(HttpCommError::read, "HTTP response header too large"));
+          return false;
+        }
+        break; // need more data
+      }
+      string headers = mRxBuffer.substr(pos, e-pos);
+      pos = e+4;
+      if (!parseResponseHeaders(headers)) return false;
+    }
+    else if (mParserState==rs_length || mParserState==rs_chunkData) {
+      size_t n = mRxBuffer.size()-pos;
+      if (n==0) break;
+      if ((int64_t)n>mBodyRemaining) n = (size_t)mBodyRemaining;
+      mBodyRemaining -= n;
+      if (mBodyRemaining==0) mParserState = mParserState==rs_length ? rs_done : rs_chunkEnd;
+      size_t at = pos;
+      pos += n;
+      if (!deliverBody(mRxBuffer.c_str()+at, n)) break;
+    }
+    else if (mParserState==rs_untilClose) {
+      size_t n = mRxBuffer.size()-pos;
+      if (n>0) {
+        size_t at = pos;
+        pos += n;
+        if (!deliverBody(mRxBuffer.c_str()+at, n)) break;
+      }
+      if (aClosed) mParserState = rs_done;
+      else break;
+    }
+    else if (mParserState==rs_chunkSize || mParserState==rs_chunkEnd || mParserState==rs_trailer) {
+      size_t e = mRxBuffer.find("\r\n", pos);
+      if (e==string::npos) break; // need more data
+      string line = mRxBuffer.substr(pos, e-pos);
+      pos = e+2;
+      if (mParserState==rs_chunkEnd) {
+        mParserState = rs_chunkSize;
+      }
+      else if (mParserState==rs_trailer) {
+        if (line.empty()) mParserState = rs_done;
+      }
+      else {
+        char *ep;
+        mBodyRemaining = strtoll(line.c_str(), &ep, 16);
+        if (ep==line.c_str() || mBodyRemaining<0) {
+          endMainloopRequest(Error::err<HttpCommError>(HttpCommError::read, "invalid HTTP chunk size"));
+          return false;
+        }
+        mParserState = mBodyRemaining==0 ? rs_trailer : rs_chunkData;
+      }
+    }
+    else {
+      complete = mParserState==rs_done;
+      break;
+    }
+  }
+  if (mSocket) mRxBuffer.erase(0, pos);
+  return complete;
+}
+
+
+bool HttpComm::parseResponseHeaders(const string &aHeaders)
+{
+  const char *p = aHeaders.c_str();
+  string line;
+  // status line
+  nextLine(p, line);
+  int major, minor;
+  if (sscanf(line.c_str(), "HTTP/%d.%d %d", &major, &minor, &mResponseStatus)!=3) {
+    endMainloopRequest(Error::err<HttpCommError>(HttpCommError::read, "invalid HTTP response"));
+    return false;
+  }
+  if (mResponseStatus>=100 && mResponseStatus<200) {
+    // interim response (e.g. 100 Continue), real response follows
+    return true;
+  }
+  // headers
+  int64_t contentLength = -1;
+  bool chunked = false;
+  while (nextLine(p, line)) {
+    size_t c = line.find(':');
+    if (c==string::npos) continue;
+    string name = trimWhiteSpace(line.substr(0, c));
+    string value = trimWhiteSpace(line.substr(c+1));
+    if (mResponseHeaders) (*mResponseHeaders)[name] = value;
+    if (uequals(name, "Content-Length")) {
+      contentLength = atoll(value.c_str());
+    }
+    else if (uequals(name, "Transfer-Encoding")) {
+      chunked = !uequals(value, "identity");
+    }
+  }
+  // accept 200..203 status codes as OK (these are: success, created, accepted, non-authorative(=proxy modified))
+  if (mResponseStatus<200 || mResponseStatus>203) {
+    // Important: report status as WebError, not HttpCommError, because it is not technically an error on the HTTP transport level
+    mRequestError = WebError::webErr(mResponseStatus,"HTTP non-ok status");
+  }
+  // determine how body ends
+  if (mNoResponseBody || mResponseStatus==204 || mResponseStatus==304) {
+    mParserState = rs_done;
+  }
+  else if (chunked) {
+    mParserState = rs_chunkSize;
+  }
+  else if (contentLength>=0) {
+    mBodyRemaining = contentLength;
+    mParserState = contentLength>0 ? rs_length : rs_done;
+  }
+  else {
+    mParserState = rs_untilClose;
+  }
+  return true;
+}
+
+
+/// @return false if request has ended (cancelled from callback) or sink has paused delivery
+bool HttpComm::deliverBody(const char *aData, size_t aSize)
+{
+  if (mSink) {
+    ErrorPtr err;
+    bool more = mSink->bodyData((const uint8_t *)aData, aSize, err);
+    if (Error::notOK(err)) {
+      endMainloopRequest(err);
+      return false;
+    }
+    if (!more && mSocket) {
+      // stop reading, so TCP flow control throttles the server until sink resumes
+      mBodyPaused = true;
+      mSocket->setReceiveHandler(NoOP);
+      mRequestTicket.cancel(); // no timeout while paused
+      return false;
+    }
+    return mSocket!=NULL; // sink might have cancelled the request
+  }
+  else if (mResponseDataFd>=0) {
+    write(mResponseDataFd, aData, aSize);
+  }
+  else if (mStreamResult) {
+    // pass back the data chunk now
+    mResponse.assign(aData, aSize);
+    if (mResponseCallback) mResponseCallback(mResponse, mRequestError);
+    return mSocket!=NULL; // callback might have cancelled the request
+  }
+  else {
+    mResponse.append(aData, aSize);
+  }
+  return true;
+}
+
+
+void HttpComm::resumeMainloopBody()
+{
+  if (!mSocket) return;
+  HttpCommPtr keepMeAlive(this); // callbacks might release us
+  // first process what is already buffered
+  if (parseResponse(mServerClosed)) {
+    if (mSocket) endMainloopRequest(ErrorPtr());
+    return;
+  }
+  if (!mSocket || mBodyPaused) return; // ended or paused again
+  if (mServerClosed) {
+    endMainloopRequest(Error::err<HttpCommError>(HttpCommError::read, "HTTP connection closed before response was complete"));
+    return;
+  }
+  // continue reading
+  mSocket->setReceiveHandler(boost::bind(&HttpComm::mainloopRequestData, this, _1));
+  if (mTimeout!=Never) {
+    mRequestTicket.executeOnce(boost::bind(&HttpComm::mainloopRequestTimeout, this), mTimeout);
+  }
+}
+
+
+void HttpComm::mainloopRequestTimeout()
+{
+  endMainloopRequest(Error::err<HttpCommError>(mParserState==rs_status ? HttpCommError::noConnection : HttpCommError::read, "HTTP request timeout"));
+}
+
+
+void HttpComm::endMainloopRequest(ErrorPtr aError)
+{
+  HttpCommPtr keepMeAlive(this); // callbacks might release us
+  closeMainloopRequest();
+  if (Error::notOK(aError)) mRequestError = aError;
+  if (mSink) {
+    ErrorPtr err = finishSink();
+    if (Error::notOK(err)) mRequestError = err;
+  }
+  // when streaming, signal end-of-stream condition by an empty data response
+  if (mStreamResult) mResponse.clear();
+  mRequestInProgress = false;
+  requestCompleted();
+}
+
+
+void HttpComm::closeMainloopRequest()
+{
+  mRequestTicket.cancel();
+  mResumeTicket.cancel();
+  mBodyPaused = false;
+  mServerClosed = false;
+  mRxLimit = 0;
+  if (mSocket) {
+    SocketCommPtr s = mSocket;
+    mSocket.reset();
+    s->clearCallbacks();
+    s->closeConnection();
+  }
+  mRxBuffer.clear();
 }
 
 // MARK: - Utilities
@@ -24,6 +24,7 @@
 #define __p44utils__httpcomm__
 
 #include "p44utils_main.hpp"
+#include "socketcomm.hpp"
 
 #if USE_LIBMONGOOSE
   #include "mongoose.h"
@@ -82,6 +83,154 @@ namespace p44 {
   typedef boost::shared_ptr<HttpHeaderMap> HttpHeaderMapPtr;
 
 
+  #if !USE_LIBMONGOOSE
+
+  /// Pool of idle HTTP/1.1 keep-alive client connections, shared by all HttpComm instances using keep-alive
+  /// @note connection slots are acquired by the request threads, and released on the main thread
+  class HttpConnectionPool
+  {
+    typedef struct {
+      struct mg_connection *conn;
+      MLMicroSeconds idleSince;
+    } IdleConnection;
+    typedef std::list<IdleConnection> IdleList;
+
+    typedef struct {
+      IdleList idle; ///< idle connections, most recently used first
+      int inUse; ///< number of connection slots currently used by requests
+      long connects; ///< number of new connections opened
+      double connectTime; ///< total time spent opening new connections, in seconds
+    } HostConnections;
+    typedef std::map<string, HostConnections> HostMap;
+
+    pthread_mutex_t mMutex;
+    pthread_cond_t mSlotReleased;
+    HostMap mHosts;
+    int mMaxPerHost; ///< max number of connections (in use and idle) per host
+    MLMicroSeconds mIdleTimeout; ///< idle connections are closed after this time
+    MLTicket mCleanupTicket;
+
+    // statistics
+    long mRequests;
+    long mReusedConnections;
+    long mNewConnections;
+    MLMicroSeconds mHandshakeTimeSaved;
+
+    HttpConnectionPool();
+
+  public:
+
+    ~HttpConnectionPool();
+
+    /// get shared instance of the pool
+    /// @note the shared pool is never destroyed. Applications wanting to close idle connections
+    ///   cleanly at shutdown should call closeIdleConnections() while the mainloop is still alive.
+    static HttpConnectionPool &sharedPool();
+
+    /// set pool limits
+    /// @param aMaxPerHost max number of connections per host. Requests exceeding this wait for a connection to be released
+    /// @param aIdleTimeout time after which idle connections are closed
+    void setLimits(int aMaxPerHost, MLMicroSeconds aIdleTimeout);
+
+    /// acquire a connection slot for a request
+    /// @param aHostKey identifies the server (scheme, host, port and certificate options)
+    /// @param aIdleConn will be set to an idle connection to reuse, or NULL if a new connection must be opened
+    /// @param aSlotAcquired will be set when a slot is acquired (which must then be returned with release())
+    /// @param aMaxWait max time to wait for a free slot when all connections to the host are in use, Never = no limit
+    /// @return error if no slot became available within aMaxWait
+    /// @note called from request threads, blocks while waiting for a free slot
+    ErrorPtr acquire(const string &aHostKey, struct mg_connection *&aIdleConn, bool &aSlotAcquired, MLMicroSeconds aMaxWait);
+
+    /// release a connection slot
+    /// @param aHostKey identifies the server
+    /// @param aConn connection to keep for reuse, or NULL if the connection was closed or is not reusable
+    /// @param aReused set if the request was sent over an idle connection from the pool
+    /// @param aConnectTime time spent for opening a new connection, in seconds
+    /// @note must be called on the main thread
+    void release(const string &aHostKey, struct mg_connection *aConn, bool aReused, double aConnectTime);
+
+    /// close all idle connections
+    void closeIdleConnections();
+
+    /// @name statistics
+    /// @{
+    long requests() { return mRequests; }; ///< number of requests that used the pool
+    long reusedConnections() { return mReusedConnections; }; ///< number of requests sent over an idle connection
+    long newConnections() { return mNewConnections; }; ///< number of new connections opened
+    double reuseRate() { return mRequests>0 ? (double)mReusedConnections/mRequests : 0; }; ///< fraction of requests that could reuse a connection
+    MLMicroSeconds handshakeTimeSaved() { return mHandshakeTimeSaved; }; ///< estimated connect/handshake time saved by reusing connections
+    size_t idleConnections(); ///< number of idle connections currently in the pool
+    /// @}
+
+  private:
+
+    void closeExpired(MLTimer &aTimer);
+    void closeExpiredLocked(MLMicroSeconds aNow);
+
+  };
+
+  #endif // !USE_LIBMONGOOSE
+
+
+  /// Receiver for response body data of downloads started with HttpComm::httpDownload()
+  /// @note body data is passed without copying it into a string first, so downloads of any size
+  ///   can be processed in constant memory
+  class HttpBodySink : public P44Obj
+  {
+  public:
+
+    /// process a chunk of body data
+    /// @param aData the data. Only valid during the call.
+    /// @param aSize number of bytes
+    /// @param aError can be set to abort the download
+    /// @return true if ready for more data, false to pause delivery until HttpComm::resumeBody() is called
+    virtual bool bodyData(const uint8_t *aData, size_t aSize, ErrorPtr &aError) = 0;
+
+    /// called when the body is complete (not called when the download fails)
+    /// @return error if the body could not be processed completely
+    virtual ErrorPtr bodyEnd() { return ErrorPtr(); };
+
+    /// @return true if bodyData() can be called directly in the request thread (engine_thread only)
+    /// @note such sinks apply backpressure by blocking in bodyData(), and must not return false
+    virtual bool inRequestThread() { return false; };
+
+  };
+  typedef boost::intrusive_ptr<HttpBodySink> HttpBodySinkPtr;
+
+
+  /// callback for streamed body data
+  /// @param aData the data. Only valid during the call.
+  /// @param aSize number of bytes
+  /// @return true if ready for more data, false to pause delivery until HttpComm::resumeBody() is called
+  typedef boost::function<bool (const uint8_t *aData, size_t aSize)> HttpBodyDataCB;
+
+  /// body sink calling a callback with every chunk of data
+  class HttpCallbackSink : public HttpBodySink
+  {
+    HttpBodyDataCB mDataCB;
+  public:
+    HttpCallbackSink(HttpBodyDataCB aDataCB) : mDataCB(aDataCB) {};
+    virtual bool bodyData(const uint8_t *aData, size_t aSize, ErrorPtr &aError) P44_OVERRIDE;
+  };
+
+  /// body sink writing to a file descriptor (e.g. a file or flash partition)
+  class HttpFdSink : public HttpBodySink
+  {
+    int mFd;
+    bool mCloseAtEnd;
+    size_t mBytesWritten;
+  public:
+    /// @param aFd the file descriptor to write to
+    /// @param aCloseAtEnd if set, aFd is closed when the sink is deleted
+    HttpFdSink(int aFd, bool aCloseAtEnd = false) : mFd(aFd), mCloseAtEnd(aCloseAtEnd), mBytesWritten(0) {};
+    virtual ~HttpFdSink();
+    virtual bool bodyData(const uint8_t *aData, size_t aSize, ErrorPtr &aError) P44_OVERRIDE;
+    virtual ErrorPtr bodyEnd() P44_OVERRIDE;
+    virtual bool inRequestThread() P44_OVERRIDE { return true; };
+    size_t bytesWritten() { return mBytesWritten; };
+  };
+
+
   /// callback for returning response data or reporting error
   /// @param aResponse the response string
   /// @param aError an error object if an error occurred, empty pointer otherwise
@@ -102,6 +251,11 @@ namespace p44 {
       basic_first = 2, // basic auth is attempted in first try without server asking for it
     } AuthMode; ///< http auth mode
 
+    typedef enum {
+      engine_thread = 0, // blocking civetweb client running in a separate thread per request
+      engine_mainloop = 1, // non-blocking client on the mainloop, for plain http without digest auth (otherwise, engine_thread is used)
+    } Engine; ///< http client implementation
+
     HttpHeaderMapPtr mResponseHeaders; ///< the response headers when httpRequest is called with aSaveHeaders
     int mResponseStatus; ///< set to the status code of the response (in all cases, success or not, 0 if none)
 
@@ -121,10 +275,35 @@ namespace p44 {
     string mServerCertVfyDir;
     int mResponseDataFd;
     size_t mBufferSz; ///< buffer size for civetweb/mongoose data read operations
+    size_t mMaxBufferSz; ///< buffer size limit for adaptive buffer sizing in httpDownload()
+    HttpBodySinkPtr mSink; ///< sink for body data in httpDownload()
+    const uint8_t *mChunkData; ///< body data chunk handed over from request thread to sink
+    size_t mChunkSize; ///< size of the data chunk handed over
+    bool mAbortBody; ///< set by main thread when sink wants download to abort
+    bool mBodyPaused; ///< set while sink has paused delivery
+    pthread_mutex_t mHandoverMutex; ///< protects mDataProcessingPending
+    pthread_cond_t mHandoverCond; ///< signals mDataProcessingPending reset
     bool mStreamResult; ///< if set, result will be "streamed", meaning callback will be called multiple times as data chunks arrive
     MLMicroSeconds mTimeout; ///< timeout, Never = use default, do not set
     struct mg_connection *mMgConn; ///< mongoose connection
     void *mHttpAuthInfo; ///< opaque auth info kept stored between connections
+    bool mKeepAlive; ///< if set, connections are taken from and returned to the shared HttpConnectionPool
+    string mPoolKey; ///< pool key of the current request's server
+    bool mPoolSlotAcquired; ///< set when the current request holds a slot in the connection pool
+    struct mg_connection *mKeepConn; ///< connection to return to the pool after the request
+    bool mConnReused; ///< set when the current request was sent over a pooled connection
+    double mConnectTime; ///< time spent for opening a new connection for the current request
+    Engine mEngine; ///< client implementation to use
+    // vars used by engine_mainloop requests
+    SocketCommPtr mSocket; ///< connection of the current request
+    MLTicket mRequestTicket; ///< timeout (or deferred error reporting)
+    string mRxBuffer; ///< received but not yet parsed response data
+    int mParserState; ///< response parser state
+    int64_t mBodyRemaining; ///< remaining bytes of body or current chunk
+    bool mNoResponseBody; ///< set for requests that never have a response body (HEAD)
+    bool mServerClosed; ///< set when server closed connection while body delivery was paused
+    size_t mRxLimit; ///< current max number of bytes to read at once (adaptive)
+    MLTicket mResumeTicket; ///< for continuing paused body delivery
 
   protected:
 
@@ -158,6 +337,9 @@ namespace p44 {
     /// @param aAuthMode defaults to digest_only.
     void setHttpAuthCredentials(const string aUsername, const string aPassword, AuthMode aAuthMode = digest_only) { mUsername = aUsername; mPassword = aPassword; mAuthMode = aAuthMode; };
 
+    /// @return true if http auth credentials or a client certificate are set
+    bool hasCredentials() { return !mUsername.empty() || !mClientCertFile.empty(); };
+
     /// explicitly set socket timeout to use
     /// @param aTimeout set to timeout value or Never for no timeout at all
     void setTimeout(MLMicroSeconds aTimeout) { mTimeout = aTimeout; };
@@ -167,6 +349,11 @@ namespace p44 {
     ///   only set a large buffer when you need more performance for receiving a lot of data.
     void setBufferSize(size_t aBufferSize) { mBufferSz = aBufferSize; };
 
+    /// set the buffer size limit for downloads into a sink
+    /// @param aMaxBufferSize the buffer grows from the size set with setBufferSize() up to this
+    ///   size as long as data arrives faster than it is delivered, and shrinks again on slow connections.
+    void setMaxBufferSize(size_t aMaxBufferSize) { mMaxBufferSz = aMaxBufferSize; };
+
     /// explicitly set a client certificate path
     /// @param aClientCertFile set file path to a client certificate to use with the connection.
     ///   Use empty string to use no certificate.
@@ -182,6 +369,18 @@ namespace p44 {
     ///   - prefix a file name with "=" to specify a CAFile (multiple certs in one file)
     void setServerCertVfyDir(const string aServerCertVfyDir) { mServerCertVfyDir = aServerCertVfyDir; };
 
+    /// enable HTTP/1.1 keep-alive
+    /// @param aKeepAlive if set, connections are kept open after requests and reused by later requests
+    ///   to the same server (from this or other HttpComm objects). See HttpConnectionPool for limits and statistics.
+    void setKeepAlive(bool aKeepAlive) { mKeepAlive = aKeepAlive; };
+
+    /// select the client implementation
+    /// @param aEngine engine_thread (default) runs each request in its own thread.
+    ///   engine_mainloop handles requests on the mainloop without any threads, which scales to many
+    ///   concurrent requests. It supports plain http only, and no digest auth; requests it cannot handle
+    ///   automatically use engine_thread.
+    void setEngine(Engine aEngine) { mEngine = aEngine; };
+
     
     /// send a HTTP or HTTPS request
     /// @param aURL the http or https URL to access
@@ -206,6 +405,29 @@ namespace p44 {
       bool aStreamResult = false
     );
 
+    /// download (potentially large) response body into a sink, in constant memory
+    /// @param aURL the http or https URL to access
+    /// @param aSink receives the body data as it arrives
+    /// @param aDoneCallback will be called with an empty response string when the download is complete or has failed
+    /// @param aMethod the HTTP method to use (defaults to "GET")
+    /// @param aRequestBody a C string containing the request body to send, or NULL if none
+    /// @param aContentType the content type for the body to send, or NULL to use default
+    /// @param aSaveHeaders if true, mResponseHeaders will be set to a string,string map containing the headers
+    /// @return false if no request could be initiated (already busy with another request).
+    /// @note the sink also receives the body of non-ok responses, the status is reported in aDoneCallback
+    bool httpDownload(
+      const char *aURL,
+      HttpBodySinkPtr aSink,
+      HttpCommCB aDoneCallback,
+      const char *aMethod = "GET",
+      const char* aRequestBody = NULL,
+      const char *aContentType = NULL,
+      bool aSaveHeaders = false
+    );
+
+    /// resume body delivery after a sink has paused it by returning false from HttpBodySink::bodyData()
+    void resumeBody();
+
     /// cancel request, request callbacks will be executed
     void cancelRequest();
 
@@ -222,8 +444,31 @@ namespace p44 {
 
     virtual void requestThreadSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode);
 
+    /// called on the main thread when a request has completed (mResponse and mRequestError are set)
+    /// @note the base class passes the result to the response callback
+    virtual void requestCompleted();
+
+    /// return the connection slot used by the request thread to the pool
+    /// @note must be called on the main thread when the request thread has ended
+    void releasePoolConnection();
+
   private:
     void requestThread(ChildThreadWrapper &aThread);
+    bool startRequest(const char *aURL, HttpCommCB aResponseCallback, const char *aMethod, const char* aRequestBody, const char *aContentType, int aResponseDataFd, bool aSaveHeaders, bool aStreamResult, HttpBodySinkPtr aSink);
+    void handOverToMainThread(ChildThreadWrapper &aThread, ThreadSignals aSignalCode);
+    void dataProcessed();
+    ErrorPtr finishSink();
+    void resumeMainloopBody();
+
+    bool startMainloopRequest();
+    void mainloopRequestConnected(SocketCommPtr aSocketComm, ErrorPtr aError);
+    void mainloopRequestData(ErrorPtr aError);
+    bool parseResponse(bool aClosed);
+    bool parseResponseHeaders(const string &aHeaders);
+    bool deliverBody(const char *aData, size_t aSize);
+    void mainloopRequestTimeout();
+    void endMainloopRequest(ErrorPtr aError);
+    void closeMainloopRequest();
 
   };
 
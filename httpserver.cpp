@@ -0,0 +1,1070 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "httpserver.hpp"
+
+#include <sys/stat.h>
+
+#if ENABLE_HTTP_SERVER_SCRIPT_FUNCS && ENABLE_P44SCRIPT
+  #include "application.hpp"
+#endif
+
+using namespace p44;
+
+
+#if ENABLE_NAMED_ERRORS
+const char* HttpServerError::errorName() const
+{
+  switch(getErrorCode()) {
+    case protocol: return "protocol";
+    case closed: return "closed";
+    case tooBig: return "tooBig";
+  }
+  return NULL;
+}
+#endif // ENABLE_NAMED_ERRORS
+
+
+#define DEFAULT_KEEPALIVE_TIMEOUT (30*Second)
+#define DEFAULT_MAX_HEADER_SIZE (16*1024)
+#define DEFAULT_MAX_BODY_SIZE (1024*1024)
+#define DEFAULT_MAX_PIPELINED 16
+#define DEFAULT_MAX_WEBSOCKET_MESSAGE_SIZE (1024*1024)
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+
+// MARK: - helpers
+
+static string urlDecode(const string &aText, bool aPlusAsSpace)
+{
+  string res;
+  res.reserve(aText.size());
+  for (size_t i=0; i<aText.size(); i++) {
+    char c = aText[i];
+    if (c=='%' && i+2<aText.size() && isxdigit(aText[i+1]) && isxdigit(aText[i+2])) {
+      res += (char)strtol(aText.substr(i+1, 2).c_str(), NULL, 16);
+      i += 2;
+    }
+    else if (c=='+' && aPlusAsSpace) {
+      res += ' ';
+    }
+    else {
+      res += c;
+    }
+  }
+  return res;
+}
+
+
+static string base64Encode(const string &aData)
+{
+  static const char *b64chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string res;
+  size_t i = 0;
+  while (i<aData.size()) {
+    uint32_t v = (uint8_t)aData[i]<<16;
+    if (i+1<aData.size()) v |= (uint8_t)aData[i+1]<<8;
+    if (i+2<aData.size()) v |= (uint8_t)aData[i+2];
+    res += b64chars[(v>>18)&0x3F];
+    res += b64chars[(v>>12)&0x3F];
+    res += i+1<aData.size() ? b64chars[(v>>6)&0x3F] : '=';
+    res += i+2<aData.size() ? b64chars[v&0x3F] : '=';
+    i += 3;
+  }
+  return res;
+}
+
+
+static inline uint32_t rol32(uint32_t aVal, int aBits)
+{
+  return (aVal<<aBits) | (aVal>>(32-aBits));
+}
+
+
+/// SHA-1 digest, only used for the websocket handshake
+static string sha1(const string &aData)
+{
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  // pad: 0x80, zeroes, 64-bit big endian bit length
+  string msg = aData;
+  uint64_t bits = (uint64_t)aData.size()*8;
+  msg += (char)0x80;
+  while (msg.size()%64!=56) msg += (char)0;
+  for (int i=7; i>=0; i--) msg += (char)((bits>>(i*8)) & 0xFF);
+  for (size_t blk=0; blk<msg.size(); blk+=64) {
+    uint32_t w[80];
+    for (int i=0; i<16; i++) {
+      const uint8_t *p = (const uint8_t *)msg.data()+blk+i*4;
+      w[i] = ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint32_t)p[2]<<8) | p[3];
+    }
+    for (int i=16; i<80; i++) w[i] = rol32(w[i-3]^w[i-8]^w[i-14]^w[i-16], 1);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i=0; i<80; i++) {
+      uint32_t f, k;
+      if (i<20) { f = (b&c)|(~b&d); k = 0x5A827999; }
+      else if (i<40) { f = b^c^d; k = 0x6ED9EBA1; }
+      else if (i<60) { f = (b&c)|(b&d)|(c&d); k = 0x8F1BBCDC; }
+      else { f = b^c^d; k = 0xCA62C1D6; }
+      uint32_t t = rol32(a, 5)+f+e+k+w[i];
+      e = d; d = c; c = rol32(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+  string digest;
+  for (int i=0; i<5; i++) {
+    for (int j=3; j>=0; j--) digest += (char)((h[i]>>(j*8)) & 0xFF);
+  }
+  return digest;
+}
+
+
+// MARK: - HttpServerRequest
+
+HttpServerRequest::HttpServerRequest(HttpServerConnectionPtr aConnection) :
+  mConnection(aConnection),
+  mKeepAlive(false),
+  mUpgrade(false),
+  mResponded(false)
+{
+}
+
+
+HttpServerRequest::~HttpServerRequest()
+{
+}
+
+
+string HttpServerRequest::header(const string &aName) const
+{
+  HeaderMap::const_iterator pos = mHeaders.find(lowerCase(aName));
+  if (pos==mHeaders.end()) return "";
+  return pos->second;
+}
+
+
+bool HttpServerRequest::queryParam(const string &aName, string &aValue) const
+{
+  const char *p = mQuery.c_str();
+  string part, key, val;
+  while (nextPart(p, part, '&')) {
+    size_t e = part.find('=');
+    key = urlDecode(part.substr(0, e), true);
+    if (key==aName) {
+      aValue = e==string::npos ? "" : urlDecode(part.substr(e+1), true);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+JsonObjectPtr HttpServerRequest::jsonBody() const
+{
+  if (mBody.empty()) return JsonObjectPtr();
+  return JsonObject::objFromText(mBody.c_str(), mBody.size());
+}
+
+
+string HttpServerRequest::peerAddress()
+{
+  if (!mConnection) return "";
+  return mConnection->getHost();
+}
+
+
+void HttpServerRequest::respond(int aStatus, const string &aBody, const string &aContentType, const string &aExtraHeaders)
+{
+  string hdrs;
+  if (!aContentType.empty()) hdrs = string_format("Content-Type: %s\r\n", aContentType.c_str());
+  hdrs += aExtraHeaders;
+  size_t sz = aBody.size();
+  respondWith(aStatus, hdrs, sz>0 ? new StringTxBuffer(aBody) : NULL, sz);
+}
+
+
+void HttpServerRequest::respondJson(JsonObjectPtr aJson, int aStatus)
+{
+  respond(aStatus, aJson ? aJson->json_str() : "null", "application/json");
+}
+
+
+void HttpServerRequest::respondStatus(int aStatus)
+{
+  respond(aStatus, string_format("%d %s\n", aStatus, reasonPhrase(aStatus)));
+}
+
+
+bool HttpServerRequest::respondFile(const string &aFilePath, const char *aContentType)
+{
+  int fd = open(aFilePath.c_str(), O_RDONLY);
+  if (fd>=0) {
+    struct stat st;
+    if (fstat(fd, &st)==0 && S_ISREG(st.st_mode)) {
+      if (!aContentType) aContentType = HttpServer::mimeType(aFilePath);
+      if (mConnection && mConnection->mServer) mConnection->mServer->mFilesServed++;
+      TxBufferPtr body;
+      if (st.st_size>0) body = new FileTxBuffer(fd, 0, (size_t)st.st_size);
+      else close(fd);
+      respondWith(200, string_format("Content-Type: %s\r\n", aContentType), body, (size_t)st.st_size);
+      return true;
+    }
+    close(fd);
+  }
+  respondStatus(404);
+  return false;
+}
+
+
+void HttpServerRequest::respondWith(int aStatus, const string &aHeaders, TxBufferPtr aBody, size_t aContentLength)
+{
+  if (mResponded) return; // only one response per request
+  mResponded = true;
+  if (!mConnection) return; // connection has closed in the meantime
+  mResponseHead = string_format("HTTP/1.1 %d %s\r\n", aStatus, reasonPhrase(aStatus));
+  if (aStatus!=101) {
+    if (aStatus!=204 && aStatus!=304) string_format_append(mResponseHead, "Content-Length: %zu\r\n", aContentLength);
+    if (!mKeepAlive) mResponseHead += "Connection: close\r\n";
+    else if (mVersion=="HTTP/1.0") mResponseHead += "Connection: keep-alive\r\n";
+  }
+  mResponseHead += aHeaders;
+  mResponseHead += "\r\n";
+  if (mMethod!="HEAD") mResponseBody = aBody;
+  mConnection->sendResponses();
+}
+
+
+const char *HttpServerRequest::reasonPhrase(int aStatus)
+{
+  switch (aStatus) {
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+  }
+  return aStatus<300 ? "OK" : (aStatus<400 ? "Redirect" : (aStatus<500 ? "Client Error" : "Server Error"));
+}
+
+
+// MARK: - HttpServerWebSocket
+
+HttpServerWebSocket::HttpServerWebSocket(HttpServerConnectionPtr aConnection) :
+  mConnection(aConnection),
+  mMaxMessageSize(DEFAULT_MAX_WEBSOCKET_MESSAGE_SIZE),
+  mFragmented(false),
+  mCloseSent(false)
+{
+}
+
+
+HttpServerWebSocket::~HttpServerWebSocket()
+{
+}
+
+
+ErrorPtr HttpServerWebSocket::send(const string &aMessage, uint8_t aOpcode)
+{
+  if (!isOpen()) return Error::err<HttpServerError>(HttpServerError::closed, "websocket not open");
+  sendFrame(aOpcode, (const uint8_t *)aMessage.data(), aMessage.size());
+  return ErrorPtr();
+}
+
+
+void HttpServerWebSocket::close(uint16_t aCode, const string &aReason)
+{
+  if (!isOpen()) return;
+  string payload;
+  payload += (char)(aCode>>8);
+  payload += (char)(aCode & 0xFF);
+  payload += aReason.substr(0, 123);
+  sendFrame(0x8, (const uint8_t *)payload.data(), payload.size());
+  mCloseSent = true;
+  // we initiate closing the TCP connection once the close frame is out
+  mConnection->mCloseWhenSent = true;
+  if (mConnection->transmitQueueBytes()==0) mConnection->scheduleClose();
+}
+
+
+void HttpServerWebSocket::sendFrame(uint8_t aOpcode, const uint8_t *aPayload, size_t aSize)
+{
+  // server frames are not masked
+  string frame;
+  frame.reserve(aSize+10);
+  frame += (char)(0x80 | aOpcode); // FIN, no fragmentation
+  if (aSize<126) {
+    frame += (char)aSize;
+  }
+  else if (aSize<=0xFFFF) {
+    frame += (char)126;
+    frame += (char)(aSize>>8);
+    frame += (char)(aSize & 0xFF);
+  }
+  else {
+    frame += (char)127;
+    for (int i=7; i>=0; i--) frame += (char)(((uint64_t)aSize>>(i*8)) & 0xFF);
+  }
+  frame.append((const char *)aPayload, aSize);
+  ErrorPtr err = mConnection->sendBuffer(new StringTxBuffer(frame, true));
+  if (Error::notOK(err)) {
+    mConnection->closeConnection();
+  }
+}
+
+
+void HttpServerWebSocket::processFrames(string &aData)
+{
+  HttpServerWebSocketPtr keepMeAlive(this); // handlers might release us
+  size_t pos = 0;
+  while (mConnection) {
+    size_t avail = aData.size()-pos;
+    if (avail<2) break;
+    const uint8_t *p = (const uint8_t *)aData.data()+pos;
+    bool fin = (p[0] & 0x80)!=0;
+    uint8_t opcode = p[0] & 0x0F;
+    uint64_t len = p[1] & 0x7F;
+    size_t hdrSz = 2;
+    if (len==126) {
+      if (avail<4) break;
+      len = ((uint64_t)p[2]<<8) | p[3];
+      hdrSz = 4;
+    }
+    else if (len==127) {
+      if (avail<10) break;
+      len = 0;
+      for (int i=0; i<8; i++) len = (len<<8) | p[2+i];
+      hdrSz = 10;
+    }
+    if ((p[1] & 0x80)==0 || (p[0] & 0x70)!=0) {
+      // client frames must be masked, and we do not support extensions
+      close(1002, "protocol error");
+      break;
+    }
+    if (len>mMaxMessageSize || mMessage.size()+len>mMaxMessageSize) {
+      close(1009, "message too big");
+      break;
+    }
+    if (avail<hdrSz+4+len) break; // frame not complete yet
+    const uint8_t *mask = p+hdrSz;
+    string payload((const char *)p+hdrSz+4, (size_t)len);
+    for (size_t i=0; i<payload.size(); i++) payload[i] ^= mask[i&3];
+    pos += hdrSz+4+len;
+    if (opcode>=0x8) {
+      // control frame
+      if (!fin || len>125) {
+        close(1002, "protocol error");
+        break;
+      }
+      if (opcode==0x8) {
+        // close: echo status code and close connection
+        uint16_t code = payload.size()>=2 ? ((uint8_t)payload[0]<<8) | (uint8_t)payload[1] : 1000;
+        close(code);
+        break;
+      }
+      else if (opcode==0x9) {
+        // ping: answer with pong carrying the same data
+        sendFrame(0xA, (const uint8_t *)payload.data(), payload.size());
+      }
+      // unsolicited pong is just ignored
+      continue;
+    }
+    if (opcode==0) {
+      // continuation
+      if (!mFragmented) {
+        close(1002, "unexpected continuation frame");
+        break;
+      }
+      mMessage += payload;
+    }
+    else {
+      if (mFragmented) {
+        close(1002, "expected continuation frame");
+        break;
+      }
+      mMessage.swap(payload);
+      mFragmented = true;
+    }
+    if (fin) {
+      mFragmented = false;
+      string msg;
+      msg.swap(mMessage);
+      if (mMessageHandler && !mCloseSent) mMessageHandler(this, msg, ErrorPtr());
+    }
+  }
+  aData.erase(0, pos);
+}
+
+
+void HttpServerWebSocket::closed(ErrorPtr aError)
+{
+  mConnection.reset();
+  HttpWebSocketMessageCB cb = mMessageHandler;
+  mMessageHandler = NoOP;
+  if (cb) cb(this, "", aError);
+}
+
+
+// MARK: - HttpServerConnection
+
+HttpServerConnection::HttpServerConnection(HttpServer *aServer, MainLoop &aMainLoop) :
+  inherited(aMainLoop),
+  mServer(aServer),
+  mRequestCount(0),
+  mNoMoreRequests(false),
+  mCloseWhenSent(false),
+  mReceivePaused(false),
+  mProcessing(false)
+{
+  setReceiveHandler(boost::bind(&HttpServerConnection::gotData, this, _1));
+  setConnectionStatusHandler(boost::bind(&HttpServerConnection::connectionStatus, this, _2));
+}
+
+
+HttpServerConnection::~HttpServerConnection()
+{
+}
+
+
+void HttpServerConnection::connectionStatus(ErrorPtr aError)
+{
+  if (Error::isOK(aError)) {
+    // connection accepted
+    if (mServer) mIdleTicket.executeOnce(boost::bind(&HttpServerConnection::idleTimeout, this), mServer->mKeepAliveTimeout);
+  }
+  else {
+    detach();
+  }
+}
+
+
+void HttpServerConnection::detach()
+{
+  HttpServerConnectionPtr keepMeAlive(this);
+  mIdleTicket.cancel();
+  // requests still waiting for a response can no longer be answered
+  for (RequestQueue::iterator pos = mRequests.begin(); pos!=mRequests.end(); ++pos) {
+    (*pos)->mConnection.reset();
+  }
+  mRequests.clear();
+  if (mWebSocket) {
+    HttpServerWebSocketPtr ws = mWebSocket;
+    mWebSocket.reset();
+    ws->closed(Error::err<HttpServerError>(HttpServerError::closed, "websocket connection closed"));
+  }
+}
+
+
+void HttpServerConnection::scheduleClose()
+{
+  mCloseTicket.executeOnce(boost::bind(&HttpServerConnection::closeConnection, HttpServerConnectionPtr(this)));
+}
+
+
+void HttpServerConnection::transmitQueueEmptied()
+{
+  if (mCloseWhenSent) scheduleClose();
+}
+
+
+void HttpServerConnection::idleTimeout()
+{
+  if (mWebSocket) return; // websockets do not time out
+  if (!mRequests.empty() || transmitQueueBytes()>0) {
+    // still busy with a request, check again later
+    if (mServer) mIdleTicket.executeOnce(boost::bind(&HttpServerConnection::idleTimeout, this), mServer->mKeepAliveTimeout);
+    return;
+  }
+  LOG(LOG_DEBUG, "HttpServer: closing idle connection from %s", getHost());
+  HttpServerConnectionPtr keepMeAlive(this); // closing releases the server's reference
+  closeConnection();
+}
+
+
+void HttpServerConnection::setReceivePaused(bool aPaused)
+{
+  if (aPaused==mReceivePaused) return;
+  mReceivePaused = aPaused;
+  // no receive handler means no POLLIN, so the client gets backpressure via TCP flow control
+  if (aPaused) setReceiveHandler(NoOP);
+  else setReceiveHandler(boost::bind(&HttpServerConnection::gotData, this, _1));
+}
+
+
+void HttpServerConnection::gotData(ErrorPtr aError)
+{
+  HttpServerConnectionPtr keepMeAlive(this);
+  if (Error::isOK(aError)) {
+    aError = receiveAndAppendToString(mRxData);
+  }
+  if (Error::notOK(aError)) {
+    LOG(LOG_INFO, "HttpServer: error receiving from %s: %s", getHost(), aError->text());
+    closeConnection();
+    return;
+  }
+  if (mWebSocket) {
+    HttpServerWebSocketPtr ws = mWebSocket;
+    ws->processFrames(mRxData);
+    return;
+  }
+  if (mServer && mRequests.empty()) {
+    mIdleTicket.executeOnce(boost::bind(&HttpServerConnection::idleTimeout, this), mServer->mKeepAliveTimeout);
+  }
+  processRequests();
+}
+
+
+void HttpServerConnection::processRequests()
+{
+  if (mProcessing) return; // already processing further up in the call chain
+  HttpServerConnectionPtr keepMeAlive(this);
+  mProcessing = true;
+  while (mServer && connected() && !mNoMoreRequests && mRequests.size()<mServer->mMaxPipelined) {
+    if (!parseRequest()) break;
+  }
+  mProcessing = false;
+  if (mServer && connected() && !mWebSocket) {
+    // stop reading when the pipeline is full, or when no more requests are expected on this connection
+    setReceivePaused(mNoMoreRequests || mRequests.size()>=mServer->mMaxPipelined);
+  }
+}
+
+
+void HttpServerConnection::badRequest(int aStatus)
+{
+  // respond with error and close the connection
+  mRxData.clear();
+  mNoMoreRequests = true;
+  HttpServerRequestPtr req = new HttpServerRequest(this);
+  req->mVersion = "HTTP/1.1";
+  mRequests.push_back(req);
+  req->respondStatus(aStatus);
+}
+
+
+bool HttpServerConnection::parseRequest()
+{
+  // ignore empty lines preceding the request line
+  size_t start = mRxData.find_first_not_of("\r\n");
+  if (start==string::npos) {
+    mRxData.clear();
+    return false;
+  }
+  if (start>0) mRxData.erase(0, start);
+  // look for end of header
+  size_t hdrEnd = mRxData.find("\r\n\r\n");
+  if (hdrEnd==string::npos) {
+    if (mRxData.size()>mServer->mMaxHeaderSize) badRequest(431);
+    return false;
+  }
+  if (hdrEnd>mServer->mMaxHeaderSize) {
+    badRequest(431);
+    return false;
+  }
+  HttpServerRequestPtr req = new HttpServerRequest(this);
+  string head = mRxData.substr(0, hdrEnd+2);
+  const char *p = head.c_str();
+  string line;
+  // request line
+  nextLine(p, line);
+  size_t s1 = line.find(' ');
+  size_t s2 = s1==string::npos ? string::npos : line.find(' ', s1+1);
+  if (s2==string::npos) {
+    badRequest(400);
+    return false;
+  }
+  req->mMethod = line.substr(0, s1);
+  req->mUri = line.substr(s1+1, s2-s1-1);
+  req->mVersion = line.substr(s2+1);
+  if (req->mVersion.substr(0, 7)!="HTTP/1.") {
+    badRequest(505);
+    return false;
+  }
+  // headers
+  string key, value;
+  while (nextLine(p, line)) {
+    if (line.empty()) continue;
+    if (!keyAndValue(line, key, value)) {
+      badRequest(400);
+      return false;
+    }
+    key = lowerCase(key);
+    HttpServerRequest::HeaderMap::iterator pos = req->mHeaders.find(key);
+    if (pos!=req->mHeaders.end()) pos->second += ", "+value;
+    else req->mHeaders[key] = value;
+  }
+  // body
+  size_t bodySz = 0;
+  if (!req->header("transfer-encoding").empty()) {
+    badRequest(501); // chunked request bodies are not supported
+    return false;
+  }
+  string cl = req->header("content-length");
+  if (!cl.empty()) {
+    char *e;
+    unsigned long long n = strtoull(cl.c_str(), &e, 10);
+    if (*e!=0 || !isdigit(cl[0])) {
+      badRequest(400);
+      return false;
+    }
+    if (n>mServer->mMaxBodySize) {
+      badRequest(413);
+      return false;
+    }
+    bodySz = (size_t)n;
+  }
+  if (mRxData.size()<hdrEnd+4+bodySz) return false; // body not complete yet
+  req->mBody.assign(mRxData, hdrEnd+4, bodySz);
+  mRxData.erase(0, hdrEnd+4+bodySz);
+  // path and query
+  string uri = req->mUri;
+  if (uri.substr(0, 7)=="http://") {
+    // absolute form, skip host
+    size_t ps = uri.find('/', 7);
+    uri = ps==string::npos ? "/" : uri.substr(ps);
+  }
+  size_t q = uri.find('?');
+  req->mPath = urlDecode(uri.substr(0, q), false);
+  if (q!=string::npos) req->mQuery = uri.substr(q+1);
+  // connection handling
+  string conn = lowerCase(req->header("connection"));
+  if (req->mVersion=="HTTP/1.0") req->mKeepAlive = conn.find("keep-alive")!=string::npos;
+  else req->mKeepAlive = conn.find("close")==string::npos;
+  if (
+    mServer->mWebSocketHandler &&
+    req->mMethod=="GET" &&
+    lowerCase(req->header("upgrade"))=="websocket" &&
+    conn.find("upgrade")!=string::npos &&
+    !req->header("sec-websocket-key").empty()
+  ) {
+    req->mUpgrade = true;
+  }
+  if (!req->mKeepAlive || req->mUpgrade) mNoMoreRequests = true;
+  // statistics
+  mRequestCount++;
+  if (mRequestCount>1) mServer->mKeepAliveReuses++;
+  mRequests.push_back(req);
+  if ((long)mRequests.size()>mServer->mMaxPipelineDepth) mServer->mMaxPipelineDepth = mRequests.size();
+  FOCUSLOG("HttpServer: %s %s from %s", req->mMethod.c_str(), req->mUri.c_str(), getHost());
+  // dispatch
+  if (req->mUpgrade) {
+    string accept = base64Encode(sha1(req->header("sec-websocket-key")+WEBSOCKET_GUID));
+    req->respondWith(101, string_format(
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: %s\r\n",
+      accept.c_str()
+    ), TxBufferPtr(), 0);
+  }
+  else {
+    mServer->handleRequest(req);
+  }
+  return true;
+}
+
+
+void HttpServerConnection::sendResponses()
+{
+  HttpServerConnectionPtr keepMeAlive(this);
+  // responses must be sent in the order the requests were received
+  while (!mRequests.empty() && mRequests.front()->mResponded) {
+    HttpServerRequestPtr req = mRequests.front();
+    mRequests.pop_front();
+    req->mConnection.reset(); // done with this request
+    if (mServer) mServer->mRequestsServed++;
+    if (!req->mKeepAlive && !req->mUpgrade) mCloseWhenSent = true; // must be set before sending, as sending might empty the queue right away
+    TxBufferPtr body = req->mResponseBody;
+    req->mResponseBody.reset();
+    ErrorPtr err = sendBuffer(new StringTxBuffer(req->mResponseHead, true), body!=NULL);
+    if (body && Error::isOK(err)) err = sendBuffer(body);
+    if (Error::notOK(err)) {
+      LOG(LOG_INFO, "HttpServer: error sending response to %s: %s", getHost(), err->text());
+      closeConnection();
+      return;
+    }
+    if (req->mUpgrade) {
+      startWebSocket(req);
+      return;
+    }
+    if (mCloseWhenSent) return;
+  }
+  if (mServer && mRequests.empty()) {
+    mIdleTicket.executeOnce(boost::bind(&HttpServerConnection::idleTimeout, this), mServer->mKeepAliveTimeout);
+  }
+  // pipeline might have room again
+  if (mReceivePaused || !mRxData.empty()) processRequests();
+}
+
+
+void HttpServerConnection::startWebSocket(HttpServerRequestPtr aRequest)
+{
+  mIdleTicket.cancel();
+  mWebSocket = new HttpServerWebSocket(this);
+  HttpServerWebSocketPtr ws = mWebSocket;
+  if (mServer) {
+    mServer->mWebSocketsOpened++;
+    if (mServer->mWebSocketHandler) mServer->mWebSocketHandler(ws, aRequest);
+  }
+  if (!mWebSocket) return; // closed in the handler
+  setReceivePaused(false);
+  // the client might have sent frames right after the upgrade request already
+  if (!mRxData.empty()) ws->processFrames(mRxData);
+}
+
+
+// MARK: - HttpServer
+
+HttpServer::HttpServer() :
+  mKeepAliveTimeout(DEFAULT_KEEPALIVE_TIMEOUT),
+  mMaxHeaderSize(DEFAULT_MAX_HEADER_SIZE),
+  mMaxBodySize(DEFAULT_MAX_BODY_SIZE),
+  mMaxPipelined(DEFAULT_MAX_PIPELINED),
+  mRequestsServed(0),
+  mFilesServed(0),
+  mKeepAliveReuses(0),
+  mWebSocketsOpened(0),
+  mMaxPipelineDepth(0)
+{
+}
+
+
+HttpServer::~HttpServer()
+{
+  stop();
+}
+
+
+ErrorPtr HttpServer::start(const string &aPort, bool aNonLocal, int aMaxConnections)
+{
+  stop();
+  mListener = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  mListener->setConnectionParams(NULL, aPort.c_str(), SOCK_STREAM, PF_INET);
+  mListener->setAllowNonlocalConnections(aNonLocal);
+  ErrorPtr err = mListener->startServer(boost::bind(&HttpServer::serverConnectionHandler, this, _1), aMaxConnections);
+  if (Error::notOK(err)) {
+    mListener.reset();
+  }
+  return err;
+}
+
+
+void HttpServer::stop()
+{
+  if (mListener) {
+    SocketCommPtr listener = mListener;
+    mListener.reset();
+    // connections must no longer refer to us
+    listener->eachClient(boost::bind(&HttpServer::detachConnection, this, _1));
+    listener->clearCallbacks();
+    listener->closeConnection();
+  }
+}
+
+
+void HttpServer::detachConnection(SocketCommPtr aConnection)
+{
+  HttpServerConnection *conn = dynamic_cast<HttpServerConnection *>(aConnection.get());
+  if (conn) conn->mServer = NULL;
+}
+
+
+SocketCommPtr HttpServer::serverConnectionHandler(SocketCommPtr aServerSocketComm)
+{
+  return new HttpServerConnection(this);
+}
+
+
+void HttpServer::setDocumentRoot(const string &aDocumentRoot, const string &aUrlPrefix)
+{
+  mDocumentRoot = aDocumentRoot;
+  mUrlPrefix = aUrlPrefix;
+}
+
+
+void HttpServer::setLimits(size_t aMaxHeaderSize, size_t aMaxBodySize, size_t aMaxPipelined)
+{
+  mMaxHeaderSize = aMaxHeaderSize;
+  mMaxBodySize = aMaxBodySize;
+  mMaxPipelined = aMaxPipelined>0 ? aMaxPipelined : 1;
+}
+
+
+void HttpServer::handleRequest(HttpServerRequestPtr aRequest)
+{
+  if (!mDocumentRoot.empty() && (aRequest->method()=="GET" || aRequest->method()=="HEAD")) {
+    if (serveFile(aRequest)) return;
+  }
+  if (mRequestHandler) {
+    mRequestHandler(aRequest);
+  }
+  else {
+    aRequest->respondStatus(404);
+  }
+}
+
+
+bool HttpServer::serveFile(HttpServerRequestPtr aRequest)
+{
+  const string &path = aRequest->path();
+  if (path.substr(0, mUrlPrefix.size())!=mUrlPrefix) return false;
+  string rel = path.substr(mUrlPrefix.size());
+  // do not allow escaping from the document root
+  if (rel.find('\0')!=string::npos) return false;
+  if (("/"+rel+"/").find("/../")!=string::npos) return false;
+  if (rel.empty() || rel[rel.size()-1]=='/') rel += "index.html";
+  string filePath = mDocumentRoot;
+  if (filePath.empty() || filePath[filePath.size()-1]!='/') filePath += '/';
+  filePath += rel[0]=='/' ? rel.substr(1) : rel;
+  struct stat st;
+  if (stat(filePath.c_str(), &st)!=0 || !S_ISREG(st.st_mode)) return false; // no such file, let request handler try
+  aRequest->respondFile(filePath);
+  return true;
+}
+
+
+const char *HttpServer::mimeType(const string &aPath)
+{
+  static const struct { const char *ext; const char *type; } types[] = {
+    { "html", "text/html; charset=UTF-8" },
+    { "htm", "text/html; charset=UTF-8" },
+    { "css", "text/css" },
+    { "js", "application/javascript" },
+    { "json", "application/json" },
+    { "txt", "text/plain; charset=UTF-8" },
+    { "xml", "application/xml" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "ico", "image/x-icon" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+    { NULL, NULL }
+  };
+  size_t d = aPath.rfind('.');
+  if (d!=string::npos && aPath.find('/', d)==string::npos) {
+    string ext = lowerCase(aPath.substr(d+1));
+    for (int i=0; types[i].ext; i++) {
+      if (ext==types[i].ext) return types[i].type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+
+// MARK: - script support
+
+#if ENABLE_HTTP_SERVER_SCRIPT_FUNCS && ENABLE_P44SCRIPT
+
+using namespace P44Script;
+
+
+// request()
+static void request_func(BuiltinFunctionContextPtr f)
+{
+  HttpServerObj* s = dynamic_cast<HttpServerObj*>(f->thisObj().get());
+  assert(s);
+  // return event source placeholder for received requests
+  f->finish(new OneShotEventNullValue(s, "http request"));
+}
+
+
+// stop()
+static void stop_func(BuiltinFunctionContextPtr f)
+{
+  HttpServerObj* s = dynamic_cast<HttpServerObj*>(f->thisObj().get());
+  assert(s);
+  s->httpServer()->stop();
+  f->finish();
+}
+
+
+static const BuiltinMemberDescriptor httpServerFunctions[] = {
+  FUNC_DEF_NOARG(request, executable|null),
+  FUNC_DEF_NOARG(stop, executable|null),
+  BUILTINS_TERMINATOR
+};
+
+static BuiltInMemberLookup* sharedHttpServerFunctionLookupP = NULL;
+
+HttpServerObj::HttpServerObj(HttpServerPtr aHttpServer) :
+  mHttpServer(aHttpServer)
+{
+  registerSharedLookup(sharedHttpServerFunctionLookupP, httpServerFunctions);
+  mHttpServer->setRequestHandler(boost::bind(&HttpServerObj::gotRequest, this, _1));
+}
+
+
+HttpServerObj::~HttpServerObj()
+{
+  mHttpServer->clearCallbacks();
+  mHttpServer->stop();
+}
+
+
+void HttpServerObj::gotRequest(HttpServerRequestPtr aRequest)
+{
+  if (!hasSinks()) {
+    aRequest->respondStatus(503); // no script is handling requests right now
+    return;
+  }
+  sendEvent(new HttpRequestObj(aRequest));
+}
+
+
+// respond(body [, status [, contenttype]])
+FUNC_ARG_DEFS(respond, { anyvalid|null }, { numeric|optionalarg }, { text|optionalarg });
+static void respond_func(BuiltinFunctionContextPtr f)
+{
+  HttpRequestObj* r = dynamic_cast<HttpRequestObj*>(f->thisObj().get());
+  assert(r);
+  int status = f->numArgs()>1 ? f->arg(1)->intValue() : 200;
+  if (f->arg(0)->hasType(structured)) {
+    // objects and arrays are sent as JSON
+    r->request()->respondJson(f->arg(0)->jsonValue(), status);
+  }
+  else {
+    string ct = f->numArgs()>2 ? f->arg(2)->stringValue() : "text/plain; charset=UTF-8";
+    r->request()->respond(status, f->arg(0)->defined() ? f->arg(0)->stringValue() : "", ct);
+  }
+  f->finish();
+}
+
+
+static ScriptObjPtr method_accessor(BuiltInMemberLookup& aMemberLookup, ScriptObjPtr aParentObj, ScriptObjPtr aObjToWrite, BuiltinMemberDescriptor*)
+{
+  HttpRequestObj* r = dynamic_cast<HttpRequestObj*>(aParentObj.get());
+  return new StringValue(r->request()->method());
+}
+
+
+static ScriptObjPtr path_accessor(BuiltInMemberLookup& aMemberLookup, ScriptObjPtr aParentObj, ScriptObjPtr aObjToWrite, BuiltinMemberDescriptor*)
+{
+  HttpRequestObj* r = dynamic_cast<HttpRequestObj*>(aParentObj.get());
+  return new StringValue(r->request()->path());
+}
+
+
+static ScriptObjPtr query_accessor(BuiltInMemberLookup& aMemberLookup, ScriptObjPtr aParentObj, ScriptObjPtr aObjToWrite, BuiltinMemberDescriptor*)
+{
+  HttpRequestObj* r = dynamic_cast<HttpRequestObj*>(aParentObj.get());
+  return new StringValue(r->request()->query());
+}
+
+
+static ScriptObjPtr body_accessor(BuiltInMemberLookup& aMemberLookup, ScriptObjPtr aParentObj, ScriptObjPtr aObjToWrite, BuiltinMemberDescriptor*)
+{
+  HttpRequestObj* r = dynamic_cast<HttpRequestObj*>(aParentObj.get());
+  return new StringValue(r->request()->body());
+}
+
+
+static ScriptObjPtr json_accessor(BuiltInMemberLookup& aMemberLookup, ScriptObjPtr aParentObj, ScriptObjPtr aObjToWrite, BuiltinMemberDescriptor*)
+{
+  HttpRequestObj* r = dynamic_cast<HttpRequestObj*>(aParentObj.get());
+  JsonObjectPtr j = r->request()->jsonBody();
+  if (!j) return new AnnotatedNullValue("no JSON body");
+  return ScriptObj::valueFromJSON(j);
+}
+
+
+static const BuiltinMemberDescriptor httpRequestFunctions[] = {
+  FUNC_DEF_W_ARG(respond, executable|null),
+  MEMBER_DEF(method, builtinvalue|text),
+  MEMBER_DEF(path, builtinvalue|text),
+  MEMBER_DEF(query, builtinvalue|text),
+  MEMBER_DEF(body, builtinvalue|text),
+  MEMBER_DEF(json, builtinvalue|structured|null),
+  BUILTINS_TERMINATOR
+};
+
+static BuiltInMemberLookup* sharedHttpRequestFunctionLookupP = NULL;
+
+HttpRequestObj::HttpRequestObj(HttpServerRequestPtr aRequest) :
+  mRequest(aRequest)
+{
+  registerSharedLookup(sharedHttpRequestFunctionLookupP, httpRequestFunctions);
+}
+
+
+HttpRequestObj::~HttpRequestObj()
+{
+  // make sure the client gets an answer even if the script did not respond
+  if (!mRequest->responded()) mRequest->respondStatus(500);
+}
+
+
+// httpserver(port [, documentroot [, nonlocal]])
+FUNC_ARG_DEFS(httpserver, { text|numeric }, { text|optionalarg }, { numeric|optionalarg });
+static void httpserver_func(BuiltinFunctionContextPtr f)
+{
+  HttpServerPtr server = new HttpServer();
+  if (f->numArgs()>1 && !f->arg(1)->stringValue().empty()) {
+    string docroot = f->arg(1)->stringValue();
+    // documents served are readable by anyone on the network, so user level 1 is required for free paths
+    Application::PathType ty = Application::sharedApplication()->getPathType(docroot, 1, true);
+    if (ty==Application::notallowed) {
+      f->finish(new ErrorValue(ScriptError::NoPrivilege, "no reading privileges for this document root"));
+      return;
+    }
+    server->setDocumentRoot(Application::sharedApplication()->dataPath(docroot, P44SCRIPT_DATA_SUBDIR "/", false));
+  }
+  bool nonlocal = f->arg(2)->boolValue(); // defaults to local only
+  ErrorPtr err = server->start(f->arg(0)->stringValue(), nonlocal);
+  if (Error::isOK(err)) {
+    f->finish(new HttpServerObj(server));
+  }
+  else {
+    f->finish(new ErrorValue(err));
+  }
+}
+
+
+static const BuiltinMemberDescriptor cHttpServerGlobals[] = {
+  FUNC_DEF_W_ARG(httpserver, executable|null),
+  BUILTINS_TERMINATOR
+};
+
+const BuiltinMemberDescriptor* p44::P44Script::httpServerGlobals()
+{
+  return cHttpServerGlobals;
+}
+
+
+#endif // ENABLE_HTTP_SERVER_SCRIPT_FUNCS && ENABLE_P44SCRIPT
@@ -0,0 +1,418 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44utils__httpserver__
+#define __p44utils__httpserver__
+
+#include "p44utils_main.hpp"
+
+#include "socketcomm.hpp"
+#include "jsonobject.hpp"
+
+#include <map>
+#include <deque>
+
+#if ENABLE_P44SCRIPT && !defined(ENABLE_HTTP_SERVER_SCRIPT_FUNCS)
+  #define ENABLE_HTTP_SERVER_SCRIPT_FUNCS 1
+#endif
+
+#if ENABLE_HTTP_SERVER_SCRIPT_FUNCS
+#include "p44script.hpp"
+#endif
+
+
+using namespace std;
+
+namespace p44 {
+
+  class HttpServerError : public Error
+  {
+  public:
+    // Note: HTTP status codes and websocket close codes are used as error codes, plus some special codes
+    enum {
+      protocol = 10000, ///< invalid data received from the client
+      closed = 10001, ///< connection or websocket closed
+      tooBig = 10002, ///< websocket message too big
+    };
+    typedef uint16_t ErrorCodes;
+
+    static const char *domain() { return "HttpServer"; }
+    virtual const char *getErrorDomain() const P44_OVERRIDE { return HttpServerError::domain(); };
+    HttpServerError(ErrorCodes aError) : Error(ErrorCode(aError)) {};
+    #if ENABLE_NAMED_ERRORS
+  protected:
+    virtual const char* errorName() const P44_OVERRIDE;
+    #endif // ENABLE_NAMED_ERRORS
+  };
+
+
+  class HttpServer;
+  class HttpServerConnection;
+  class HttpServerRequest;
+  class HttpServerWebSocket;
+  typedef boost::intrusive_ptr<HttpServer> HttpServerPtr;
+  typedef boost::intrusive_ptr<HttpServerConnection> HttpServerConnectionPtr;
+  typedef boost::intrusive_ptr<HttpServerRequest> HttpServerRequestPtr;
+  typedef boost::intrusive_ptr<HttpServerWebSocket> HttpServerWebSocketPtr;
+
+  /// callback for handling a request
+  /// @param aRequest the request. The handler must call one of the respond...() methods on it,
+  ///   either right away or later (asynchronously).
+  typedef boost::function<void (HttpServerRequestPtr aRequest)> HttpRequestCB;
+
+  /// callback for a new websocket connection
+  /// @param aWebSocket the websocket, ready for sending and receiving messages
+  /// @param aRequest the upgrade request (e.g. for checking the path)
+  typedef boost::function<void (HttpServerWebSocketPtr aWebSocket, HttpServerRequestPtr aRequest)> HttpWebSocketCB;
+
+  /// callback for websocket messages
+  /// @param aWebSocket the websocket
+  /// @param aMessage the message (complete, reassembled from fragments)
+  /// @param aError set when the websocket has closed or failed, aMessage is empty then
+  typedef boost::function<void (HttpServerWebSocketPtr aWebSocket, const string &aMessage, ErrorPtr aError)> HttpWebSocketMessageCB;
+
+
+  /// a HTTP request received by HttpServer, and the means to respond to it
+  class HttpServerRequest : public P44Obj
+  {
+    friend class HttpServerConnection;
+
+    HttpServerConnectionPtr mConnection; ///< the connection, set while the response is pending
+    string mMethod;
+    string mUri;
+    string mPath;
+    string mQuery;
+    string mVersion;
+    typedef std::map<string, string> HeaderMap;
+    HeaderMap mHeaders; ///< headers, keys are lowercase
+    string mBody;
+    bool mKeepAlive; ///< if set, connection can stay open after the response
+    bool mUpgrade; ///< set for websocket upgrade requests
+
+    bool mResponded;
+    string mResponseHead;
+    TxBufferPtr mResponseBody;
+
+    HttpServerRequest(HttpServerConnectionPtr aConnection);
+
+  public:
+
+    virtual ~HttpServerRequest();
+
+    /// @name request data
+    /// @{
+    const string &method() const { return mMethod; };
+    const string &uri() const { return mUri; }; ///< the URI as sent by the client
+    const string &path() const { return mPath; }; ///< the URI path, URL decoded
+    const string &query() const { return mQuery; }; ///< the query string (without '?'), not decoded
+    const string &version() const { return mVersion; };
+    const string &body() const { return mBody; };
+    /// @param aName header name (case insensitive)
+    /// @return header value, empty string if not present
+    string header(const string &aName) const;
+    /// @param aName query parameter name
+    /// @param aValue will be set to the URL decoded value
+    /// @return true if the parameter is present
+    bool queryParam(const string &aName, string &aValue) const;
+    /// @return the body parsed as JSON, NULL if not JSON
+    JsonObjectPtr jsonBody() const;
+    /// @return the peer's IP address, empty if no longer connected
+    string peerAddress();
+    /// @}
+
+    /// @name responding
+    /// @{
+
+    /// respond with a body from memory
+    /// @param aStatus the HTTP status code
+    /// @param aBody the body (omitted for HEAD requests)
+    /// @param aContentType the content type
+    /// @param aExtraHeaders additional header lines, each terminated by CRLF
+    void respond(int aStatus, const string &aBody, const string &aContentType = "text/plain; charset=UTF-8", const string &aExtraHeaders = "");
+
+    /// respond with JSON
+    /// @param aJson the JSON object to send
+    /// @param aStatus the HTTP status code
+    void respondJson(JsonObjectPtr aJson, int aStatus = 200);
+
+    /// respond with a file
+    /// @param aFilePath path of the file to send
+    /// @param aContentType the content type. If NULL, it is derived from the file name extension
+    /// @return true if the file is sent, false if it could not be opened and a 404 response was sent instead
+    /// @note the file contents are sent with sendfile() where available, i.e. without copying them through user space
+    bool respondFile(const string &aFilePath, const char *aContentType = NULL);
+
+    /// respond with just the status code and the standard reason phrase as body
+    void respondStatus(int aStatus);
+
+    /// @return true if a response has already been provided
+    bool responded() const { return mResponded; };
+
+    /// @}
+
+    /// @return standard reason phrase for a HTTP status
+    static const char *reasonPhrase(int aStatus);
+
+  private:
+
+    void respondWith(int aStatus, const string &aHeaders, TxBufferPtr aBody, size_t aContentLength);
+
+  };
+
+
+  /// a websocket connection accepted by HttpServer
+  class HttpServerWebSocket : public P44Obj
+  {
+    friend class HttpServerConnection;
+
+    HttpServerConnectionPtr mConnection; ///< the connection, NULL when closed
+    HttpWebSocketMessageCB mMessageHandler;
+    size_t mMaxMessageSize;
+    string mMessage; ///< message being reassembled from fragments
+    bool mFragmented; ///< set while receiving a fragmented message
+    bool mCloseSent;
+
+    HttpServerWebSocket(HttpServerConnectionPtr aConnection);
+
+  public:
+
+    /// websocket opcodes
+    enum {
+      text = 0x1,
+      binary = 0x2
+    };
+
+    virtual ~HttpServerWebSocket();
+
+    /// set handler for received messages
+    void setMessageHandler(HttpWebSocketMessageCB aMessageHandler) { mMessageHandler = aMessageHandler; };
+
+    /// set the max size of a received message, larger messages close the websocket with code 1009
+    void setMaxMessageSize(size_t aMaxMessageSize) { mMaxMessageSize = aMaxMessageSize; };
+
+    /// send a message
+    /// @param aMessage the message
+    /// @param aOpcode text or binary
+    /// @return error if websocket is not open
+    ErrorPtr send(const string &aMessage, uint8_t aOpcode = text);
+
+    /// close the websocket
+    /// @param aCode the close status code
+    /// @param aReason the close reason
+    void close(uint16_t aCode = 1000, const string &aReason = "");
+
+    /// @return true if the websocket is open
+    bool isOpen() { return mConnection && !mCloseSent; };
+
+  private:
+
+    void sendFrame(uint8_t aOpcode, const uint8_t *aPayload, size_t aSize);
+    void processFrames(string &aData);
+    void closed(ErrorPtr aError);
+
+  };
+
+
+  /// a single client connection of HttpServer
+  class HttpServerConnection : public SocketComm
+  {
+    typedef SocketComm inherited;
+    friend class HttpServer;
+    friend class HttpServerRequest;
+    friend class HttpServerWebSocket;
+
+    HttpServer *mServer; ///< the server, NULL when server has stopped
+    string mRxData; ///< received data not yet processed
+    typedef std::deque<HttpServerRequestPtr> RequestQueue;
+    RequestQueue mRequests; ///< requests waiting for their response to be sent, in order of arrival
+    long mRequestCount; ///< number of requests received on this connection
+    bool mNoMoreRequests; ///< set when a request ends the connection (Connection: close or upgrade)
+    bool mCloseWhenSent; ///< set when the connection must be closed when the transmit queue has emptied
+    bool mReceivePaused; ///< set while receiving is paused because the pipeline is full
+    bool mProcessing; ///< set while parsing requests, to prevent recursion from synchronously sent responses
+    HttpServerWebSocketPtr mWebSocket; ///< set when the connection has been upgraded to a websocket
+    MLTicket mIdleTicket;
+    MLTicket mCloseTicket;
+
+  public:
+
+    HttpServerConnection(HttpServer *aServer, MainLoop &aMainLoop = MainLoop::currentMainLoop());
+    virtual ~HttpServerConnection();
+
+  protected:
+
+    virtual void transmitQueueEmptied() P44_OVERRIDE;
+
+  private:
+
+    void gotData(ErrorPtr aError);
+    void connectionStatus(ErrorPtr aError);
+    void processRequests();
+    bool parseRequest();
+    void badRequest(int aStatus);
+    void sendResponses();
+    void startWebSocket(HttpServerRequestPtr aRequest);
+    void setReceivePaused(bool aPaused);
+    void idleTimeout();
+    void detach();
+    void scheduleClose();
+
+  };
+
+
+  /// mainloop based HTTP/1.1 server with keep-alive, pipelining, static files and websockets
+  class HttpServer : public P44Obj
+  {
+    friend class HttpServerConnection;
+    friend class HttpServerRequest;
+    friend class HttpServerWebSocket;
+
+    SocketCommPtr mListener;
+    HttpRequestCB mRequestHandler;
+    HttpWebSocketCB mWebSocketHandler;
+    string mDocumentRoot; ///< root directory for static files, empty if none
+    string mUrlPrefix; ///< URL path prefix for static files
+    MLMicroSeconds mKeepAliveTimeout;
+    size_t mMaxHeaderSize;
+    size_t mMaxBodySize;
+    size_t mMaxPipelined;
+
+    // statistics
+    long mRequestsServed;
+    long mFilesServed;
+    long mKeepAliveReuses;
+    long mWebSocketsOpened;
+    long mMaxPipelineDepth;
+
+  public:
+
+    HttpServer();
+    virtual ~HttpServer();
+
+    /// start serving
+    /// @param aPort the port number or service name to listen on
+    /// @param aNonLocal if set, connections from other hosts are accepted (otherwise, only from localhost)
+    /// @param aMaxConnections max number of concurrent connections
+    /// @return error if server could not be started
+    ErrorPtr start(const string &aPort, bool aNonLocal = false, int aMaxConnections = 20);
+
+    /// stop serving, close all connections
+    void stop();
+
+    /// @return true if server is running
+    bool isRunning() { return mListener!=NULL; };
+
+    /// set handler for requests
+    /// @param aRequestHandler called for every request that is not a websocket upgrade and not
+    ///   served from the document root. If no handler is set, such requests get a 404 response.
+    void setRequestHandler(HttpRequestCB aRequestHandler) { mRequestHandler = aRequestHandler; };
+
+    /// set handler for websocket connections
+    /// @param aWebSocketHandler called for every accepted websocket connection. If no handler is set,
+    ///   upgrade requests are passed to the request handler like other requests.
+    void setWebSocketHandler(HttpWebSocketCB aWebSocketHandler) { mWebSocketHandler = aWebSocketHandler; };
+
+    /// serve static files (GET and HEAD) from a directory
+    /// @param aDocumentRoot the directory, empty to disable serving files
+    /// @param aUrlPrefix only requests with paths starting with this prefix are served from aDocumentRoot,
+    ///   with the prefix removed. Requests for which no file exists are passed to the request handler.
+    void setDocumentRoot(const string &aDocumentRoot, const string &aUrlPrefix = "/");
+
+    /// set the time a connection may stay idle between requests
+    void setKeepAliveTimeout(MLMicroSeconds aTimeout) { mKeepAliveTimeout = aTimeout; };
+
+    /// set limits
+    /// @param aMaxHeaderSize max size of request line and headers, larger requests get a 431 response and the connection is closed
+    /// @param aMaxBodySize max size of a request body, larger requests get a 413 response and the connection is closed
+    /// @param aMaxPipelined max number of requests per connection waiting for their response. When reached,
+    ///   no further data is read from the connection until responses have been sent.
+    void setLimits(size_t aMaxHeaderSize, size_t aMaxBodySize, size_t aMaxPipelined);
+
+    /// @return MIME type for a file path, derived from the extension
+    static const char *mimeType(const string &aPath);
+
+    /// clear all callbacks
+    void clearCallbacks() { mRequestHandler = NoOP; mWebSocketHandler = NoOP; };
+
+    /// @name statistics
+    /// @{
+    long requestsServed() const { return mRequestsServed; }; ///< number of requests responded to
+    long filesServed() const { return mFilesServed; }; ///< number of responses sent from files
+    long keepAliveReuses() const { return mKeepAliveReuses; }; ///< number of requests received on an already used connection
+    long webSocketsOpened() const { return mWebSocketsOpened; }; ///< number of connections upgraded to websockets
+    long maxPipelineDepth() const { return mMaxPipelineDepth; }; ///< max number of requests waiting for their response on a connection
+    long connections() const { return mListener ? (long)mListener->numClients() : 0; }; ///< number of currently open connections
+    /// @}
+
+  private:
+
+    SocketCommPtr serverConnectionHandler(SocketCommPtr aServerSocketComm);
+    void detachConnection(SocketCommPtr aConnection);
+    void handleRequest(HttpServerRequestPtr aRequest);
+    bool serveFile(HttpServerRequestPtr aRequest);
+
+  };
+
+
+  #if ENABLE_HTTP_SERVER_SCRIPT_FUNCS && ENABLE_P44SCRIPT
+
+  namespace P44Script {
+
+    /// represents a HTTP server
+    /// Note: is an event source for requests, but does not expose it directly, only via request()
+    class HttpServerObj : public StructuredLookupObject, public EventSource
+    {
+      typedef StructuredLookupObject inherited;
+      HttpServerPtr mHttpServer;
+    public:
+      HttpServerObj(HttpServerPtr aHttpServer);
+      virtual ~HttpServerObj();
+      virtual string getAnnotation() const P44_OVERRIDE { return "httpserver"; };
+      HttpServerPtr httpServer() { return mHttpServer; }
+      void gotRequest(HttpServerRequestPtr aRequest);
+    };
+    typedef boost::intrusive_ptr<HttpServerObj> HttpServerObjPtr;
+
+    /// represents a request received by a HTTP server
+    class HttpRequestObj : public StructuredLookupObject
+    {
+      typedef StructuredLookupObject inherited;
+      HttpServerRequestPtr mRequest;
+    public:
+      HttpRequestObj(HttpServerRequestPtr aRequest);
+      virtual ~HttpRequestObj();
+      virtual string getAnnotation() const P44_OVERRIDE { return "httprequest"; };
+      HttpServerRequestPtr request() { return mRequest; }
+    };
+    typedef boost::intrusive_ptr<HttpRequestObj> HttpRequestObjPtr;
+
+    // get global builtins
+    const BuiltinMemberDescriptor* httpServerGlobals();
+
+  }
+
+  #endif // ENABLE_HTTP_SERVER_SCRIPT_FUNCS && ENABLE_P44SCRIPT
+
+} // namespace p44
+
+
+#endif /* defined(__p44utils__httpserver__) */
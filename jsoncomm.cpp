@@ -28,6 +28,14 @@ using namespace p44;
 JsonComm::JsonComm(MainLoop &aMainLoop) :
   inherited(aMainLoop),
   mEOM('\n'), // default to linefeed
+  mLengthPrefixed(false),
+  mMaxMessageSize(1024*1024),
+  mBinaryEncoding(false),
+  mBinaryOffered(false),
+  mPeerBinary(false),
+  mRxBuf(NULL),
+  mRxBufSize(0),
+  mRxFill(0),
   tokener(NULL),
   ignoreUntilNextEOM(false),
   closeWhenSent(false)
@@ -42,6 +50,10 @@ JsonComm::~JsonComm()
     json_tokener_free(tokener);
     tokener = NULL;
   }
+  if (mRxBuf) {
+    free(mRxBuf);
+    mRxBuf = NULL;
+  }
 }
 
 
@@ -59,6 +71,31 @@ void JsonComm::setRawMessageHandler(TextLineCB aRawMessageHandler)
 }
 
 
+// length prefix flag marking binary encoded message, binary offer if length is 0
+#define BINARY_FRAME_FLAG 0x80000000
+
+void JsonComm::setBinaryEncoding(bool aBinaryEncoding)
+{
+  mBinaryEncoding = aBinaryEncoding;
+  if (mBinaryEncoding) mLengthPrefixed = true;
+}
+
+
+uint8_t *JsonComm::rxSpace(size_t aNeeded)
+{
+  if (mRxFill+aNeeded>mRxBufSize) {
+    // grow buffer, it is kept for subsequent reads
+    size_t newSize = mRxFill+aNeeded;
+    if (newSize<2*mRxBufSize) newSize = 2*mRxBufSize;
+    uint8_t *newBuf = (uint8_t *)realloc(mRxBuf, newSize);
+    if (!newBuf) return NULL;
+    mRxBuf = newBuf;
+    mRxBufSize = newSize;
+  }
+  return mRxBuf+mRxFill;
+}
+
+
 void JsonComm::gotData(ErrorPtr aError)
 {
   JsonCommPtr keepMeAlive(this); // make sure this object lives until routine terminates
@@ -66,87 +103,30 @@ void JsonComm::gotData(ErrorPtr aError)
     // no error, read data we've got so far
     size_t dataSz = numBytesReady();
     if (dataSz>0) {
-      // temporary buffer
-      uint8_t *buf = new uint8_t[dataSz];
-      size_t receivedBytes = receiveBytes(dataSz, buf, aError);
-      if (Error::isOK(aError)) {
-        // check for end-of-message (mEOM or NULL char), make spaces from any other ctrl char
-        size_t bom = 0;
-        while (bom<receivedBytes) {
-          // data to process, scan for EOM
-          size_t eom = bom;
-          bool messageComplete = false;
-          while (eom<receivedBytes) {
-            if (buf[eom]<0x20) {
-              if (buf[eom]==mEOM || buf[eom]==0) {
-                // end of message
-                buf[eom] = 0; // terminate message here
-                messageComplete = true;
-                break;
-              }
-              else {
-                // other control char, convert to space
-                buf[eom] = ' ';
-              }
-            }
-            eom++;
-          }
-          if (rawMessageHandler) {
-            // just append to line buffer
-            if (eom>0 && !ignoreUntilNextEOM) {
-              // append data to text line buffer
-              textLine.append((const char *)buf+bom, eom-bom);
-              if (messageComplete)
-                rawMessageHandler(ErrorPtr(),textLine);
-              // begin next line
-              textLine.clear();
+      uint8_t *buf = rxSpace(dataSz);
+      if (!buf) {
+        aError = SysError::err(ENOMEM, "JsonComm receive buffer: ");
+      }
+      else {
+        size_t receivedBytes = receiveBytes(dataSz, buf, aError);
+        if (Error::isOK(aError)) {
+          if (mLengthPrefixed) {
+            mRxFill += receivedBytes;
+            aError = processLengthPrefixed();
+            if (Error::notOK(aError)) {
+              // framing is lost, no way to resynchronize
+              mRxFill = 0;
+              if (jsonMessageHandler) jsonMessageHandler(aError, JsonObjectPtr());
+              else if (rawMessageHandler) rawMessageHandler(aError, "");
+              closeConnection();
+              return;
             }
           }
           else {
-            // create JSON tokener to parse message, if none found already
-            if (!tokener) {
-              tokener = json_tokener_new();
-            }
-            if (eom>0 && !ignoreUntilNextEOM) {
-              // feed data to tokener
-              struct json_object *o = json_tokener_parse_ex(tokener, (const char *)buf+bom, (int)(eom-bom));
-              if (o==NULL) {
-                // error (or incomplete JSON, which is fine)
-                JsonError::ErrorCodes err = json_tokener_get_error(tokener);
-                if (err!=json_tokener_continue) {
-                  // real error
-                  if (jsonMessageHandler) {
-                    jsonMessageHandler(ErrorPtr(new JsonError(err)), JsonObjectPtr());
-                  }
-                  // reset the parser
-                  ignoreUntilNextEOM = true;
-                  json_tokener_reset(tokener);
-                }
-              }
-              else {
-                // got JSON object
-                JsonObjectPtr message = JsonObject::newObj(o);
-                if (jsonMessageHandler) {
-                  // pass json_object into handler, will consume it
-                  jsonMessageHandler(ErrorPtr(), message);
-                }
-                ignoreUntilNextEOM = true;
-                json_tokener_reset(tokener);
-              }
-            }
-          }
-          // now check for having reached the end of the message in this data chunk
-          if (messageComplete) {
-            // new message starts, don't ignore any more
-            ignoreUntilNextEOM = false;
-            // skip any control chars
-            while (eom<receivedBytes && buf[eom]<0x20) eom++;
+            processDelimited(buf, receivedBytes);
           }
-          // now eom becomes the new bom
-          bom = eom;
-        } // while data to process
-      } // no read error
-      delete[] buf; buf = NULL;
+        }
+      }
     } // some data seems to be ready
   } // no connection error
   if (Error::notOK(aError)) {
@@ -158,53 +138,214 @@ void JsonComm::gotData(ErrorPtr aError)
       rawMessageHandler(aError, "");
     }
     ignoreUntilNextEOM = false;
+    mRxFill = 0;
     if (tokener) json_tokener_reset(tokener);
+    // a new connection must negotiate binary encoding again
+    mBinaryOffered = false;
+    mPeerBinary = false;
   }
 }
 
 
-ErrorPtr JsonComm::sendMessage(JsonObjectPtr aJsonObject)
+void JsonComm::processDelimited(uint8_t *aBuf, size_t aSize)
 {
-  string json_string = aJsonObject->json_c_str();
-  json_string.append(1, mEOM);
-  return sendRaw(json_string);
+  // check for end-of-message (mEOM or NULL char), make spaces from any other ctrl char
+  size_t bom = 0;
+  while (bom<aSize) {
+    // data to process, scan for EOM
+    size_t eom = bom;
+    bool messageComplete = false;
+    while (eom<aSize) {
+      if (aBuf[eom]<0x20) {
+        if (aBuf[eom]==mEOM || aBuf[eom]==0) {
+          // end of message
+          aBuf[eom] = 0; // terminate message here
+          messageComplete = true;
+          break;
+        }
+        else {
+          // other control char, convert to space
+          aBuf[eom] = ' ';
+        }
+      }
+      eom++;
+    }
+    if (rawMessageHandler) {
+      // just append to line buffer
+      if (eom>0 && !ignoreUntilNextEOM) {
+        // append data to text line buffer
+        textLine.append((const char *)aBuf+bom, eom-bom);
+        if (messageComplete)
+          rawMessageHandler(ErrorPtr(),textLine);
+        // begin next line
+        textLine.clear();
+      }
+    }
+    else {
+      // create JSON tokener to parse message, if none found already
+      if (!tokener) {
+        tokener = json_tokener_new();
+      }
+      if (eom>0 && !ignoreUntilNextEOM) {
+        // feed data to tokener
+        struct json_object *o = json_tokener_parse_ex(tokener, (const char *)aBuf+bom, (int)(eom-bom));
+        if (o==NULL) {
+          // error (or incomplete JSON, which is fine)
+          JsonError::ErrorCodes err = json_tokener_get_error(tokener);
+          if (err!=json_tokener_continue) {
+            // real error
+            if (jsonMessageHandler) {
+              jsonMessageHandler(ErrorPtr(new JsonError(err)), JsonObjectPtr());
+            }
+            // reset the parser
+            ignoreUntilNextEOM = true;
+            json_tokener_reset(tokener);
+          }
+        }
+        else {
+          // got JSON object
+          JsonObjectPtr message = JsonObject::newObj(o);
+          if (jsonMessageHandler) {
+            // pass json_object into handler, will consume it
+            jsonMessageHandler(ErrorPtr(), message);
+          }
+          ignoreUntilNextEOM = true;
+          json_tokener_reset(tokener);
+        }
+      }
+    }
+    // now check for having reached the end of the message in this data chunk
+    if (messageComplete) {
+      // new message starts, don't ignore any more
+      ignoreUntilNextEOM = false;
+      // skip any control chars
+      while (eom<aSize && aBuf[eom]<0x20) eom++;
+    }
+    // now eom becomes the new bom
+    bom = eom;
+  } // while data to process
 }
 
 
-ErrorPtr JsonComm::sendRaw(string &aRawBytes)
+ErrorPtr JsonComm::processLengthPrefixed()
 {
+  size_t bom = 0;
+  while (mRxFill-bom>=4) {
+    const uint8_t *p = mRxBuf+bom;
+    size_t len = ((size_t)p[0]<<24) | ((size_t)p[1]<<16) | ((size_t)p[2]<<8) | p[3];
+    bool binary = (len & BINARY_FRAME_FLAG)!=0;
+    len &= ~BINARY_FRAME_FLAG;
+    if (binary && len==0) {
+      // peer offers binary encoding
+      bom += 4;
+      mPeerBinary = true;
+      if (mBinaryEncoding && !mBinaryOffered) offerBinary(false);
+      continue;
+    }
+    if (len>mMaxMessageSize) {
+      return Error::err<JsonError>(json_tokener_error_size, "length prefixed message too large (%zu bytes)", len);
+    }
+    if (mRxFill-bom<4+len) break; // message not yet complete
+    deliverMessage((const char *)p+4, len, binary);
+    bom += 4+len;
+  }
+  // move incomplete remainder to the front, once per read
+  if (bom>0) {
+    mRxFill -= bom;
+    if (mRxFill>0) memmove(mRxBuf, mRxBuf+bom, mRxFill);
+  }
+  return ErrorPtr();
+}
+
+
+void JsonComm::deliverMessage(const char *aText, size_t aSize, bool aBinary)
+{
+  if (aBinary) {
+    ErrorPtr err;
+    JsonObjectPtr message = JsonObject::objFromTLV(aText, aSize, &err);
+    if (rawMessageHandler) {
+      rawMessageHandler(err, message ? message->json_str() : "");
+    }
+    else if (jsonMessageHandler) {
+      jsonMessageHandler(err, message);
+    }
+    return;
+  }
+  if (rawMessageHandler) {
+    rawMessageHandler(ErrorPtr(), string(aText, aSize));
+    return;
+  }
+  if (!tokener) {
+    tokener = json_tokener_new();
+  }
+  // complete message is available, parse it in one go
+  struct json_object *o = json_tokener_parse_ex(tokener, aText, (int)aSize);
   ErrorPtr err;
-  if (transmitBuffer.size()>0) {
-    // other messages are already waiting, append entire message
-    transmitBuffer.append(aRawBytes);
+  if (o==NULL) {
+    JsonError::ErrorCodes jerr = json_tokener_get_error(tokener);
+    if (jerr==json_tokener_continue) {
+      // values like numbers are only complete when a delimiter follows
+      o = json_tokener_parse_ex(tokener, " ", 1);
+      if (!o) jerr = json_tokener_error_parse_eof;
+    }
+    if (!o) err = ErrorPtr(new JsonError(jerr));
   }
-  else {
-    size_t rawSize = aRawBytes.size();
-    // nothing in buffer yet, start new send
-    size_t sentBytes = transmitBytes(rawSize, (uint8_t *)aRawBytes.c_str(), err);
-    if (Error::isOK(err)) {
-      // check if all could be sent
-      if (sentBytes<rawSize) {
-        // Not everything (or maybe nothing, transmitBytes() can return 0) was sent
-        // - enable callback for ready-for-send
-        setTransmitHandler(boost::bind(&JsonComm::canSendData, this, _1));
-        // buffer the rest, canSendData handler will take care of writing it out
-        transmitBuffer.assign(aRawBytes.c_str()+sentBytes, rawSize-sentBytes);
-      }
-			else {
-				// all sent
-				// - disable transmit handler
-        setTransmitHandler(NoOP);
-			}
+  json_tokener_reset(tokener);
+  if (jsonMessageHandler) {
+    jsonMessageHandler(err, o ? JsonObject::newObj(o) : JsonObjectPtr());
+  }
+  else if (o) {
+    json_object_put(o);
+  }
+}
+
+
+ErrorPtr JsonComm::sendMessage(JsonObjectPtr aJsonObject)
+{
+  // send JSON text directly from the JSON object's serialisation buffer, framed by length prefix or separator
+  if (mLengthPrefixed && mBinaryEncoding) {
+    if (!mBinaryOffered) offerBinary(true);
+    if (mPeerBinary) {
+      // send binary encoded
+      string tlv;
+      if (aJsonObject) aJsonObject->appendTLV(tlv);
+      else tlv.assign("\x0C\x00", 2); // null
+      uint32_t len = (uint32_t)tlv.size() | BINARY_FRAME_FLAG;
+      uint8_t prefix[4] = { (uint8_t)(len>>24), (uint8_t)(len>>16), (uint8_t)(len>>8), (uint8_t)len };
+      sendBuffer(TxBufferPtr(new StaticTxBuffer(prefix, 4, false)), true);
+      return sendBuffer(TxBufferPtr(new StringTxBuffer(tlv, true)));
     }
   }
-  return err;
+  TxBufferPtr json = TxBufferPtr(new JsonTxBuffer(aJsonObject));
+  if (mLengthPrefixed) {
+    uint32_t len = (uint32_t)json->size();
+    uint8_t prefix[4] = { (uint8_t)(len>>24), (uint8_t)(len>>16), (uint8_t)(len>>8), (uint8_t)len };
+    sendBuffer(TxBufferPtr(new StaticTxBuffer(prefix, 4, false)), true);
+    return sendBuffer(json);
+  }
+  sendBuffer(json, true);
+  return sendBuffer(TxBufferPtr(new StaticTxBuffer(&mEOM, 1)));
+}
+
+
+void JsonComm::offerBinary(bool aMore)
+{
+  static const uint8_t offer[4] = { 0x80, 0, 0, 0 };
+  mBinaryOffered = true;
+  sendBuffer(TxBufferPtr(new StaticTxBuffer(offer, 4)), aMore);
+}
+
+
+ErrorPtr JsonComm::sendRaw(string &aRawBytes)
+{
+  // Note: only the part that cannot be sent immediately will be copied
+  return sendBuffer(TxBufferPtr(new StaticTxBuffer(aRawBytes.c_str(), aRawBytes.size(), false)));
 }
 
 
 void JsonComm::closeAfterSend()
 {
-  if (transmitBuffer.size()==0) {
+  if (transmitQueueBytes()==0) {
     // nothing buffered for later, close now
     closeConnection();
   }
@@ -214,31 +355,23 @@ void JsonComm::closeAfterSend()
 }
 
 
+void JsonComm::transmitQueueEmptied()
+{
+  // check for closing connection when no data pending to be sent any more
+  if (closeWhenSent) {
+    closeWhenSent = false; // done
+    closeConnection();
+  }
+}
+
 
+// MARK: - JsonTxBuffer
 
-void JsonComm::canSendData(ErrorPtr aError)
+JsonTxBuffer::JsonTxBuffer(JsonObjectPtr aJson, int aFlags) :
+  mJson(aJson)
 {
-  size_t bytesToSend = transmitBuffer.size();
-  if (bytesToSend>0 && Error::isOK(aError)) {
-    // send data from transmit buffer
-    size_t sentBytes = transmitBytes(bytesToSend, (const uint8_t *)transmitBuffer.c_str(), aError);
-    if (Error::isOK(aError)) {
-      if (sentBytes==bytesToSend) {
-        // all sent
-        transmitBuffer.erase();
-				// - disable transmit handler
-        setTransmitHandler(NoOP);
-      }
-      else {
-        // partially sent, remove sent bytes
-        transmitBuffer.erase(0, sentBytes);
-      }
-      // check for closing connection when no data pending to be sent any more
-      if (closeWhenSent && transmitBuffer.size()==0) {
-        closeWhenSent = false; // done
-        closeConnection();
-      }
-    }
-  }
+  mText = mJson ? mJson->json_c_str(aFlags) : "";
+  mSize = strlen(mText);
 }
 
+
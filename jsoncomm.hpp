@@ -40,6 +40,23 @@ namespace p44 {
   typedef boost::function<void (ErrorPtr aError, string aTextLine)> TextLineCB;
 
 
+  /// transmit buffer referencing the serialized text of a JSON object
+  /// @note the text is owned by the JSON object and becomes invalid when the object is serialized again
+  ///   or modified. So this buffer is not persistent, and its unsent remainder gets copied
+  ///   when it cannot be sent right away.
+  class JsonTxBuffer : public TxBuffer
+  {
+    JsonObjectPtr mJson;
+    const char *mText;
+    size_t mSize;
+  public:
+    JsonTxBuffer(JsonObjectPtr aJson, int aFlags = 0);
+    virtual const uint8_t *data() P44_OVERRIDE { return (const uint8_t *)mText; };
+    virtual size_t size() P44_OVERRIDE { return mSize; };
+    virtual bool persistent() P44_OVERRIDE { return false; };
+  };
+
+
   typedef boost::intrusive_ptr<JsonComm> JsonCommPtr;
   /// A class providing low level access to the DALI bus
   class JsonComm : public SocketComm
@@ -54,13 +71,22 @@ namespace p44 {
 
     // JSON parameters
     char mEOM; /// the end-of-message character separating JSON messages in the socket data stream
+    bool mLengthPrefixed; ///< if set, messages are framed by a 4-byte big endian length instead of mEOM
+    size_t mMaxMessageSize; ///< max size of a length prefixed message
+    bool mBinaryEncoding; ///< if set, binary (TLV) encoding is offered to the peer, and used when the peer offers it, too
+    bool mBinaryOffered; ///< set when we have offered binary encoding to the peer
+    bool mPeerBinary; ///< set when the peer has offered binary encoding
+
+    // receive buffer, kept across reads
+    uint8_t *mRxBuf; ///< receive buffer (malloc'ed)
+    size_t mRxBufSize; ///< allocated size of mRxBuf
+    size_t mRxFill; ///< number of bytes in mRxBuf (length prefixed mode only, EOM mode processes all data read)
 
     // JSON parsing
     struct json_tokener* tokener;
     bool ignoreUntilNextEOM;
 
     // JSON sending
-    string transmitBuffer;
     bool closeWhenSent;
 
   public:
@@ -72,6 +98,26 @@ namespace p44 {
     /// @param aEOM end of message char. Defaults to '\n' (line feed).
     void setEndOfMessageChar(char aEOM) { mEOM = aEOM; };
 
+    /// use length prefixed framing instead of end-of-message characters
+    /// @param aLengthPrefixed if set, each message is preceded by its length as a 4-byte big endian number.
+    ///   This avoids scanning every byte for the end-of-message character, and allows messages to contain
+    ///   any characters. Both sides must use the same framing, so this is intended for connections between
+    ///   services known to support it.
+    /// @param aMaxMessageSize incoming messages larger than this are rejected with an error and the connection is closed
+    void setLengthPrefixed(bool aLengthPrefixed, size_t aMaxMessageSize = 1024*1024) { mLengthPrefixed = aLengthPrefixed; mMaxMessageSize = aMaxMessageSize; };
+
+    /// offer and use compact binary encoding of JSON messages (see JsonObject::tlvEncoded())
+    /// @param aBinaryEncoding if set, binary encoding is offered to the peer (before sending the first message).
+    ///   When the peer offers binary encoding as well, all further messages are sent binary.
+    ///   Binary messages are always accepted in length prefixed mode, regardless of this setting.
+    /// @note binary encoding requires length prefixed framing, so this also enables setLengthPrefixed().
+    ///   Both endpoints must use this version of JsonComm, as the binary offer is signalled with a
+    ///   special length prefix.
+    void setBinaryEncoding(bool aBinaryEncoding);
+
+    /// @return true if messages are currently sent binary encoded
+    bool binaryActive() { return mBinaryEncoding && mPeerBinary; };
+
     /// install callback for received JSON messages
     /// @param aJsonMessageHandler will be called when a JSON message has been received
     /// @note setting the JSON message handler will disable raw message processing
@@ -102,9 +148,16 @@ namespace p44 {
     virtual void clearCallbacks() { jsonMessageHandler = NoOP; inherited::clearCallbacks(); }
 
 
+  protected:
+    virtual void transmitQueueEmptied() P44_OVERRIDE;
+
   private:
     void gotData(ErrorPtr aError);
-    void canSendData(ErrorPtr aError);
+    uint8_t *rxSpace(size_t aNeeded);
+    void processDelimited(uint8_t *aBuf, size_t aSize);
+    ErrorPtr processLengthPrefixed();
+    void deliverMessage(const char *aText, size_t aSize, bool aBinary);
+    void offerBinary(bool aMore);
     
   };
   
@@ -27,8 +27,14 @@
   #include "json_object_private.h"
 #endif
 
+#include "tlv.hpp"
+
 #include <sys/stat.h> // for fstat
 
+#if ENABLE_JSON_FASTPATH && defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
 using namespace p44;
 
 
@@ -81,6 +87,513 @@ JsonObject& JsonObject::operator=(const JsonObject& aObj)
 
 
 
+// MARK: - fast path parser and serializer
+
+#if ENABLE_JSON_FASTPATH
+
+// Note: the fast parser only accepts strict JSON with an object or array at the top level, and
+//   builds the very same json-c objects json_tokener would build for it. Everything it does not
+//   handle (lenient syntax json-c accepts, errors, extreme nesting or numbers) makes it give up,
+//   and the caller then parses the text again with json_tokener, so results and error messages
+//   are exactly the same as without the fast path.
+
+#define FAST_MAX_DEPTH 30 // json_tokener's default max depth is 32
+#define FAST_MAX_NUMBER_LEN 64
+#define FAST_MAX_FILE_SIZE (1024*1024) // larger files are parsed by json-c in chunks of MAX_JSON_BUF_SIZE
+#define IS_DIGIT(c) ((c)>='0' && (c)<='9')
+
+// bit twiddling helpers for scanning 8 bytes at a time when no SIMD is available
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define SWAR_HAS_LESS(w, n) (((w)-SWAR_ONES*(n)) & ~(w) & SWAR_HIGHS)
+#define SWAR_HAS_BYTE(w, c) SWAR_HAS_LESS((w)^(SWAR_ONES*(c)), 1)
+
+
+/// @return pointer to first quote, backslash or NUL in aText, or aEnd if none
+static inline const char *scanStringChars(const char *aText, const char *aEnd)
+{
+  #if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i zero = _mm_setzero_si128();
+  while (aEnd-aText>=16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)aText);
+    int m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)), _mm_cmpeq_epi8(v, zero)));
+    if (m) return aText+__builtin_ctz(m);
+    aText += 16;
+  }
+  #else
+  while (aEnd-aText>=8) {
+    uint64_t w;
+    memcpy(&w, aText, 8);
+    if (SWAR_HAS_BYTE(w, '"') | SWAR_HAS_BYTE(w, '\\') | SWAR_HAS_LESS(w, 1)) break;
+    aText += 8;
+  }
+  #endif
+  while (aText<aEnd && *aText!='"' && *aText!='\\' && *aText!=0) aText++;
+  return aText;
+}
+
+
+/// @return pointer to first char in aText json-c escapes when serializing (controls, quote, backslash, slash), or aEnd if none
+static inline const char *scanEscapeChars(const char *aText, const char *aEnd)
+{
+  #if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i ctrl = _mm_set1_epi8(0x1F);
+  while (aEnd-aText>=16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)aText);
+    __m128i c = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v); // v<=0x1F
+    c = _mm_or_si128(c, _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_or_si128(_mm_cmpeq_epi8(v, backslash), _mm_cmpeq_epi8(v, slash))));
+    int m = _mm_movemask_epi8(c);
+    if (m) return aText+__builtin_ctz(m);
+    aText += 16;
+  }
+  #else
+  while (aEnd-aText>=8) {
+    uint64_t w;
+    memcpy(&w, aText, 8);
+    if (SWAR_HAS_BYTE(w, '"') | SWAR_HAS_BYTE(w, '\\') | SWAR_HAS_BYTE(w, '/') | SWAR_HAS_LESS(w, 0x20)) break;
+    aText += 8;
+  }
+  #endif
+  while (aText<aEnd) {
+    uint8_t c = (uint8_t)*aText;
+    if (c<0x20 || c=='"' || c=='\\' || c=='/') break;
+    aText++;
+  }
+  return aText;
+}
+
+
+typedef struct {
+  const char *p; ///< current position
+  const char *end; ///< end of text
+  bool comments; ///< C comments allowed
+  string str; ///< buffer for strings that need unescaping
+} FastParser;
+
+
+static bool fastSkipWhitespace(FastParser &aP)
+{
+  while (aP.p<aP.end) {
+    char c = *aP.p;
+    if (c==' ' || c=='\n' || c=='\r' || c=='\t') {
+      aP.p++;
+    }
+    else if (c=='/' && aP.comments && aP.p+1<aP.end && aP.p[1]=='*') {
+      const char *ce = aP.p+2;
+      while (true) {
+        ce = (const char *)memchr(ce, '*', aP.end-ce);
+        if (!ce || ce+1>=aP.end) return false; // unterminated comment
+        if (ce[1]=='/') break;
+        ce++;
+      }
+      aP.p = ce+2;
+    }
+    else {
+      break;
+    }
+  }
+  return true;
+}
+
+
+static int hexDigit(char aC)
+{
+  if (aC>='0' && aC<='9') return aC-'0';
+  if (aC>='a' && aC<='f') return aC-'a'+10;
+  if (aC>='A' && aC<='F') return aC-'A'+10;
+  return -1;
+}
+
+
+static bool fastHex4(FastParser &aP, uint32_t &aCode)
+{
+  if (aP.end-aP.p<4) return false;
+  aCode = 0;
+  for (int i=0; i<4; i++) {
+    int h = hexDigit(*aP.p++);
+    if (h<0) return false;
+    aCode = (aCode<<4) | h;
+  }
+  return true;
+}
+
+
+/// parse string, aP.p must be on the opening quote
+/// @return false if the string is not valid or not handled by the fast parser
+static bool fastString(FastParser &aP, const char *&aStr, size_t &aLen)
+{
+  const char *s = ++aP.p;
+  const char *q = scanStringChars(s, aP.end);
+  if (q>=aP.end || *q==0) return false;
+  if (*q=='"') {
+    // no escapes, use directly from text
+    aStr = s;
+    aLen = q-s;
+  }
+  else {
+    aP.str.assign(s, q-s);
+    while (true) {
+      if (*q=='"') break;
+      if (*q==0) return false;
+      // backslash
+      aP.p = q+1;
+      if (aP.p>=aP.end) return false;
+      char c = *aP.p++;
+      switch (c) {
+        case '"': case '\\': case '/': aP.str += c; break;
+        case 'b': aP.str += '\b'; break;
+        case 'f': aP.str += '\f'; break;
+        case 'n': aP.str += '\n'; break;
+        case 'r': aP.str += '\r'; break;
+        case 't': aP.str += '\t'; break;
+        case 'u': {
+          uint32_t code;
+          if (!fastHex4(aP, code)) return false;
+          if (code>=0xD800 && code<0xE000) {
+            // must be a proper surrogate pair, leave everything else to json-c
+            uint32_t lo;
+            if (code>=0xDC00 || aP.end-aP.p<6 || aP.p[0]!='\\' || aP.p[1]!='u') return false;
+            aP.p += 2;
+            if (!fastHex4(aP, lo) || lo<0xDC00 || lo>=0xE000) return false;
+            code = 0x10000+((code-0xD800)<<10)+(lo-0xDC00);
+          }
+          if (code<0x80) {
+            aP.str += (char)code;
+          }
+          else if (code<0x800) {
+            aP.str += (char)(0xC0|(code>>6));
+            aP.str += (char)(0x80|(code&0x3F));
+          }
+          else if (code<0x10000) {
+            aP.str += (char)(0xE0|(code>>12));
+            aP.str += (char)(0x80|((code>>6)&0x3F));
+            aP.str += (char)(0x80|(code&0x3F));
+          }
+          else {
+            aP.str += (char)(0xF0|(code>>18));
+            aP.str += (char)(0x80|((code>>12)&0x3F));
+            aP.str += (char)(0x80|((code>>6)&0x3F));
+            aP.str += (char)(0x80|(code&0x3F));
+          }
+          break;
+        }
+        default:
+          return false;
+      }
+      s = aP.p;
+      q = scanStringChars(s, aP.end);
+      if (q>=aP.end) return false;
+      aP.str.append(s, q-s);
+    }
+    aStr = aP.str.c_str();
+    aLen = aP.str.size();
+  }
+  aP.p = q+1;
+  // the legacy parser removes C comments even within strings
+  if (aP.comments && aLen>1 && memchr(aStr, '*', aLen)) {
+    for (size_t i=0; i+1<aLen; i++) if (aStr[i]=='/' && aStr[i+1]=='*') return false;
+  }
+  return true;
+}
+
+
+static bool fastNumber(FastParser &aP, struct json_object *&aObj)
+{
+  const char *s = aP.p;
+  const char *p = s;
+  bool neg = false;
+  bool isDouble = false;
+  if (p<aP.end && *p=='-') { neg = true; p++; }
+  if (p>=aP.end || !IS_DIGIT(*p)) return false;
+  if (*p=='0') {
+    p++;
+    if (p<aP.end && IS_DIGIT(*p)) return false; // leading zeroes are handled by json-c
+  }
+  else {
+    while (p<aP.end && IS_DIGIT(*p)) p++;
+  }
+  const char *intEnd = p;
+  if (p<aP.end && *p=='.') {
+    isDouble = true;
+    p++;
+    if (p>=aP.end || !IS_DIGIT(*p)) return false;
+    while (p<aP.end && IS_DIGIT(*p)) p++;
+  }
+  if (p<aP.end && (*p=='e' || *p=='E')) {
+    isDouble = true;
+    p++;
+    if (p<aP.end && (*p=='+' || *p=='-')) p++;
+    if (p>=aP.end || !IS_DIGIT(*p)) return false;
+    while (p<aP.end && IS_DIGIT(*p)) p++;
+  }
+  // json-c would continue consuming these, and come to a different conclusion
+  if (p<aP.end && (*p=='.' || *p=='+' || *p=='-' || *p=='e' || *p=='E')) return false;
+  if (isDouble) {
+    char buf[FAST_MAX_NUMBER_LEN];
+    if (p-s>=FAST_MAX_NUMBER_LEN) return false;
+    memcpy(buf, s, p-s);
+    buf[p-s] = 0;
+    aObj = json_object_new_double_s(strtod(buf, NULL), buf);
+  }
+  else {
+    // integer
+    const char *d = neg ? s+1 : s;
+    if (intEnd-d>19) return false;
+    uint64_t u = 0;
+    while (d<intEnd) u = u*10+(*d++-'0');
+    if (u>(uint64_t)INT64_MAX+(neg ? 1 : 0)) return false; // json-c clamps, leave that to it
+    aObj = json_object_new_int64(neg ? (int64_t)(0-u) : (int64_t)u);
+  }
+  aP.p = p;
+  return true;
+}
+
+
+static bool fastLiteral(FastParser &aP, const char *aLiteral, size_t aLen)
+{
+  if ((size_t)(aP.end-aP.p)<aLen || strncmp(aP.p, aLiteral, aLen)!=0) return false;
+  aP.p += aLen;
+  return true;
+}
+
+
+static bool fastValue(FastParser &aP, int aDepth, struct json_object *&aObj)
+{
+  aObj = NULL;
+  if (!fastSkipWhitespace(aP) || aP.p>=aP.end) return false;
+  switch (*aP.p) {
+    case '{': {
+      if (aDepth>=FAST_MAX_DEPTH) return false;
+      aP.p++;
+      aObj = json_object_new_object();
+      if (!fastSkipWhitespace(aP) || aP.p>=aP.end) return false;
+      if (*aP.p=='}') { aP.p++; return true; }
+      string key;
+      while (true) {
+        const char *k;
+        size_t kl;
+        if (aP.p>=aP.end || *aP.p!='"' || !fastString(aP, k, kl)) return false;
+        if (memchr(k, 0, kl)) return false; // json-c keys are C strings
+        key.assign(k, kl);
+        if (!fastSkipWhitespace(aP) || aP.p>=aP.end || *aP.p!=':') return false;
+        aP.p++;
+        struct json_object *v;
+        if (!fastValue(aP, aDepth+1, v)) {
+          json_object_put(v);
+          return false;
+        }
+        json_object_object_add(aObj, key.c_str(), v);
+        if (!fastSkipWhitespace(aP) || aP.p>=aP.end) return false;
+        if (*aP.p=='}') { aP.p++; return true; }
+        if (*aP.p!=',') return false;
+        aP.p++;
+        if (!fastSkipWhitespace(aP)) return false;
+      }
+    }
+    case '[': {
+      if (aDepth>=FAST_MAX_DEPTH) return false;
+      aP.p++;
+      aObj = json_object_new_array();
+      if (!fastSkipWhitespace(aP) || aP.p>=aP.end) return false;
+      if (*aP.p==']') { aP.p++; return true; }
+      while (true) {
+        struct json_object *v;
+        if (!fastValue(aP, aDepth+1, v)) {
+          json_object_put(v);
+          return false;
+        }
+        json_object_array_add(aObj, v);
+        if (!fastSkipWhitespace(aP) || aP.p>=aP.end) return false;
+        if (*aP.p==']') { aP.p++; return true; }
+        if (*aP.p!=',') return false;
+        aP.p++;
+      }
+    }
+    case '"': {
+      const char *s;
+      size_t l;
+      if (!fastString(aP, s, l)) return false;
+      aObj = json_object_new_string_len(s, (int)l);
+      return true;
+    }
+    case 't': if (!fastLiteral(aP, "true", 4)) return false; aObj = json_object_new_boolean(true); return true;
+    case 'f': if (!fastLiteral(aP, "false", 5)) return false; aObj = json_object_new_boolean(false); return true;
+    case 'n': return fastLiteral(aP, "null", 4);
+    default: return fastNumber(aP, aObj);
+  }
+}
+
+
+/// try to parse aText with the fast parser
+/// @return parsed object, or NULL if text must be parsed by json-c
+static struct json_object *fastParse(const char *aText, size_t aLen, bool aAllowCComments, ssize_t *aParsedCharsP)
+{
+  FastParser fp;
+  fp.p = aText;
+  fp.end = aText+aLen;
+  fp.comments = aAllowCComments;
+  if (!fastSkipWhitespace(fp) || fp.p>=fp.end) return NULL;
+  if (*fp.p!='{' && *fp.p!='[') return NULL; // plain values at top level are rare, and have json-c specific termination rules
+  struct json_object *o;
+  if (!fastValue(fp, 0, o)) {
+    json_object_put(o);
+    return NULL;
+  }
+  if (aParsedCharsP) {
+    // json_tokener also consumes whitespace (and comments, which we leave to it) following the value
+    while (fp.p<fp.end && isspace((uint8_t)*fp.p)) fp.p++;
+    if (fp.p<fp.end && *fp.p=='/') {
+      json_object_put(o);
+      return NULL;
+    }
+    *aParsedCharsP = fp.p-aText;
+  }
+  return o;
+}
+
+
+static void appendEscaped(string &aText, const char *aStr, size_t aLen)
+{
+  const char *e = aStr+aLen;
+  while (true) {
+    const char *x = scanEscapeChars(aStr, e);
+    aText.append(aStr, x-aStr);
+    if (x>=e) break;
+    uint8_t c = (uint8_t)*x;
+    switch (c) {
+      case '\b': aText += "\\b"; break;
+      case '\n': aText += "\\n"; break;
+      case '\r': aText += "\\r"; break;
+      case '\t': aText += "\\t"; break;
+      case '\f': aText += "\\f"; break;
+      case '"': aText += "\\\""; break;
+      case '\\': aText += "\\\\"; break;
+      case '/': aText += "\\/"; break;
+      default: {
+        static const char hex[] = "0123456789abcdef";
+        aText += "\\u00";
+        aText += hex[c>>4];
+        aText += hex[c&0xF];
+        break;
+      }
+    }
+    aStr = x+1;
+  }
+}
+
+
+static void appendIndent(string &aText, int aLevel, int aFlags)
+{
+  if (aFlags & JSON_C_TO_STRING_PRETTY) aText.append(aLevel*2, ' ');
+}
+
+
+/// @return true if appendJsonText() renders aFlags exactly like the json-c version we are compiled against
+/// @note appendJsonText() replicates json-c 0.12 formatting. Later versions render SPACED|PRETTY without
+///   the extra spaces, and have additional flags (NOSLASHESCAPE, PRETTY_TAB...), so these go via json-c.
+static bool fastSerializable(int aFlags)
+{
+  // Note: NOZERO only affects doubles, which are always rendered by json-c
+  if (aFlags & ~(JSON_C_TO_STRING_SPACED|JSON_C_TO_STRING_PRETTY|JSON_C_TO_STRING_NOZERO)) return false;
+  #if JSON_C_VERSION_NUM>=0x000D00
+  if ((aFlags & JSON_C_TO_STRING_SPACED) && (aFlags & JSON_C_TO_STRING_PRETTY)) return false;
+  #endif
+  return true;
+}
+
+
+/// append JSON text for aObj, exactly as json_object_to_json_string_ext() would render it
+/// @note must only be called with aFlags accepted by fastSerializable()
+static void appendJsonText(string &aText, struct json_object *aObj, int aLevel, int aFlags)
+{
+  switch (json_object_get_type(aObj)) {
+    case json_type_null:
+      aText += "null";
+      break;
+    case json_type_boolean:
+      aText += json_object_get_boolean(aObj) ? "true" : "false";
+      break;
+    case json_type_int: {
+      char buf[24];
+      char *p = buf+sizeof(buf);
+      int64_t i = json_object_get_int64(aObj);
+      #if JSON_C_VERSION_NUM>=0x000E00
+      if (i==INT64_MAX) {
+        // might be an unsigned value beyond int64 range (json-c 0.14+), let json-c render it
+        aText += json_object_to_json_string_ext(aObj, aFlags);
+        break;
+      }
+      #endif
+      uint64_t u = i<0 ? 0-(uint64_t)i : (uint64_t)i;
+      do { *(--p) = '0'+u%10; u /= 10; } while (u);
+      if (i<0) *(--p) = '-';
+      aText.append(p, buf+sizeof(buf)-p);
+      break;
+    }
+    case json_type_double:
+      // json-c keeps the original text of parsed doubles, which is not accessible otherwise
+      aText += json_object_to_json_string_ext(aObj, aFlags);
+      break;
+    case json_type_string:
+      aText += '"';
+      appendEscaped(aText, json_object_get_string(aObj), json_object_get_string_len(aObj));
+      aText += '"';
+      break;
+    case json_type_object: {
+      bool first = true;
+      aText += '{';
+      if (aFlags & JSON_C_TO_STRING_PRETTY) aText += '\n';
+      json_object_object_foreach(aObj, key, val) {
+        if (!first) {
+          aText += ',';
+          if (aFlags & JSON_C_TO_STRING_PRETTY) aText += '\n';
+        }
+        first = false;
+        if (aFlags & JSON_C_TO_STRING_SPACED) aText += ' ';
+        appendIndent(aText, aLevel+1, aFlags);
+        aText += '"';
+        appendEscaped(aText, key, strlen(key));
+        aText += (aFlags & JSON_C_TO_STRING_SPACED) ? "\": " : "\":";
+        appendJsonText(aText, val, aLevel+1, aFlags);
+      }
+      if (aFlags & JSON_C_TO_STRING_PRETTY) {
+        if (!first) aText += '\n';
+        appendIndent(aText, aLevel, aFlags);
+      }
+      aText += (aFlags & JSON_C_TO_STRING_SPACED) ? " }" : "}";
+      break;
+    }
+    case json_type_array: {
+      int n = json_object_array_length(aObj);
+      aText += '[';
+      if (aFlags & JSON_C_TO_STRING_PRETTY) aText += '\n';
+      for (int i=0; i<n; i++) {
+        if (i>0) {
+          aText += ',';
+          if (aFlags & JSON_C_TO_STRING_PRETTY) aText += '\n';
+        }
+        if (aFlags & JSON_C_TO_STRING_SPACED) aText += ' ';
+        appendIndent(aText, aLevel+1, aFlags);
+        appendJsonText(aText, json_object_array_get_idx(aObj, i), aLevel+1, aFlags);
+      }
+      if (aFlags & JSON_C_TO_STRING_PRETTY) {
+        if (n>0) aText += '\n';
+        appendIndent(aText, aLevel, aFlags);
+      }
+      aText += (aFlags & JSON_C_TO_STRING_SPACED) ? " ]" : "]";
+      break;
+    }
+  }
+}
+
+#endif // ENABLE_JSON_FASTPATH
+
+
 // MARK: - read and write from files
 
 
@@ -158,6 +671,10 @@ JsonObjectPtr JsonObject::objFromText(const char *aJsonText, ssize_t aMaxChars,
 {
   JsonObjectPtr obj;
   if (aMaxChars<0) aMaxChars = (ssize_t)strlen(aJsonText);
+  #if ENABLE_JSON_FASTPATH
+  struct json_object *fo = fastParse(aJsonText, aMaxChars, aAllowCComments, aParsedCharsP);
+  if (fo) return JsonObject::newObj(fo);
+  #endif
   struct json_tokener* tokener = json_tokener_new();
   bool inComment = false;
   const char *seg;
@@ -220,6 +737,22 @@ JsonObjectPtr JsonObject::objFromFile(const char *aJsonFilePath, ErrorPtr *aErro
     // opened, check buffer needs
     struct stat fs;
     fstat(fd, &fs);
+    #if ENABLE_JSON_FASTPATH
+    if (fs.st_size>0 && fs.st_size<=FAST_MAX_FILE_SIZE) {
+      // read entire file and try fast parser first
+      char *filebuf = new char[fs.st_size];
+      struct json_object *fo = NULL;
+      if (read(fd, filebuf, fs.st_size)==fs.st_size) {
+        fo = fastParse(filebuf, fs.st_size, aAllowCComments, NULL);
+      }
+      delete[] filebuf;
+      if (fo) {
+        close(fd);
+        return JsonObject::newObj(fo);
+      }
+      lseek(fd, 0, SEEK_SET); // let json-c parse it
+    }
+    #endif
     if (fs.st_size<(ssize_t)bufSize) bufSize = (size_t)fs.st_size; // don't need the entire buffer
     // decode
     struct json_tokener* tokener = json_tokener_new();
@@ -304,6 +837,226 @@ ErrorPtr JsonObject::saveToFile(const char *aJsonFilePath, int aFlags)
 }
 
 
+// MARK: - binary (TLV) encoding
+
+// Note: this produces the format of tlv.hpp, but writes it in a single pass into one string:
+//   containers always use a 4-byte length, which is filled in when the container is complete.
+
+#define TLV_MAX_NESTING 100
+
+static void appendTL(string &aTLV, TLVTag aTag, size_t aLen)
+{
+  if (aLen<0x100) { aTLV += (char)(aTag|0); }
+  else if (aLen<0x10000) { aTLV += (char)(aTag|1); aTLV += (char)(aLen>>8); }
+  else if (aLen<0x1000000) { aTLV += (char)(aTag|2); aTLV += (char)(aLen>>16); aTLV += (char)(aLen>>8); }
+  else { aTLV += (char)(aTag|3); aTLV += (char)(aLen>>24); aTLV += (char)(aLen>>16); aTLV += (char)(aLen>>8); }
+  aTLV += (char)aLen;
+}
+
+
+static void appendSigned(string &aTLV, int64_t aValue)
+{
+  // minimal number of bytes that still has the correct sign bit
+  int bytes = 1;
+  while (bytes<8 && (aValue<-((int64_t)1<<(bytes*8-1)) || aValue>=((int64_t)1<<(bytes*8-1)))) bytes++;
+  appendTL(aTLV, tlv_signed, bytes);
+  while (bytes>0) {
+    bytes--;
+    aTLV += (char)((uint64_t)aValue>>(bytes*8));
+  }
+}
+
+
+static size_t startContainer(string &aTLV, TLVTag aTag)
+{
+  aTLV += (char)(aTag|3); // always 4-byte length
+  size_t lenPos = aTLV.size();
+  aTLV.append(4, 0);
+  return lenPos;
+}
+
+
+static void endContainer(string &aTLV, size_t aLenPos)
+{
+  size_t len = aTLV.size()-aLenPos-4;
+  aTLV[aLenPos] = (char)(len>>24);
+  aTLV[aLenPos+1] = (char)(len>>16);
+  aTLV[aLenPos+2] = (char)(len>>8);
+  aTLV[aLenPos+3] = (char)len;
+}
+
+
+static void encodeTLV(string &aTLV, struct json_object *aObj)
+{
+  switch (json_object_get_type(aObj)) {
+    case json_type_null:
+      appendTL(aTLV, tlv_blob, 0);
+      break;
+    case json_type_boolean:
+      appendTL(aTLV, tlv_unsigned, 1);
+      aTLV += (char)(json_object_get_boolean(aObj) ? 1 : 0);
+      break;
+    case json_type_int:
+      appendSigned(aTLV, json_object_get_int64(aObj));
+      break;
+    case json_type_double: {
+      double d = json_object_get_double(aObj);
+      uint64_t bits;
+      memcpy(&bits, &d, sizeof(bits));
+      appendTL(aTLV, tlv_blob, 8);
+      for (int i=7; i>=0; i--) aTLV += (char)(bits>>(i*8));
+      break;
+    }
+    case json_type_string: {
+      size_t len = (size_t)json_object_get_string_len(aObj);
+      appendTL(aTLV, tlv_string, len);
+      aTLV.append(json_object_get_string(aObj), len);
+      break;
+    }
+    case json_type_object: {
+      size_t lenPos = startContainer(aTLV, tlv_container);
+      json_object_object_foreach(aObj, key, val) {
+        size_t klen = strlen(key);
+        appendTL(aTLV, tlv_id_string, klen);
+        aTLV.append(key, klen);
+        encodeTLV(aTLV, val);
+      }
+      endContainer(aTLV, lenPos);
+      break;
+    }
+    case json_type_array: {
+      size_t lenPos = startContainer(aTLV, tlv_counted_container);
+      int n = json_object_array_length(aObj);
+      // element count, as in TLVWriter::start_counted_container()
+      int bytes = n<0x100 ? 1 : (n<0x10000 ? 2 : (n<0x1000000 ? 3 : 4));
+      appendTL(aTLV, tlv_unsigned, bytes);
+      while (bytes>0) {
+        bytes--;
+        aTLV += (char)(n>>(bytes*8));
+      }
+      for (int i=0; i<n; i++) {
+        encodeTLV(aTLV, json_object_array_get_idx(aObj, i));
+      }
+      endContainer(aTLV, lenPos);
+      break;
+    }
+  }
+}
+
+
+void JsonObject::appendTLV(string &aTLV)
+{
+  encodeTLV(aTLV, mJson_obj);
+}
+
+
+string JsonObject::tlvEncoded()
+{
+  string tlv;
+  appendTLV(tlv);
+  return tlv;
+}
+
+
+/// decode one TLV value
+/// @return true if ok, aObj is set to the decoded value (which might be NULL for JSON null)
+static bool decodeTLV(const uint8_t *&aP, const uint8_t *aEnd, int aDepth, struct json_object *&aObj)
+{
+  aObj = NULL;
+  if (aP>=aEnd || aDepth>TLV_MAX_NESTING) return false;
+  TLVTag tag = *aP++;
+  int szSz = (tag & tlv_sizemask)+1;
+  if (aEnd-aP<szSz) return false;
+  size_t len = 0;
+  while (szSz-->0) len = (len<<8) | *aP++;
+  if ((size_t)(aEnd-aP)<len) return false;
+  const uint8_t *v = aP;
+  aP += len; // value ends here in all cases
+  switch (tag & tlv_tagmask) {
+    case tlv_unsigned:
+      if (len<1 || len>8) return false;
+      aObj = json_object_new_boolean(v[len-1]!=0);
+      return true;
+    case tlv_signed: {
+      if (len<1 || len>8) return false;
+      uint64_t u = (v[0] & 0x80) ? ~(uint64_t)0 : 0; // sign extension
+      for (size_t i=0; i<len; i++) u = (u<<8) | v[i];
+      aObj = json_object_new_int64((int64_t)u);
+      return true;
+    }
+    case tlv_blob: {
+      if (len==0) return true; // null
+      if (len!=8) return false;
+      uint64_t bits = 0;
+      for (int i=0; i<8; i++) bits = (bits<<8) | v[i];
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      aObj = json_object_new_double(d);
+      return true;
+    }
+    case tlv_string:
+      aObj = json_object_new_string_len((const char *)v, (int)len);
+      return true;
+    case tlv_container: {
+      aObj = json_object_new_object();
+      const uint8_t *e = v+len;
+      string key;
+      while (v<e) {
+        // member name
+        if ((*v & tlv_tagmask)!=tlv_id_string) return false;
+        int kszSz = (*v++ & tlv_sizemask)+1;
+        if (e-v<kszSz) return false;
+        size_t klen = 0;
+        while (kszSz-->0) klen = (klen<<8) | *v++;
+        if ((size_t)(e-v)<klen) return false;
+        key.assign((const char *)v, klen);
+        v += klen;
+        // member value
+        struct json_object *m;
+        bool ok = decodeTLV(v, e, aDepth+1, m);
+        if (!ok) { if (m) json_object_put(m); return false; }
+        json_object_object_add(aObj, key.c_str(), m);
+      }
+      return true;
+    }
+    case tlv_counted_container: {
+      aObj = json_object_new_array();
+      const uint8_t *e = v+len;
+      // element count
+      if (v>=e || (*v & tlv_tagmask)!=tlv_unsigned) return false;
+      int cszSz = (*v++ & tlv_sizemask)+1;
+      if (e-v<cszSz) return false;
+      size_t clen = 0;
+      while (cszSz-->0) clen = (clen<<8) | *v++;
+      if ((size_t)(e-v)<clen || clen>8) return false;
+      v += clen; // count is informational only, elements extend to end of container
+      while (v<e) {
+        struct json_object *m;
+        bool ok = decodeTLV(v, e, aDepth+1, m);
+        if (!ok) { if (m) json_object_put(m); return false; }
+        json_object_array_add(aObj, m);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+
+JsonObjectPtr JsonObject::objFromTLV(const void *aTLV, size_t aSize, ErrorPtr *aErrorP)
+{
+  const uint8_t *p = (const uint8_t *)aTLV;
+  const uint8_t *e = p+aSize;
+  struct json_object *o;
+  if (!decodeTLV(p, e, 0, o) || p!=e) {
+    if (o) json_object_put(o);
+    if (aErrorP) *aErrorP = Error::err<JsonError>(json_tokener_error_parse_unexpected, "invalid binary JSON at offset %zu", (size_t)(p-(const uint8_t *)aTLV));
+    return JsonObjectPtr();
+  }
+  return JsonObject::newObj(o);
+}
+
+
 // MARK: - type
 
 
@@ -330,6 +1083,13 @@ const char *JsonObject::json_c_str(int aFlags)
 
 string JsonObject::json_str(int aFlags)
 {
+  #if ENABLE_JSON_FASTPATH
+  if (fastSerializable(aFlags)) {
+    string s;
+    appendJsonText(s, mJson_obj, 0, aFlags);
+    return s;
+  }
+  #endif
   return string(json_c_str(aFlags));
 }
 
@@ -31,6 +31,10 @@
   #include <json-c/json.h>
 #endif
 
+#ifndef ENABLE_JSON_FASTPATH
+  #define ENABLE_JSON_FASTPATH 1 // use fast parser and serializer for strict JSON, json-c only for the rest
+#endif
+
 using namespace std;
 
 namespace p44 {
@@ -102,6 +106,9 @@ namespace p44 {
     /// return JSON string representation
     /// @param aFlags formatting options, see JSON_C_TO_STRING_PRETTY and other constants
     /// @return JSON string representation of object.
+    /// @note with ENABLE_JSON_FASTPATH, this is rendered directly (not via json-c's printbuf), but
+    ///   produces exactly the same text as json_c_str(). Formatting options the direct rendering
+    ///   does not replicate for the json-c version in use are rendered via json_c_str().
     string json_str(int aFlags=0);
 
     /// Convenience method: return JSON string representation of passed object, which may be NULL
@@ -207,6 +214,8 @@ namespace p44 {
     /// @param aAllowCComments if set, C-Style comments /* */ are allowed withing JSON text (not conformant to JSON specs)
     /// @param aParsedCharsP where to store the number of chars parsed from aJsonText, or NULL if not needed
     /// @return new object or NULL if aJsonText parsing was not succesful
+    /// @note with ENABLE_JSON_FASTPATH, objects and arrays in strict JSON are parsed by a fast single pass parser.
+    ///   Everything else (lenient syntax, errors) is parsed by json-c, so results are the same in all cases.
     static JsonObjectPtr objFromText(const char *aJsonText, ssize_t aMaxChars = -1, ErrorPtr *aErrorP = NULL, bool aAllowCComments = false, ssize_t* aParsedCharsP = NULL);
 
     /// create new object from text file
@@ -222,6 +231,24 @@ namespace p44 {
     /// @return ok or error
     ErrorPtr saveToFile(const char *aJsonFilePath, int aFlags = 0);
 
+    /// @return compact binary representation (TLV, see tlv.hpp) of this object
+    /// @note this is considerably faster to encode and decode than JSON text, and intended for exchanging
+    ///   JSON between p44utils based processes. All JSON types are represented losslessly:
+    ///   null=empty blob, boolean=unsigned, integer=signed, double=8 byte IEEE754 blob, string=string,
+    ///   object=container with id_string tagged members, array=counted container.
+    string tlvEncoded();
+
+    /// append compact binary representation (TLV) of this object
+    /// @param aTLV string to append the TLV to
+    void appendTLV(string &aTLV);
+
+    /// create new object from binary representation as created by tlvEncoded()
+    /// @param aTLV the binary data
+    /// @param aSize size of the binary data
+    /// @param aErrorP where to store decoding error, or NULL if no error return is needed
+    /// @return new object or NULL if decoding was not succesful
+    static JsonObjectPtr objFromTLV(const void *aTLV, size_t aSize, ErrorPtr *aErrorP = NULL);
+
     /// @return new array object
     static JsonObjectPtr newArray();
 
@@ -44,6 +44,7 @@ const char* JsonRpcError::errorName() const
     case MethodNotFound: return "MethodNotFound";
     case InvalidParams: return "InvalidParams";
     case InternalError: return "InternalError";
+    case RequestTimeout: return "RequestTimeout";
   }
   if (getErrorCode()>=ServerError && getErrorCode()<=ServerErrorMax) {
     return "ServerError";
@@ -56,7 +57,18 @@ const char* JsonRpcError::errorName() const
 JsonRpcComm::JsonRpcComm(MainLoop &aMainLoop) :
   inherited(aMainLoop),
   requestIdCounter(0),
-  reportAllErrors(false)
+  reportAllErrors(false),
+  mRequestTimeout(Infinite),
+  mNextExpiry(Never),
+  mBatching(false),
+  mIncomingBatchDepth(0),
+  mRequestsSent(0),
+  mResponsesReceived(0),
+  mTimeouts(0),
+  mBatchesSent(0),
+  mBatchesReceived(0),
+  mRoundTripTotal(0),
+  mRoundTripMax(0)
 {
   // set myself as handler of incoming JSON objects (which are supposed to be JSON-RPC 2.0
   setMessageHandler(boost::bind(&JsonRpcComm::gotJson, this, _1, _2));
@@ -74,6 +86,17 @@ void JsonRpcComm::setRequestHandler(JsonRpcRequestCB aJsonRpcRequestHandler)
 }
 
 
+void JsonRpcComm::setBatching(bool aBatching)
+{
+  mBatching = aBatching;
+  if (!mBatching) {
+    // send what is already collected
+    mBatchTicket.cancel();
+    sendBatches();
+  }
+}
+
+
 static JsonObjectPtr jsonRPCObj()
 {
   JsonObjectPtr obj = JsonObject::newObj();
@@ -87,7 +110,7 @@ static JsonObjectPtr jsonRPCObj()
 // MARK: - sending outgoing requests and responses
 
 
-ErrorPtr JsonRpcComm::sendRequest(const char *aMethod, JsonObjectPtr aParams, JsonRpcResponseCB aResponseHandler)
+ErrorPtr JsonRpcComm::sendRequest(const char *aMethod, JsonObjectPtr aParams, JsonRpcResponseCB aResponseHandler, MLMicroSeconds aTimeout)
 {
   JsonObjectPtr request = jsonRPCObj();
   // the method or notification name
@@ -103,11 +126,21 @@ ErrorPtr JsonRpcComm::sendRequest(const char *aMethod, JsonObjectPtr aParams, Js
     // add the ID so the callee can include it in the response
     request->add("id", JsonObject::newInt32(requestIdCounter));
     // remember it in our map
-    pendingAnswers[requestIdCounter] = aResponseHandler;
+    PendingAnswer &pa = pendingAnswers[requestIdCounter];
+    pa.callback = aResponseHandler;
+    pa.sent = MainLoop::now();
+    if (aTimeout==Never) aTimeout = mRequestTimeout;
+    pa.expires = aTimeout==Infinite ? Never : pa.sent+aTimeout;
+    mRequestsSent++;
+    if (pa.expires!=Never && (mNextExpiry==Never || pa.expires<mNextExpiry)) {
+      // this one expires first
+      mNextExpiry = pa.expires;
+      mTimeoutTicket.executeOnceAt(boost::bind(&JsonRpcComm::checkTimeouts, this, _1), mNextExpiry);
+    }
   }
   // now send
   FOCUSLOG("Sending JSON-RPC 2.0 request message:\n  %s", request->c_strValue());
-  return sendMessage(request);
+  return sendRpcMessage(request, false);
 }
 
 
@@ -120,7 +153,7 @@ ErrorPtr JsonRpcComm::sendResult(const JsonObjectPtr aJsonRpcId, JsonObjectPtr a
   response->add("id", aJsonRpcId);
   // now send
   FOCUSLOG("Sending JSON-RPC 2.0 result message:\n  %s", response->c_strValue());
-  return sendMessage(response);
+  return sendRpcMessage(response, true);
 }
 
 
@@ -148,7 +181,7 @@ ErrorPtr JsonRpcComm::sendError(const JsonObjectPtr aJsonRpcId, int32_t aErrorCo
   response->add("id", aJsonRpcId);
   // now send
   FOCUSLOG("Sending JSON-RPC 2.0 error message:\n  %s", response->c_strValue());
-  return sendMessage(response);
+  return sendRpcMessage(response, true);
 }
 
 
@@ -162,122 +195,255 @@ ErrorPtr JsonRpcComm::sendError(const JsonObjectPtr aJsonRpcId, ErrorPtr aErrorT
 
 
 
+ErrorPtr JsonRpcComm::sendRpcMessage(JsonObjectPtr aMessage, bool aResponse)
+{
+  if (aResponse && mIncomingBatchDepth>0) {
+    // answer to a request in a batch being processed, collect for sending as batch
+    mIncomingBatchResponses->arrayAppend(aMessage);
+    return ErrorPtr();
+  }
+  if (mBatching) {
+    // collect for sending at end of this mainloop cycle
+    JsonObjectPtr &batch = aResponse ? mResponseBatch : mRequestBatch;
+    if (!batch) batch = JsonObject::newArray();
+    batch->arrayAppend(aMessage);
+    if (!mBatchTicket) mBatchTicket.executeOnce(boost::bind(&JsonRpcComm::sendBatches, this));
+    return ErrorPtr();
+  }
+  return sendMessage(aMessage);
+}
+
+
+void JsonRpcComm::sendBatches()
+{
+  JsonObjectPtr batches[2] = { mResponseBatch, mRequestBatch };
+  mResponseBatch.reset();
+  mRequestBatch.reset();
+  for (int i=0; i<2; i++) {
+    JsonObjectPtr batch = batches[i];
+    if (!batch) continue;
+    ErrorPtr err;
+    if (batch->arrayLength()==1) {
+      // single message, no need for a batch
+      err = sendMessage(batch->arrayGet(0));
+    }
+    else {
+      FOCUSLOG("Sending JSON-RPC 2.0 batch of %d messages", batch->arrayLength());
+      mBatchesSent++;
+      err = sendMessage(batch);
+    }
+    if (Error::notOK(err)) {
+      LOG(LOG_WARNING, "JSON-RPC 2.0: error sending batch: %s", err->text());
+      if (i==1) failBatchedRequests(batch, err); // nobody will answer these requests
+    }
+  }
+}
+
+
+void JsonRpcComm::failBatchedRequests(JsonObjectPtr aBatch, ErrorPtr aError)
+{
+  // collect first, callbacks might send new requests
+  std::vector<std::pair<int32_t, JsonRpcResponseCB> > failed;
+  for (int i=0; i<aBatch->arrayLength(); i++) {
+    JsonObjectPtr idObj;
+    if (!aBatch->arrayGet(i)->get("id", idObj) || !idObj) continue; // notification, nobody waiting for it
+    PendingAnswerMap::iterator pos = pendingAnswers.find(idObj->int32Value());
+    if (pos!=pendingAnswers.end()) {
+      failed.push_back(std::make_pair(pos->first, pos->second.callback));
+      pendingAnswers.erase(pos);
+    }
+  }
+  // Note: mTimeoutTicket might now fire for none of the remaining requests, which is harmless
+  JsonRpcCommPtr keepMeAlive(this);
+  for (size_t i=0; i<failed.size(); i++) {
+    ErrorPtr err = aError;
+    failed[i].second(failed[i].first, err, JsonObjectPtr());
+  }
+}
+
+
+void JsonRpcComm::checkTimeouts(MLTimer &aTimer)
+{
+  MLMicroSeconds now = MainLoop::now();
+  std::vector<std::pair<int32_t, JsonRpcResponseCB> > expired;
+  mNextExpiry = Never;
+  PendingAnswerMap::iterator pos = pendingAnswers.begin();
+  while (pos!=pendingAnswers.end()) {
+    if (pos->second.expires!=Never) {
+      if (pos->second.expires<=now) {
+        expired.push_back(std::make_pair(pos->first, pos->second.callback));
+        pendingAnswers.erase(pos++);
+        continue;
+      }
+      if (mNextExpiry==Never || pos->second.expires<mNextExpiry) mNextExpiry = pos->second.expires;
+    }
+    ++pos;
+  }
+  if (mNextExpiry!=Never) {
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, mNextExpiry, 0, MainLoop::absolute);
+  }
+  // report timeouts (callbacks might send new requests)
+  JsonRpcCommPtr keepMeAlive(this);
+  for (size_t i=0; i<expired.size(); i++) {
+    mTimeouts++;
+    ErrorPtr err = Error::err<JsonRpcError>(JsonRpcError::RequestTimeout, "No response within timeout");
+    expired[i].second(expired[i].first, err, JsonObjectPtr());
+  }
+}
+
+
 // MARK: - handling incoming requests and responses
 
 
 void JsonRpcComm::gotJson(ErrorPtr aError, JsonObjectPtr aJsonObject)
 {
   JsonRpcCommPtr keepMeAlive(this); // make sure this object lives until routine terminates
-  ErrorPtr respErr;
-  bool safeError = false; // set when reporting error is safe (i.e. not error possibly generated by malformed error, to prevent error loops)
-  JsonObjectPtr idObj;
   if (Error::isOK(aError)) {
     // received proper JSON, now check JSON-RPC specifics
     FOCUSLOG("Received JSON message:\n  %s", aJsonObject->c_strValue());
-    if (aJsonObject->isType(json_type_array)) {
-      respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - batch mode not supported by this implementation");
+    if (aJsonObject->isType(json_type_array) && aJsonObject->arrayLength()>0) {
+      // batch of requests or responses
+      // Note: answers generated while processing the batch are sent back as a batch. Answers sent
+      //   later (asynchronously) are sent individually.
+      mBatchesReceived++;
+      if (mIncomingBatchDepth++==0) mIncomingBatchResponses = JsonObject::newArray();
+      for (int i=0; i<aJsonObject->arrayLength(); i++) {
+        handleMessage(aJsonObject->arrayGet(i));
+      }
+      if (--mIncomingBatchDepth==0) {
+        JsonObjectPtr responses = mIncomingBatchResponses;
+        mIncomingBatchResponses.reset();
+        if (responses->arrayLength()>0) {
+          FOCUSLOG("Sending JSON-RPC 2.0 batch of %d responses", responses->arrayLength());
+          mBatchesSent++;
+          sendMessage(responses);
+        }
+      }
+    }
+    else {
+      handleMessage(aJsonObject);
+    }
+  }
+  else {
+    // no proper JSON received, create error response
+    ErrorPtr respErr;
+    if (aError->isDomain(JsonError::domain())) {
+      // some kind of parsing error
+      respErr = Error::err_str<JsonRpcError>(JsonRpcError::ParseError, aError->description());
     }
-    else if (!aJsonObject->isType(json_type_object)) {
-      respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - request must be JSON object");
+    else {
+      // some other type of server error
+      respErr = Error::err_str<JsonRpcError>(JsonRpcError::ServerError, aError->description());
     }
+    if (reportAllErrors)
+      sendError(JsonObjectPtr(), respErr);
+    else
+      LOG(LOG_WARNING, "Received data that generated error which can't be sent back: Code=%ld, Message='%s'", respErr->getErrorCode(), respErr->text());
+  }
+}
+
+
+void JsonRpcComm::handleMessage(JsonObjectPtr aJsonObject)
+{
+  ErrorPtr respErr;
+  bool safeError = false; // set when reporting error is safe (i.e. not error possibly generated by malformed error, to prevent error loops)
+  JsonObjectPtr idObj;
+  if (aJsonObject->isType(json_type_array)) {
+    respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - empty or nested batch");
+  }
+  else if (!aJsonObject->isType(json_type_object)) {
+    respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - request must be JSON object");
+  }
+  else {
+    // check request object fields
+    const char *method = NULL;
+    JsonObjectPtr o = aJsonObject->get("jsonrpc");
+    if (!o)
+      respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - missing 'jsonrpc'");
+    else if (o->stringValue()!="2.0")
+      respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - wrong version in 'jsonrpc'");
     else {
-      // check request object fields
-      const char *method = NULL;
-      JsonObjectPtr o = aJsonObject->get("jsonrpc");
-      if (!o)
-        respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - missing 'jsonrpc'");
-      else if (o->stringValue()!="2.0")
-        respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - wrong version in 'jsonrpc'");
-      else {
-        // get ID param (must be present for all messages except notification)
-        idObj = aJsonObject->get("id");
-        JsonObjectPtr paramsObj = aJsonObject->get("params");
-        // JSON-RPC version is correct, check other params
-        method = aJsonObject->getCString("method");
-        if (method) {
-          // this is a request (responses don't have the method member)
-          safeError = idObj!=NULL; // reporting error is safe if this is a method call. Other errors are reported only when reportAllErrors is set
-          if (*method==0)
-            respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - empty 'method'");
+      // get ID param (must be present for all messages except notification)
+      idObj = aJsonObject->get("id");
+      JsonObjectPtr paramsObj = aJsonObject->get("params");
+      // JSON-RPC version is correct, check other params
+      method = aJsonObject->getCString("method");
+      if (method) {
+        // this is a request (responses don't have the method member)
+        safeError = idObj!=NULL; // reporting error is safe if this is a method call. Other errors are reported only when reportAllErrors is set
+        if (*method==0)
+          respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - empty 'method'");
+        else {
+          // looks like a valid method or notification call
+          if (!jsonRequestHandler) {
+            // no handler -> method cannot be executed
+            respErr = Error::err<JsonRpcError>(JsonRpcError::MethodNotFound, "Method not found");
+          }
           else {
-            // looks like a valid method or notification call
-            if (!jsonRequestHandler) {
-              // no handler -> method cannot be executed
-              respErr = Error::err<JsonRpcError>(JsonRpcError::MethodNotFound, "Method not found");
+            if (paramsObj && !paramsObj->isType(json_type_array) && !paramsObj->isType(json_type_object)) {
+              // invalid param object
+              respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - 'params' must be object or array");
             }
             else {
-              if (paramsObj && !paramsObj->isType(json_type_array) && !paramsObj->isType(json_type_object)) {
-                // invalid param object
-                respErr = Error::err<JsonRpcError>(JsonRpcError::InvalidRequest, "Invalid Request - 'params' must be object or array");
-              }
-              else {
-                // call handler to execute method or notification
-                jsonRequestHandler(method, idObj, paramsObj);
-              }
+              // call handler to execute method or notification
+              jsonRequestHandler(method, idObj, paramsObj);
             }
           }
         }
-        else {
-          // this is a response (requests always have a method member)
-          // - check if result or error
-          JsonObjectPtr respObj;
-          if (!aJsonObject->get("result", respObj, false)) { // NULL result also counts as having a result!
-            // must be error, need further decoding
-            respObj = aJsonObject->get("error");
-            if (!respObj)
-              respErr = Error::err<JsonRpcError>(JsonRpcError::InternalError, "Internal JSON-RPC error - response with neither 'result' nor 'error'");
-            else {
-              // dissect error object
-              ErrorCode errCode = JsonRpcError::InternalError; // Internal RPC error
-              const char *errMsg = "malformed Error response";
-              // - try to get error code
-              o = respObj->get("code");
-              if (o) errCode = o->int32Value();
-              // - try to get error message
-              o = respObj->get("message");
-              if (o) errMsg = o->c_strValue();
-              // compose error object from this
-              respErr = Error::err_cstr<JsonRpcError>(errCode, errMsg);
-              // also get optional data element
-              respObj = respObj->get("data");
-            }
+      }
+      else {
+        // this is a response (requests always have a method member)
+        // - check if result or error
+        JsonObjectPtr respObj;
+        if (!aJsonObject->get("result", respObj, false)) { // NULL result also counts as having a result!
+          // must be error, need further decoding
+          respObj = aJsonObject->get("error");
+          if (!respObj)
+            respErr = Error::err<JsonRpcError>(JsonRpcError::InternalError, "Internal JSON-RPC error - response with neither 'result' nor 'error'");
+          else {
+            // dissect error object
+            ErrorCode errCode = JsonRpcError::InternalError; // Internal RPC error
+            const char *errMsg = "malformed Error response";
+            // - try to get error code
+            o = respObj->get("code");
+            if (o) errCode = o->int32Value();
+            // - try to get error message
+            o = respObj->get("message");
+            if (o) errMsg = o->c_strValue();
+            // compose error object from this
+            respErr = Error::err_cstr<JsonRpcError>(errCode, errMsg);
+            // also get optional data element
+            respObj = respObj->get("data");
           }
-          // Now we have either result or error.data in respObj, and respErr is Ok or contains the error code + message
-          if (!idObj) {
+        }
+        // Now we have either result or error.data in respObj, and respErr is Ok or contains the error code + message
+        if (!idObj) {
+          // errors without ID cannot be associated with calls made earlier, so just log the error
+          LOG(LOG_WARNING, "JSON-RPC 2.0 warning: Received response with no or NULL 'id' that cannot be dispatched:\n  %s", aJsonObject->c_strValue());
+        }
+        else {
+          // dispatch by ID
+          int32_t requestId = idObj->int32Value();
+          PendingAnswerMap::iterator pos = pendingAnswers.find(requestId);
+          if (pos==pendingAnswers.end()) {
             // errors without ID cannot be associated with calls made earlier, so just log the error
-            LOG(LOG_WARNING, "JSON-RPC 2.0 warning: Received response with no or NULL 'id' that cannot be dispatched:\n  %s", aJsonObject->c_strValue());
+            LOG(LOG_WARNING, "JSON-RPC 2.0 error: Received response with unknown 'id'=%d : %s", requestId, aJsonObject->c_strValue());
           }
           else {
-            // dispatch by ID
-            int32_t requestId = idObj->int32Value();
-            PendingAnswerMap::iterator pos = pendingAnswers.find(requestId);
-            if (pos==pendingAnswers.end()) {
-              // errors without ID cannot be associated with calls made earlier, so just log the error
-              LOG(LOG_WARNING, "JSON-RPC 2.0 error: Received response with unknown 'id'=%d : %s", requestId, aJsonObject->c_strValue());
-            }
-            else {
-              // found callback
-              JsonRpcResponseCB cb = pos->second;
-              pendingAnswers.erase(pos); // erase
-              cb(requestId, respErr, respObj); // call
-            }
-            respErr.reset(); // handled
+            // found callback
+            JsonRpcResponseCB cb = pos->second.callback;
+            MLMicroSeconds roundTrip = MainLoop::now()-pos->second.sent;
+            mResponsesReceived++;
+            mRoundTripTotal += roundTrip;
+            if (roundTrip>mRoundTripMax) mRoundTripMax = roundTrip;
+            pendingAnswers.erase(pos); // erase
+            cb(requestId, respErr, respObj); // call
           }
+          respErr.reset(); // handled
         }
       }
     }
   }
-  else {
-    // no proper JSON received, create error response
-    if (aError->isDomain(JsonError::domain())) {
-      // some kind of parsing error
-      respErr = Error::err_str<JsonRpcError>(JsonRpcError::ParseError, aError->description());
-    }
-    else {
-      // some other type of server error
-      respErr = Error::err_str<JsonRpcError>(JsonRpcError::ServerError, aError->description());
-    }
-  }
   // auto-generate error response for internally created errors
   if (Error::notOK(respErr)) {
     if (safeError || reportAllErrors)
@@ -39,6 +39,7 @@ namespace p44 {
       InvalidParams = -32602,
       InternalError = -32603,
       ServerError = -32000,
+      RequestTimeout = -32001, ///< locally generated: no response from peer within request timeout
       ServerErrorMax = -32099
     };
     typedef int32_t ErrorCodes;
@@ -81,8 +82,33 @@ namespace p44 {
     int32_t requestIdCounter;
     bool reportAllErrors;
 
-    typedef map<int32_t, JsonRpcResponseCB> PendingAnswerMap;
+    typedef struct {
+      JsonRpcResponseCB callback; ///< the handler to call with the answer
+      MLMicroSeconds sent; ///< when the request was sent
+      MLMicroSeconds expires; ///< when the request times out, Never if no timeout
+    } PendingAnswer;
+    typedef map<int32_t, PendingAnswer> PendingAnswerMap;
     PendingAnswerMap pendingAnswers;
+    MLMicroSeconds mRequestTimeout; ///< default timeout for method calls
+    MLTicket mTimeoutTicket; ///< single timer for all pending answers, scheduled for the earliest expiry
+    MLMicroSeconds mNextExpiry; ///< expiry mTimeoutTicket is scheduled for, Never if none
+
+    // batching
+    bool mBatching; ///< if set, messages sent in the same mainloop cycle are coalesced into batches
+    JsonObjectPtr mRequestBatch; ///< requests waiting to be sent as a batch
+    JsonObjectPtr mResponseBatch; ///< responses waiting to be sent as a batch
+    MLTicket mBatchTicket;
+    int mIncomingBatchDepth; ///< >0 while processing a received batch: responses are collected to be sent as a batch
+    JsonObjectPtr mIncomingBatchResponses;
+
+    // statistics
+    long mRequestsSent;
+    long mResponsesReceived;
+    long mTimeouts;
+    long mBatchesSent;
+    long mBatchesReceived;
+    MLMicroSeconds mRoundTripTotal;
+    MLMicroSeconds mRoundTripMax;
 
   public:
 
@@ -99,14 +125,26 @@ namespace p44 {
     /// @param aReportAllErrors set to report all errors (default is false).
     void setReportAllErrors(bool aReportAllErrors) { reportAllErrors = aReportAllErrors; };
 
+    /// set default timeout for method calls
+    /// @param aTimeout time to wait for an answer, after which the response handler is called with a
+    ///   JsonRpcError::RequestTimeout error. Infinite (default) means waiting forever.
+    void setRequestTimeout(MLMicroSeconds aTimeout) { mRequestTimeout = aTimeout; };
+
+    /// enable coalescing outgoing messages into JSON-RPC batches
+    /// @param aBatching if set, requests (and separately, responses) sent within the same mainloop cycle
+    ///   are not sent immediately, but collected and sent as a single JSON-RPC batch array at the end of the cycle.
+    /// @note the peer must support JSON-RPC 2.0 batches
+    void setBatching(bool aBatching);
+
     /// send a JSON-RPC request
     /// @param aMethod the JSON-RPC (2.0) method or notification request to be sent
     /// @param aParams the parameters for the method or notification request as a JsonObject. Can be nullptr.
     /// @param aResponseHandler if the request is a method call, this handler will be called when the method result arrives
-    ///   Note that the aResponseHandler might not be called at all in case of lost messages etc. So do not rely on
-    ///   this callback for chaining an execution thread.
+    ///   Note that without a timeout, the aResponseHandler might not be called at all in case of lost messages etc.
+    ///   So do not rely on this callback for chaining an execution thread unless a timeout is set.
+    /// @param aTimeout timeout for this method call, Never to use the default set with setRequestTimeout(), Infinite for no timeout
     /// @return empty or Error object in case of error
-    ErrorPtr sendRequest(const char *aMethod, JsonObjectPtr aParams, JsonRpcResponseCB aResponseHandler = NoOP);
+    ErrorPtr sendRequest(const char *aMethod, JsonObjectPtr aParams, JsonRpcResponseCB aResponseHandler = NoOP, MLMicroSeconds aTimeout = Never);
 
     /// @return Id generated for last sendRequest. 
     int32_t lastRequestId() { return requestIdCounter; };
@@ -132,12 +170,29 @@ namespace p44 {
     /// @result empty or Error object in case of error sending error response
     ErrorPtr sendError(const JsonObjectPtr aJsonRpcId, ErrorPtr aErrorToSend);
 
+    /// @name statistics
+    /// @{
+    size_t outstandingRequests() { return pendingAnswers.size(); }; ///< number of method calls waiting for an answer
+    long requestsSent() { return mRequestsSent; }; ///< number of method calls sent
+    long responsesReceived() { return mResponsesReceived; }; ///< number of answers received for method calls
+    long timeouts() { return mTimeouts; }; ///< number of method calls that timed out
+    long batchesSent() { return mBatchesSent; }; ///< number of batches sent
+    long batchesReceived() { return mBatchesReceived; }; ///< number of batches received
+    MLMicroSeconds averageRoundTrip() { return mResponsesReceived>0 ? mRoundTripTotal/mResponsesReceived : 0; }; ///< average method call round trip time
+    MLMicroSeconds maxRoundTrip() { return mRoundTripMax; }; ///< longest method call round trip time
+    /// @}
+
     /// clear all callbacks
     /// @note this is important because handlers might cause retain cycles when they have smart ptr arguments
     virtual void clearCallbacks() { jsonRequestHandler = NoOP; inherited::clearCallbacks(); }
 
   private:
     void gotJson(ErrorPtr aError, JsonObjectPtr aJsonObject);
+    void handleMessage(JsonObjectPtr aJsonObject);
+    ErrorPtr sendRpcMessage(JsonObjectPtr aMessage, bool aResponse);
+    void sendBatches();
+    void failBatchedRequests(JsonObjectPtr aBatch, ErrorPtr aError);
+    void checkTimeouts(MLTimer &aTimer);
 
   };
   
@@ -22,12 +22,19 @@
 
 #include "jsonwebclient.hpp"
 
+#include "fnv.hpp"
+#include "extutils.hpp"
+#if ENABLE_APPLICATION_SUPPORT
+  #include "application.hpp" // we need it for the cache persistence path
+#endif
+
 
 
 using namespace p44;
 
 JsonWebClient::JsonWebClient(MainLoop &aMainLoop) :
-  HttpComm(aMainLoop)
+  HttpComm(aMainLoop),
+  mRevalidating(false)
 {
 }
 
@@ -37,54 +44,103 @@ JsonWebClient::~JsonWebClient()
 }
 
 
-void JsonWebClient::requestThreadSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode)
+void JsonWebClient::terminate()
 {
+  if (mCacheTicket) {
+    // answer from cache pending
+    mCacheTicket.cancel();
+    mRequestInProgress = false;
+  }
+  inherited::terminate();
+}
+
+
+void JsonWebClient::cachedAnswer(JsonObjectPtr aJson)
+{
+  mRequestInProgress = false;
+  LOG(LOG_DEBUG, "JsonWebClient: <- answered from cache:\n%s", JsonObject::text(aJson));
+  JsonWebClientCB cb = mJsonResponseCallback;
+  mJsonResponseCallback.clear();
+  // caller gets its own copy, so modifying it cannot affect the cached object
+  if (cb) cb(JsonObjectPtr(new JsonObject(*aJson)), ErrorPtr());
+}
+
+
+void JsonWebClient::requestCompleted()
+{
+  JsonWebCache::Entry* cached = NULL;
+  if (!mCacheKey.empty()) {
+    // remove the validators, they are only valid for this request
+    mRequestHeaders.erase("If-None-Match");
+    mRequestHeaders.erase("If-Modified-Since");
+    if (mCache && Error::isError(mRequestError, WebError::domain(), 304)) {
+      cached = mCache->lookup(mCacheKey);
+    }
+  }
+  bool revalidated = mRevalidating;
+  mRevalidating = false;
+  if (cached && mJsonResponseCallback) {
+    // not modified, return the cached object
+    mRequestError.reset();
+    if (mResponseHeaders) mCache->refresh(*cached, *mResponseHeaders);
+    mCache->mRevalidations++;
+    mCacheKey.clear();
+    JsonObjectPtr message = JsonObjectPtr(new JsonObject(*cached->json)); // private copy for the caller
+    LOG(LOG_DEBUG, "JsonWebClient: <- not modified, answered from cache");
+    JsonWebClientCB cb = mJsonResponseCallback;
+    mJsonResponseCallback.clear();
+    cb(message, mRequestError);
+    return;
+  }
+  if (revalidated && mCache && mJsonResponseCallback && Error::isError(mRequestError, WebError::domain(), 304)) {
+    // not modified, but entry was evicted from the cache in the meantime: fetch again, unconditionally
+    LOG(LOG_DEBUG, "JsonWebClient: <- not modified, but no longer cached, re-requesting %s", mCacheURL.c_str());
+    string url = mCacheURL;
+    if (httpRequest(url.c_str(), NoOP, "GET", NULL, NULL, -1, true)) return;
+  }
   if (mJsonResponseCallback) {
     // only if we have a json callback, we need to parse the response at all
-    if (aSignalCode==threadSignalCompleted) {
-      mRequestInProgress = false; // thread completed
-      JsonObjectPtr message;
-      if (Error::isOK(mRequestError) || mRequestError->isDomain(WebError::domain())) {
-        // try to decode JSON
-        struct json_tokener* tokener = json_tokener_new();
-        struct json_object *o = json_tokener_parse_ex(tokener, mResponse.c_str(), (int)mResponse.size());
-        if (o==NULL) {
-          // error (or incomplete JSON, which is fine)
-          JsonError::ErrorCodes err = json_tokener_get_error(tokener);
-          if (err!=json_tokener_continue) {
-            // real JSON error - however, if we already have a http level error, just annotate
-            if (Error::notOK(mRequestError))
-              mRequestError->prefixMessage("JSON cannot be decoded, probably due to: ");
-            else
-              mRequestError = ErrorPtr(new JsonError(err));
-          }
-        }
-        else {
-          // got JSON object
-          message = JsonObject::newObj(o);
+    JsonObjectPtr message;
+    if (Error::isOK(mRequestError) || mRequestError->isDomain(WebError::domain())) {
+      // try to decode JSON
+      struct json_tokener* tokener = json_tokener_new();
+      struct json_object *o = json_tokener_parse_ex(tokener, mResponse.c_str(), (int)mResponse.size());
+      if (o==NULL) {
+        // error (or incomplete JSON, which is fine)
+        JsonError::ErrorCodes err = json_tokener_get_error(tokener);
+        if (err!=json_tokener_continue) {
+          // real JSON error - however, if we already have a http level error, just annotate
+          if (Error::notOK(mRequestError))
+            mRequestError->prefixMessage("JSON cannot be decoded, probably due to: ");
+          else
+            mRequestError = ErrorPtr(new JsonError(err));
         }
-        json_tokener_free(tokener);
       }
-      // call back with result of request
-      LOG(LOG_DEBUG, "JsonWebClient: <- received JSON response (Error=%s), answer:\n%s", Error::text(mRequestError), JsonObject::text(message));
-      // Note: this callback might initiate another request already
-      if (mJsonResponseCallback) {
-        // use this callback, but as callback routine might post another request immediately, we need to free the member first
-        JsonWebClientCB cb = mJsonResponseCallback;
-        mJsonResponseCallback.clear();
-        cb(message, mRequestError);
+      else {
+        // got JSON object
+        message = JsonObject::newObj(o);
       }
-      // release child thread object now
-      mChildThread.reset();
+      json_tokener_free(tokener);
     }
-    else {
-      // none of the signals we understand at this level (e.g. httpThreadSignalDataReady), let inherited handle that
-      inherited::requestThreadSignal(aChildThread, aSignalCode);
+    if (!mCacheKey.empty() && mCache) {
+      mCache->mMisses++;
+      if (Error::isOK(mRequestError) && message && mResponseHeaders) {
+        // cache a private copy, the caller might modify the object it receives
+        mCache->store(mCacheKey, JsonObjectPtr(new JsonObject(*message)), mResponse.size(), *mResponseHeaders);
+      }
     }
+    mCacheKey.clear();
+    // call back with result of request
+    LOG(LOG_DEBUG, "JsonWebClient: <- received JSON response (Error=%s), answer:\n%s", Error::text(mRequestError), JsonObject::text(message));
+    // Note: this callback might initiate another request already
+    // use this callback, but as callback routine might post another request immediately, we need to free the member first
+    JsonWebClientCB cb = mJsonResponseCallback;
+    mJsonResponseCallback.clear();
+    cb(message, mRequestError);
   }
   else {
     // no JSON callback, let inherited handle this
-    inherited::requestThreadSignal(aChildThread, aSignalCode);
+    inherited::requestCompleted();
   }
 }
 
@@ -100,7 +156,54 @@ bool JsonWebClient::jsonRequest(const char *aURL, JsonWebClientCB aResponseCallb
     jsonstring = aJsonRequest->json_c_str();
   }
   LOG(LOG_DEBUG, "JsonWebClient: -> sending %s JSON request to %s:\n%s", aMethod, aURL, jsonstring.c_str());
-  return httpRequest(aURL, NoOP, aMethod, jsonstring.c_str(), aContentType,  -1, aSaveHeaders);
+  mCacheKey.clear();
+  mRevalidating = false;
+  string key;
+  if (mCache && jsonstring.empty() && strucmp(aMethod, "GET")==0 && !mRequestInProgress) key = cacheKeyFor(aURL);
+  if (!key.empty()) {
+    // cacheable request
+    JsonWebCache::Entry* cached = mCache->lookup(key);
+    if (cached && cached->expires>MainLoop::unixtime()) {
+      // fresh, answer from cache without contacting the server
+      mCache->mHits++;
+      mRequestInProgress = true;
+      mCacheTicket.executeOnce(boost::bind(&JsonWebClient::cachedAnswer, this, cached->json));
+      return true;
+    }
+    mCacheKey = key;
+    mCacheURL = aURL;
+    if (cached) {
+      // stale, ask server to revalidate
+      if (!cached->etag.empty()) addRequestHeader("If-None-Match", cached->etag);
+      if (!cached->lastModified.empty()) addRequestHeader("If-Modified-Since", cached->lastModified);
+      mRevalidating = true;
+    }
+    aSaveHeaders = true; // we need the caching headers
+  }
+  if (!httpRequest(aURL, NoOP, aMethod, jsonstring.c_str(), aContentType,  -1, aSaveHeaders)) {
+    if (!mCacheKey.empty()) {
+      mRequestHeaders.erase("If-None-Match");
+      mRequestHeaders.erase("If-Modified-Since");
+      mCacheKey.clear();
+      mRevalidating = false;
+    }
+    return false;
+  }
+  return true;
+}
+
+
+string JsonWebClient::cacheKeyFor(const char *aURL)
+{
+  // responses to requests with credentials might be specific to the requester, never share them
+  if (hasCredentials()) return "";
+  string key = aURL;
+  for (HttpHeaderMap::iterator pos = mRequestHeaders.begin(); pos!=mRequestHeaders.end(); ++pos) {
+    if (strucmp(pos->first.c_str(), "Authorization")==0 || strucmp(pos->first.c_str(), "Cookie")==0) return "";
+    // other headers might influence the response, so different values must use different entries
+    string_format_append(key, "\n%s: %s", pos->first.c_str(), pos->second.c_str());
+  }
+  return key;
 }
 
 
@@ -114,4 +217,291 @@ bool JsonWebClient::jsonReturningRequest(const char *aURL, JsonWebClientCB aResp
 }
 
 
+// MARK: - JsonWebCache
+
+#define CACHE_DIR_NAME "jsonwebcache"
+
+JsonWebCache::JsonWebCache(size_t aMaxEntries, size_t aMaxBytes) :
+  mMaxEntries(aMaxEntries),
+  mMaxBytes(aMaxBytes),
+  mBytes(0),
+  mHits(0),
+  mRevalidations(0),
+  mMisses(0),
+  mEvictions(0)
+{
+}
+
+
+JsonWebCache::~JsonWebCache()
+{
+}
+
+
+void JsonWebCache::setLimits(size_t aMaxEntries, size_t aMaxBytes)
+{
+  mMaxEntries = aMaxEntries;
+  mMaxBytes = aMaxBytes;
+  enforceLimits();
+}
+
+
+ErrorPtr JsonWebCache::setPersistence(const char *aDir)
+{
+  if (!aDir) {
+    mPersistDir.clear();
+    return ErrorPtr();
+  }
+  string dir = aDir;
+  if (dir.empty()) {
+    #if ENABLE_APPLICATION_SUPPORT
+    if (Application::sharedApplication()) dir = Application::sharedApplication()->tempPath(CACHE_DIR_NAME);
+    #endif
+    if (dir.empty()) dir = "/tmp/" CACHE_DIR_NAME; // no application, use system temp
+  }
+  ErrorPtr err = ensureDirExists(dir);
+  if (Error::isOK(err)) {
+    mPersistDir = dir;
+  }
+  return err;
+}
+
+
+void JsonWebCache::clear()
+{
+  while (!mLRU.empty()) remove(mLRU.back());
+}
+
+
+string JsonWebCache::persistPath(const string &aKey)
+{
+  Fnv64 h;
+  h.addString(aKey);
+  return string_format("%s/%016llx.json", mPersistDir.c_str(), (unsigned long long)h.getHash());
+}
+
+
+JsonWebCache::Entry* JsonWebCache::lookup(const string &aKey)
+{
+  EntryMap::iterator pos = mEntries.find(aKey);
+  if (pos==mEntries.end()) {
+    // not in memory, maybe persisted
+    return load(aKey);
+  }
+  // now the most recently used
+  mLRU.splice(mLRU.begin(), mLRU, pos->second.lruPos);
+  return &pos->second;
+}
+
+
+void JsonWebCache::store(const string &aKey, JsonObjectPtr aJson, size_t aSize, const HttpHeaderMap &aHeaders)
+{
+  remove(aKey); // new response always replaces the old entry
+  bool noStore;
+  Entry e;
+  e.json = aJson;
+  e.size = aSize;
+  freshness(aHeaders, noStore, e.expires);
+  if (noStore) return;
+  for (HttpHeaderMap::const_iterator pos = aHeaders.begin(); pos!=aHeaders.end(); ++pos) {
+    if (uequals(pos->first, "ETag")) e.etag = pos->second;
+    else if (uequals(pos->first, "Last-Modified")) e.lastModified = pos->second;
+  }
+  if (e.etag.empty() && e.lastModified.empty() && e.expires<=MainLoop::unixtime()) return; // can neither be used nor revalidated
+  if (e.size>mMaxBytes) return; // would never fit
+  mLRU.push_front(aKey);
+  e.lruPos = mLRU.begin();
+  mEntries[aKey] = e;
+  mBytes += e.size;
+  persist(aKey, e);
+  enforceLimits();
+}
+
 
+void JsonWebCache::refresh(Entry &aEntry, const HttpHeaderMap &aHeaders)
+{
+  bool noStore;
+  freshness(aHeaders, noStore, aEntry.expires);
+  for (HttpHeaderMap::const_iterator pos = aHeaders.begin(); pos!=aHeaders.end(); ++pos) {
+    if (uequals(pos->first, "ETag")) aEntry.etag = pos->second;
+  }
+  persist(*aEntry.lruPos, aEntry);
+}
+
+
+void JsonWebCache::remove(const string &aKey)
+{
+  // Note: aKey might be the LRU list element itself, so it must not be used after erasing from the list
+  if (!mPersistDir.empty()) {
+    unlink(persistPath(aKey).c_str());
+  }
+  EntryMap::iterator pos = mEntries.find(aKey);
+  if (pos!=mEntries.end()) {
+    mBytes -= pos->second.size;
+    mLRU.erase(pos->second.lruPos);
+    mEntries.erase(pos);
+  }
+}
+
+
+void JsonWebCache::enforceLimits()
+{
+  while (!mLRU.empty() && (mEntries.size()>mMaxEntries || mBytes>mMaxBytes)) {
+    LOG(LOG_DEBUG, "JsonWebCache: evicting %s", mLRU.back().c_str());
+    remove(mLRU.back());
+    mEvictions++;
+  }
+}
+
+
+void JsonWebCache::persist(const string &aKey, const Entry &aEntry)
+{
+  if (mPersistDir.empty()) return;
+  JsonObjectPtr f = JsonObject::newObj();
+  f->add("url", JsonObject::newString(aKey));
+  if (!aEntry.etag.empty()) f->add("etag", JsonObject::newString(aEntry.etag));
+  if (!aEntry.lastModified.empty()) f->add("lastmodified", JsonObject::newString(aEntry.lastModified));
+  f->add("expires", JsonObject::newInt64(aEntry.expires/Second));
+  f->add("size", JsonObject::newInt64(aEntry.size));
+  f->add("body", aEntry.json);
+  ErrorPtr err = f->saveToFile(persistPath(aKey).c_str());
+  if (Error::notOK(err)) {
+    LOG(LOG_WARNING, "JsonWebCache: cannot persist entry for %s: %s", aKey.c_str(), err->text());
+  }
+}
+
+
+JsonWebCache::Entry* JsonWebCache::load(const string &aKey)
+{
+  if (mPersistDir.empty()) return NULL;
+  JsonObjectPtr f = JsonObject::objFromFile(persistPath(aKey).c_str());
+  JsonObjectPtr o;
+  if (!f || !f->get("url", o) || o->stringValue()!=aKey) return NULL; // none, or hash collision
+  Entry e;
+  if (!f->get("body", e.json)) return NULL;
+  if (f->get("etag", o)) e.etag = o->stringValue();
+  if (f->get("lastmodified", o)) e.lastModified = o->stringValue();
+  e.expires = f->get("expires", o) ? o->int64Value()*Second : 0;
+  e.size = f->get("size", o) ? (size_t)o->int64Value() : 0;
+  if (e.size>mMaxBytes) return NULL;
+  mLRU.push_front(aKey);
+  e.lruPos = mLRU.begin();
+  mEntries[aKey] = e;
+  mBytes += e.size;
+  enforceLimits();
+  EntryMap::iterator pos = mEntries.find(aKey);
+  return pos==mEntries.end() ? NULL : &pos->second;
+}
+
+
+void JsonWebCache::freshness(const HttpHeaderMap &aHeaders, bool &aNoStore, MLMicroSeconds &aExpires)
+{
+  aNoStore = false;
+  aExpires = 0;
+  bool maxAge = false;
+  bool revalidate = false;
+  MLMicroSeconds expiresHeader = 0;
+  for (HttpHeaderMap::const_iterator pos = aHeaders.begin(); pos!=aHeaders.end(); ++pos) {
+    if (uequals(pos->first, "Cache-Control")) {
+      const char *p = pos->second.c_str();
+      string directive;
+      while (nextPart(p, directive, ',')) {
+        directive = trimWhiteSpace(directive);
+        if (uequals(directive, "no-store") || uequals(directive, "private")) {
+          aNoStore = true;
+        }
+        else if (uequals(directive, "no-cache")) {
+          revalidate = true;
+        }
+        else if (uequals(directive, "max-age=", 8)) {
+          aExpires = MainLoop::unixtime()+atoll(directive.c_str()+8)*Second;
+          maxAge = true;
+        }
+      }
+    }
+    else if (uequals(pos->first, "Expires")) {
+      struct tm t;
+      memset(&t, 0, sizeof(t));
+      if (strptime(pos->second.c_str(), "%a, %d %b %Y %H:%M:%S", &t)) {
+        expiresHeader = (MLMicroSeconds)timegm(&t)*Second;
+      }
+    }
+  }
+  if (!maxAge) aExpires = expiresHeader; // max-age has precedence over Expires
+  if (revalidate) aExpires = 0;
+}
+
+
+// MARK: - JsonBodySink
+
+JsonBodySink::JsonBodySink(JsonBodyValueCB aValueCB) :
+  mValueCB(aValueCB),
+  mPartial(false),
+  mValues(0)
+{
+  mTokener = json_tokener_new();
+}
+
+
+JsonBodySink::~JsonBodySink()
+{
+  json_tokener_free(mTokener);
+}
+
+
+void JsonBodySink::deliver(struct json_object *aObj)
+{
+  mValues++;
+  JsonObjectPtr value = JsonObject::newObj(aObj);
+  if (mValueCB) mValueCB(value);
+}
+
+
+bool JsonBodySink::bodyData(const uint8_t *aData, size_t aSize, ErrorPtr &aError)
+{
+  const char *p = (const char *)aData;
+  while (aSize>0) {
+    if (!mPartial) {
+      // skip whitespace between values
+      while (aSize>0 && isspace(*p)) { p++; aSize--; }
+      if (aSize==0) break;
+    }
+    struct json_object *o = json_tokener_parse_ex(mTokener, p, (int)aSize);
+    if (o==NULL) {
+      JsonError::ErrorCodes err = json_tokener_get_error(mTokener);
+      if (err!=json_tokener_continue) {
+        aError = ErrorPtr(new JsonError(err));
+        return true;
+      }
+      // incomplete, needs more data
+      mPartial = true;
+      break;
+    }
+    // complete value
+    size_t used = (size_t)mTokener->char_offset;
+    json_tokener_reset(mTokener);
+    mPartial = false;
+    deliver(o);
+    p += used;
+    aSize -= used;
+  }
+  return true;
+}
+
+
+ErrorPtr JsonBodySink::bodyEnd()
+{
+  if (mPartial) {
+    // values like numbers are only complete when a delimiter follows
+    struct json_object *o = json_tokener_parse_ex(mTokener, " ", 1);
+    if (o) {
+      json_tokener_reset(mTokener);
+      mPartial = false;
+      deliver(o);
+    }
+    else {
+      return Error::err<JsonError>(json_tokener_error_parse_eof, "incomplete JSON at end of body");
+    }
+  }
+  return ErrorPtr();
+}
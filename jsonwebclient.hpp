@@ -42,6 +42,124 @@ namespace p44 {
   typedef boost::function<void (JsonObjectPtr aJsonResponse, ErrorPtr aError)> JsonWebClientCB;
 
 
+  /// callback for JSON values parsed from a streamed body
+  typedef boost::function<void (JsonObjectPtr aJsonObject)> JsonBodyValueCB;
+
+  /// body sink for HttpComm::httpDownload() which parses JSON incrementally as data arrives
+  /// @note the body can be a single JSON value, or a stream of concatenated or newline delimited JSON values,
+  ///   each of which is passed to the callback as soon as it is complete. Only the JSON value being
+  ///   parsed is kept in memory.
+  class JsonBodySink : public HttpBodySink
+  {
+    JsonBodyValueCB mValueCB;
+    struct json_tokener *mTokener;
+    bool mPartial; ///< set when tokener has received non-whitespace data of an incomplete value
+    size_t mValues;
+
+  public:
+
+    JsonBodySink(JsonBodyValueCB aValueCB);
+    virtual ~JsonBodySink();
+
+    virtual bool bodyData(const uint8_t *aData, size_t aSize, ErrorPtr &aError) P44_OVERRIDE;
+    virtual ErrorPtr bodyEnd() P44_OVERRIDE;
+
+    /// @return number of JSON values parsed so far
+    size_t values() { return mValues; };
+
+  private:
+
+    void deliver(struct json_object *aObj);
+
+  };
+
+
+  class JsonWebCache;
+  typedef boost::intrusive_ptr<JsonWebCache> JsonWebCachePtr;
+
+  /// cache for parsed JSON responses of GET requests made by JsonWebClient
+  /// - entries are kept in memory, with the least recently used ones evicted when entry count or size limits are exceeded
+  /// - freshness is determined from Cache-Control max-age (or Expires), "no-store" responses are never cached
+  /// - stale entries are revalidated with If-None-Match/If-Modified-Since, a 304 answer returns the cached object
+  /// - callers always receive their own copy of the cached object
+  /// - optionally, entries are persisted as files so they survive restarts
+  /// @note one cache can be shared by multiple JsonWebClient instances
+  class JsonWebCache : public P44Obj
+  {
+    friend class JsonWebClient;
+
+    typedef std::list<string> LRUList;
+
+    typedef struct {
+      JsonObjectPtr json; ///< the parsed response
+      string etag; ///< ETag validator, empty if none
+      string lastModified; ///< Last-Modified validator, empty if none
+      MLMicroSeconds expires; ///< unix time until which the entry is fresh, 0 if it must always be revalidated
+      size_t size; ///< approximate memory footprint (size of the response body)
+      LRUList::iterator lruPos; ///< position in the LRU list
+    } Entry;
+    typedef std::map<string, Entry> EntryMap;
+
+    EntryMap mEntries;
+    LRUList mLRU; ///< keys, most recently used first
+    size_t mMaxEntries;
+    size_t mMaxBytes;
+    size_t mBytes;
+    string mPersistDir; ///< directory for persisted entries, empty if not persisting
+
+    // statistics
+    long mHits;
+    long mRevalidations;
+    long mMisses;
+    long mEvictions;
+
+  public:
+
+    /// create a cache
+    /// @param aMaxEntries max number of entries kept in memory
+    /// @param aMaxBytes max total size of the response bodies kept in memory
+    JsonWebCache(size_t aMaxEntries = 100, size_t aMaxBytes = 1024*1024);
+    virtual ~JsonWebCache();
+
+    /// set cache size limits
+    /// @param aMaxEntries max number of entries kept in memory
+    /// @param aMaxBytes max total size of the response bodies kept in memory
+    void setLimits(size_t aMaxEntries, size_t aMaxBytes);
+
+    /// enable or disable persisting cache entries to files
+    /// @param aDir directory to store entries in. If empty, "jsonwebcache" in the application's temp directory
+    ///   is used. Pass NULL to disable persistence
+    /// @return error if directory could not be created
+    ErrorPtr setPersistence(const char *aDir = "");
+
+    /// forget all cached entries (including persisted ones)
+    void clear();
+
+    /// @name statistics
+    /// @{
+    long hits() { return mHits; }; ///< number of requests answered from cache without contacting the server
+    long revalidations() { return mRevalidations; }; ///< number of requests answered from cache after a 304 response
+    long misses() { return mMisses; }; ///< number of requests that needed a full response
+    long evictions() { return mEvictions; }; ///< number of entries evicted due to size limits
+    size_t entries() { return mEntries.size(); }; ///< number of entries in memory
+    size_t bytes() { return mBytes; }; ///< total size of entries in memory
+    /// @}
+
+  private:
+
+    Entry* lookup(const string &aKey);
+    void store(const string &aKey, JsonObjectPtr aJson, size_t aSize, const HttpHeaderMap &aHeaders);
+    void refresh(Entry &aEntry, const HttpHeaderMap &aHeaders);
+    void remove(const string &aKey);
+    void enforceLimits();
+    string persistPath(const string &aKey);
+    void persist(const string &aKey, const Entry &aEntry);
+    Entry* load(const string &aKey);
+    static void freshness(const HttpHeaderMap &aHeaders, bool &aNoStore, MLMicroSeconds &aExpires);
+
+  };
+
+
   /// wrapper for non-blocking http client communication
   /// @note this class' implementation is not suitable for handling huge http requests and answers. It is
   ///   intended for accessing web APIs with short messages.
@@ -51,6 +169,12 @@ namespace p44 {
 
     JsonWebClientCB mJsonResponseCallback;
 
+    JsonWebCachePtr mCache;
+    string mCacheKey; ///< key of the request being checked against the cache
+    string mCacheURL; ///< URL of the request being checked against the cache
+    bool mRevalidating; ///< set when the request carries validators of a cached entry
+    MLTicket mCacheTicket;
+
   public:
 
     JsonWebClient(MainLoop &aMainLoop = MainLoop::currentMainLoop());
@@ -78,11 +202,28 @@ namespace p44 {
     ///   If false, aHttpCallback will not be called
     bool jsonReturningRequest(const char *aURL, JsonWebClientCB aResponseCallback, const char *aMethod = "POST", const string &aPostData = "", const char* aContentType = NULL, bool aSaveHeaders = false);
 
+    /// use a response cache for GET requests without request body
+    /// @param aCache the cache to use, NULL to disable caching
+    /// @note requests with credentials (http auth, Authorization or Cookie headers) are never cached,
+    ///   other request headers are part of the cache key
+    void setCache(JsonWebCachePtr aCache) { mCache = aCache; };
+
+    /// @return the cache in use, NULL if none
+    JsonWebCachePtr getCache() { return mCache; };
+
+    /// terminate any request in progress (including answers from the cache)
+    virtual void terminate() P44_OVERRIDE;
+
   protected:
 
     virtual const char *defaultContentType() { return CONTENT_TYPE_JSON; };
 
-    virtual void requestThreadSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode);
+    virtual void requestCompleted() P44_OVERRIDE;
+
+  private:
+
+    void cachedAnswer(JsonObjectPtr aJson);
+    string cacheKeyFor(const char *aURL);
 
   };
 
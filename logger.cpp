@@ -24,6 +24,22 @@
 
 #include "utils.hpp"
 
+#if ENABLE_LOG_ASYNC || ENABLE_LOG_ROTATION
+  #include <sys/uio.h>
+#endif
+#if ENABLE_LOG_ASYNC
+  #include <atomic>
+  #include <signal.h>
+#endif
+#if ENABLE_LOG_ROTATION
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #if ENABLE_LOG_COMPRESSION
+    #include <zlib.h>
+    #include <deque>
+  #endif
+#endif
+
 using namespace p44;
 
 // MARK: - C interface for logging
@@ -38,15 +54,768 @@ extern "C" {
 }
 
 
+// MARK: - RotatingLogFile
+
+#if ENABLE_LOG_ROTATION
+
+namespace p44 {
+
+  /// size-bounded log file, preallocated and written via a shared memory map, rotated when full
+  class RotatingLogFile
+  {
+  public:
+    RotatingLogFile(const string& aPath, size_t aMaxSize, int aMaxFiles, bool aCompress);
+    ~RotatingLogFile();
+
+    /// open the log file, continue after existing content
+    bool open();
+
+    /// write data that must go into the same segment
+    void write(const struct iovec* aIov, int aIovCnt);
+
+    /// sync written data to disk
+    void sync();
+
+    /// get the file descriptor for writing directly from a signal handler
+    /// @param aBytes number of bytes that will be written to the returned fd
+    /// @return fd positioned at the end of the content, or -1 if none
+    /// @note never rotates, so the current segment might grow beyond its max size. The next open() or write() will rotate it.
+    int emergencyFd(size_t aBytes);
+
+  private:
+    string mPath;
+    size_t mMaxSize;
+    int mMaxFiles;
+    bool mCompress;
+    int mFd;
+    uint8_t* mMap;
+    size_t mUsed; ///< bytes used in the current segment
+    size_t mSynced; ///< bytes synced to disk in the current segment
+    #if ENABLE_LOG_COMPRESSION
+    // rotated segments are renamed to a unique pending name by rotate(), and shifted into place and
+    // compressed by a background thread, so the logging thread never waits for compression.
+    pthread_t mCompressThread;
+    bool mCompressThreadRunning;
+    pthread_mutex_t mJobMutex;
+    pthread_cond_t mJobCond;
+    std::deque<string> mPendingSegments; ///< paths of rotated segments not yet shifted into place and compressed
+    bool mTerminate; ///< set to make the background thread exit after processing all pending segments
+    long mPendingSeq; ///< sequence number for unique pending segment names
+    static void* compressThreadRoutine(void* aArg);
+    void compressThread();
+    void compressSegment(const string& aPath);
+    #endif
+
+    void close();
+    void rotate();
+    void shiftSegments();
+    string segmentPath(int aIndex);
+  };
+
+} // namespace p44
+
+
+RotatingLogFile::RotatingLogFile(const string& aPath, size_t aMaxSize, int aMaxFiles, bool aCompress) :
+  mPath(aPath),
+  mMaxSize(aMaxSize),
+  mMaxFiles(aMaxFiles),
+  mCompress(aCompress),
+  mFd(-1),
+  mMap(NULL),
+  mUsed(0),
+  mSynced(0)
+  #if ENABLE_LOG_COMPRESSION
+  ,mCompressThreadRunning(false)
+  ,mTerminate(false)
+  ,mPendingSeq(0)
+  #endif
+{
+  if (mMaxSize<4096) mMaxSize = 4096;
+  #if ENABLE_LOG_COMPRESSION
+  pthread_mutex_init(&mJobMutex, NULL);
+  pthread_cond_init(&mJobCond, NULL);
+  #endif
+}
+
+
+RotatingLogFile::~RotatingLogFile()
+{
+  close();
+  #if ENABLE_LOG_COMPRESSION
+  if (mCompressThreadRunning) {
+    // background thread finishes all pending segments before exiting
+    pthread_mutex_lock(&mJobMutex);
+    mTerminate = true;
+    pthread_cond_signal(&mJobCond);
+    pthread_mutex_unlock(&mJobMutex);
+    pthread_join(mCompressThread, NULL);
+  }
+  pthread_cond_destroy(&mJobCond);
+  pthread_mutex_destroy(&mJobMutex);
+  #endif
+}
+
+
+string RotatingLogFile::segmentPath(int aIndex)
+{
+  if (aIndex==0) return mPath;
+  return string_format("%s.%d", mPath.c_str(), aIndex);
+}
+
+
+bool RotatingLogFile::open()
+{
+  mFd = ::open(mPath.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+  if (mFd<0) return false;
+  struct stat st;
+  if (fstat(mFd, &st)<0) { ::close(mFd); mFd = -1; return false; }
+  size_t existing = (size_t)st.st_size;
+  if (existing>mMaxSize) {
+    // existing file is larger than segment size, rotate first
+    ::close(mFd); mFd = -1;
+    rotate();
+    return mFd>=0;
+  }
+  // preallocate the entire segment, so writing via the map cannot fail later (SIGBUS on full disk)
+  #ifdef __linux__
+  if (posix_fallocate(mFd, 0, mMaxSize)!=0)
+  #endif
+  {
+    if (ftruncate(mFd, mMaxSize)<0) { ::close(mFd); mFd = -1; return false; }
+  }
+  mMap = (uint8_t*)mmap(NULL, mMaxSize, PROT_READ|PROT_WRITE, MAP_SHARED, mFd, 0);
+  if (mMap==MAP_FAILED) {
+    mMap = NULL;
+    mUsed = existing; // close() restores original size
+    close();
+    return false;
+  }
+  // find the end of the existing content: a file not properly closed has trailing NULs
+  mUsed = existing;
+  while (mUsed>0 && mMap[mUsed-1]==0) mUsed--;
+  mSynced = mUsed;
+  return true;
+}
+
+
+void RotatingLogFile::close()
+{
+  if (mMap) {
+    msync(mMap, mMaxSize, MS_SYNC);
+    munmap(mMap, mMaxSize);
+    mMap = NULL;
+  }
+  if (mFd>=0) {
+    // remove the preallocated but unused part
+    if (ftruncate(mFd, mUsed)<0) { /* nothing we can do */ }
+    ::close(mFd);
+    mFd = -1;
+  }
+  mUsed = 0;
+  mSynced = 0;
+}
+
+
+void RotatingLogFile::write(const struct iovec* aIov, int aIovCnt)
+{
+  size_t total = 0;
+  for (int i=0; i<aIovCnt; i++) total += aIov[i].iov_len;
+  if (!mMap || total==0) return;
+  if (mUsed+total>mMaxSize) {
+    rotate();
+    if (!mMap) return;
+  }
+  for (int i=0; i<aIovCnt && mUsed<mMaxSize; i++) {
+    size_t n = aIov[i].iov_len;
+    if (mUsed+n>mMaxSize) n = mMaxSize-mUsed; // oversize line in a fresh segment, truncate
+    memcpy(mMap+mUsed, aIov[i].iov_base, n);
+    mUsed += n;
+  }
+}
+
+
+void RotatingLogFile::sync()
+{
+  if (!mMap || mUsed==mSynced) return;
+  // sync from the page containing the first unsynced byte
+  long pageSize = sysconf(_SC_PAGESIZE);
+  size_t from = mSynced - mSynced%pageSize;
+  msync(mMap+from, mUsed-from, MS_SYNC);
+  mSynced = mUsed;
+}
+
+
+int RotatingLogFile::emergencyFd(size_t aBytes)
+{
+  // only async-signal-safe calls here
+  if (mFd<0 || lseek(mFd, (off_t)mUsed, SEEK_SET)<0) return -1;
+  mUsed += aBytes; // the map shares the page cache with the fd, so later writes via the map continue after these bytes
+  return mFd;
+}
+
+
+void RotatingLogFile::rotate()
+{
+  close();
+  #if ENABLE_LOG_COMPRESSION
+  if (mCompress && mMaxFiles>1) {
+    if (!mCompressThreadRunning) {
+      mCompressThreadRunning = pthread_create(&mCompressThread, NULL, compressThreadRoutine, this)==0;
+    }
+    if (mCompressThreadRunning) {
+      // just move the full segment out of the way, the background thread does the rest
+      string pending = string_format("%s.pending%ld", mPath.c_str(), ++mPendingSeq);
+      if (rename(mPath.c_str(), pending.c_str())==0) {
+        pthread_mutex_lock(&mJobMutex);
+        mPendingSegments.push_back(pending);
+        pthread_cond_signal(&mJobCond);
+        pthread_mutex_unlock(&mJobMutex);
+      }
+      else {
+        unlink(mPath.c_str());
+      }
+      open();
+      return;
+    }
+  }
+  #endif
+  shiftSegments();
+  if (mMaxFiles>1) {
+    rename(mPath.c_str(), segmentPath(1).c_str());
+  }
+  else {
+    unlink(mPath.c_str());
+  }
+  // start new segment
+  open();
+}
+
+
+void RotatingLogFile::shiftSegments()
+{
+  // drop the oldest, shift the others
+  for (int i=mMaxFiles-1; i>0; i--) {
+    string p = segmentPath(i);
+    if (i==mMaxFiles-1) {
+      unlink(p.c_str());
+      unlink((p+".gz").c_str());
+    }
+    else {
+      rename(p.c_str(), segmentPath(i+1).c_str());
+      rename((p+".gz").c_str(), (segmentPath(i+1)+".gz").c_str());
+    }
+  }
+}
+
+
+#if ENABLE_LOG_COMPRESSION
+
+void* RotatingLogFile::compressThreadRoutine(void* aArg)
+{
+  static_cast<RotatingLogFile*>(aArg)->compressThread();
+  return NULL;
+}
+
+
+void RotatingLogFile::compressThread()
+{
+  // Note: this thread is the only one renaming numbered segments while compression is enabled
+  pthread_mutex_lock(&mJobMutex);
+  while (true) {
+    if (mPendingSegments.empty()) {
+      if (mTerminate) break;
+      pthread_cond_wait(&mJobCond, &mJobMutex);
+      continue;
+    }
+    string pending = mPendingSegments.front();
+    mPendingSegments.pop_front();
+    pthread_mutex_unlock(&mJobMutex);
+    shiftSegments();
+    string seg = segmentPath(1);
+    if (rename(pending.c_str(), seg.c_str())==0) compressSegment(seg);
+    else unlink(pending.c_str());
+    pthread_mutex_lock(&mJobMutex);
+  }
+  pthread_mutex_unlock(&mJobMutex);
+}
+
+
+void RotatingLogFile::compressSegment(const string& aPath)
+{
+  string tmpPath = aPath + ".gz.tmp";
+  FILE* in = fopen(aPath.c_str(), "rb");
+  gzFile out = gzopen(tmpPath.c_str(), "wb");
+  bool ok = in && out;
+  if (ok) {
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in))>0) {
+      if (gzwrite(out, buf, (unsigned)n)!=(int)n) { ok = false; break; }
+    }
+  }
+  if (in) fclose(in);
+  if (out && gzclose(out)!=Z_OK) ok = false;
+  if (ok) {
+    // only replace the uncompressed file once the compressed one is complete
+    rename(tmpPath.c_str(), (aPath+".gz").c_str());
+    unlink(aPath.c_str());
+  }
+  else {
+    unlink(tmpPath.c_str());
+  }
+}
+
+#endif // ENABLE_LOG_COMPRESSION
+
+#endif // ENABLE_LOG_ROTATION
+
+
+// MARK: - AsyncLogBuffer
+
+#if ENABLE_LOG_ASYNC
+
+namespace p44 {
+
+  /// ring buffer for log lines, filled by the logging threads (serialized by Logger::mReportMutex),
+  /// and emptied by a dedicated writer thread. Producer and consumer only synchronize via
+  /// the atomic head/tail positions, so logging never waits for I/O.
+  class AsyncLogBuffer
+  {
+  public:
+
+    enum {
+      target_file = 0x01,
+      target_stderr = 0x02,
+      target_stdout = 0x04,
+      numTargets = 3
+    };
+
+    AsyncLogBuffer(Logger& aLogger, size_t aBufferSize, LogOverflowPolicy aOverflowPolicy);
+    ~AsyncLogBuffer();
+
+    /// start the writer thread
+    bool start();
+
+    /// stop the writer thread after all pending lines are written
+    void stop();
+
+    /// put a line into the buffer
+    /// @param aUrgent if set, the writer thread is woken immediately, otherwise only when the buffer fills up
+    ///   or the writer's idle interval expires
+    /// @return false if the line had to be dropped
+    bool put(uint8_t aTargets, const char* aLinePrefix, const char* aLogMessage, bool aUrgent);
+
+    /// wait until all lines put so far have been written
+    void flush();
+
+    /// write pending lines from the calling thread (for crash handlers)
+    void emergencyFlush();
+
+    uint64_t dropped() { return mDropped.load(); }
+
+  private:
+
+    // record header, records are 8-byte aligned
+    typedef struct {
+      uint32_t len; ///< length of the text (without header), or padMarker
+      uint8_t targets; ///< target_xxx bits
+      uint8_t urgent; ///< set if line should be synced to disk immediately
+      uint8_t reserved[2];
+    } RecordHeader;
+
+    static const uint32_t padMarker = 0xFFFFFFFF; ///< record header len marking unused space up to the end of the buffer
+    static const int maxBatch = 64; ///< max number of lines written per writev() call
+    static const long idleWaitMs = 20; ///< max time non-urgent lines might wait in the buffer
+
+    Logger& mLogger;
+    uint8_t* mBuffer;
+    size_t mSize;
+    LogOverflowPolicy mOverflowPolicy;
+    std::atomic<uint64_t> mHead; ///< write position, only modified by producers
+    std::atomic<uint64_t> mTail; ///< read position, only modified by the writer thread
+    std::atomic<uint64_t> mDropped; ///< number of dropped lines
+    uint64_t mReportedDropped; ///< number of dropped lines already reported in the log (writer thread only)
+    std::atomic<bool> mWriterWaiting; ///< set while writer thread is waiting for new lines
+    std::atomic<bool> mTerminate; ///< set to make writer thread exit
+    pthread_mutex_t mWaitMutex;
+    pthread_cond_t mWakeCond; ///< signalled when new lines are available or termination is requested
+    pthread_cond_t mSpaceCond; ///< signalled when the writer thread has freed space in the buffer
+    pthread_t mWriterThread;
+    bool mRunning;
+
+    static size_t recordSize(size_t aTextLen) { return (sizeof(RecordHeader)+aTextLen+7) & ~(size_t)7; }
+    static void* writerThreadRoutine(void* aArg);
+    void writerThread();
+    uint64_t writeRecords(uint64_t aFrom, uint64_t aTo, bool aReportDropped, bool aEmergency);
+    int targetFd(int aTargetIdx); ///< fd for stderr/stdout targets, log file (target 0) is accessed under mFileMutex
+    void wakeWriter();
+    static void timedWait(pthread_cond_t& aCond, pthread_mutex_t& aMutex, long aMillis);
+    static void writeAll(int aFd, struct iovec* aIov, int aIovCnt);
+
+  };
+
+} // namespace p44
+
+
+AsyncLogBuffer::AsyncLogBuffer(Logger& aLogger, size_t aBufferSize, LogOverflowPolicy aOverflowPolicy) :
+  mLogger(aLogger),
+  mOverflowPolicy(aOverflowPolicy),
+  mHead(0),
+  mTail(0),
+  mDropped(0),
+  mReportedDropped(0),
+  mWriterWaiting(false),
+  mTerminate(false),
+  mRunning(false)
+{
+  mSize = aBufferSize & ~(size_t)7;
+  if (mSize<1024) mSize = 1024;
+  mBuffer = new uint8_t[mSize];
+  pthread_mutex_init(&mWaitMutex, NULL);
+  pthread_cond_init(&mWakeCond, NULL);
+  pthread_cond_init(&mSpaceCond, NULL);
+}
+
+
+AsyncLogBuffer::~AsyncLogBuffer()
+{
+  stop();
+  pthread_cond_destroy(&mSpaceCond);
+  pthread_cond_destroy(&mWakeCond);
+  pthread_mutex_destroy(&mWaitMutex);
+  delete[] mBuffer;
+}
+
+
+bool AsyncLogBuffer::start()
+{
+  mTerminate = false;
+  mRunning = pthread_create(&mWriterThread, NULL, writerThreadRoutine, this)==0;
+  return mRunning;
+}
+
+
+void AsyncLogBuffer::stop()
+{
+  if (!mRunning) return;
+  mTerminate = true;
+  wakeWriter();
+  pthread_join(mWriterThread, NULL); // writer thread writes all pending lines before exiting
+  mRunning = false;
+}
+
+
+void AsyncLogBuffer::timedWait(pthread_cond_t& aCond, pthread_mutex_t& aMutex, long aMillis)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += aMillis*1000000l;
+  ts.tv_sec += ts.tv_nsec/1000000000l;
+  ts.tv_nsec %= 1000000000l;
+  pthread_cond_timedwait(&aCond, &aMutex, &ts);
+}
+
+
+void AsyncLogBuffer::wakeWriter()
+{
+  pthread_mutex_lock(&mWaitMutex);
+  pthread_cond_signal(&mWakeCond);
+  pthread_mutex_unlock(&mWaitMutex);
+}
+
+
+bool AsyncLogBuffer::put(uint8_t aTargets, const char* aLinePrefix, const char* aLogMessage, bool aUrgent)
+{
+  size_t pl = strlen(aLinePrefix);
+  size_t ml = strlen(aLogMessage);
+  size_t maxText = mSize/4-sizeof(RecordHeader);
+  if (pl+ml+1>maxText) {
+    // truncate overly long lines, we don't want single lines to monopolize the buffer
+    if (pl>maxText/2) pl = maxText/2;
+    ml = maxText-pl-1;
+  }
+  size_t textLen = pl+ml+1; // including LF
+  size_t need = recordSize(textLen);
+  uint64_t head = mHead.load(std::memory_order_relaxed);
+  size_t offs = head % mSize;
+  size_t pad = offs+need>mSize ? mSize-offs : 0; // record must be contiguous, skip the end of the buffer if needed
+  while (mSize-(head-mTail.load(std::memory_order_acquire)) < need+pad) {
+    // buffer full
+    if (mOverflowPolicy==logoverflow_drop || !mRunning) {
+      mDropped++;
+      if (mWriterWaiting.load()) wakeWriter();
+      return false;
+    }
+    // block until writer thread has made room
+    pthread_mutex_lock(&mWaitMutex);
+    pthread_cond_signal(&mWakeCond);
+    if (mSize-(head-mTail.load(std::memory_order_acquire)) < need+pad) {
+      timedWait(mSpaceCond, mWaitMutex, 10);
+    }
+    pthread_mutex_unlock(&mWaitMutex);
+  }
+  if (pad) {
+    RecordHeader* hP = (RecordHeader*)(mBuffer+offs);
+    hP->len = padMarker;
+    head += pad;
+    offs = 0;
+  }
+  RecordHeader* hP = (RecordHeader*)(mBuffer+offs);
+  hP->len = (uint32_t)textLen;
+  hP->targets = aTargets;
+  hP->urgent = aUrgent;
+  char* p = (char*)(hP+1);
+  memcpy(p, aLinePrefix, pl); p += pl;
+  memcpy(p, aLogMessage, ml); p += ml;
+  *p = '\n';
+  head += need;
+  mHead.store(head, std::memory_order_release);
+  // waking the writer for every line would cost more than the output itself, so batch lines unless urgent
+  if (mWriterWaiting.load() && (aUrgent || head-mTail.load(std::memory_order_relaxed)>mSize/4)) wakeWriter();
+  return true;
+}
+
+
+void AsyncLogBuffer::flush()
+{
+  pthread_mutex_lock(&mWaitMutex);
+  while (mRunning && mTail.load()!=mHead.load()) {
+    pthread_cond_signal(&mWakeCond);
+    timedWait(mSpaceCond, mWaitMutex, 10);
+  }
+  pthread_mutex_unlock(&mWaitMutex);
+}
+
+
+void AsyncLogBuffer::emergencyFlush()
+{
+  // Note: the writer thread might be writing some of these lines at the same time,
+  //   so a few lines might appear twice. Better than losing the lines explaining a crash.
+  uint64_t tail = mTail.load();
+  mTail.store(writeRecords(tail, mHead.load(), false, true));
+}
+
+
+int AsyncLogBuffer::targetFd(int aTargetIdx)
+{
+  switch (aTargetIdx) {
+    case 1: return STDERR_FILENO;
+    case 2: return STDOUT_FILENO;
+  }
+  return -1;
+}
+
+
+void AsyncLogBuffer::writeAll(int aFd, struct iovec* aIov, int aIovCnt)
+{
+  while (aIovCnt>0) {
+    ssize_t n = writev(aFd, aIov, aIovCnt);
+    if (n<0) {
+      if (errno==EINTR || errno==EAGAIN) continue;
+      return; // output is broken, nothing we can do about it
+    }
+    // skip fully written iovecs, adjust partially written one
+    while (aIovCnt>0 && (size_t)n>=aIov->iov_len) {
+      n -= aIov->iov_len;
+      aIov++; aIovCnt--;
+    }
+    if (aIovCnt>0) {
+      aIov->iov_base = (uint8_t*)aIov->iov_base+n;
+      aIov->iov_len -= n;
+    }
+  }
+}
+
+
+uint64_t AsyncLogBuffer::writeRecords(uint64_t aFrom, uint64_t aTo, bool aReportDropped, bool aEmergency)
+{
+  struct iovec iovs[numTargets][maxBatch+1];
+  int cnt[numTargets] = { 0, 0, 0 };
+  char droppedMsg[80];
+  int lines = 0;
+  bool syncFile = false;
+  while (aFrom<aTo && lines<maxBatch) {
+    size_t offs = aFrom % mSize;
+    RecordHeader* hP = (RecordHeader*)(mBuffer+offs);
+    if (hP->len==padMarker) {
+      aFrom += mSize-offs;
+      continue;
+    }
+    if (aReportDropped && lines==0) {
+      uint64_t dropped = mDropped.load();
+      if (dropped>mReportedDropped) {
+        // report dropped lines in front of the first line written after the overflow
+        size_t l = snprintf(droppedMsg, sizeof(droppedMsg), "*** %llu log lines dropped (async log buffer full) ***\n", (unsigned long long)(dropped-mReportedDropped));
+        mReportedDropped = dropped;
+        for (int t=0; t<numTargets; t++) {
+          if (hP->targets & (1<<t)) {
+            iovs[t][cnt[t]].iov_base = droppedMsg;
+            iovs[t][cnt[t]].iov_len = l;
+            cnt[t]++;
+          }
+        }
+      }
+    }
+    for (int t=0; t<numTargets; t++) {
+      if (hP->targets & (1<<t)) {
+        iovs[t][cnt[t]].iov_base = hP+1;
+        iovs[t][cnt[t]].iov_len = hP->len;
+        cnt[t]++;
+      }
+    }
+    if (hP->urgent && (hP->targets & target_file)) syncFile = true;
+    aFrom += recordSize(hP->len);
+    lines++;
+  }
+  for (int t=0; t<numTargets; t++) {
+    if (cnt[t]>0) {
+      if (t==0) {
+        // log file might get switched by setLogFile() at any time
+        if (aEmergency) {
+          // must not block in a signal handler, the lock might be held by the crashed thread
+          if (pthread_mutex_trylock(&mLogger.mFileMutex)!=0) {
+            writeAll(STDERR_FILENO, iovs[t], cnt[t]); // better on stderr than lost
+            continue;
+          }
+        }
+        else {
+          pthread_mutex_lock(&mLogger.mFileMutex);
+        }
+        #if ENABLE_LOG_ROTATION
+        if (mLogger.mRotatingLog) {
+          if (aEmergency) {
+            // in a signal handler: rotating or msync() is not safe, just writev() to the current segment
+            size_t bytes = 0;
+            for (int i=0; i<cnt[t]; i++) bytes += iovs[t][i].iov_len;
+            int fd = mLogger.mRotatingLog->emergencyFd(bytes);
+            writeAll(fd>=0 ? fd : STDERR_FILENO, iovs[t], cnt[t]);
+          }
+          else {
+            // rotating log file, write line by line, as each line must go entirely into one segment
+            for (int i=0; i<cnt[t]; i++) mLogger.mRotatingLog->write(&iovs[t][i], 1);
+            if (syncFile) mLogger.mRotatingLog->sync();
+          }
+        }
+        else
+        #endif
+        if (mLogger.mLogFILE) {
+          writeAll(fileno(mLogger.mLogFILE), iovs[t], cnt[t]);
+        }
+        pthread_mutex_unlock(&mLogger.mFileMutex);
+        continue;
+      }
+      int fd = targetFd(t);
+      if (fd>=0) writeAll(fd, iovs[t], cnt[t]);
+    }
+  }
+  return aFrom;
+}
+
+
+void* AsyncLogBuffer::writerThreadRoutine(void* aArg)
+{
+  static_cast<AsyncLogBuffer*>(aArg)->writerThread();
+  return NULL;
+}
+
+
+void AsyncLogBuffer::writerThread()
+{
+  while (true) {
+    uint64_t tail = mTail.load(std::memory_order_relaxed);
+    if (mHead.load(std::memory_order_acquire)==tail) {
+      // nothing to write
+      if (mTerminate.load()) break;
+      pthread_mutex_lock(&mWaitMutex);
+      mWriterWaiting = true;
+      if (mHead.load()==tail && !mTerminate.load()) {
+        timedWait(mWakeCond, mWaitMutex, idleWaitMs);
+      }
+      mWriterWaiting = false;
+      pthread_mutex_unlock(&mWaitMutex);
+      continue;
+    }
+    // write a batch
+    tail = writeRecords(tail, mHead.load(std::memory_order_acquire), true, false);
+    mTail.store(tail, std::memory_order_release);
+    // let blocked producers and flush() know
+    pthread_mutex_lock(&mWaitMutex);
+    pthread_cond_broadcast(&mSpaceCond);
+    pthread_mutex_unlock(&mWaitMutex);
+  }
+}
+
+
+// the logger to flush when a fatal signal occurs
+static Logger* gCrashFlushLogger = NULL;
+
+static void crashFlushHandler(int aSignal)
+{
+  if (gCrashFlushLogger) gCrashFlushLogger->emergencyFlush();
+  // handler is installed with SA_RESETHAND, so re-raising now causes the default action (core dump etc.)
+  raise(aSignal);
+}
+
+
+static void installCrashFlushHandlers()
+{
+  const int fatalSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+  for (size_t i=0; i<sizeof(fatalSignals)/sizeof(int); i++) {
+    struct sigaction act;
+    if (sigaction(fatalSignals[i], NULL, &act)==0 && act.sa_handler==SIG_DFL && (act.sa_flags & SA_SIGINFO)==0) {
+      // not handled otherwise, install our handler
+      memset(&act, 0, sizeof(act));
+      act.sa_handler = crashFlushHandler;
+      act.sa_flags = SA_RESETHAND;
+      sigaction(fatalSignals[i], &act, NULL);
+    }
+  }
+}
+
+#endif // ENABLE_LOG_ASYNC
+
+
 // MARK: - Logger
 
+#define LOG_RATELIMIT_SLOTS 256 // number of call sites tracked for rate limiting (hash table, collisions replace)
+
+/// rate limiting state for one call site
+struct p44::LogRateLimitEntry {
+  const void* source; ///< logging object, NULL for global logging
+  const char* fmt; ///< format string
+  long long windowStartMs; ///< start of the current rate limiting interval
+  int count; ///< lines logged in the current interval
+  long suppressed; ///< lines suppressed in the current interval
+};
+
 p44::Logger globalLogger;
 
 Logger::Logger() :
   mLoggerCB(NoOP),
   mLogFILE(NULL)
+  #if ENABLE_LOG_ROTATION
+  ,mRotatingLog(NULL)
+  ,mRotationMaxSize(0)
+  ,mRotationMaxFiles(3)
+  ,mRotationCompress(false)
+  #endif
+  #if ENABLE_LOG_ASYNC
+  ,mAsyncBuffer(NULL)
+  #endif
+  ,mRateLimitLines(0)
+  ,mRateLimitSeconds(60)
+  ,mRateLimitTable(NULL)
+  ,mSuppressedLines(0)
+  ,mDeduplicate(false)
+  ,mLastLevel(-1)
+  ,mRepeatCount(0)
+  #if ENABLE_LOG_BINARY
+  ,mBinaryFILE(NULL)
+  #endif
 {
   pthread_mutex_init(&mReportMutex, NULL);
+  pthread_mutex_init(&mFileMutex, NULL);
+  pthread_mutex_init(&mRateLimitMutex, NULL);
   gettimeofday(&mLastLogTS, NULL);
   mLogLevel = LOGGER_DEFAULT_LOGLEVEL;
   mStderrLevel = LOG_ERR;
@@ -63,10 +832,15 @@ Logger::Logger() :
 
 Logger::~Logger()
 {
-  if (mLogFILE) {
-    fclose(mLogFILE);
-    mLogFILE = NULL;
-  }
+  flush();
+  #if ENABLE_LOG_ASYNC
+  setAsync(0);
+  #endif
+  #if ENABLE_LOG_BINARY
+  setBinaryLogFile(NULL);
+  #endif
+  setLogFile(NULL);
+  delete[] mRateLimitTable;
 }
 
 #define LOGBUFSIZ 8192
@@ -159,6 +933,9 @@ void Logger::logV(int aErrLevel, bool aAlways, const char *aFmt, va_list aArgs)
 void Logger::log(int aErrLevel, const char *aFmt, ... )
 {
   if (logEnabled(aErrLevel)) {
+    long suppressed;
+    if (!rateLimitAllows(NULL, aFmt, aErrLevel, 0, suppressed)) return;
+    if (suppressed>0) logStr_always(aErrLevel, string_format("%ld similar messages were suppressed (rate limit)", suppressed));
     va_list args;
     va_start(args, aFmt);
     logV(aErrLevel, false, aFmt, args);
@@ -185,10 +962,15 @@ void Logger::logStr_always(int aErrLevel, const string aMessage)
 
 void Logger::contextLogStr_always(int aErrLevel, const string& aContext, const string& aMessage)
 {
-  pthread_mutex_lock(&mReportMutex);
-  // create date + level
   struct timeval t;
   gettimeofday(&t, NULL);
+  contextLogStrAt_always(aErrLevel, aContext, aMessage, t);
+}
+
+
+string Logger::linePrefix(int aErrLevel, const struct timeval& t)
+{
+  // create date + level
   string prefix = string_ftime("[%Y-%m-%d %H:%M:%S", localtime(&t.tv_sec));
   string_format_append(prefix, ".%03d", (int)(t.tv_usec/1000));
   if (mDeltaTime) {
@@ -197,6 +979,39 @@ void Logger::contextLogStr_always(int aErrLevel, const string& aContext, const s
   }
   mLastLogTS = t;
   string_format_append(prefix, " %c] ", levelChars[aErrLevel]);
+  return prefix;
+}
+
+
+void Logger::reportRepeats()
+{
+  // Note: must be called with mReportMutex locked
+  if (mRepeatCount>0) {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    string msg = string_format("last message repeated %ld times", mRepeatCount);
+    mRepeatCount = 0;
+    logOutput_always(mLastLevel, linePrefix(mLastLevel, t).c_str(), msg.c_str());
+  }
+}
+
+
+void Logger::contextLogStrAt_always(int aErrLevel, const string& aContext, const string& aMessage, const struct timeval& t)
+{
+  pthread_mutex_lock(&mReportMutex);
+  if (mDeduplicate) {
+    if (aErrLevel==mLastLevel && aMessage==mLastMessage && aContext==mLastContext) {
+      // same as last line, just count
+      mRepeatCount++;
+      pthread_mutex_unlock(&mReportMutex);
+      return;
+    }
+    reportRepeats();
+    mLastLevel = aErrLevel;
+    mLastContext = aContext;
+    mLastMessage = aMessage;
+  }
+  string prefix = linePrefix(aErrLevel, t);
   // generate empty leading lines, if any
   string::size_type i=0;
   while (i<aMessage.length() && aMessage[i]=='\n') {
@@ -265,6 +1080,33 @@ void Logger::logOutput_always(int aLevel, const char *aLinePrefix, const char *a
     mLoggerCB(aLevel, aLinePrefix, aLogMessage);
     if (!mAllowOther) return;
   }
+  #if ENABLE_LOG_ASYNC
+  if (mAsyncBuffer) {
+    // determine targets the same way as below, but let the writer thread do the output
+    uint8_t targets = 0;
+    bool logFile = hasLogFile();
+    if (logFile) {
+      targets |= AsyncLogBuffer::target_file;
+    }
+    if (!logFile || mAllowOther) {
+      if (aLevel<=mStderrLevel || !mDaemonMode) targets |= AsyncLogBuffer::target_stderr;
+      if (mDaemonMode && (aLevel>mStderrLevel || mErrToStdout)) targets |= AsyncLogBuffer::target_stdout;
+    }
+    if (targets) mAsyncBuffer->put(targets, aLinePrefix, aLogMessage, aLevel<=mStderrLevel);
+    return;
+  }
+  #endif // ENABLE_LOG_ASYNC
+  #if ENABLE_LOG_ROTATION
+  if (mRotatingLog) {
+    struct iovec iov[3];
+    iov[0].iov_base = (void*)aLinePrefix; iov[0].iov_len = strlen(aLinePrefix);
+    iov[1].iov_base = (void*)aLogMessage; iov[1].iov_len = strlen(aLogMessage);
+    iov[2].iov_base = (void*)"\n"; iov[2].iov_len = 1;
+    mRotatingLog->write(iov, 3);
+    if (aLevel<=mStderrLevel) mRotatingLog->sync();
+    if (!mAllowOther) return;
+  }
+  #endif // ENABLE_LOG_ROTATION
   if (mLogFILE) {
     fputs(aLinePrefix, mLogFILE);
     fputs(aLogMessage, mLogFILE);
@@ -293,21 +1135,212 @@ void Logger::logOutput_always(int aLevel, const char *aLinePrefix, const char *a
 }
 
 
+void Logger::setRateLimit(int aMaxLines, int aIntervalSeconds)
+{
+  pthread_mutex_lock(&mRateLimitMutex);
+  if (aMaxLines>0 && !mRateLimitTable) {
+    mRateLimitTable = new LogRateLimitEntry[LOG_RATELIMIT_SLOTS];
+    memset(mRateLimitTable, 0, sizeof(LogRateLimitEntry)*LOG_RATELIMIT_SLOTS);
+  }
+  mRateLimitSeconds = aIntervalSeconds>0 ? aIntervalSeconds : 1;
+  mRateLimitLines = aMaxLines>0 ? aMaxLines : 0;
+  pthread_mutex_unlock(&mRateLimitMutex);
+}
+
+
+bool Logger::rateLimitAllows(const void* aSource, const char* aFmt, int aLevel, int aLevelOffset, long& aSuppressed)
+{
+  aSuppressed = 0;
+  if (mRateLimitLines<=0 || aLevel<LOG_ERR || aLevelOffset>0) return true; // not limited
+  int maxLines = mRateLimitLines;
+  if (aLevelOffset<0) {
+    maxLines /= 1-aLevelOffset;
+    if (maxLines<1) maxLines = 1;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  long long nowMs = (long long)ts.tv_sec*1000+ts.tv_nsec/1000000;
+  // the format string pointer identifies the call site (format strings are usually literals)
+  size_t slot = (((uintptr_t)aFmt>>2) ^ ((uintptr_t)aSource>>4)*31) % LOG_RATELIMIT_SLOTS;
+  pthread_mutex_lock(&mRateLimitMutex);
+  LogRateLimitEntry& e = mRateLimitTable[slot];
+  if (e.source!=aSource || e.fmt!=aFmt) {
+    // new call site for this slot (suppressed count of a previous one is lost, but still in mSuppressedLines)
+    e.source = aSource;
+    e.fmt = aFmt;
+    e.windowStartMs = nowMs;
+    e.count = 0;
+    e.suppressed = 0;
+  }
+  else if (nowMs-e.windowStartMs>=(long long)mRateLimitSeconds*1000) {
+    // new interval
+    aSuppressed = e.suppressed;
+    e.windowStartMs = nowMs;
+    e.count = 0;
+    e.suppressed = 0;
+  }
+  bool allowed = e.count<maxLines;
+  if (allowed) {
+    e.count++;
+  }
+  else {
+    e.suppressed++;
+    mSuppressedLines++;
+  }
+  pthread_mutex_unlock(&mRateLimitMutex);
+  return allowed;
+}
+
+
+void Logger::setDeduplicate(bool aDeduplicate)
+{
+  pthread_mutex_lock(&mReportMutex);
+  if (!aDeduplicate) reportRepeats();
+  mDeduplicate = aDeduplicate;
+  mLastLevel = -1;
+  mLastContext.clear();
+  mLastMessage.clear();
+  pthread_mutex_unlock(&mReportMutex);
+}
+
+
+void Logger::flush()
+{
+  pthread_mutex_lock(&mReportMutex);
+  reportRepeats();
+  #if ENABLE_LOG_BINARY
+  if (mBinaryFILE) fflush(mBinaryFILE);
+  #endif
+  pthread_mutex_unlock(&mReportMutex);
+  #if ENABLE_LOG_ASYNC
+  if (mAsyncBuffer) {
+    mAsyncBuffer->flush();
+  }
+  else
+  #endif
+  {
+    pthread_mutex_lock(&mFileMutex);
+    if (mLogFILE) fflush(mLogFILE);
+    pthread_mutex_unlock(&mFileMutex);
+    fflush(stderr);
+    fflush(stdout);
+  }
+  #if ENABLE_LOG_ROTATION
+  pthread_mutex_lock(&mFileMutex);
+  if (mRotatingLog) mRotatingLog->sync();
+  pthread_mutex_unlock(&mFileMutex);
+  #endif
+}
+
+
+#if ENABLE_LOG_ASYNC
+
+void Logger::setAsync(size_t aBufferSize, LogOverflowPolicy aOverflowPolicy, bool aFlushOnCrash)
+{
+  pthread_mutex_lock(&mReportMutex);
+  if (mAsyncBuffer) {
+    // stop current async mode, writes out all pending lines
+    if (gCrashFlushLogger==this) gCrashFlushLogger = NULL;
+    delete mAsyncBuffer;
+    mAsyncBuffer = NULL;
+  }
+  if (aBufferSize>0) {
+    // make sure nothing remains in stdio buffers, async writer bypasses stdio
+    pthread_mutex_lock(&mFileMutex);
+    if (mLogFILE) fflush(mLogFILE);
+    pthread_mutex_unlock(&mFileMutex);
+    fflush(stderr);
+    fflush(stdout);
+    mAsyncBuffer = new AsyncLogBuffer(*this, aBufferSize, aOverflowPolicy);
+    if (!mAsyncBuffer->start()) {
+      // no writer thread, stay synchronous
+      delete mAsyncBuffer;
+      mAsyncBuffer = NULL;
+    }
+    else if (aFlushOnCrash) {
+      gCrashFlushLogger = this;
+      installCrashFlushHandlers();
+    }
+  }
+  pthread_mutex_unlock(&mReportMutex);
+}
+
+
+uint64_t Logger::droppedLines()
+{
+  return mAsyncBuffer ? mAsyncBuffer->dropped() : 0;
+}
+
+
+void Logger::emergencyFlush()
+{
+  if (mAsyncBuffer) mAsyncBuffer->emergencyFlush();
+}
+
+#endif // ENABLE_LOG_ASYNC
+
+
+bool Logger::hasLogFile()
+{
+  #if ENABLE_LOG_ROTATION
+  if (mRotatingLog) return true;
+  #endif
+  return mLogFILE!=NULL;
+}
+
+
 void Logger::setLogFile(const char *aLogFilePath, bool aAllowOther)
 {
+  pthread_mutex_lock(&mReportMutex); // no new lines while switching files
+  #if ENABLE_LOG_ASYNC
+  if (mAsyncBuffer) mAsyncBuffer->flush(); // pending lines must go to the previous file
+  #endif
+  pthread_mutex_lock(&mFileMutex); // async writer thread must not use the files while switching
   mAllowOther = aAllowOther;
-  if (aLogFilePath) {
-    mLogFILE = fopen(aLogFilePath, "a");
+  // close previous file
+  #if ENABLE_LOG_ROTATION
+  if (mRotatingLog) {
+    delete mRotatingLog; // finalizes the file
+    mRotatingLog = NULL;
   }
-  else {
-    if (mLogFILE) {
-      fclose(mLogFILE);
-      mLogFILE = NULL;
+  #endif
+  if (mLogFILE) {
+    fclose(mLogFILE);
+    mLogFILE = NULL;
+  }
+  // open new file
+  if (aLogFilePath) {
+    #if ENABLE_LOG_ROTATION
+    if (mRotationMaxSize>0) {
+      mRotatingLog = new RotatingLogFile(aLogFilePath, mRotationMaxSize, mRotationMaxFiles, mRotationCompress);
+      if (!mRotatingLog->open()) {
+        delete mRotatingLog;
+        mRotatingLog = NULL;
+      }
+    }
+    if (!mRotatingLog)
+    #endif
+    {
+      mLogFILE = fopen(aLogFilePath, "a");
     }
   }
+  pthread_mutex_unlock(&mFileMutex);
+  pthread_mutex_unlock(&mReportMutex);
 }
 
 
+#if ENABLE_LOG_ROTATION
+
+void Logger::setLogFileRotation(size_t aMaxSize, int aMaxFiles, bool aCompress)
+{
+  mRotationMaxSize = aMaxSize;
+  mRotationMaxFiles = aMaxFiles<1 ? 1 : aMaxFiles;
+  mRotationCompress = aCompress;
+}
+
+#endif // ENABLE_LOG_ROTATION
+
+
 void Logger::setLogLevel(int aLogLevel)
 {
   if (aLogLevel<LOG_EMERG || aLogLevel>LOG_DEBUG) return;
@@ -330,6 +1363,429 @@ void Logger::setLogHandler(LoggerCB aLoggerCB, bool aAllowOther)
 }
 
 
+// MARK: - binary logging
+
+#if ENABLE_LOG_BINARY
+
+// Binary log file format:
+// - file header: BINLOG_MAGIC
+// - records: uint8_t type, uint32_t payload length, payload
+//   - 'B' (begin session): no payload, call site IDs from previous sessions are no longer valid
+//   - 'S' (call site): uint32_t id, uint8_t level (of first use, informational only), uint32_t line, format string\0, file name\0
+//   - 'L' (log line): uint32_t id, uint8_t level, int64_t seconds, int32_t microseconds, context\0,
+//     followed by the arguments, each as uint8_t kind and data:
+//     - 'i' int64_t, 'u' uint64_t, 'd' double, 'p' uint64_t (pointer), 's' string\0
+// Note: integers are stored in host byte order, so decoding must happen on a host with the same endianness
+
+#define BINLOG_MAGIC "p44blog1"
+#define BINLOG_MAGIC_LEN 8
+#define BINLOG_MAX_CALL_SITE_ID (256*1024) ///< sanity limit for decoding, larger IDs indicate a corrupt file
+
+/// one conversion specification of a printf format string
+typedef struct {
+  const char* start; ///< start of the spec (the %)
+  const char* end; ///< end of the spec (after the conversion char)
+  string flags; ///< flag characters
+  int width; ///< field width, -1 if none, -2 if from argument
+  int precision; ///< precision, -1 if none, -2 if from argument
+  char lengthMod; ///< 0 for int, 'l' long, 'q' long long, 'L' long double, 'z' size_t, 'j' intmax_t, 't' ptrdiff_t
+  char conversion; ///< conversion char
+} FormatSpec;
+
+
+/// find the next conversion spec in a printf format string
+/// @param aP cursor into the format string, will be advanced past the found spec
+/// @param aSpec will be set to the found spec
+/// @return false if no more specs found
+static bool nextFormatSpec(const char*& aP, FormatSpec& aSpec)
+{
+  while (*aP) {
+    if (*aP!='%') { aP++; continue; }
+    aSpec.start = aP++;
+    if (*aP=='%') { aP++; continue; } // literal percent
+    aSpec.flags.clear();
+    while (*aP && strchr("-+ #0'", *aP)) aSpec.flags += *aP++;
+    aSpec.width = -1;
+    if (*aP=='*') { aSpec.width = -2; aP++; }
+    else if (isdigit(*aP)) { aSpec.width = 0; while (isdigit(*aP)) aSpec.width = aSpec.width*10 + (*aP++ - '0'); }
+    aSpec.precision = -1;
+    if (*aP=='.') {
+      aP++;
+      if (*aP=='*') { aSpec.precision = -2; aP++; }
+      else { aSpec.precision = 0; while (isdigit(*aP)) aSpec.precision = aSpec.precision*10 + (*aP++ - '0'); }
+    }
+    aSpec.lengthMod = 0;
+    if (*aP=='h') { aP++; if (*aP=='h') aP++; } // promoted to int anyway
+    else if (*aP=='l') { aP++; aSpec.lengthMod = 'l'; if (*aP=='l') { aP++; aSpec.lengthMod = 'q'; } }
+    else if (*aP && strchr("qLzjt", *aP)) { aSpec.lengthMod = *aP++; }
+    if (!*aP) return false; // incomplete spec at end of format
+    aSpec.conversion = *aP++;
+    aSpec.end = aP;
+    return true;
+  }
+  return false;
+}
+
+
+LogCallSite::LogCallSite(const char* aFmt, const char* aFile, int aLine) :
+  mFmt(aFmt),
+  mFile(aFile),
+  mLine(aLine),
+  mNoContext(false)
+{
+  static pthread_mutex_t sCallSiteMutex = PTHREAD_MUTEX_INITIALIZER;
+  static uint32_t sNextCallSiteId = 0;
+  if (*mFmt=='\r') {
+    mNoContext = true;
+    mFmt++;
+  }
+  pthread_mutex_lock(&sCallSiteMutex);
+  mId = sNextCallSiteId++;
+  pthread_mutex_unlock(&sCallSiteMutex);
+  // analyze format once, so capturing arguments does not need to parse the format again
+  // - type chars: lowercase signed/uppercase unsigned integer of type: i=int, l=long, q=long long,
+  //   z=size_t, j=intmax_t, t=ptrdiff_t; d=double, D=long double, s=string, w=wide string,
+  //   p=pointer, n=ignored pointer, m=strerror(errno) (no argument)
+  const char* p = mFmt;
+  FormatSpec spec;
+  while (nextFormatSpec(p, spec)) {
+    if (spec.width==-2) mArgTypes += 'i';
+    if (spec.precision==-2) mArgTypes += 'i';
+    char lm = spec.lengthMod;
+    switch (spec.conversion) {
+      case 'd': case 'i': case 'c':
+        mArgTypes += lm=='L' ? 'q' : (lm ? lm : 'i');
+        break;
+      case 'o': case 'u': case 'x': case 'X':
+        mArgTypes += toupper(lm=='L' ? 'q' : (lm ? lm : 'i'));
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        mArgTypes += lm=='L' ? 'D' : 'd';
+        break;
+      case 's':
+        mArgTypes += lm=='l' ? 'w' : 's';
+        break;
+      case 'p': mArgTypes += 'p'; break;
+      case 'n': mArgTypes += 'n'; break;
+      case 'm': mArgTypes += 'm'; break;
+      default: break; // unknown conversion, consumes no argument
+    }
+  }
+}
+
+
+static void binAppend(string& aRec, const void* aData, size_t aSize)
+{
+  aRec.append((const char*)aData, aSize);
+}
+
+static void binAppendInt(string& aRec, int64_t aVal)
+{
+  aRec += 'i'; binAppend(aRec, &aVal, sizeof(aVal));
+}
+
+static void binAppendUInt(string& aRec, uint64_t aVal, char aKind = 'u')
+{
+  aRec += aKind; binAppend(aRec, &aVal, sizeof(aVal));
+}
+
+static void binAppendStr(string& aRec, const char* aStr)
+{
+  aRec += 's'; aRec.append(aStr ? aStr : "(null)"); aRec += '\0';
+}
+
+
+static void binWriteRecord(FILE* aFile, char aType, const string& aPayload)
+{
+  uint32_t l = (uint32_t)aPayload.size();
+  fputc(aType, aFile);
+  fwrite(&l, sizeof(l), 1, aFile);
+  fwrite(aPayload.data(), 1, l, aFile);
+}
+
+
+void Logger::logCallSite(LogCallSite& aCallSite, int aErrLevel, const char* aContext, const char* aFmt, ...)
+{
+  long suppressed;
+  if (!rateLimitAllows(NULL, aCallSite.mFmt, aErrLevel, 0, suppressed)) return;
+  if (suppressed>0) {
+    contextLogStr_always(aErrLevel, aContext ? aContext : "", string_format("%ld similar messages were suppressed (rate limit)", suppressed));
+  }
+  va_list args;
+  va_start(args, aFmt);
+  logCallSiteV(aCallSite, aErrLevel, aContext, args);
+  va_end(args);
+}
+
+
+void Logger::logCallSiteV(LogCallSite& aCallSite, int aErrLevel, const char* aContext, va_list aArgs)
+{
+  if (!mBinaryFILE) {
+    // no binary logging, just format now
+    string message;
+    string_format_v(message, false, aCallSite.mFmt, aArgs);
+    contextLogStr_always(aErrLevel, aContext ? aContext : "", message);
+    return;
+  }
+  // capture arguments, as identified by the call site's argument types
+  int savedErrno = errno;
+  string rec;
+  rec.reserve(64);
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  binAppend(rec, &aCallSite.mId, sizeof(aCallSite.mId));
+  uint8_t lvl = aErrLevel; binAppend(rec, &lvl, 1);
+  int64_t secs = t.tv_sec; binAppend(rec, &secs, sizeof(secs));
+  int32_t usecs = (int32_t)t.tv_usec; binAppend(rec, &usecs, sizeof(usecs));
+  rec.append(aContext ? aContext : ""); rec += '\0';
+  for (string::const_iterator pos = aCallSite.mArgTypes.begin(); pos!=aCallSite.mArgTypes.end(); ++pos) {
+    switch (*pos) {
+      case 'i': binAppendInt(rec, va_arg(aArgs, int)); break;
+      case 'I': binAppendUInt(rec, va_arg(aArgs, unsigned int)); break;
+      case 'l': binAppendInt(rec, va_arg(aArgs, long)); break;
+      case 'L': binAppendUInt(rec, va_arg(aArgs, unsigned long)); break;
+      case 'q': binAppendInt(rec, va_arg(aArgs, long long)); break;
+      case 'Q': binAppendUInt(rec, va_arg(aArgs, unsigned long long)); break;
+      case 'z': binAppendInt(rec, va_arg(aArgs, ssize_t)); break;
+      case 'Z': binAppendUInt(rec, va_arg(aArgs, size_t)); break;
+      case 'j': binAppendInt(rec, va_arg(aArgs, intmax_t)); break;
+      case 'J': binAppendUInt(rec, va_arg(aArgs, uintmax_t)); break;
+      case 't': binAppendInt(rec, va_arg(aArgs, ptrdiff_t)); break;
+      case 'T': binAppendUInt(rec, va_arg(aArgs, ptrdiff_t)); break;
+      case 'd': { double d = va_arg(aArgs, double); rec += 'd'; binAppend(rec, &d, sizeof(d)); break; }
+      case 'D': { double d = (double)va_arg(aArgs, long double); rec += 'd'; binAppend(rec, &d, sizeof(d)); break; }
+      case 's': binAppendStr(rec, va_arg(aArgs, const char*)); break;
+      case 'w': va_arg(aArgs, void*); binAppendStr(rec, "(wide string)"); break;
+      case 'p': binAppendUInt(rec, (uintptr_t)va_arg(aArgs, void*), 'p'); break;
+      case 'n': va_arg(aArgs, void*); break;
+      case 'm': binAppendStr(rec, strerror(savedErrno)); break;
+    }
+  }
+  pthread_mutex_lock(&mReportMutex);
+  if (mBinaryFILE) {
+    if (aCallSite.mId>=mBinarySitesWritten.size()) mBinarySitesWritten.resize(aCallSite.mId+1, false);
+    if (!mBinarySitesWritten[aCallSite.mId]) {
+      // first use of this call site in this file and session: write definition
+      string site;
+      binAppend(site, &aCallSite.mId, sizeof(aCallSite.mId));
+      binAppend(site, &lvl, 1);
+      uint32_t line = aCallSite.mLine; binAppend(site, &line, sizeof(line));
+      site.append(aCallSite.mFmt); site += '\0';
+      site.append(aCallSite.mFile); site += '\0';
+      binWriteRecord(mBinaryFILE, 'S', site);
+      mBinarySitesWritten[aCallSite.mId] = true;
+    }
+    binWriteRecord(mBinaryFILE, 'L', rec);
+  }
+  pthread_mutex_unlock(&mReportMutex);
+}
+
+
+bool Logger::setBinaryLogFile(const char* aBinaryLogFilePath)
+{
+  pthread_mutex_lock(&mReportMutex);
+  if (mBinaryFILE) {
+    fclose(mBinaryFILE);
+    mBinaryFILE = NULL;
+  }
+  mBinarySitesWritten.clear();
+  if (aBinaryLogFilePath) {
+    mBinaryFILE = fopen(aBinaryLogFilePath, "ab");
+    if (mBinaryFILE) {
+      if (ftell(mBinaryFILE)==0) {
+        fwrite(BINLOG_MAGIC, 1, BINLOG_MAGIC_LEN, mBinaryFILE);
+      }
+      binWriteRecord(mBinaryFILE, 'B', "");
+    }
+  }
+  bool ok = mBinaryFILE!=NULL || aBinaryLogFilePath==NULL;
+  pthread_mutex_unlock(&mReportMutex);
+  return ok;
+}
+
+
+/// reader for binary log record payloads
+class BinLogReader
+{
+  const string& mData;
+  size_t mPos;
+  bool mOk;
+public:
+  BinLogReader(const string& aData) : mData(aData), mPos(0), mOk(true) {};
+  bool ok() { return mOk; }
+  bool atEnd() { return mPos>=mData.size(); }
+  bool get(void* aDest, size_t aSize)
+  {
+    if (mPos+aSize>mData.size()) { mOk = false; return false; }
+    memcpy(aDest, mData.data()+mPos, aSize);
+    mPos += aSize;
+    return true;
+  }
+  string getStr()
+  {
+    size_t e = mData.find('\0', mPos);
+    if (e==string::npos) { mOk = false; return ""; }
+    string s = mData.substr(mPos, e-mPos);
+    mPos = e+1;
+    return s;
+  }
+  char kind()
+  {
+    char k = 0;
+    get(&k, 1);
+    return k;
+  }
+};
+
+
+/// decoded argument of a binary log record
+typedef struct {
+  char kind;
+  union { int64_t i; uint64_t u; double d; };
+  string s;
+} BinLogArg;
+
+
+static bool readBinLogArg(BinLogReader& aReader, BinLogArg& aArg)
+{
+  if (aReader.atEnd()) return false;
+  aArg.kind = aReader.kind();
+  switch (aArg.kind) {
+    case 'i': return aReader.get(&aArg.i, sizeof(aArg.i));
+    case 'u': case 'p': return aReader.get(&aArg.u, sizeof(aArg.u));
+    case 'd': return aReader.get(&aArg.d, sizeof(aArg.d));
+    case 's': aArg.s = aReader.getStr(); return aReader.ok();
+  }
+  return false;
+}
+
+
+/// format a message from the call site's format and the recorded arguments
+static string formatBinLogMessage(const string& aFmt, BinLogReader& aReader)
+{
+  string msg;
+  const char* fmt = aFmt.c_str();
+  const char* p = fmt;
+  const char* lit = fmt;
+  FormatSpec spec;
+  BinLogArg arg;
+  while (nextFormatSpec(p, spec)) {
+    // literal text before the spec (with %% unescaped)
+    for (const char* q = lit; q<spec.start; q++) {
+      msg += *q;
+      if (*q=='%') q++;
+    }
+    lit = spec.end;
+    // rebuild the spec with width/precision resolved, and the length modifier matching the recorded value
+    string sf = "%" + spec.flags;
+    if (spec.width==-2) { if (readBinLogArg(aReader, arg)) string_format_append(sf, "%d", (int)arg.i); }
+    else if (spec.width>=0) string_format_append(sf, "%d", spec.width);
+    if (spec.precision==-2) { if (readBinLogArg(aReader, arg)) string_format_append(sf, ".%d", (int)arg.i); }
+    else if (spec.precision>=0) string_format_append(sf, ".%d", spec.precision);
+    if (spec.conversion=='n') { readBinLogArg(aReader, arg); continue; } // was not recorded, nothing to output
+    if (!readBinLogArg(aReader, arg)) {
+      msg += "<missing>";
+      continue;
+    }
+    switch (arg.kind) {
+      case 'i':
+        if (spec.conversion=='c') { sf += 'c'; string_format_append(msg, sf.c_str(), (int)arg.i); }
+        else { sf += "ll"; sf += spec.conversion; string_format_append(msg, sf.c_str(), (long long)arg.i); }
+        break;
+      case 'u':
+        sf += "ll"; sf += spec.conversion;
+        string_format_append(msg, sf.c_str(), (unsigned long long)arg.u);
+        break;
+      case 'd':
+        sf += spec.conversion;
+        string_format_append(msg, sf.c_str(), arg.d);
+        break;
+      case 'p':
+        sf += 'p';
+        string_format_append(msg, sf.c_str(), (void*)(uintptr_t)arg.u);
+        break;
+      case 's':
+        sf += 's';
+        string_format_append(msg, sf.c_str(), arg.s.c_str());
+        break;
+    }
+  }
+  for (const char* q = lit; *q; q++) {
+    msg += *q;
+    if (*q=='%' && *(q+1)=='%') q++;
+  }
+  return msg;
+}
+
+
+bool Logger::decodeBinaryLog(const char* aBinaryLogFilePath)
+{
+  FILE* f = fopen(aBinaryLogFilePath, "rb");
+  if (!f) return false;
+  char magic[BINLOG_MAGIC_LEN];
+  if (fread(magic, 1, BINLOG_MAGIC_LEN, f)!=BINLOG_MAGIC_LEN || memcmp(magic, BINLOG_MAGIC, BINLOG_MAGIC_LEN)!=0) {
+    fclose(f);
+    return false;
+  }
+  // record sizes must be checked against the file size, a corrupt or truncated file must not cause huge allocations
+  long pos = ftell(f);
+  fseek(f, 0, SEEK_END);
+  long fileSize = ftell(f);
+  fseek(f, pos, SEEK_SET);
+  typedef struct { string fmt; string file; uint32_t line; } SiteInfo;
+  std::vector<SiteInfo> sites;
+  string payload;
+  bool ok = true;
+  while (true) {
+    int type = fgetc(f);
+    if (type==EOF) break;
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, f)!=1) { ok = false; break; } // truncated
+    if (len>fileSize-ftell(f)) { ok = false; break; } // truncated or corrupt length
+    payload.resize(len);
+    if (len>0 && fread(&payload[0], 1, len, f)!=len) { ok = false; break; } // truncated
+    BinLogReader r(payload);
+    switch (type) {
+      case 'B':
+        sites.clear(); // new session, new call site IDs
+        break;
+      case 'S': {
+        uint32_t id; uint8_t lvl; SiteInfo si;
+        r.get(&id, sizeof(id)); r.get(&lvl, 1); r.get(&si.line, sizeof(si.line));
+        si.fmt = r.getStr(); si.file = r.getStr();
+        if (!r.ok()) break;
+        if (id>=BINLOG_MAX_CALL_SITE_ID) { ok = false; break; } // corrupt
+        if (id>=sites.size()) sites.resize(id+1);
+        sites[id] = si;
+        break;
+      }
+      case 'L': {
+        uint32_t id; uint8_t lvl; int64_t secs; int32_t usecs;
+        r.get(&id, sizeof(id)); r.get(&lvl, 1); r.get(&secs, sizeof(secs)); r.get(&usecs, sizeof(usecs));
+        string context = r.getStr();
+        if (!r.ok()) break;
+        if (lvl>LOG_DEBUG) lvl = LOG_DEBUG;
+        struct timeval t;
+        t.tv_sec = (time_t)secs;
+        t.tv_usec = usecs;
+        string msg;
+        if (id<sites.size()) msg = formatBinLogMessage(sites[id].fmt, r);
+        else msg = string_format("<unknown call site #%u>", id);
+        contextLogStrAt_always(lvl, context, msg, t);
+        break;
+      }
+      default:
+        break; // unknown record type, skip
+    }
+    if (!ok) break;
+  }
+  fclose(f);
+  return ok;
+}
+
+#endif // ENABLE_LOG_BINARY
+
+
 // MARK: - P44LoggingObj
 
 P44LoggingObj::P44LoggingObj() :
@@ -380,29 +1836,42 @@ bool P44LoggingObj::logEnabled(int aLogLevel)
   return globalLogger.logEnabled(aLogLevel, getLogLevelOffset());
 }
 
+string P44LoggingObj::logContext(bool aWithObjectPrefix)
+{
+  string context;
+  int offs = getLogLevelOffset();
+  #if ENABLE_LOG_COLORS
+  if (globalLogger.logSymbols()) {
+    if (offs>0) context = gIncreasedLevelPrefix;
+    else if (offs<0) context = gReducedLevelPrefix;
+  }
+  else
+  #endif // ENABLE_LOG_COLORS
+  {
+    if (offs!=0) context = string_format("[%+d] ", offs);
+  }
+  if (aWithObjectPrefix) {
+    context += logContextPrefix();
+  }
+  return context;
+}
+
+
 void P44LoggingObj::log(int aErrLevel, const char *aFmt, ... )
 {
   if (logEnabled(aErrLevel)) {
+    // cheap check for rate limiting before doing any formatting
+    long suppressed;
+    if (!globalLogger.rateLimitAllows(this, aFmt, aErrLevel, getLogLevelOffset(), suppressed)) return;
     va_list args;
     va_start(args, aFmt);
     // get the prefix (can be disabled by starting log line with \r)
     string message;
-    string context;
-    int offs = getLogLevelOffset();
-    #if ENABLE_LOG_COLORS
-    if (globalLogger.logSymbols()) {
-      if (offs>0) context = gIncreasedLevelPrefix;
-      else if (offs<0) context = gReducedLevelPrefix;
-    }
-    else
-    #endif // ENABLE_LOG_COLORS
-    {
-      if (offs!=0) context = string_format("[%+d] ", offs);
-    }
-    if (*aFmt!='\r') {
-      context += logContextPrefix();
+    string context = logContext(*aFmt!='\r');
+    if (suppressed>0) {
+      globalLogger.contextLogStr_always(aErrLevel, context, string_format("%ld similar messages were suppressed (rate limit)", suppressed));
     }
-    else {
+    if (*aFmt=='\r') {
       // prefix disabled, skip marker
       aFmt++; // skip \r
     }
@@ -413,6 +1882,25 @@ void P44LoggingObj::log(int aErrLevel, const char *aFmt, ... )
   }
 }
 
+
+#if ENABLE_LOG_BINARY
+
+void P44LoggingObj::logCallSite(LogCallSite* aCallSiteP, int aErrLevel, const char* aFmt, ... )
+{
+  long suppressed;
+  if (!globalLogger.rateLimitAllows(this, aCallSiteP->mFmt, aErrLevel, getLogLevelOffset(), suppressed)) return;
+  va_list args;
+  va_start(args, aFmt);
+  string context = logContext(!aCallSiteP->mNoContext);
+  if (suppressed>0) {
+    globalLogger.contextLogStr_always(aErrLevel, context, string_format("%ld similar messages were suppressed (rate limit)", suppressed));
+  }
+  globalLogger.logCallSiteV(*aCallSiteP, aErrLevel, context.c_str(), args);
+  va_end(args);
+}
+
+#endif // ENABLE_LOG_BINARY
+
 int P44LoggingObj::getLogLevelOffset()
 {
   return mLogLevelOffset;
@@ -67,9 +67,38 @@
   #define ENABLE_LOG_COLORS 1
 #endif
 
+#ifndef ENABLE_LOG_BINARY
+  #if REDUCED_FOOTPRINT
+    #define ENABLE_LOG_BINARY 0
+  #else
+    #define ENABLE_LOG_BINARY 1 // support for binary logging with deferred formatting (BLOG/BOLOG macros)
+  #endif
+#endif
+
+#ifndef ENABLE_LOG_ROTATION
+  #ifdef ESP_PLATFORM
+    #define ENABLE_LOG_ROTATION 0
+  #else
+    #define ENABLE_LOG_ROTATION 1 // support for size-bounded, rotating log files written via mmap
+  #endif
+#endif
+
+#ifndef ENABLE_LOG_COMPRESSION
+  #define ENABLE_LOG_COMPRESSION 0 // compression of rotated log files, requires zlib
+#endif
+
+#ifndef ENABLE_LOG_ASYNC
+  #ifdef ESP_PLATFORM
+    #define ENABLE_LOG_ASYNC 0
+  #else
+    #define ENABLE_LOG_ASYNC 1 // support for asynchronous output of log lines via a writer thread
+  #endif
+#endif
+
 
 #include "p44obj.hpp"
 #include <boost/function.hpp>
+#include <vector>
 
 // global object independent logging
 #define LOGENABLED(lvl) globalLogger.logEnabled(lvl)
@@ -81,6 +110,8 @@
 #define SETLOGHANDLER(lh,allowother) globalLogger.setLogHandler(lh,allowother)
 #define DAEMONMODE globalLogger.getDaemonMode()
 #define SETDAEMONMODE(d) globalLogger.setDaemonMode(d)
+#define SETLOGRATELIMIT(lines,secs) globalLogger.setRateLimit(lines,secs)
+#define SETLOGDEDUPLICATE(d) globalLogger.setDeduplicate(d)
 #if ENABLE_LOG_COLORS
 #define SETLOGSYMBOLS(s) globalLogger.setSymbols(s)
 #define SETLOGCOLORING(c) globalLogger.setColoring(c)
@@ -99,6 +130,16 @@
 #define POLOGENABLED(obj,lvl) ((obj) ? (obj)->logEnabled(lvl) : LOGENABLED(lvl))
 #define POLOG(obj,lvl,...) { if (POLOGENABLED(obj,lvl)) { if (obj) (obj)->log(lvl,##__VA_ARGS__); else globalLogger.log(lvl,##__VA_ARGS__); }}
 
+// binary-capable logging: like LOG/OLOG, but when a binary log file is set (see Logger::setBinaryLogFile()),
+// only the raw arguments are recorded, and formatting is deferred to decoding the binary log
+#if ENABLE_LOG_BINARY
+#define BLOG(lvl,fmt,...) { if (globalLogger.logEnabled(lvl)) { static p44::LogCallSite _cs(fmt,__FILE__,__LINE__); globalLogger.logCallSite(_cs,lvl,NULL,fmt,##__VA_ARGS__); }}
+#define BOLOG(lvl,fmt,...) { if (logEnabled(lvl)) { static p44::LogCallSite _cs(fmt,__FILE__,__LINE__); logCallSite(&_cs,lvl,fmt,##__VA_ARGS__); }}
+#else
+#define BLOG(lvl,...) LOG(lvl,##__VA_ARGS__)
+#define BOLOG(lvl,...) OLOG(lvl,##__VA_ARGS__)
+#endif
+
 // debug build extra logging (not included in release code unless ALWAYS_DEBUG is set)
 #if defined(DEBUG) || ALWAYS_DEBUG
 #define DEBUGLOGGING 1
@@ -167,9 +208,52 @@ namespace p44 {
   /// @param aLogMessage the log message itself
   typedef boost::function<void (int aLevel, const char *aLinePrefix, const char *aLogMessage)> LoggerCB;
 
+  #if ENABLE_LOG_BINARY
+
+  /// a log statement's call site, with its format string pre-analyzed for capturing arguments
+  /// @note instances are created as function-level statics by the BLOG/BOLOG macros. The log level is not
+  ///   part of the call site, as it might vary between calls.
+  class LogCallSite
+  {
+  public:
+    const char* mFmt; ///< the format string
+    const char* mFile; ///< source file
+    int mLine; ///< source line
+    bool mNoContext; ///< set if format string started with \r, meaning no object context prefix
+    uint32_t mId; ///< call site ID, unique within the running process
+    std::string mArgTypes; ///< types of the arguments to capture, as derived from mFmt
+
+    LogCallSite(const char* aFmt, const char* aFile, int aLine);
+  };
+
+  #endif // ENABLE_LOG_BINARY
+
+  struct LogRateLimitEntry;
+
+  #if ENABLE_LOG_ROTATION
+  class RotatingLogFile;
+  #endif
+
+  #if ENABLE_LOG_ASYNC
+
+  /// policy for when the asynchronous log buffer is full
+  typedef enum {
+    logoverflow_drop, ///< drop new log lines while the buffer is full (and count them, see Logger::droppedLines())
+    logoverflow_block ///< block the logging thread until the writer thread has made room in the buffer
+  } LogOverflowPolicy;
+
+  class AsyncLogBuffer;
+
+  #endif // ENABLE_LOG_ASYNC
+
   class Logger : public P44Obj
   {
+    #if ENABLE_LOG_ASYNC
+    friend class AsyncLogBuffer;
+    #endif
+
     pthread_mutex_t mReportMutex;
+    pthread_mutex_t mFileMutex; ///< protects mLogFILE and mRotatingLog, which are also used by the async writer thread
     struct timeval mLastLogTS; ///< timestamp of last log line
     int mLogLevel; ///< log level
     int mStderrLevel; ///< lowest level that also goes to stderr
@@ -179,10 +263,33 @@ namespace p44 {
     LoggerCB mLoggerCB; ///< custom logger output function to use (instead or in addition of stderr/stdout, see mLogCBOnly)
     bool mAllowOther; ///< if set, setting CB or file will still allow other logging to happen in parallel
     FILE *mLogFILE; ///< file to log to (instead of stderr/stdout)
+    #if ENABLE_LOG_ROTATION
+    RotatingLogFile* mRotatingLog; ///< rotating log file to log to (instead of mLogFILE)
+    size_t mRotationMaxSize; ///< max size of a log file segment, 0 for no rotation
+    int mRotationMaxFiles; ///< max number of log files (including the active one)
+    bool mRotationCompress; ///< if set, rotated log files are compressed
+    #endif
     #if ENABLE_LOG_COLORS
     bool mLogColors; ///< if set, logger uses ANSI colors to differentiate levels
     bool mLogSymbols; ///< if set, logger uses UTF-8 color dots to differentiate levels
     #endif
+    #if ENABLE_LOG_ASYNC
+    AsyncLogBuffer* mAsyncBuffer; ///< if set, output to file/stdout/stderr happens asynchronously via this buffer
+    #endif
+    pthread_mutex_t mRateLimitMutex;
+    int mRateLimitLines; ///< max number of lines per call site and interval, 0 if no rate limiting
+    int mRateLimitSeconds; ///< rate limiting interval in seconds
+    LogRateLimitEntry* mRateLimitTable; ///< rate limiting state per call site (allocated when rate limiting is enabled)
+    uint64_t mSuppressedLines; ///< total number of lines suppressed by rate limiting
+    bool mDeduplicate; ///< if set, repetitions of the same line are summarized
+    int mLastLevel; ///< level of the last line output (for deduplication)
+    std::string mLastContext; ///< context of the last line output (for deduplication)
+    std::string mLastMessage; ///< message of the last line output (for deduplication)
+    long mRepeatCount; ///< number of repetitions of the last line not yet reported
+    #if ENABLE_LOG_BINARY
+    FILE* mBinaryFILE; ///< if set, BLOG/BOLOG call sites write binary records into this file
+    std::vector<bool> mBinarySitesWritten; ///< call site definitions already written to mBinaryFILE, indexed by call site ID
+    #endif
 
   public:
     Logger();
@@ -237,8 +344,24 @@ namespace p44 {
     /// @param aLogFilePath file to write log to instead of stdout
     /// @param aAllowOther if set,  stdout/stderr still happens
     /// @note if a callback is set with setLogHandler, it overrides logging to a file if aAllowOther is not set
+    /// @note if rotation is configured (see setLogFileRotation()), the log file is size-bounded and rotated
     void setLogFile(const char *aLogFilePath, bool aAllowOther = false);
 
+    #if ENABLE_LOG_ROTATION
+    /// configure log file rotation
+    /// @param aMaxSize max size of a log file. 0 disables rotation (log file grows forever)
+    /// @param aMaxFiles max number of log files, including the active one. When the active file is full,
+    ///   it is renamed to <logfile>.1 (older ones to .2, .3 etc.), and the oldest is deleted.
+    /// @param aCompress if set (and ENABLE_LOG_COMPRESSION), rotated files are gzip compressed in a background thread
+    /// @note must be called before setLogFile() to take effect.
+    /// @note with rotation, the active log file is preallocated to aMaxSize and written through a shared memory
+    ///   map, so writing a line is a memcpy, and lines written survive a crash of the process. Lines at or below
+    ///   the stderr level (see setErrLevel()) and flush() also sync the map to disk, so these survive a reboot.
+    ///   Until the file is closed or rotated, it has trailing NUL bytes up to aMaxSize. When re-opened after
+    ///   a crash, logging continues after the last line found.
+    void setLogFileRotation(size_t aMaxSize, int aMaxFiles = 3, bool aCompress = false);
+    #endif
+
     /// set log level
     /// @param aLogLevel the new log level
     /// @note even if aLogLevel is set to suppress messages, messages that qualify for going to stderr
@@ -278,8 +401,109 @@ namespace p44 {
     /// @param aColoring if set, ANSI terminal colors are used to differentiate levels and separate prefix from actual log content
     void setColoring(bool aColoring) { mLogColors = aColoring; };
 
+    #if ENABLE_LOG_BINARY
+
+    /// log a message from a binary-capable call site (usually called via BLOG/BOLOG macros)
+    /// @param aCallSite the call site
+    /// @param aErrLevel error level of the message
+    /// @param aContext context string, to be inserted before the message itself, can be NULL
+    /// @param aFmt ... the call site's format string (only used for compile time argument checking) and arguments
+    /// @note if a binary log file is set, the arguments are only captured into a binary record,
+    ///   otherwise, the message is formatted and logged as usual
+    void logCallSite(LogCallSite& aCallSite, int aErrLevel, const char* aContext, const char* aFmt, ...) __printflike(5,6);
+
+    /// log a message from a binary-capable call site
+    /// @param aCallSite the call site
+    /// @param aErrLevel error level of the message
+    /// @param aContext context string, can be NULL
+    /// @param aArgs va_list of the arguments
+    void logCallSiteV(LogCallSite& aCallSite, int aErrLevel, const char* aContext, va_list aArgs);
+
+    /// set binary log file
+    /// @param aBinaryLogFilePath file to append binary log records to, NULL to stop binary logging
+    /// @return false if file could not be opened
+    /// @note while a binary log file is set, messages from BLOG/BOLOG call sites are not formatted and go
+    ///   to the binary log file ONLY. Each record consists of the call site ID, timestamp, level, context
+    ///   and the raw arguments. Call site definitions (format string, source location) are written once
+    ///   per file and session. Use decodeBinaryLog() to get the text.
+    bool setBinaryLogFile(const char* aBinaryLogFilePath);
+
+    /// decode a binary log file and output it in the usual text format via this logger
+    /// @param aBinaryLogFilePath binary log file to decode
+    /// @return false if the file could not be read or is not a binary log file
+    /// @note lines are output with their original timestamps, unconditionally (regardless of log level)
+    ///   to the outputs set for this logger (log file, handler, stdout/stderr)
+    bool decodeBinaryLog(const char* aBinaryLogFilePath);
+
+    #endif // ENABLE_LOG_BINARY
+
+    /// set rate limiting per call site
+    /// @param aMaxLines max number of lines logged per call site (format string and logging object) within
+    ///   aIntervalSeconds. Further lines are suppressed without being formatted, and their number is reported
+    ///   when the call site is allowed to log again. 0 disables rate limiting.
+    /// @param aIntervalSeconds the rate limiting interval
+    /// @note messages with level LOG_CRIT and more severe are never rate limited. For P44LoggingObj, the
+    ///   log level offset also controls rate limiting: a positive offset (elevated logging) disables it,
+    ///   a negative offset reduces the number of lines allowed to aMaxLines/(1-offset).
+    void setRateLimit(int aMaxLines, int aIntervalSeconds = 60);
+
+    /// check rate limit for a call site (before any formatting)
+    /// @param aSource the logging object or NULL
+    /// @param aFmt the format string (identifies the call site)
+    /// @param aLevel the log level of the message
+    /// @param aLevelOffset the logging object's log level offset
+    /// @param aSuppressed will be set to the number of lines suppressed from this call site since the last
+    ///   time it was allowed to log (to be reported along with the message)
+    /// @return true if the message can be logged, false if it must be suppressed
+    bool rateLimitAllows(const void* aSource, const char* aFmt, int aLevel, int aLevelOffset, long& aSuppressed);
+
+    /// @return total number of lines suppressed by rate limiting
+    uint64_t suppressedLines() { return mSuppressedLines; }
+
+    /// enable deduplication
+    /// @param aDeduplicate if set, repeated identical lines (same level, context and message) are not
+    ///   output, but summarized as "last message repeated N times" when another line is logged or at flush()
+    void setDeduplicate(bool aDeduplicate);
+
+    /// make sure all log lines emitted so far are written out
+    /// @note in async mode, this waits until the writer thread has written all buffered lines
+    void flush();
+
+    #if ENABLE_LOG_ASYNC
+
+    /// enable or disable asynchronous logging
+    /// @param aBufferSize size of the ring buffer in bytes. If 0, asynchronous logging is disabled
+    ///   (after writing out all pending lines), and log lines are written synchronously again.
+    /// @param aOverflowPolicy what to do when the buffer is full
+    /// @note in async mode, log lines for the log file, stdout and stderr are formatted into a ring buffer,
+    ///   and a dedicated writer thread writes them out in batches using writev(). The logging thread
+    ///   no longer blocks on slow output devices. Lines are batched, so lines below the stderr level
+    ///   (see setErrLevel()) might appear with a small delay. A custom log handler (see setLogHandler())
+    ///   is still called synchronously.
+    /// @param aFlushOnCrash if set, handlers for fatal signals (SIGSEGV etc.) that are not otherwise
+    ///   handled are installed to write out pending lines before the process terminates. As these handlers
+    ///   are process-wide, this is meant to be enabled by the application only, not by library code.
+    void setAsync(size_t aBufferSize, LogOverflowPolicy aOverflowPolicy = logoverflow_drop, bool aFlushOnCrash = false);
+
+    /// @return true if log output is asynchronous
+    bool isAsync() { return mAsyncBuffer!=NULL; }
+
+    /// @return number of log lines dropped due to buffer overflow since async mode was enabled
+    uint64_t droppedLines();
+
+    /// write out all pending log lines directly from the calling thread
+    /// @note this is meant to be called from signal handlers for fatal signals, and does not block on any locks
+    ///   (if the log file is locked by another thread, the pending lines go to stderr instead)
+    void emergencyFlush();
+
+    #endif // ENABLE_LOG_ASYNC
+
   private:
 
+    bool hasLogFile();
+    void contextLogStrAt_always(int aErrLevel, const std::string& aContext, const std::string& aMessage, const struct timeval& aTimestamp);
+    std::string linePrefix(int aErrLevel, const struct timeval& aTimestamp);
+    void reportRepeats();
     void logOutput_always(int aLevel, const char *aLinePrefix, const char *aLogMessage);
 
   };
@@ -345,9 +569,21 @@ namespace p44 {
     /// @param aFmt ... printf style error message
     void log(int aErrLevel, const char *aFmt, ... ) __printflike(3,4);
 
+    #if ENABLE_LOG_BINARY
+    /// log a message from a binary-capable call site in this object (usually called via BOLOG macro)
+    /// @param aCallSiteP the call site
+    /// @param aErrLevel error level of the message
+    /// @param aFmt ... the call site's format string (only used for compile time argument checking) and arguments
+    void logCallSite(LogCallSite* aCallSiteP, int aErrLevel, const char* aFmt, ... ) __printflike(4,5);
+    #endif
+
     /// @return always locally stored offset, even when getLogLevelOffset() returns something else
     int getLocalLogLevelOffset() { return mLogLevelOffset; }
 
+  private:
+
+    string logContext(bool aWithObjectPrefix);
+
 
   };
 
@@ -28,6 +28,7 @@
 #define FOCUSLOGLEVEL 0
 
 #include "mainloop.hpp"
+#include "timeutils.hpp"
 
 #ifdef __APPLE__
   #include <mach/mach_time.h>
@@ -258,12 +259,30 @@ MLMicroSeconds MainLoop::localTimeToMainLoopTime(const struct tm& aLocalTime)
 }
 
 
+// cache for the most recently converted second
+static __thread time_t tLocalTimeCacheSecond = 0;
+static __thread long tLocalTimeCacheTz = 0;
+static __thread bool tLocalTimeCacheGMT = false;
+static __thread bool tLocalTimeCacheValid = false;
+static __thread struct tm tLocalTimeCache;
+
 void MainLoop::getLocalTime(struct tm& aLocalTime, double* aFractionalSecondsP, MLMicroSeconds aUnixTime, bool aGMT)
 {
   double unixsecs = (double)aUnixTime/Second;
   time_t t = (time_t)unixsecs;
-  if (aGMT) gmtime_r(&t, &aLocalTime);
-  else localtime_r(&t, &aLocalTime);
+  long tzs = aGMT ? 0 : timeZoneSignature();
+  if (tLocalTimeCacheValid && t==tLocalTimeCacheSecond && aGMT==tLocalTimeCacheGMT && tzs==tLocalTimeCacheTz) {
+    aLocalTime = tLocalTimeCache;
+  }
+  else {
+    if (aGMT) gmtime_r(&t, &aLocalTime);
+    else localtime_r(&t, &aLocalTime);
+    tLocalTimeCache = aLocalTime;
+    tLocalTimeCacheSecond = t;
+    tLocalTimeCacheGMT = aGMT;
+    tLocalTimeCacheTz = tzs;
+    tLocalTimeCacheValid = true;
+  }
   if (aFractionalSecondsP) {
     *aFractionalSecondsP = unixsecs-floor(unixsecs);
   }
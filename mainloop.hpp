@@ -346,6 +346,9 @@ namespace p44 {
     /// @param aFractionalSecondsP if not NULL, the fractional seconds part will be returned [0..1[
     /// @param aUnixTime optional unix time to calculate local time from. Defaults to current unixtime()
     /// @param aGMT if set, conversion to localtime happens in GMT(UTC)
+    /// @note the broken-down time of the most recently converted second is cached per thread, so repeated
+    ///   calls within the same second (typically: all time builtins evaluated in a mainloop cycle) do not
+    ///   call localtime_r() again. The cache is invalidated when the second or the timezone changes.
     static void getLocalTime(struct tm& aLocalTime, double* aFractionalSecondsP = NULL, MLMicroSeconds aUnixTime = unixtime(), bool aGMT = false);
 
     /// convert a mainloop timestamp to unix epoch time
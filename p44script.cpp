@@ -200,7 +200,7 @@ void EventSource::copySinksFrom(EventSource* aOtherSource)
 
 
 
-// MARK: - ScriptObj
+// MARK: - focus logging helpers
 
 #if FOCUSLOGGING
   #define FOCUSLOGCLEAR(p) \
@@ -219,6 +219,189 @@ void EventSource::copySinksFrom(EventSource* aOtherSource)
 #endif // FOCUSLOGGING
 
 
+#if BOOST_DISABLE_THREADS
+  #define P44SCRIPT_THREAD_LOCAL
+#else
+  #define P44SCRIPT_THREAD_LOCAL __thread
+#endif
+
+#if P44SCRIPT_POOLED_ALLOCATION
+
+// MARK: - ScriptObjPool
+
+#define POOL_GRANULARITY 16
+#define POOL_SIZE_CLASSES ((P44SCRIPT_POOL_MAX_OBJSIZE+POOL_GRANULARITY-1)/POOL_GRANULARITY)
+
+namespace {
+  struct FreeBlock { FreeBlock* next; };
+  // Note: plain POD thread locals, no destructors. Blocks cached by a thread that ends are not returned to the heap.
+  P44SCRIPT_THREAD_LOCAL FreeBlock* tFreeLists[POOL_SIZE_CLASSES];
+  P44SCRIPT_THREAD_LOCAL uint16_t tFreeCounts[POOL_SIZE_CLASSES];
+}
+
+
+void* ScriptObjPool::allocate(size_t aSize)
+{
+  if (aSize>0 && aSize<=P44SCRIPT_POOL_MAX_OBJSIZE) {
+    size_t sc = (aSize-1)/POOL_GRANULARITY;
+    FreeBlock* b = tFreeLists[sc];
+    if (b) {
+      tFreeLists[sc] = b->next;
+      tFreeCounts[sc]--;
+      return b;
+    }
+    // allocate full size class, so block can be reused for any object of this class
+    return ::operator new((sc+1)*POOL_GRANULARITY);
+  }
+  return ::operator new(aSize);
+}
+
+
+void ScriptObjPool::release(void* aPtr, size_t aSize)
+{
+  if (!aPtr) return;
+  if (aSize>0 && aSize<=P44SCRIPT_POOL_MAX_OBJSIZE) {
+    size_t sc = (aSize-1)/POOL_GRANULARITY;
+    if (tFreeCounts[sc]<P44SCRIPT_POOL_MAX_FREE) {
+      FreeBlock* b = static_cast<FreeBlock*>(aPtr);
+      b->next = tFreeLists[sc];
+      tFreeLists[sc] = b;
+      tFreeCounts[sc]++;
+      return;
+    }
+  }
+  ::operator delete(aPtr);
+}
+
+#endif // P44SCRIPT_POOLED_ALLOCATION
+
+
+#if P44SCRIPT_MEMORY_ACCOUNTING
+
+// MARK: - ScriptMemoryAccount
+
+// Note: per (OS) thread, as ScriptMainContexts may run on worker threads
+static P44SCRIPT_THREAD_LOCAL ScriptMemoryAccount* tCurrentAccount = NULL; ///< the account new objects are attributed to, NULL if none
+static P44SCRIPT_THREAD_LOCAL size_t tPendingAllocSize = 0; ///< size of the heap allocation the next ScriptObj constructor will pick up
+
+
+ScriptMemoryAccount::Scope::Scope(ScriptMemoryAccountPtr aAccount) :
+  mPrevious(tCurrentAccount),
+  mAccount(aAccount)
+{
+  tCurrentAccount = mAccount.get();
+}
+
+
+ScriptMemoryAccount::Scope::~Scope()
+{
+  tCurrentAccount = mPrevious;
+}
+
+
+ScriptMemoryAccount* ScriptMemoryAccount::current()
+{
+  return tCurrentAccount;
+}
+
+
+
+ScriptMemoryAccount::ScriptMemoryAccount(ScriptMemoryAccountPtr aTotal) :
+  mLiveObjects(0),
+  mLiveBytes(0),
+  mPeakBytes(0),
+  mAllocations(0),
+  mMaxBytes(0),
+  mMaxObjects(0),
+  mRateSampleAllocations(0),
+  mTotal(aTotal)
+{
+  mRateSampleTime = MainLoop::now();
+}
+
+
+double ScriptMemoryAccount::allocationRate()
+{
+  MLMicroSeconds now = MainLoop::now();
+  double rate = 0;
+  if (now>mRateSampleTime) {
+    rate = (double)(mAllocations-mRateSampleAllocations)*Second/(now-mRateSampleTime);
+  }
+  mRateSampleTime = now;
+  mRateSampleAllocations = mAllocations;
+  return rate;
+}
+
+
+#if SCRIPTING_JSON_SUPPORT
+
+JsonObjectPtr ScriptMemoryAccount::statusInfo()
+{
+  JsonObjectPtr info = JsonObject::newObj();
+  info->add("objects", JsonObject::newInt64((int64_t)mLiveObjects));
+  info->add("bytes", JsonObject::newInt64((int64_t)mLiveBytes));
+  info->add("peakbytes", JsonObject::newInt64((int64_t)mPeakBytes));
+  info->add("allocations", JsonObject::newInt64((int64_t)mAllocations));
+  info->add("allocrate", JsonObject::newDouble(allocationRate()));
+  info->add("maxbytes", JsonObject::newInt64((int64_t)mMaxBytes));
+  info->add("maxobjects", JsonObject::newInt64((int64_t)mMaxObjects));
+  return info;
+}
+
+#endif // SCRIPTING_JSON_SUPPORT
+
+#endif // P44SCRIPT_MEMORY_ACCOUNTING
+
+
+// MARK: - ScriptObj
+
+ScriptObj::ScriptObj() :
+  mAssignmentRefCount(0)
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  , mAccountedBytes(0)
+  #endif
+{
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  // Note: base class constructor runs before any member objects of subclasses are constructed,
+  //   so the pending size is always that of the object being constructed here. Objects not
+  //   allocated via our operator new (members, stack) find no pending size and remain unaccounted.
+  if (tPendingAllocSize) {
+    if (tCurrentAccount) {
+      mMemoryAccount = tCurrentAccount;
+      mAccountedBytes = tPendingAllocSize;
+      mMemoryAccount->allocated(mAccountedBytes);
+    }
+    tPendingAllocSize = 0;
+  }
+  #endif
+}
+
+
+ScriptObj::~ScriptObj()
+{
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  if (mMemoryAccount) mMemoryAccount->released(mAccountedBytes);
+  #endif
+}
+
+
+#if P44SCRIPT_MEMORY_ACCOUNTING || P44SCRIPT_POOLED_ALLOCATION
+
+void* ScriptObj::operator new(size_t aSize)
+{
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  tPendingAllocSize = aSize;
+  #endif
+  #if P44SCRIPT_POOLED_ALLOCATION
+  return ScriptObjPool::allocate(aSize);
+  #else
+  return ::operator new(aSize);
+  #endif
+}
+
+#endif // P44SCRIPT_MEMORY_ACCOUNTING || P44SCRIPT_POOLED_ALLOCATION
+
+
 ErrorPtr ScriptObj::setMemberByName(const string aName, const ScriptObjPtr aMember)
 {
   FOCUSLOGSTORE("ScriptObj")
@@ -2118,6 +2301,9 @@ ScriptMainContext::ScriptMainContext(ScriptingDomainPtr aDomain, ScriptObjPtr aT
   mDomainObj(aDomain),
   mThisObj(aThis)
 {
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  mMemoryAccount = new ScriptMemoryAccount(aDomain ? aDomain->totalMemoryAccount() : ScriptMemoryAccountPtr());
+  #endif
 }
 
 
@@ -2181,6 +2367,10 @@ ScriptObjPtr ScriptMainContext::registerHandler(ScriptObjPtr aHandler)
   // - but re-compiling without changes or re-running a on()-statement can make it getting registered twice
   // - this can be detected by comparing source start locations
   for (HandlerList::iterator pos = mHandlers.begin(); pos!=mHandlers.end(); pos++) {
+    if (*pos==handler) {
+      // already registered (reused unchanged handler)
+      return handler;
+    }
     if ((*pos)->codeFromSameSourceAs(*handler)) {
       // replace this handler by the new one
       CompiledHandlerPtr h = handler;
@@ -2199,6 +2389,22 @@ ScriptObjPtr ScriptMainContext::registerHandler(ScriptObjPtr aHandler)
 }
 
 
+CompiledHandlerPtr ScriptMainContext::adoptUnchangedHandler(SourceContainerPtr aPreviousSource, CompiledHandlerPtr aHandler, CompiledTriggerPtr aTrigger)
+{
+  if (!aPreviousSource || !aHandler || !aTrigger) return CompiledHandlerPtr();
+  for (HandlerList::iterator pos = mHandlers.begin(); pos!=mHandlers.end(); pos++) {
+    CompiledHandlerPtr h = *pos;
+    if (h->originatesFrom(aPreviousSource) && h->sameHandlerAs(*aHandler, *aTrigger)) {
+      // unchanged: move existing handler over to the new source, keeping its trigger state
+      h->relocate(aHandler->getCursor());
+      h->mTrigger->relocate(aTrigger->getCursor());
+      return h;
+    }
+  }
+  return CompiledHandlerPtr();
+}
+
+
 ScriptObjPtr ScriptMainContext::handlersInfo()
 {
   ArrayValue* infos = new ArrayValue();
@@ -4498,7 +4704,14 @@ void SourceProcessor::defineHandler(bool aGlobal)
     // global handlers are stored when compiling, all others when running
     CompiledHandlerPtr handler = new CompiledHandler("handler", getTriggerAndHandlerMainContext());
     mResult = captureCode(handler); // get the code first, so we can execute it in the trigger init
-    handler->installAndInitializeTrigger(mOlderResult);
+    CompiledHandlerPtr unchanged = unchangedHandler(handler, mOlderResult);
+    if (unchanged) {
+      // use the already running handler instead (no trigger initialisation needed)
+      mResult = unchanged;
+    }
+    else {
+      handler->installAndInitializeTrigger(mOlderResult);
+    }
     storeHandler();
   }
   // back to where we were before
@@ -5528,6 +5741,19 @@ bool CompiledCode::codeFromSameSourceAs(const CompiledCode &aCode) const
 }
 
 
+bool CompiledCode::sameCodeAs(const CompiledCode &aCode) const
+{
+  size_t n = mCursor.charsleft();
+  return n==aCode.mCursor.charsleft() && strncmp(mCursor.postext(), aCode.mCursor.postext(), n)==0;
+}
+
+
+void CompiledCode::relocate(const SourceCursor& aCursor)
+{
+  setCursor(aCursor);
+}
+
+
 
 
 // MARK: - CompiledFunction
@@ -5618,6 +5844,31 @@ CompiledTrigger::CompiledTrigger(const string aName, ScriptMainContextPtr aMainC
 }
 
 
+bool CompiledTrigger::sameTriggerAs(const CompiledTrigger &aTrigger) const
+{
+  return
+    sameCodeAs(aTrigger) &&
+    mTriggerMode==aTrigger.mTriggerMode &&
+    mHoldOff==aTrigger.mHoldOff &&
+    mResultVarName==aTrigger.mResultVarName;
+}
+
+
+void CompiledTrigger::relocate(const SourceCursor& aCursor)
+{
+  // frozen values are keyed by their position in the source text, move them along
+  const char* oldStart = mCursor.postext();
+  const char* newStart = aCursor.postext();
+  FrozenResultsMap relocated;
+  for (FrozenResultsMap::iterator pos = mFrozenResults.begin(); pos!=mFrozenResults.end(); ++pos) {
+    relocated[newStart+(pos->first-oldStart)] = pos->second;
+  }
+  mFrozenResults.swap(relocated);
+  if (mFrozenEventPos) mFrozenEventPos = newStart+(mFrozenEventPos-oldStart);
+  inherited::relocate(aCursor);
+}
+
+
 void CompiledTrigger::deactivate()
 {
   // reset everything that could be part of a retain cycle
@@ -5990,6 +6241,16 @@ bool CompiledTrigger::unfreezeTimed(SourcePos::UniquePos aFreezeId)
 
 // MARK: - CompiledHandler
 
+bool CompiledHandler::sameHandlerAs(const CompiledHandler &aHandler, const CompiledTrigger &aTrigger) const
+{
+  return
+    mTrigger &&
+    mMainContext==aHandler.mMainContext &&
+    sameCodeAs(aHandler) &&
+    mTrigger->sameTriggerAs(aTrigger);
+}
+
+
 void CompiledHandler::installAndInitializeTrigger(ScriptObjPtr aTrigger)
 {
   mTrigger = boost::dynamic_pointer_cast<CompiledTrigger>(aTrigger);
@@ -6045,6 +6306,16 @@ void CompiledHandler::deactivate()
 
 static void flagSetter(bool* aFlag) { *aFlag = true; }
 
+ScriptCompiler::ScriptCompiler(ScriptingDomainPtr aDomain) :
+  mDomain(aDomain)
+  #if P44SCRIPT_FULL_SUPPORT
+  , mReusedHandlers(0)
+  , mCompiledHandlers(0)
+  #endif
+{
+}
+
+
 void ScriptCompiler::deactivate()
 {
   // reset everything that could be part of a retain cycle
@@ -6067,6 +6338,8 @@ ScriptObjPtr ScriptCompiler::compile(SourceContainerPtr aSource, CompiledFunctio
   bool completed = false;
   setCompletedCB(boost::bind(&flagSetter,&completed));
   mCompileForContext = aMainContext; // set for compiling other scriptlets (triggers, handlers) into the same context
+  mReusedHandlers = 0;
+  mCompiledHandlers = 0;
   start();
   mCompileForContext.reset(); // release
   if (!completed) {
@@ -6132,6 +6405,15 @@ void ScriptCompiler::storeHandler()
   checkAndResume();
 }
 
+
+CompiledHandlerPtr ScriptCompiler::unchangedHandler(CompiledHandlerPtr aHandler, ScriptObjPtr aTrigger)
+{
+  CompiledHandlerPtr h = mDomain->adoptUnchangedHandler(mPreviousSource, aHandler, boost::dynamic_pointer_cast<CompiledTrigger>(aTrigger));
+  if (h) mReusedHandlers++;
+  else mCompiledHandlers++;
+  return h;
+}
+
 #endif // P44SCRIPT_FULL_SUPPORT
 
 
@@ -6245,6 +6527,9 @@ void ScriptHost::activate(EvaluationFlags aDefaultFlags, const char* aOriginLabe
     mActiveParams->mLoggingContextP = aLoggingContextP;
     mActiveParams->mSourceDirty = false;
     mActiveParams->mUnstored = false;
+    #if P44SCRIPT_FULL_SUPPORT
+    mActiveParams->mReusedHandlers = 0;
+    #endif
     #if P44SCRIPT_MIGRATE_TO_DOMAIN_SOURCE
     mActiveParams->mDomainSource = false;
     mActiveParams->mLocalDataReportedRemoved = false;
@@ -6615,11 +6900,15 @@ void ScriptHost::uncompile(bool aDoAbort, bool aAllowAutoRestart)
     mActiveParams->mCachedExecutable.reset(); // release cached executable (will release SourceCursor holding our source)
   }
   if (mActiveParams->mSourceContainer) {
-    if (mScriptingDomain) {
-      mScriptingDomain->releaseObjsFromSource(mActiveParams->mSourceContainer); // release all global objects from this source
-      mScriptingDomain->unincludeFrom(*this);
+    if (mScriptingDomain) mScriptingDomain->unincludeFrom(*this);
+    #if P44SCRIPT_FULL_SUPPORT
+    // Note: when recompiling incrementally, objects of the previous version are released only after
+    //   recompiling, such that unchanged handlers can be kept
+    if (mActiveParams->mSourceContainer!=mActiveParams->mPreviousSource)
+    #endif
+    {
+      releaseObjsFromSource(mActiveParams->mSourceContainer);
     }
-    if (mActiveParams->mSharedMainContext) mActiveParams->mSharedMainContext->releaseObjsFromSource(mActiveParams->mSourceContainer); // release all main context objects from this source
   }
   // auto-restart?
   if ((mActiveParams->mDefaultFlags & autorestart)!=0 && aAllowAutoRestart) {
@@ -6629,6 +6918,13 @@ void ScriptHost::uncompile(bool aDoAbort, bool aAllowAutoRestart)
 }
 
 
+void ScriptHost::releaseObjsFromSource(SourceContainerPtr aSource)
+{
+  if (mScriptingDomain) mScriptingDomain->releaseObjsFromSource(aSource); // release all global objects from this source
+  if (mActiveParams->mSharedMainContext) mActiveParams->mSharedMainContext->releaseObjsFromSource(aSource); // release all main context objects from this source
+}
+
+
 void ScriptHost::doAutorestart()
 {
   POLOG(mActiveParams->mLoggingContextP, LOG_WARNING, "auto-restarting changed script");
@@ -6649,6 +6945,19 @@ bool ScriptHost::setSource(const string aSource, EvaluationFlags aEvaluationFlag
       return false; // no change at all -> NOP
     }
   }
+  #if P44SCRIPT_FULL_SUPPORT
+  // already compiled persistent scripts with unchanged flags are recompiled incrementally:
+  // global handlers that did not change are kept running with their state and event registrations
+  mActiveParams->mReusedHandlers = 0;
+  if (
+    mActiveParams->mCachedExecutable && !mActiveParams->mCachedExecutable->isErr() &&
+    !aSource.empty() && !hasmarker &&
+    (aEvaluationFlags==inherit || mActiveParams->mDefaultFlags==aEvaluationFlags) &&
+    (mActiveParams->mDefaultFlags & (ephemeralSource|anonymousfunction))==0
+  ) {
+    mActiveParams->mPreviousSource = mActiveParams->mSourceContainer;
+  }
+  #endif
   // changed, invalidate everything related to the previous code
   uncompile((mActiveParams->mDefaultFlags & ephemeralSource)==0, true);
   if (aEvaluationFlags!=inherit) mActiveParams->mDefaultFlags = aEvaluationFlags;
@@ -6671,6 +6980,12 @@ bool ScriptHost::setSource(const string aSource, EvaluationFlags aEvaluationFlag
     #endif
   }
   mActiveParams->mSourceDirty = true;
+  #if P44SCRIPT_FULL_SUPPORT
+  if (mActiveParams->mPreviousSource) {
+    // recompile now, so handlers of the previous version do not stay active longer than needed
+    getExecutable();
+  }
+  #endif
   return true; // source has changed
 }
 
@@ -6721,7 +7036,22 @@ ScriptObjPtr ScriptHost::getExecutable()
       else {
         code = new CompiledScript(!mActiveParams->mOriginLabel.empty() ? mActiveParams->mOriginLabel : "script", mctx);
       }
+      #if P44SCRIPT_FULL_SUPPORT
+      compiler.setPreviousSource(mActiveParams->mPreviousSource);
+      #endif
       mActiveParams->mCachedExecutable = compiler.compile(mActiveParams->mSourceContainer, code, mActiveParams->mDefaultFlags, mctx);
+      #if P44SCRIPT_FULL_SUPPORT
+      if (mActiveParams->mPreviousSource) {
+        // now release what was not reused from the previous version
+        releaseObjsFromSource(mActiveParams->mPreviousSource);
+        mActiveParams->mPreviousSource.reset();
+        mActiveParams->mReusedHandlers = compiler.reusedHandlers();
+        POLOG(mActiveParams->mLoggingContextP, LOG_INFO,
+          "%s recompiled incrementally: %zu unchanged handlers kept, %zu handlers compiled",
+          getOriginLabel(), compiler.reusedHandlers(), compiler.compiledHandlers()
+        );
+      }
+      #endif
     }
     return mActiveParams->mCachedExecutable;
   }
@@ -7328,7 +7658,11 @@ string ExternalFileHost::getContextType()
 
 ScriptMainContextPtr ScriptingDomain::newContext(ScriptObjPtr aInstanceObj)
 {
-  return new ScriptMainContext(this, aInstanceObj);
+  ScriptMainContextPtr ctx = new ScriptMainContext(this, aInstanceObj);
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  ctx->memoryAccount()->setLimits(mDefaultMaxBytes, mDefaultMaxObjects);
+  #endif
+  return ctx;
 }
 
 
@@ -7451,6 +7785,10 @@ ScriptCodeThread::ScriptCodeThread(ScriptCodeContextPtr aOwner, CompiledFunction
   #endif
 {
   setCursor(aStartCursor);
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  ScriptMainContextPtr mctx = mOwner ? mOwner->scriptmain() : ScriptMainContextPtr();
+  if (mctx) mMemoryAccount = mctx->memoryAccount();
+  #endif
   FOCUSLOG("\n%04x START        thread created : %s", (uint32_t)((intptr_t)static_cast<SourceProcessor *>(this)) & 0xFFFF, mSrc.displaycode(130).c_str());
   #if P44SCRIPT_LIFECYCLE_DBG
   gNumThreads++;
@@ -7671,8 +8009,23 @@ void ScriptCodeThread::complete(ScriptObjPtr aFinalResult)
 void ScriptCodeThread::stepLoop()
 {
   MLMicroSeconds loopingSince = MainLoop::now();
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  // attribute all objects allocated while stepping to our main context
+  ScriptMemoryAccount::Scope accountingScope(mMemoryAccount);
+  #endif
   do {
     MLMicroSeconds now = MainLoop::now();
+    #if P44SCRIPT_MEMORY_ACCOUNTING
+    // Check memory limits
+    if (mMemoryAccount && mMemoryAccount->overLimit()) {
+      // Note: not calling abort as we are WITHIN the call chain
+      complete(new ErrorPosValue(mSrc, ScriptError::MemoryLimit,
+        "Aborted because context memory limit was exceeded (%zu objects, %zu bytes)",
+        mMemoryAccount->liveObjects(), mMemoryAccount->liveBytes()
+      ));
+      return;
+    }
+    #endif
     // Check maximum execution time
     #if !DEBUG
     if (DEFINED_INTERVAL(mMaxRunTime) && now-mRunningSince>mMaxRunTime) {
@@ -10356,6 +10709,22 @@ static void threadvars_func(BuiltinFunctionContextPtr f)
   f->finish(f->thread()->threadLocals());
 }
 
+#if P44SCRIPT_MEMORY_ACCOUNTING
+
+// contextmemory() - memory statistics of the calling thread's main context
+static void contextmemory_func(BuiltinFunctionContextPtr f)
+{
+  f->finish(ScriptObj::valueFromJSON(f->thread()->owner()->scriptmain()->memoryAccount()->statusInfo()));
+}
+
+// globalmemory() - memory statistics summed up over all contexts of the scripting domain
+static void globalmemory_func(BuiltinFunctionContextPtr f)
+{
+  f->finish(ScriptObj::valueFromJSON(f->thread()->owner()->domain()->totalMemoryAccount()->statusInfo()));
+}
+
+#endif // P44SCRIPT_MEMORY_ACCOUNTING
+
 #if P44SCRIPT_DEBUGGING_SUPPORT
 static void threads_func(BuiltinFunctionContextPtr f)
 {
@@ -10471,6 +10840,10 @@ static const BuiltinMemberDescriptor standardFunctions[] = {
   FUNC_DEF_NOARG(contextvars, executable|structured),
   FUNC_DEF_NOARG(localvars, executable|structured),
   FUNC_DEF_NOARG(threadvars, executable|structured),
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  FUNC_DEF_NOARG(contextmemory, executable|objectvalue),
+  FUNC_DEF_NOARG(globalmemory, executable|objectvalue),
+  #endif
   #if P44SCRIPT_DEBUGGING_SUPPORT
   FUNC_DEF_NOARG(threads, executable|structured),
   #endif
@@ -10594,5 +10967,355 @@ bool FileStorageStandardScriptingDomain::storeSource(const string &aScriptHostUi
 
 #endif // P44SCRIPT_REGISTERED_SOURCE
 
-#endif // ENABLE_P44SCRIPT
 
+#if P44SCRIPT_WORKER_THREADS
+
+// MARK: - Script worker threads
+
+// postmessage(value)
+FUNC_ARG_DEFS(postmessage, { anyvalid|null } );
+static void postmessage_func(BuiltinFunctionContextPtr f)
+{
+  WorkerScriptingDomain* d = dynamic_cast<WorkerScriptingDomain*>(f->domain().get());
+  assert(d);
+  d->worker().postMessageFromWorker(f->arg(0));
+  f->finish();
+}
+
+// mainglobal(name)
+FUNC_ARG_DEFS(mainglobal, { text } );
+static void mainglobal_func(BuiltinFunctionContextPtr f)
+{
+  WorkerScriptingDomain* d = dynamic_cast<WorkerScriptingDomain*>(f->domain().get());
+  assert(d);
+  f->finish(d->worker().parentGlobalForWorker(f->arg(0)->stringValue()));
+}
+
+static const BuiltinMemberDescriptor workerFunctions[] = {
+  FUNC_DEF_W_ARG(postmessage, executable|null),
+  FUNC_DEF_W_ARG(mainglobal, executable|anyvalid|error),
+  BUILTINS_TERMINATOR
+};
+
+
+WorkerScriptingDomain::WorkerScriptingDomain(ScriptWorker& aWorker) :
+  mWorker(aWorker)
+{
+  addGlobalBuiltins(workerFunctions);
+}
+
+
+ScriptWorker::ScriptWorker(const string aName) :
+  mName(aName),
+  mNextJobId(1),
+  mQueueMutex(PTHREAD_MUTEX_INITIALIZER),
+  mWorkerThreadP(NULL),
+  mWorkerScriptP(NULL)
+{
+  mWakeupPipe[0] = -1;
+  mWakeupPipe[1] = -1;
+}
+
+
+ScriptWorker::~ScriptWorker()
+{
+  // Note: thread keeps us alive via mKeepAlive, so when we get here, the thread is not running
+  closeWakeupPipe();
+  pthread_mutex_destroy(&mQueueMutex);
+}
+
+
+ErrorPtr ScriptWorker::start(WorkerSetupCB aSetupCB, ScriptingDomainPtr aParentDomain)
+{
+  if (mThread) return ErrorPtr(); // already running
+  if (pipe(mWakeupPipe)!=0) return SysError::errNo("cannot create worker wakeup pipe: ");
+  fcntl(mWakeupPipe[0], F_SETFL, fcntl(mWakeupPipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl(mWakeupPipe[1], F_SETFL, fcntl(mWakeupPipe[1], F_GETFL) | O_NONBLOCK);
+  mParentDomain = aParentDomain ? aParentDomain : ScriptingDomainPtr(&StandardScriptingDomain::sharedDomain());
+  mSetupCB = aSetupCB;
+  ChildThreadWrapperPtr thread = MainLoop::currentMainLoop().executeInThread(
+    boost::bind(&ScriptWorker::workerThreadRoutine, this, _1),
+    boost::bind(&ScriptWorker::threadSignalHandler, this, _1, _2)
+  );
+  if (mWakeupPipe[0]<0) {
+    // threadEnded() was called from within executeInThread() because the thread could not start
+    return TextError::err("could not start worker thread");
+  }
+  mThread = thread;
+  mKeepAlive = ScriptWorkerPtr(this); // the thread needs us until it has ended
+  OLOG(LOG_INFO, "worker thread started");
+  return ErrorPtr();
+}
+
+
+void ScriptWorker::stop()
+{
+  if (!mThread) return;
+  OLOG(LOG_INFO, "requesting worker thread to stop");
+  mThread->terminate();
+  // the worker mainloop might sleep in poll(), wake it to notice termination
+  uint8_t b = 0;
+  static_cast<void>(write(mWakeupPipe[1], &b, 1));
+}
+
+
+void ScriptWorker::closeWakeupPipe()
+{
+  if (mWakeupPipe[0]>=0) { close(mWakeupPipe[0]); mWakeupPipe[0] = -1; }
+  if (mWakeupPipe[1]>=0) { close(mWakeupPipe[1]); mWakeupPipe[1] = -1; }
+}
+
+
+void ScriptWorker::execute(const string aSource, JsonObjectPtr aArgs, WorkerResultCB aResultCB, MLMicroSeconds aMaxRunTime)
+{
+  queueJob(job_execute, aSource, aArgs ? aArgs->json_str() : "", aMaxRunTime, aResultCB);
+}
+
+
+void ScriptWorker::loadScript(const string aSource, WorkerResultCB aResultCB)
+{
+  queueJob(job_loadscript, aSource, "", Infinite, aResultCB);
+}
+
+
+uint32_t ScriptWorker::queueJob(JobType aJobType, const string& aSource, const string& aArgsJson, MLMicroSeconds aMaxRunTime, WorkerResultCB aResultCB)
+{
+  if (!mThread) {
+    if (aResultCB) aResultCB(JsonObjectPtr(), ScriptError::err(ScriptError::Aborted, "worker '%s' is not running", mName.c_str()));
+    return 0;
+  }
+  WorkerJob job;
+  job.mJobId = mNextJobId++;
+  if (mNextJobId==0) mNextJobId = 1; // 0 is reserved for messages
+  job.mJobType = aJobType;
+  job.mSource = aSource;
+  job.mArgsJson = aArgsJson;
+  job.mMaxRunTime = aMaxRunTime;
+  mResultCBs[job.mJobId] = aResultCB;
+  pthread_mutex_lock(&mQueueMutex);
+  bool wasEmpty = mJobs.empty();
+  mJobs.push_back(job);
+  pthread_mutex_unlock(&mQueueMutex);
+  if (wasEmpty) {
+    // worker drains the entire queue on wakeup, so only the first job needs to wake it
+    uint8_t b = 0;
+    static_cast<void>(write(mWakeupPipe[1], &b, 1));
+  }
+  return job.mJobId;
+}
+
+
+void ScriptWorker::threadSignalHandler(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode)
+{
+  if (aSignalCode==threadSignalUserSignal) {
+    deliverOutputs();
+  }
+  else if (aSignalCode==threadSignalCompleted || aSignalCode==threadSignalFailedToStart || aSignalCode==threadSignalCancelled) {
+    threadEnded();
+  }
+}
+
+
+void ScriptWorker::deliverOutputs()
+{
+  OutputList outputs;
+  pthread_mutex_lock(&mQueueMutex);
+  outputs.swap(mOutputs);
+  pthread_mutex_unlock(&mQueueMutex);
+  for (OutputList::iterator pos = outputs.begin(); pos!=outputs.end(); ++pos) {
+    JsonObjectPtr json;
+    if (!pos->mJson.empty()) json = JsonObject::objFromText(pos->mJson.c_str(), pos->mJson.size());
+    if (pos->mJobId==0) {
+      // message posted by worker script
+      if (mMessageCB) mMessageCB(json);
+      continue;
+    }
+    ResultCBMap::iterator cbpos = mResultCBs.find(pos->mJobId);
+    if (cbpos==mResultCBs.end()) continue;
+    WorkerResultCB cb = cbpos->second;
+    mResultCBs.erase(cbpos);
+    ErrorPtr err;
+    if (pos->mIsError) {
+      if (pos->mErrorDomain==ScriptError::domain()) {
+        err = Error::err_str<ScriptError>(pos->mErrorCode, pos->mErrorText);
+      }
+      else {
+        err = TextError::err("%s (%s:%ld)", pos->mErrorText.c_str(), pos->mErrorDomain.c_str(), (long)pos->mErrorCode);
+      }
+    }
+    if (cb) cb(json, err);
+  }
+}
+
+
+void ScriptWorker::threadEnded()
+{
+  ScriptWorkerPtr keepMe = ScriptWorkerPtr(this); // make sure we live until this method ends
+  // deliver what the worker has produced before ending
+  deliverOutputs();
+  mThread.reset();
+  closeWakeupPipe();
+  pthread_mutex_lock(&mQueueMutex);
+  mJobs.clear();
+  pthread_mutex_unlock(&mQueueMutex);
+  // jobs not completed will never complete now
+  ResultCBMap pending;
+  pending.swap(mResultCBs);
+  for (ResultCBMap::iterator pos = pending.begin(); pos!=pending.end(); ++pos) {
+    if (pos->second) pos->second(JsonObjectPtr(), ScriptError::err(ScriptError::Aborted, "worker '%s' has stopped", mName.c_str()));
+  }
+  OLOG(LOG_INFO, "worker thread ended");
+  mKeepAlive.reset();
+}
+
+
+ErrorPtr ScriptWorker::fetchParentGlobal(ChildThreadWrapper &aThread, const string& aName, string& aJson)
+{
+  // Note: runs on the parent thread while the worker thread is blocked
+  ScriptObjPtr v = mParentDomain->contextLocals()->memberByName(aName);
+  if (!v) return ScriptError::err(ScriptError::NotFound, "no main global named '%s'", aName.c_str());
+  JsonObjectPtr json = v->jsonValue();
+  aJson = json ? json->json_str() : "";
+  return ErrorPtr();
+}
+
+
+// MARK: worker thread side
+
+void ScriptWorker::workerThreadRoutine(ChildThreadWrapper &aThread)
+{
+  mWorkerThreadP = &aThread;
+  MainLoop& ml = aThread.threadMainLoop();
+  ml.registerPollHandler(mWakeupPipe[0], POLLIN, boost::bind(&ScriptWorker::workerWakeupHandler, this, _2));
+  // everything script related is created on this thread, and is never touched by any other thread
+  mWorkerDomain = new WorkerScriptingDomain(*this);
+  mWorkerContext = mWorkerDomain->newContext();
+  if (mSetupCB) mSetupCB(*mWorkerDomain, mWorkerContext);
+  mSetupCB = NoOP;
+  ml.run();
+  // clean up on this thread
+  mWorkerContext->abort(stopall, new ErrorValue(ScriptError::Aborted, "worker stopping"));
+  if (mWorkerScriptP) {
+    delete mWorkerScriptP;
+    mWorkerScriptP = NULL;
+  }
+  mWorkerContext.reset();
+  mWorkerDomain.reset();
+  ml.unregisterPollHandler(mWakeupPipe[0]);
+  mWorkerThreadP = NULL;
+}
+
+
+bool ScriptWorker::workerWakeupHandler(int aPollFlags)
+{
+  uint8_t buf[32];
+  while (read(mWakeupPipe[0], buf, sizeof(buf))>0);
+  if (mWorkerThreadP->shouldTerminate()) {
+    MainLoop::currentMainLoop().terminate(0);
+    return true;
+  }
+  while (true) {
+    pthread_mutex_lock(&mQueueMutex);
+    if (mJobs.empty()) {
+      pthread_mutex_unlock(&mQueueMutex);
+      break;
+    }
+    WorkerJob job = mJobs.front();
+    mJobs.pop_front();
+    pthread_mutex_unlock(&mQueueMutex);
+    runJob(job);
+  }
+  return true;
+}
+
+
+void ScriptWorker::runJob(const WorkerJob& aJob)
+{
+  if (aJob.mJobType==job_loadscript) {
+    if (!mWorkerScriptP) {
+      mWorkerScriptP = new ScriptHost(sourcecode|regular|keepvars|queue|concurrently, "worker script", nullptr, this);
+      mWorkerScriptP->setDomain(mWorkerDomain);
+      mWorkerScriptP->setSharedMainContext(mWorkerContext);
+    }
+    mWorkerScriptP->setSource(aJob.mSource);
+    mWorkerScriptP->run(inherit, boost::bind(&ScriptWorker::jobDone, this, aJob.mJobId, _1));
+    return;
+  }
+  // execute like eval() in the worker context
+  ScriptHost src(scriptbody|anonymousfunction, "worker job", nullptr, this);
+  src.setDomain(mWorkerDomain);
+  src.setSource(aJob.mSource);
+  ScriptObjPtr code = src.getExecutable();
+  if (code->hasType(executable)) {
+    ExecutionContextPtr ctx = code->contextForCallingFrom(mWorkerContext, NULL);
+    if (ctx) {
+      ScriptObjPtr arg;
+      if (!aJob.mArgsJson.empty()) arg = ScriptObj::valueFromJSON(JsonObject::objFromText(aJob.mArgsJson.c_str(), aJob.mArgsJson.size()));
+      else arg = new AnnotatedNullValue("no argument");
+      ctx->setMemberAtIndex(0, arg, "arg1");
+      ctx->execute(code, scriptbody|mainthread|keepvars|implicitreturn, boost::bind(&ScriptWorker::jobDone, this, aJob.mJobId, _1), NULL, ScriptObjPtr(), aJob.mMaxRunTime);
+      return;
+    }
+  }
+  jobDone(aJob.mJobId, code); // error or not executable
+}
+
+
+void ScriptWorker::jobDone(uint32_t aJobId, ScriptObjPtr aResult)
+{
+  WorkerOutput out;
+  out.mJobId = aJobId;
+  out.mIsError = false;
+  out.mErrorCode = 0;
+  if (aResult) {
+    if (aResult->isErr()) {
+      ErrorPtr err = aResult->errorValue();
+      out.mIsError = true;
+      out.mErrorDomain = err->getErrorDomain();
+      out.mErrorCode = err->getErrorCode();
+      out.mErrorText = err->getErrorMessage();
+    }
+    else {
+      JsonObjectPtr json = aResult->jsonValue();
+      if (json) out.mJson = json->json_str();
+    }
+  }
+  postOutput(out);
+}
+
+
+void ScriptWorker::postOutput(const WorkerOutput& aOutput)
+{
+  pthread_mutex_lock(&mQueueMutex);
+  bool wasEmpty = mOutputs.empty();
+  mOutputs.push_back(aOutput);
+  pthread_mutex_unlock(&mQueueMutex);
+  // parent drains all outputs per signal
+  if (wasEmpty) mWorkerThreadP->signalParentThread(threadSignalUserSignal);
+}
+
+
+void ScriptWorker::postMessageFromWorker(ScriptObjPtr aMessage)
+{
+  WorkerOutput out;
+  out.mJobId = 0;
+  out.mIsError = false;
+  out.mErrorCode = 0;
+  JsonObjectPtr json = aMessage->jsonValue();
+  if (json) out.mJson = json->json_str();
+  postOutput(out);
+}
+
+
+ScriptObjPtr ScriptWorker::parentGlobalForWorker(const string& aName)
+{
+  string json;
+  ErrorPtr err = mWorkerThreadP->executeOnParentThread(boost::bind(&ScriptWorker::fetchParentGlobal, this, _1, aName, boost::ref(json)));
+  if (Error::notOK(err)) return new ErrorValue(err);
+  if (json.empty()) return new AnnotatedNullValue("main global has no JSON representation");
+  return ScriptObj::valueFromJSON(JsonObject::objFromText(json.c_str(), json.size()));
+}
+
+#endif // P44SCRIPT_WORKER_THREADS
+
+#endif // ENABLE_P44SCRIPT
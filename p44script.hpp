@@ -52,6 +52,21 @@
 #ifndef ENABLE_FILTER_FUNCS
   #define ENABLE_FILTER_FUNCS 1
 #endif
+#ifndef P44SCRIPT_MEMORY_ACCOUNTING
+  #define P44SCRIPT_MEMORY_ACCOUNTING 1 // per main context accounting of ScriptObj allocations, cheap enough to be always on
+#endif
+#ifndef P44SCRIPT_POOLED_ALLOCATION
+  #define P44SCRIPT_POOLED_ALLOCATION 0 // per-thread free lists for ScriptObj and ScriptCodeThread allocations (avoids malloc for short-lived objects)
+#endif
+#ifndef P44SCRIPT_POOL_MAX_OBJSIZE
+  #define P44SCRIPT_POOL_MAX_OBJSIZE 512 // objects larger than this are not pooled
+#endif
+#ifndef P44SCRIPT_POOL_MAX_FREE
+  #define P44SCRIPT_POOL_MAX_FREE 128 // max number of free blocks kept per size class and thread
+#endif
+#ifndef P44SCRIPT_WORKER_THREADS
+  #define P44SCRIPT_WORKER_THREADS (P44SCRIPT_FULL_SUPPORT && SCRIPTING_JSON_SUPPORT && !BOOST_DISABLE_THREADS) // independent script contexts on worker threads
+#endif
 
 
 
@@ -106,6 +121,10 @@ namespace p44 { namespace P44Script {
   typedef boost::intrusive_ptr<ScriptCodeContext> ScriptCodeContextPtr;
   class ScriptMainContext;
   typedef boost::intrusive_ptr<ScriptMainContext> ScriptMainContextPtr;
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+  class ScriptMemoryAccount;
+  typedef boost::intrusive_ptr<ScriptMemoryAccount> ScriptMemoryAccountPtr;
+  #endif
   class ScriptingDomain;
   typedef boost::intrusive_ptr<ScriptingDomain> ScriptingDomainPtr;
   class StandardScriptingDomain;
@@ -163,6 +182,7 @@ namespace p44 { namespace P44Script {
       AsyncNotAllowed, ///< async executable encountered during synchronous execution
       WrongContext, ///< wrong context for this function/statement/operation
       Internal, ///< internal inconsistency
+      MemoryLimit, ///< aborted because the context's memory limit was exceeded
       numErrorCodes
     } ErrorCodes;
     static const char *domain() { return "ScriptError"; }
@@ -193,6 +213,7 @@ namespace p44 { namespace P44Script {
       "AsyncNotAllowed",
       "WrongContext",
       "Internal",
+      "MemoryLimit",
     };
     #endif // ENABLE_NAMED_ERRORS
   };
@@ -452,6 +473,140 @@ namespace p44 { namespace P44Script {
 
   };
 
+  #if P44SCRIPT_POOLED_ALLOCATION
+
+  // MARK: - Pooled allocation
+
+  /// Size class free list allocator for short-lived script objects
+  /// @note free lists are per (OS) thread, so objects may be allocated and freed in different
+  ///   threads. Blocks sizes are rounded up to size classes, blocks larger than P44SCRIPT_POOL_MAX_OBJSIZE
+  ///   are directly passed to the global allocator.
+  class ScriptObjPool
+  {
+  public:
+    /// @param aSize number of bytes to allocate
+    /// @return memory block of at least aSize bytes
+    static void* allocate(size_t aSize);
+
+    /// @param aPtr block previously obtained from allocate()
+    /// @param aSize the size that was passed to allocate()
+    static void release(void* aPtr, size_t aSize);
+  };
+
+  #endif // P44SCRIPT_POOLED_ALLOCATION
+
+
+  #if P44SCRIPT_MEMORY_ACCOUNTING
+
+  // MARK: - Memory accounting
+
+  /// Accounting of ScriptObj heap allocations, attributed to a ScriptMainContext
+  /// @note objects are attributed to the account that is current at the time they are allocated.
+  ///   While a ScriptCodeThread is stepping, this is the account of the thread's main context.
+  ///   Objects allocated outside of any thread (e.g. by C++ code or async callbacks) remain unaccounted.
+  /// @note the byte count covers the ScriptObj instances themselves plus string payloads,
+  ///   but not other heap structures (such as container internals).
+  class ScriptMemoryAccount : public P44Obj
+  {
+    friend class ScriptObj;
+
+    size_t mLiveObjects; ///< number of currently allocated objects
+    size_t mLiveBytes; ///< number of bytes currently allocated
+    size_t mPeakBytes; ///< highest mLiveBytes seen so far
+    uint64_t mAllocations; ///< total number of allocations
+    size_t mMaxBytes; ///< soft limit for mLiveBytes, 0 if none
+    size_t mMaxObjects; ///< soft limit for mLiveObjects, 0 if none
+    MLMicroSeconds mRateSampleTime; ///< time of the last allocation rate sample
+    uint64_t mRateSampleAllocations; ///< mAllocations at the last allocation rate sample
+    ScriptMemoryAccountPtr mTotal; ///< account that is charged with everything charged to this one, NULL if none
+
+    void allocated(size_t aBytes)
+    {
+      mLiveObjects++;
+      mAllocations++;
+      mLiveBytes += aBytes;
+      if (mLiveBytes>mPeakBytes) mPeakBytes = mLiveBytes;
+      if (mTotal) mTotal->allocated(aBytes);
+    }
+
+    void grown(size_t aBytes)
+    {
+      mLiveBytes += aBytes;
+      if (mLiveBytes>mPeakBytes) mPeakBytes = mLiveBytes;
+      if (mTotal) mTotal->grown(aBytes);
+    }
+
+    void released(size_t aBytes)
+    {
+      mLiveObjects--;
+      mLiveBytes -= aBytes;
+      if (mTotal) mTotal->released(aBytes);
+    }
+
+  public:
+
+    /// create account
+    /// @param aTotal if set, everything charged to this account is also charged to aTotal
+    ScriptMemoryAccount(ScriptMemoryAccountPtr aTotal = ScriptMemoryAccountPtr());
+
+    /// makes an account current (for the calling thread) for the lifetime of the scope object
+    class Scope
+    {
+      ScriptMemoryAccount* mPrevious;
+      ScriptMemoryAccountPtr mAccount;
+    public:
+      Scope(ScriptMemoryAccountPtr aAccount);
+      ~Scope();
+    };
+
+    /// @return the account objects are currently attributed to in the calling thread, NULL if none
+    static ScriptMemoryAccount* current();
+
+    /// @name statistics
+    /// @{
+
+    size_t liveObjects() const { return mLiveObjects; } ///< @return number of currently allocated objects
+    size_t liveBytes() const { return mLiveBytes; } ///< @return number of currently allocated bytes
+    size_t peakBytes() const { return mPeakBytes; } ///< @return peak number of allocated bytes
+    uint64_t allocations() const { return mAllocations; } ///< @return total number of allocations so far
+
+    /// @return allocations per second since the previous call (or since creation for the first call)
+    double allocationRate();
+
+    /// reset peak to current allocation
+    void resetPeak() { mPeakBytes = mLiveBytes; }
+
+    #if SCRIPTING_JSON_SUPPORT
+    /// @return statistics as a JSON object
+    JsonObjectPtr statusInfo();
+    #endif
+
+    /// @}
+
+    /// @name soft limits
+    /// @{
+
+    /// set soft limits
+    /// @param aMaxBytes max number of bytes, 0 for no limit
+    /// @param aMaxObjects max number of objects, 0 for no limit
+    /// @note limits are "soft" in that they do not prevent allocation, but threads running in the
+    ///   accounted context are aborted with ScriptError::MemoryLimit when they are stepped while the
+    ///   account exceeds its limits
+    void setLimits(size_t aMaxBytes, size_t aMaxObjects) { mMaxBytes = aMaxBytes; mMaxObjects = aMaxObjects; }
+
+    size_t maxBytes() const { return mMaxBytes; } ///< @return max number of bytes, 0 if unlimited
+    size_t maxObjects() const { return mMaxObjects; } ///< @return max number of objects, 0 if unlimited
+
+    /// @return true if one of the limits is exceeded
+    bool overLimit() const { return (mMaxBytes && mLiveBytes>mMaxBytes) || (mMaxObjects && mLiveObjects>mMaxObjects); }
+
+    /// @}
+
+  };
+
+  #endif // P44SCRIPT_MEMORY_ACCOUNTING
+
+
   // MARK: - ScriptObj base class
 
   /// Base Object in scripting
@@ -461,9 +616,39 @@ namespace p44 { namespace P44Script {
 
     int mAssignmentRefCount; ///< reference count for use of assignmentValue() and deactivateAssignment()
 
+    #if P44SCRIPT_MEMORY_ACCOUNTING
+    ScriptMemoryAccountPtr mMemoryAccount; ///< the account this object is attributed to, NULL if not accounted
+    size_t mAccountedBytes; ///< number of bytes attributed to mMemoryAccount
+    #endif
+
   public:
 
-    ScriptObj() : mAssignmentRefCount(0) {};
+    ScriptObj();
+    virtual ~ScriptObj();
+
+    #if P44SCRIPT_MEMORY_ACCOUNTING || P44SCRIPT_POOLED_ALLOCATION
+    /// heap allocation, passes the size to the constructor for accounting, and/or allocates from pool
+    static void* operator new(size_t aSize);
+    #if P44SCRIPT_POOLED_ALLOCATION
+    static void operator delete(void* aPtr, size_t aSize) { ScriptObjPool::release(aPtr, aSize); }
+    #else
+    static void operator delete(void* aPtr) { ::operator delete(aPtr); }
+    #endif
+    #endif
+
+  protected:
+
+    /// account additional heap memory owned by this object
+    /// @param aBytes number of bytes to add to the object's accounted size
+    /// @note only has an effect for objects that are accounted at all
+    void accountAdditionalBytes(size_t aBytes)
+    {
+      #if P44SCRIPT_MEMORY_ACCOUNTING
+      if (mMemoryAccount) { mAccountedBytes += aBytes; mMemoryAccount->grown(aBytes); }
+      #endif
+    }
+
+  public:
 
     /// @name information
     /// @{
@@ -1024,7 +1209,7 @@ namespace p44 { namespace P44Script {
   protected:
     string mStr;
   public:
-    StringValue(string aString) : mStr(aString) {};
+    StringValue(string aString) : mStr(aString) { accountAdditionalBytes(mStr.capacity()); };
     virtual string getAnnotation() const P44_OVERRIDE { return "string"; };
     virtual TypeInfo getTypeInfo() const P44_OVERRIDE { return text; };
     // value getters
@@ -1477,6 +1662,9 @@ namespace p44 { namespace P44Script {
 
     ScriptingDomainPtr mDomainObj; ///< the scripting domain (unless it's myself to avoid locking)
     ScriptObjPtr mThisObj; ///< the object _instance_ scope of this execution context (if any)
+    #if P44SCRIPT_MEMORY_ACCOUNTING
+    ScriptMemoryAccountPtr mMemoryAccount; ///< accounting of objects allocated by threads running in this context
+    #endif
 
     #if P44SCRIPT_FULL_SUPPORT
     typedef std::list<CompiledHandlerPtr> HandlerList;
@@ -1521,6 +1709,11 @@ namespace p44 { namespace P44Script {
     virtual ScriptingDomainPtr domain() const P44_OVERRIDE { return mDomainObj; }
     virtual ScriptMainContextPtr scriptmain() const P44_OVERRIDE { return ScriptMainContextPtr(const_cast<ScriptMainContext*>(this)); }
 
+    #if P44SCRIPT_MEMORY_ACCOUNTING
+    /// @return the memory account of this context (statistics and soft limits)
+    ScriptMemoryAccountPtr memoryAccount() const { return mMemoryAccount; }
+    #endif
+
     #if P44SCRIPT_FULL_SUPPORT
 
     /// @return info about handlers
@@ -1535,6 +1728,15 @@ namespace p44 { namespace P44Script {
     /// @return Ok or error
     ScriptObjPtr registerHandler(ScriptObjPtr aHandler);
 
+    /// find an already registered handler from a previous version of a source which is unchanged in the new version,
+    /// and relocate it to the new version's position
+    /// @param aPreviousSource the previous version of the source
+    /// @param aHandler the newly compiled (not yet initialized) handler
+    /// @param aTrigger the newly compiled trigger for aHandler
+    /// @return the existing handler (now referring to the new source), or NULL if none can be reused
+    /// @note reusing keeps event registrations, trigger state and frozen values of the existing handler
+    CompiledHandlerPtr adoptUnchangedHandler(SourceContainerPtr aPreviousSource, CompiledHandlerPtr aHandler, CompiledTriggerPtr aTrigger);
+
     virtual void clearVars() P44_OVERRIDE;
     virtual void releaseObjsFromSource(SourceContainerPtr aSource) P44_OVERRIDE;
     virtual bool abort(EvaluationFlags aAbortFlags = stopall, ScriptObjPtr aAbortResult = ScriptObjPtr(), ScriptCodeThreadPtr aExceptThread = ScriptCodeThreadPtr()) P44_OVERRIDE;
@@ -2045,6 +2247,10 @@ namespace p44 { namespace P44Script {
       string mOriginLabel; ///< a label used for logging and error reporting
       P44LoggingObj* mLoggingContextP; ///< the logging context
       SourceContainerPtr mSourceContainer; ///< the container of the source
+      #if P44SCRIPT_FULL_SUPPORT
+      SourceContainerPtr mPreviousSource; ///< previous version of the source while recompiling incrementally
+      size_t mReusedHandlers; ///< number of unchanged handlers kept at last incremental recompilation
+      #endif
       #if P44SCRIPT_REGISTERED_SOURCE
       string mScriptHostUid; ///< domain-unique, persistent ID for this source
       string mTitleTemplate; ///< user facing template for title
@@ -2307,6 +2513,13 @@ namespace p44 { namespace P44Script {
     /// @return error in case of syntax errors or other fatal conditions
     ScriptObjPtr syntaxcheck();
 
+    #if P44SCRIPT_FULL_SUPPORT
+    /// @return number of global handlers kept running unchanged when the source was last changed by setSource()
+    /// @note when the source of an already compiled script changes, it is recompiled right away, and
+    ///   handlers that are textually unchanged keep their event registrations and trigger state.
+    size_t reusedHandlers() const { return active() ? mActiveParams->mReusedHandlers : 0; }
+    #endif
+
     /// reset to state before compilation, i.e. stop all threads running code from this source
     /// including handlers, undeclare all handlers that were declared by this source
     /// @param aDoAbort if set, threads will be aborted. Otherwise, threads will keep running and will possibly keep
@@ -2355,6 +2568,7 @@ namespace p44 { namespace P44Script {
   private:
 
     void doAutorestart();
+    void releaseObjsFromSource(SourceContainerPtr aSource);
 
   };
 
@@ -2467,6 +2681,11 @@ namespace p44 { namespace P44Script {
 
     GeoLocation *mGeoLocationP;
     MLMicroSeconds mMaxBlockTime;
+    #if P44SCRIPT_MEMORY_ACCOUNTING
+    size_t mDefaultMaxBytes; ///< soft memory limit (bytes) for new contexts
+    size_t mDefaultMaxObjects; ///< soft memory limit (objects) for new contexts
+    ScriptMemoryAccountPtr mTotalMemoryAccount; ///< sum of the accounts of all contexts of this domain, including its own
+    #endif
 
     #if P44SCRIPT_REGISTERED_SOURCE
     typedef std::vector<SourceHostPtr> SourceHostsVector;
@@ -2483,10 +2702,18 @@ namespace p44 { namespace P44Script {
     ScriptingDomain() :
       inherited(ScriptingDomainPtr(), ScriptObjPtr()), mGeoLocationP(NULL),
       mMaxBlockTime(DEFAULT_MAX_BLOCK_TIME)
+      #if P44SCRIPT_MEMORY_ACCOUNTING
+      , mDefaultMaxBytes(0), mDefaultMaxObjects(0)
+      #endif
       #if P44SCRIPT_DEBUGGING_SUPPORT
       , mDefaultPausingMode(running)
       #endif
-    {};
+    {
+      #if P44SCRIPT_MEMORY_ACCOUNTING
+      mTotalMemoryAccount = new ScriptMemoryAccount();
+      mMemoryAccount = new ScriptMemoryAccount(mTotalMemoryAccount); // nothing accounted yet, so can be replaced
+      #endif
+    };
 
     /// @name environment
     /// @{
@@ -2505,6 +2732,18 @@ namespace p44 { namespace P44Script {
     /// @return domain's maxblocktime
     MLMicroSeconds getMaxBlockTime() { return mMaxBlockTime; };
 
+    #if P44SCRIPT_MEMORY_ACCOUNTING
+    /// set soft memory limits applied to contexts created from now on via newContext()
+    /// @param aMaxBytes max number of bytes, 0 for no limit
+    /// @param aMaxObjects max number of objects, 0 for no limit
+    /// @note the domain's own context is not affected, use memoryAccount()->setLimits() for that
+    void setDefaultMemoryLimits(size_t aMaxBytes, size_t aMaxObjects) { mDefaultMaxBytes = aMaxBytes; mDefaultMaxObjects = aMaxObjects; };
+
+    /// @return account summing up the accounts of all contexts created by this domain, plus the domain's own context
+    /// @note limits set on this account are not enforced, as no thread runs in it
+    ScriptMemoryAccountPtr totalMemoryAccount() const { return mTotalMemoryAccount; }
+    #endif
+
     /// @}
 
     /// get new execution context
@@ -2767,6 +3006,12 @@ namespace p44 { namespace P44Script {
     /// @note must cause calling resume()
     virtual void storeHandler();
 
+    /// check for an existing handler that can be used instead of a newly compiled one
+    /// @param aHandler the newly compiled handler
+    /// @param aTrigger the newly compiled trigger
+    /// @return existing handler to use instead of aHandler, or NULL if aHandler needs to be initialized and used
+    virtual CompiledHandlerPtr unchangedHandler(CompiledHandlerPtr aHandler, ScriptObjPtr aTrigger) { return CompiledHandlerPtr(); }
+
     #endif // P44SCRIPT_FULL_SUPPORT
 
     /// must set a new funcCallContext suitable to execute result as a function
@@ -3039,6 +3284,11 @@ namespace p44 { namespace P44Script {
     SourceCursor getCursor() { return mCursor; };
 
     bool codeFromSameSourceAs(const CompiledCode &aCode) const; ///< return true if both compiled codes are from the same source position
+    bool sameCodeAs(const CompiledCode &aCode) const; ///< return true if both compiled codes have identical source text (possibly at different positions)
+
+    /// re-associate this code with identical source text at another position, usually in an edited version of the source
+    /// @param aCursor cursor covering the identical code in the new source
+    virtual void relocate(const SourceCursor& aCursor);
     virtual bool originatesFrom(SourceContainerPtr aSource) const P44_OVERRIDE { return mCursor.refersTo(aSource); };
     virtual bool floating() const P44_OVERRIDE { return mCursor.mSourceContainer->floating(); }
     virtual P44LoggingObj* loggingContext() const P44_OVERRIDE { return mCursor.mSourceContainer ? mCursor.mSourceContainer->mLoggingContextP : NULL; };
@@ -3223,6 +3473,12 @@ namespace p44 { namespace P44Script {
     void scheduleEvalNotLaterThan(const MLMicroSeconds aLatestEval);
 
 
+    /// @return true if aTrigger has identical code and the same trigger mode, holdoff and result variable
+    bool sameTriggerAs(const CompiledTrigger &aTrigger) const;
+
+    /// re-associate this trigger with identical code at another source position, keeping state, event sources and frozen values
+    virtual void relocate(const SourceCursor& aCursor) P44_OVERRIDE;
+
     /// return a frozen event result exists for the source position at aFreezeId
     /// @param aResult On call: the current result of a (sub)expression
     ///   On return: replaced by a frozen event result, if one exists
@@ -3291,6 +3547,8 @@ namespace p44 { namespace P44Script {
     virtual string getAnnotation() const P44_OVERRIDE { return "handler"; };
 
     void installAndInitializeTrigger(ScriptObjPtr aTrigger);
+    /// @return true if aHandler with its trigger aTrigger is textually identical to this handler and would run in the same context
+    bool sameHandlerAs(const CompiledHandler &aHandler, const CompiledTrigger &aTrigger) const;
     virtual bool originatesFrom(SourceContainerPtr aSource) const P44_OVERRIDE
       { return inherited::originatesFrom(aSource) || (mTrigger && mTrigger->originatesFrom(aSource)); };
     virtual void deactivate() P44_OVERRIDE;
@@ -3313,10 +3571,15 @@ namespace p44 { namespace P44Script {
 
     ScriptingDomainPtr mDomain; ///< the domain to store compiled functions and handlers
     ScriptMainContextPtr mCompileForContext; ///< the main context this script is compiled for and should execute in later
+    #if P44SCRIPT_FULL_SUPPORT
+    SourceContainerPtr mPreviousSource; ///< previous version of the source, unchanged handlers from it are reused
+    size_t mReusedHandlers; ///< number of handlers reused from mPreviousSource
+    size_t mCompiledHandlers; ///< number of handlers newly compiled and initialized
+    #endif
 
   public:
 
-    ScriptCompiler(ScriptingDomainPtr aDomain) : mDomain(aDomain) {}
+    ScriptCompiler(ScriptingDomainPtr aDomain);
 
     virtual void deactivate() P44_OVERRIDE;
 
@@ -3333,6 +3596,17 @@ namespace p44 { namespace P44Script {
 
     #if P44SCRIPT_FULL_SUPPORT
 
+    /// set previous version of the source being compiled, for incremental recompilation
+    /// @param aPreviousSource the previous version. Global handlers from it which are unchanged in the new
+    ///   version will be kept running (relocated to the new source) instead of being replaced by new ones.
+    void setPreviousSource(SourceContainerPtr aPreviousSource) { mPreviousSource = aPreviousSource; }
+
+    /// @return number of handlers reused from the previous source in the last compile()
+    size_t reusedHandlers() const { return mReusedHandlers; }
+
+    /// @return number of handlers newly compiled in the last compile()
+    size_t compiledHandlers() const { return mCompiledHandlers; }
+
     /// must store result as a compiled function in the scripting domain
     /// @note must cause calling resume()
     virtual void storeFunction() P44_OVERRIDE;
@@ -3341,6 +3615,9 @@ namespace p44 { namespace P44Script {
     /// @note must cause calling resume()
     virtual void storeHandler() P44_OVERRIDE;
 
+    /// check for an unchanged handler from the previous source
+    virtual CompiledHandlerPtr unchangedHandler(CompiledHandlerPtr aHandler, ScriptObjPtr aTrigger) P44_OVERRIDE;
+
     #endif // P44SCRIPT_FULL_SUPPORT
 
     /// @return true if running as compiler
@@ -3391,6 +3668,9 @@ namespace p44 { namespace P44Script {
     ExecutionContextPtr mChainedExecutionContext; ///< set during calls to other contexts, e.g. to propagate abort()
     ScriptCodeThreadPtr mChainedFromThread; ///< the thread from which this thread is a chained execution, if any
     MLTicket mAutoResumeTicket; ///< auto-resume ticket
+    #if P44SCRIPT_MEMORY_ACCOUNTING
+    ScriptMemoryAccountPtr mMemoryAccount; ///< the account objects allocated by this thread are attributed to
+    #endif
 
     #if P44SCRIPT_DEBUGGING_SUPPORT
 
@@ -3410,6 +3690,11 @@ namespace p44 { namespace P44Script {
 
     virtual ~ScriptCodeThread();
 
+    #if P44SCRIPT_POOLED_ALLOCATION
+    static void* operator new(size_t aSize) { return ScriptObjPool::allocate(aSize); }
+    static void operator delete(void* aPtr, size_t aSize) { ScriptObjPool::release(aPtr, aSize); }
+    #endif
+
     virtual void deactivate() P44_OVERRIDE;
 
     /// logging context to use
@@ -3851,6 +4136,176 @@ namespace p44 { namespace P44Script {
 
   #endif // P44SCRIPT_REGISTERED_SOURCE
 
+
+  #if P44SCRIPT_WORKER_THREADS
+
+  // MARK: - Script worker threads
+
+  class ScriptWorker;
+  typedef boost::intrusive_ptr<ScriptWorker> ScriptWorkerPtr;
+
+  /// callback delivering the result of a job executed by a ScriptWorker (called on the thread that started the job)
+  /// @param aResult the result, as JSON (NULL if the result has no JSON representation)
+  /// @param aError error if the job failed, NULL otherwise
+  typedef boost::function<void (JsonObjectPtr aResult, ErrorPtr aError)> WorkerResultCB;
+
+  /// callback delivering a message posted with `postmessage()` from a script running in a ScriptWorker
+  /// @param aMessage the message, as JSON
+  typedef boost::function<void (JsonObjectPtr aMessage)> WorkerMessageCB;
+
+  /// callback to set up the worker's domain and context, e.g. to add builtins or member lookups
+  /// @note this is called ON THE WORKER THREAD, and must not access any objects of the parent thread's
+  ///   scripting domain
+  typedef boost::function<void (StandardScriptingDomain& aWorkerDomain, ScriptMainContextPtr aWorkerContext)> WorkerSetupCB;
+
+
+  /// Standard scripting domain for use in worker threads, additionally has builtins
+  /// to communicate with the parent thread
+  class WorkerScriptingDomain : public StandardScriptingDomain
+  {
+    typedef StandardScriptingDomain inherited;
+
+    ScriptWorker& mWorker;
+
+  public:
+
+    WorkerScriptingDomain(ScriptWorker& aWorker);
+
+    /// @return the worker this domain runs in
+    ScriptWorker& worker() { return mWorker; }
+
+  };
+  typedef boost::intrusive_ptr<WorkerScriptingDomain> WorkerScriptingDomainPtr;
+
+
+  /// Runs an independent ScriptMainContext in a separate scripting domain on a worker thread with its own MainLoop.
+  /// This allows CPU heavy computations in independent contexts to use other cores and not delay the parent mainloop.
+  /// @note No ScriptObj, JsonObject or other refcounted object is ever shared between the threads. All data crossing the
+  ///   thread boundary is marshalled as JSON text. Worker scripts only see the worker domain's globals. Access to
+  ///   the parent thread is limited to `mainglobal(name)`, which returns a copy of a parent domain global
+  ///   (executed on the parent mainloop while the worker waits), and `postmessage(value)`, which asynchronously
+  ///   delivers a value to the WorkerMessageCB on the parent mainloop.
+  class ScriptWorker : public P44LoggingObj
+  {
+    typedef P44LoggingObj inherited;
+    friend class WorkerScriptingDomain;
+
+    typedef enum {
+      job_execute, ///< execute code as anonymous function in the worker context
+      job_loadscript, ///< set and run persistent worker script (which can define functions and handlers)
+    } JobType;
+
+    typedef struct {
+      uint32_t mJobId;
+      JobType mJobType;
+      string mSource;
+      string mArgsJson;
+      MLMicroSeconds mMaxRunTime;
+    } WorkerJob;
+    typedef std::list<WorkerJob> JobList;
+
+    typedef struct {
+      uint32_t mJobId; ///< 0 for messages
+      string mJson; ///< result or message as JSON text, empty if none
+      bool mIsError;
+      string mErrorDomain;
+      ErrorCode mErrorCode;
+      string mErrorText;
+    } WorkerOutput;
+    typedef std::list<WorkerOutput> OutputList;
+
+    typedef std::map<uint32_t, WorkerResultCB> ResultCBMap;
+
+    // parent thread side
+    string mName;
+    ChildThreadWrapperPtr mThread;
+    ScriptingDomainPtr mParentDomain; ///< the domain `mainglobal()` accesses
+    ResultCBMap mResultCBs;
+    WorkerMessageCB mMessageCB;
+    uint32_t mNextJobId;
+    ScriptWorkerPtr mKeepAlive; ///< keeps the worker alive while its thread is running
+
+    // shared, protected by mQueueMutex
+    pthread_mutex_t mQueueMutex;
+    JobList mJobs;
+    OutputList mOutputs;
+    int mWakeupPipe[2]; ///< to wake up the worker thread's mainloop
+
+    // worker thread side
+    ChildThreadWrapper* mWorkerThreadP;
+    WorkerScriptingDomainPtr mWorkerDomain;
+    ScriptMainContextPtr mWorkerContext;
+    ScriptHost* mWorkerScriptP;
+    WorkerSetupCB mSetupCB;
+
+  public:
+
+    /// create a worker
+    /// @param aName name of the worker (for logging)
+    ScriptWorker(const string aName);
+    virtual ~ScriptWorker();
+
+    virtual string contextType() const P44_OVERRIDE { return "script worker"; };
+    virtual string contextName() const P44_OVERRIDE { return mName; };
+
+    /// start the worker thread
+    /// @param aSetupCB if set, this is called on the worker thread after creating the worker domain and context
+    /// @param aParentDomain the domain `mainglobal()` accesses. Defaults to the parent thread's standard domain.
+    /// @return ok or error when the thread could not be started
+    ErrorPtr start(WorkerSetupCB aSetupCB = NoOP, ScriptingDomainPtr aParentDomain = ScriptingDomainPtr());
+
+    /// stop the worker thread. Pending jobs will get their callback invoked with ScriptError::Aborted
+    void stop();
+
+    /// @return true if the worker thread is running
+    bool isRunning() const { return mThread!=nullptr; }
+
+    /// execute code in the worker context
+    /// @param aSource source code, is run like `eval()`, i.e. as an anonymous function in the worker's context.
+    /// @param aArgs the argument, available to the code as `arg1` (can be NULL)
+    /// @param aResultCB called on the parent thread's mainloop with the result
+    /// @param aMaxRunTime max run time of the job
+    void execute(const string aSource, JsonObjectPtr aArgs, WorkerResultCB aResultCB, MLMicroSeconds aMaxRunTime = Infinite);
+
+    /// set and run the persistent worker script, which can define functions and handlers in the worker context
+    /// @param aSource source code. Pass empty string to remove the script and all functions and handlers it has defined.
+    /// @param aResultCB called on the parent thread's mainloop with the result of running the script's main body
+    void loadScript(const string aSource, WorkerResultCB aResultCB = NoOP);
+
+    /// set handler for messages posted from worker scripts with `postmessage()`
+    void setMessageHandler(WorkerMessageCB aMessageCB) { mMessageCB = aMessageCB; }
+
+    /// @return number of jobs not yet completed
+    size_t pendingJobs() const { return mResultCBs.size(); }
+
+  private:
+
+    // parent thread side
+    uint32_t queueJob(JobType aJobType, const string& aSource, const string& aArgsJson, MLMicroSeconds aMaxRunTime, WorkerResultCB aResultCB);
+    void threadSignalHandler(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode);
+    void deliverOutputs();
+    void threadEnded();
+    void closeWakeupPipe();
+    ErrorPtr fetchParentGlobal(ChildThreadWrapper &aThread, const string& aName, string& aJson);
+
+    // worker thread side
+    void workerThreadRoutine(ChildThreadWrapper &aThread);
+    bool workerWakeupHandler(int aPollFlags);
+    void runJob(const WorkerJob& aJob);
+    void jobDone(uint32_t aJobId, ScriptObjPtr aResult);
+    void postOutput(const WorkerOutput& aOutput);
+
+  public:
+
+    // for worker builtins, to be called on the worker thread only
+    void postMessageFromWorker(ScriptObjPtr aMessage);
+    ScriptObjPtr parentGlobalForWorker(const string& aName);
+
+  };
+
+  #endif // P44SCRIPT_WORKER_THREADS
+
+
   #if ENABLE_FILTER_FUNCS
   namespace BuiltinFunctions {
     WindowEvaluatorPtr filterFromParams(BuiltinFunctionContextPtr f);
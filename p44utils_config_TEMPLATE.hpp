@@ -44,6 +44,12 @@
 #ifndef ENABLE_JSON_APPLICATION
   #define ENABLE_JSON_APPLICATION 0 // enables JSON utilities in Application, requires json-c
 #endif
+#ifndef ENABLE_LOG_COMPRESSION
+  #define ENABLE_LOG_COMPRESSION 0 // enables compression of rotated log files, requires zlib
+#endif
+#ifndef ENABLE_WEBSOCKET_COMPRESSION
+  #define ENABLE_WEBSOCKET_COMPRESSION 0 // enables permessage-deflate for websocket text messages, requires zlib
+#endif
 
 
 #endif // __p44utils__config__
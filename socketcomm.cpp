@@ -42,6 +42,10 @@ const struct in6_addr in6addr_loopback = IN6ADDR_LOOPBACK_INIT;
 
 using namespace p44;
 
+#define CONNECTION_ATTEMPT_DELAY (250*MilliSecond) // delay before starting a parallel connection attempt to the next address (RFC 8305)
+#define DATAGRAM_MAX_BATCHES_PER_CYCLE 4 // max number of batches delivered per mainloop cycle before giving other handlers a chance
+#define DATAGRAM_SEND_CHUNK 32 // max number of datagrams passed to the kernel in one call
+
 SocketComm::SocketComm(MainLoop &aMainLoop) :
   FdComm(aMainLoop),
   mProtocolFamily(PF_UNSPEC),
@@ -52,8 +56,9 @@ SocketComm::SocketComm(MainLoop &aMainLoop) :
   mConnectionLess(false),
   mBroadcast(false),
   mConnectionFd(-1),
-  mAddressInfoList(NULL),
-  mCurrentAddressInfo(NULL),
+  mNextAddress(0),
+  mResolveSerial(0),
+  mInitiating(false),
   mCurrentSockAddrP(NULL),
   mPeerSockAddrP(NULL),
   mPeerSockAddrLen(0),
@@ -61,6 +66,11 @@ SocketComm::SocketComm(MainLoop &aMainLoop) :
   mIsClosing(false),
   mConnectionOpen(false),
   mClearHandlersAtClose(false),
+  mAcceptedConnections(0),
+  mRejectedConnections(0),
+  mMaxBatch(0),
+  mMaxDatagramSize(0),
+  mBatchBuffer(NULL),
   mMaxServerConnections(1)
 {
 }
@@ -72,6 +82,7 @@ SocketComm::~SocketComm()
   if (!mIsClosing) {
     internalCloseConnection();
   }
+  if (mBatchBuffer) free(mBatchBuffer);
 }
 
 
@@ -244,6 +255,15 @@ ErrorPtr SocketComm::startServer(ServerConnectionCB aServerConnectionHandler, in
         if (setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, (char *)&one, (int)sizeof(one)) == -1) {
           err = SysError::errNo("Cannot setsockopt(SO_REUSEADDR): ");
         }
+        #ifdef SO_REUSEPORT
+        else if (mServerGroup && setsockopt(socketFD, SOL_SOCKET, SO_REUSEPORT, (char *)&one, (int)sizeof(one)) == -1) {
+          err = SysError::errNo("Cannot setsockopt(SO_REUSEPORT): ");
+        }
+        #else
+        else if (mServerGroup) {
+          err = Error::err<SocketCommError>(SocketCommError::Unsupported, "SO_REUSEPORT not supported on this platform");
+        }
+        #endif
         else {
           #if defined(ESP_PLATFORM) || defined(__APPLE__)
           if (!mInterface.empty()) {
@@ -266,7 +286,8 @@ ErrorPtr SocketComm::startServer(ServerConnectionCB aServerConnectionHandler, in
   }
   // listen
   if (Error::isOK(err)) {
-    if (mSocketType==SOCK_STREAM && listen(socketFD, mMaxServerConnections) < 0) {
+    // Note: backlog is not limited to max connections, to survive connection storms (limit is enforced when accepting)
+    if (mSocketType==SOCK_STREAM && listen(socketFD, SOMAXCONN) < 0) {
       err = SysError::errNo("Cannot listen on socket: ");
     }
     else {
@@ -293,70 +314,26 @@ ErrorPtr SocketComm::startServer(ServerConnectionCB aServerConnectionHandler, in
 
 bool SocketComm::connectionAcceptHandler(int aFd, int aPollFlags)
 {
-  ErrorPtr err;
   if (aPollFlags & POLLIN) {
-    // server socket has data, means connection waiting to get accepted
-    socklen_t fsinlen;
-    struct sockaddr fsin;
-    int clientFD = -1;
-    fsinlen = sizeof(fsin);
-    clientFD = accept(mConnectionFd, (struct sockaddr *) &fsin, &fsinlen);
-    if (clientFD>0) {
-      // get address and port of incoming connection
-      char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-      #ifndef ESP_PLATFORM
-      if (mProtocolFamily==PF_LOCAL) {
-        // no real address and port
-        strcpy(hbuf,"local");
-        strcpy(sbuf,"local_socket");
-      }
-      else
-      #endif // !ESP_PLATFORM
-      {
-        #ifdef ESP_PLATFORM
-        #warning "%%% ESP32 version of getnameinfo missing"
-        // TODO: find how to use getnameinfo on ESP32
-        #else
-        int s = getnameinfo(
-          &fsin, fsinlen,
-          hbuf, sizeof hbuf,
-          sbuf, sizeof sbuf,
-          NI_NUMERICHOST | NI_NUMERICSERV
-        );
-        if (s!=0)
-        #endif
-        {
-          strcpy(hbuf,"<unknown>");
-          strcpy(sbuf,"<unknown>");
+    SocketCommPtr keepMyselfAlive(this);
+    // server socket has data, means connection(s) waiting to get accepted
+    // - accept all of them in one go, connections often arrive in bursts
+    while (mServing) {
+      struct sockaddr_storage fsin;
+      socklen_t fsinlen = sizeof(fsin);
+      #if defined(__linux__) && !defined(ESP_PLATFORM)
+      int clientFD = accept4(mConnectionFd, (struct sockaddr *)&fsin, &fsinlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+      #else
+      int clientFD = accept(mConnectionFd, (struct sockaddr *)&fsin, &fsinlen);
+      #endif
+      if (clientFD<0) {
+        if (errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR && errno!=ECONNABORTED) {
+          LOG(LOG_WARNING, "Cannot accept connection: %s", strerror(errno));
         }
+        if (errno==EINTR || errno==ECONNABORTED) continue; // try next
+        break; // no more pending connections (or error)
       }
-      // actually accepted
-      // - establish keepalive checks, so we'll detect eventually when client connection breaks w/o FIN
-      int one = 1;
-      if (setsockopt(clientFD, SOL_SOCKET, SO_KEEPALIVE, (char *)&one, (int)sizeof(one)) == -1) {
-        LOG(LOG_WARNING, "Cannot set SO_KEEPALIVE for new connection");
-      }
-      // - call handler to create child connection
-      SocketCommPtr clientComm;
-      if (mServerConnectionHandler) {
-        clientComm = mServerConnectionHandler(this);
-      }
-      if (clientComm) {
-        // - set host/port
-        clientComm->mHostNameOrAddress = hbuf;
-        clientComm->mServiceOrPortOrSocket = sbuf;
-        // - remember
-        mClientConnections.push_back(clientComm);
-        LOG(LOG_DEBUG, "New client connection accepted from %s:%s (now %zu connections)", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str(), mClientConnections.size());
-        // - pass connection to child
-        clientComm->passClientConnection(clientFD, this);
-      }
-      else {
-        // can't handle connection, close immediately
-        LOG(LOG_NOTICE, "Connection not accepted from %s:%s - shut down", hbuf, sbuf);
-        shutdown(clientFD, SHUT_RDWR);
-        close(clientFD);
-      }
+      acceptClientConnection(clientFD, fsin, fsinlen);
     }
   }
   // handled
@@ -364,6 +341,84 @@ bool SocketComm::connectionAcceptHandler(int aFd, int aPollFlags)
 }
 
 
+void SocketComm::acceptClientConnection(int aClientFd, const struct sockaddr_storage &aAddr, socklen_t aAddrLen)
+{
+  // get address and port of incoming connection
+  char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+  #ifndef ESP_PLATFORM
+  if (mProtocolFamily==PF_LOCAL) {
+    // no real address and port
+    strcpy(hbuf,"local");
+    strcpy(sbuf,"local_socket");
+  }
+  else
+  #endif // !ESP_PLATFORM
+  {
+    #ifdef ESP_PLATFORM
+    #warning "%%% ESP32 version of getnameinfo missing"
+    // TODO: find how to use getnameinfo on ESP32
+    #else
+    int s = getnameinfo(
+      (const struct sockaddr *)&aAddr, aAddrLen,
+      hbuf, sizeof hbuf,
+      sbuf, sizeof sbuf,
+      NI_NUMERICHOST | NI_NUMERICSERV
+    );
+    if (s!=0)
+    #endif
+    {
+      strcpy(hbuf,"<unknown>");
+      strcpy(sbuf,"<unknown>");
+    }
+  }
+  // check connection limit
+  bool limitReached;
+  if (mServerGroup) {
+    // limit is global for all listeners of the group
+    limitReached = !mServerGroup->addConnection();
+  }
+  else {
+    limitReached = (int)mClientConnections.size()>=mMaxServerConnections;
+  }
+  if (limitReached) {
+    mRejectedConnections++;
+    LOG(LOG_NOTICE, "Connection from %s:%s rejected - max number of connections (%d) reached", hbuf, sbuf, mServerGroup ? mServerGroup->mMaxConnections : mMaxServerConnections);
+    close(aClientFd);
+    return;
+  }
+  // actually accepted
+  // - establish keepalive checks, so we'll detect eventually when client connection breaks w/o FIN
+  int one = 1;
+  if (setsockopt(aClientFd, SOL_SOCKET, SO_KEEPALIVE, (char *)&one, (int)sizeof(one)) == -1) {
+    LOG(LOG_WARNING, "Cannot set SO_KEEPALIVE for new connection");
+  }
+  // - call handler to create child connection
+  SocketCommPtr clientComm;
+  if (mServerConnectionHandler) {
+    clientComm = mServerConnectionHandler(this);
+  }
+  if (clientComm) {
+    mAcceptedConnections++;
+    // - set host/port
+    clientComm->mHostNameOrAddress = hbuf;
+    clientComm->mServiceOrPortOrSocket = sbuf;
+    // - remember
+    mClientConnections.push_back(clientComm);
+    LOG(LOG_DEBUG, "New client connection accepted from %s:%s (now %zu connections)", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str(), mClientConnections.size());
+    // - pass connection to child
+    clientComm->passClientConnection(aClientFd, this);
+  }
+  else {
+    // can't handle connection, close immediately
+    if (mServerGroup) mServerGroup->removeConnection();
+    mRejectedConnections++;
+    LOG(LOG_NOTICE, "Connection not accepted from %s:%s - shut down", hbuf, sbuf);
+    shutdown(aClientFd, SHUT_RDWR);
+    close(aClientFd);
+  }
+}
+
+
 void SocketComm::passClientConnection(int aFd, SocketCommPtr aServerConnection)
 {
   // make non-blocking
@@ -395,6 +450,7 @@ SocketCommPtr SocketComm::returnClientConnection(SocketCommPtr aClientConnection
       endingConnection = *pos;
       // remove from list
       mClientConnections.erase(pos);
+      if (mServerGroup) mServerGroup->removeConnection();
       break;
     }
   }
@@ -435,7 +491,8 @@ ErrorPtr SocketComm::initiateConnection()
   ErrorPtr err;
 
   if (!mConnectionOpen && !mIsConnecting && !mServerConnection) {
-    freeAddressInfo();
+    mAddresses.clear();
+    mNextAddress = 0;
     // check for protocolfamily auto-choice
     if (mProtocolFamily==PF_UNSPEC) {
       // not specified, choose local socket if service spec begins with slash
@@ -450,19 +507,14 @@ ErrorPtr SocketComm::initiateConnection()
       // local socket -> just connect, no lists to try
       LOG(LOG_DEBUG, "Initiating local socket %s connection", mServiceOrPortOrSocket.c_str());
       mHostNameOrAddress = "local"; // set it for log display
-      // synthesize address info for unix socket, because standard UN*X getaddrinfo() call usually does not handle PF_LOCAL
-      mAddressInfoList = new struct addrinfo;
-      memset(mAddressInfoList, 0, sizeof(addrinfo));
-      mAddressInfoList->ai_family = mProtocolFamily;
-      mAddressInfoList->ai_socktype = mSocketType;
-      mAddressInfoList->ai_protocol = mProtocol;
-      struct sockaddr_un *sunP = new struct sockaddr_un;
-      mAddressInfoList->ai_addr = (struct sockaddr *)sunP;
-      mAddressInfoList->ai_addrlen = sizeof(struct sockaddr_un);
-      memset((char *)sunP, 0, mAddressInfoList->ai_addrlen);
+      // synthesize address for unix socket, because standard UN*X getaddrinfo() call usually does not handle PF_LOCAL
+      struct sockaddr_storage sa;
+      memset(&sa, 0, sizeof(sa));
+      struct sockaddr_un *sunP = (struct sockaddr_un *)&sa;
       sunP->sun_family = (sa_family_t)mProtocolFamily;
       strncpy(sunP->sun_path, mServiceOrPortOrSocket.c_str(), sizeof (sunP->sun_path));
       sunP->sun_path[sizeof (sunP->sun_path) - 1] = '\0'; // emergency terminator
+      mAddresses.push_back(sa);
     }
     else
     #endif // !ESP_PLATFORM
@@ -472,14 +524,36 @@ ErrorPtr SocketComm::initiateConnection()
         err = Error::err<SocketCommError>(SocketCommError::NoParams, "Missing host name or address");
         goto done;
       }
+      #if ENABLE_ASYNC_DNS
+      if (!mHostNameOrAddress.empty()) {
+        // resolve host name asynchronously, connection attempts will start when addresses are known
+        uint16_t port;
+        err = servicePort(port);
+        if (Error::notOK(err)) goto done;
+        mIsConnecting = true; // resolving is the first phase of connecting
+        mInitiating = true;
+        mInitiateErr.reset();
+        DnsResolver::sharedResolver().resolve(
+          mHostNameOrAddress,
+          mProtocolFamily==PF_INET4_AND_6 ? PF_UNSPEC : mProtocolFamily,
+          boost::bind(&SocketComm::addressesResolved, SocketCommPtr(this), ++mResolveSerial, port, _1, _2)
+        );
+        mInitiating = false;
+        // Note: numeric, cached and hosts file addresses are resolved immediately, and possible errors must be reported now
+        err = mInitiateErr;
+        mInitiateErr.reset();
+        goto done;
+      }
+      #endif // ENABLE_ASYNC_DNS
       // try to resolve host and service name (at least: service name)
       struct addrinfo hint;
+      struct addrinfo *addressInfoList;
       memset(&hint, 0, sizeof(addrinfo));
       hint.ai_flags = 0; // no flags
       hint.ai_socktype = mSocketType;
       hint.ai_protocol = mProtocol;
       hint.ai_family = mProtocolFamily==PF_INET4_AND_6 ? PF_UNSPEC : mProtocolFamily;
-      res = getaddrinfo(mHostNameOrAddress.empty() ? NULL : mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str(), &hint, &mAddressInfoList);
+      res = getaddrinfo(mHostNameOrAddress.empty() ? NULL : mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str(), &hint, &addressInfoList);
       if (res!=0) {
         // error
         #ifdef ESP_PLATFORM
@@ -490,26 +564,18 @@ ErrorPtr SocketComm::initiateConnection()
         DBGLOG(LOG_DEBUG, "SocketComm: getaddrinfo failed: %s", err->text());
         goto done;
       }
-      // augment IPv6 with scope index info in case we have it
-      if (mAddressInfoList->ai_family==PF_INET6 && !mInterface.empty()) {
-        struct sockaddr_in6* addr6 = (struct sockaddr_in6 *)mAddressInfoList->ai_addr;
-        addr6->sin6_scope_id = if_nametoindex(mInterface.c_str());
-        if (addr6->sin6_scope_id==0) {
-          #ifdef ESP_PLATFORM
-          err = Error::err<SocketCommError>(SocketCommError::CannotResolve, "scope id '%s': error %d", mInterface.c_str(), res);
-          #else
-          err = Error::err<SocketCommError>(SocketCommError::CannotResolve, "scope id '%s': error %d: %s", mInterface.c_str(), res, gai_strerror(res));
-          #endif
-          DBGLOG(LOG_DEBUG, "SocketComm: if_nametoindex failed: %s", err->text());
-          goto done;
-
-        }
+      DnsAddressList addresses;
+      for (struct addrinfo *ai = addressInfoList; ai; ai = ai->ai_next) {
+        struct sockaddr_storage sa;
+        memset(&sa, 0, sizeof(sa));
+        memcpy(&sa, ai->ai_addr, ai->ai_addrlen<sizeof(sa) ? ai->ai_addrlen : sizeof(sa));
+        addresses.push_back(sa);
       }
+      freeaddrinfo(addressInfoList);
+      err = setAddresses(addresses, 0);
+      if (Error::notOK(err)) goto done;
     }
     // now try all addresses in the list
-    // - init iterator pointer
-    mCurrentAddressInfo = mAddressInfoList;
-    // - try connecting first address
     LOG(LOG_DEBUG, "Initializing socket for connection to %s port %s", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str());
     err = connectNextAddress();
   }
@@ -522,31 +588,110 @@ done:
 }
 
 
-void SocketComm::freeAddressInfo()
+ErrorPtr SocketComm::servicePort(uint16_t &aPort)
+{
+  char *e;
+  long p = strtol(mServiceOrPortOrSocket.c_str(), &e, 10);
+  if (!mServiceOrPortOrSocket.empty() && *e==0 && p>=0 && p<=0xFFFF) {
+    aPort = (uint16_t)p;
+    return ErrorPtr();
+  }
+  #ifndef ESP_PLATFORM
+  struct servent *se = getservbyname(mServiceOrPortOrSocket.c_str(), mSocketType==SOCK_DGRAM ? "udp" : "tcp");
+  if (se) {
+    aPort = ntohs((uint16_t)se->s_port);
+    return ErrorPtr();
+  }
+  #endif
+  return Error::err<SocketCommError>(SocketCommError::CannotResolve, "unknown service '%s'", mServiceOrPortOrSocket.c_str());
+}
+
+
+ErrorPtr SocketComm::setAddresses(const DnsAddressList &aAddresses, uint16_t aPort)
+{
+  mAddresses = aAddresses;
+  mNextAddress = 0;
+  for (DnsAddressList::iterator pos = mAddresses.begin(); pos!=mAddresses.end(); ++pos) {
+    if (pos->ss_family==AF_INET) {
+      if (aPort) ((struct sockaddr_in *)&(*pos))->sin_port = htons(aPort);
+    }
+    else if (pos->ss_family==AF_INET6) {
+      struct sockaddr_in6* addr6 = (struct sockaddr_in6 *)&(*pos);
+      if (aPort) addr6->sin6_port = htons(aPort);
+      // augment IPv6 with scope index info in case we have it
+      if (!mInterface.empty()) {
+        addr6->sin6_scope_id = if_nametoindex(mInterface.c_str());
+        if (addr6->sin6_scope_id==0) {
+          ErrorPtr err = SysError::errNo();
+          err = Error::err<SocketCommError>(SocketCommError::CannotResolve, "scope id '%s': %s", mInterface.c_str(), Error::text(err));
+          DBGLOG(LOG_DEBUG, "SocketComm: if_nametoindex failed: %s", err->text());
+          return err;
+        }
+      }
+    }
+  }
+  return ErrorPtr();
+}
+
+
+#if ENABLE_ASYNC_DNS
+
+void SocketComm::addressesResolved(int aResolveSerial, uint16_t aPort, ErrorPtr aError, const DnsAddressList &aAddresses)
 {
-  if (!mCurrentAddressInfo && mAddressInfoList) {
-    // entire list consumed, free it
-    freeaddrinfo(mAddressInfoList);
-    mAddressInfoList = NULL;
+  if (aResolveSerial!=mResolveSerial || !mIsConnecting) return; // outdated, connection was closed or restarted meanwhile
+  mIsConnecting = false; // resolving done, connectNextAddress() will set it again when connection attempts start
+  ErrorPtr err;
+  if (Error::notOK(aError)) {
+    err = Error::err<SocketCommError>(SocketCommError::CannotResolve, "host '%s': %s", mHostNameOrAddress.c_str(), aError->text());
+  }
+  else {
+    err = setAddresses(aAddresses, aPort);
+    if (Error::isOK(err)) {
+      LOG(LOG_DEBUG, "Initializing socket for connection to %s port %s (%zu addresses)", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str(), mAddresses.size());
+      err = connectNextAddress();
+    }
+  }
+  if (Error::notOK(err)) {
+    mAddresses.clear();
+    if (mInitiating) {
+      // still within initiateConnection(), which will report the error
+      mInitiateErr = err;
+    }
+    else {
+      LOG(LOG_DEBUG, "Cannot initiate connection to %s port %s - %s", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str(), err->text());
+      if (mConnectionStatusHandler) {
+        mConnectionStatusHandler(this, err);
+      }
+    }
   }
 }
 
+#endif // ENABLE_ASYNC_DNS
+
 
 ErrorPtr SocketComm::connectNextAddress()
+{
+  // close possibly not fully open connection FD(s)
+  internalCloseConnection();
+  return startConnectAttempt();
+}
+
+
+ErrorPtr SocketComm::startConnectAttempt()
 {
   int res;
   ErrorPtr err;
   const int one = 1;
 
-  // close possibly not fully open connection FD
-  internalCloseConnection();
   // try to create a socket
   int socketFD = -1;
   // as long as we have more addresses to check and not already connecting
   bool startedConnecting = false;
-  while (mCurrentAddressInfo && !startedConnecting) {
+  while (mNextAddress<mAddresses.size() && !startedConnecting) {
     err.reset();
-    socketFD = socket(mCurrentAddressInfo->ai_family, mCurrentAddressInfo->ai_socktype, mCurrentAddressInfo->ai_protocol);
+    const struct sockaddr_storage &addr = mAddresses[mNextAddress];
+    socklen_t addrLen = sockAddrLen(addr);
+    socketFD = socket(addr.ss_family, mSocketType, mProtocol);
     if (socketFD==-1) {
       err = SysError::errNo("Cannot create client socket: ");
     }
@@ -578,7 +723,7 @@ ErrorPtr SocketComm::connectNextAddress()
           char sbuf[NI_MAXSERV];
           // If we explicitly bind here, the socket will have the port number specified in setConnectionParams()
           int s = getnameinfo(
-            mCurrentAddressInfo->ai_addr, mCurrentAddressInfo->ai_addrlen,
+            (const struct sockaddr *)&addr, addrLen,
             NULL, 0, // no host address
             sbuf, sizeof sbuf, // only service/port
             NI_NUMERICSERV
@@ -587,7 +732,7 @@ ErrorPtr SocketComm::connectNextAddress()
             // convert to numeric port number
             uint16_t port;
             if (sscanf(sbuf, "%hd", &port)==1) {
-              if (mCurrentAddressInfo->ai_family==AF_INET6) {
+              if (addr.ss_family==AF_INET6) {
                 struct sockaddr_in6 recvaddr;
                 memset(&recvaddr, 0, sizeof recvaddr);
                 recvaddr.sin6_family = AF_INET6;
@@ -600,7 +745,7 @@ ErrorPtr SocketComm::connectNextAddress()
                   err = SysError::errNo("Cannot bind to in6addr_any/in6addr_loopback: ");
                 }
               }
-              else if (mCurrentAddressInfo->ai_family==AF_INET) {
+              else if (addr.ss_family==AF_INET) {
                 // bind connectionless socket to INADDR_ANY to receive broadcasts at all
                 struct sockaddr_in recvaddr;
                 memset(&recvaddr, 0, sizeof recvaddr);
@@ -623,15 +768,15 @@ ErrorPtr SocketComm::connectNextAddress()
           // save valid address info for later use (UDP needs it to send datagrams)
           if (mCurrentSockAddrP)
             free(mCurrentSockAddrP);
-          mCurrentSockAddrLen = mCurrentAddressInfo->ai_addrlen;
+          mCurrentSockAddrLen = addrLen;
           mCurrentSockAddrP = (sockaddr *)malloc(mCurrentSockAddrLen);
-          memcpy(mCurrentSockAddrP, mCurrentAddressInfo->ai_addr, mCurrentAddressInfo->ai_addrlen);
+          memcpy(mCurrentSockAddrP, &addr, addrLen);
         }
       } // connectionLess
       else {
         // TCP: initiate connection
-        LOG(LOG_DEBUG, "- Attempting connection with address family = %d, protocol = %d, addrlen=%d/sizeof=%zu", mCurrentAddressInfo->ai_family, mCurrentAddressInfo->ai_protocol, mCurrentAddressInfo->ai_addrlen, sizeof(*(mCurrentAddressInfo->ai_addr)));
-        res = connect(socketFD, mCurrentAddressInfo->ai_addr, mCurrentAddressInfo->ai_addrlen);
+        LOG(LOG_DEBUG, "- Attempting connection with address family = %d, protocol = %d, addrlen=%d", addr.ss_family, mProtocol, addrLen);
+        res = connect(socketFD, (const struct sockaddr *)&addr, addrLen);
         if (res==0 || errno==EINPROGRESS) {
           // connection initiated (or already open, but connectionMonitorHandler will take care in both cases)
           startedConnecting = true;
@@ -642,10 +787,15 @@ ErrorPtr SocketComm::connectNextAddress()
         }
       }
     }
+    if (!startedConnecting && socketFD>=0) {
+      close(socketFD);
+      socketFD = -1;
+    }
     // advance to next address
-    mCurrentAddressInfo = mCurrentAddressInfo->ai_next;
+    mNextAddress++;
   }
   if (!startedConnecting) {
+    if (!mConnectAttemptFds.empty()) return ErrorPtr(); // no more addresses, but other attempts are still in progress
     // exhausted addresses without starting to connect
     if (!err) err = Error::err<SocketCommError>(SocketCommError::NoConnection, "No connection could be established");
     LOG(LOG_DEBUG, "Cannot initiate connection to %s port %s - %s", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str(), err->text());
@@ -656,19 +806,24 @@ ErrorPtr SocketComm::connectNextAddress()
       mIsConnecting = true;
       // - save FD
       mConnectionFd = socketFD;
+      mConnectAttemptFds.push_back(socketFD);
       // - install callback for when FD becomes writable (or errors out)
       mMainLoop.registerPollHandler(
         mConnectionFd,
         POLLOUT,
         boost::bind(&SocketComm::connectionMonitorHandler, this, _1, _2)
       );
+      if (mNextAddress<mAddresses.size()) {
+        // "happy eyeballs": if this attempt does not succeed quickly, try next address in parallel
+        mConnectAttemptTicket.executeOnce(boost::bind(&SocketComm::connectAttemptTimeout, this), CONNECTION_ATTEMPT_DELAY);
+      }
     }
     else {
       // UDP socket successfully created
       LOG(LOG_DEBUG, "Connectionless socket ready for address family = %d, protocol = %d", mProtocolFamily, mProtocol);
       mConnectionOpen = true;
       mIsConnecting = false;
-      mCurrentAddressInfo = NULL; // no more addresses to check
+      mAddresses.clear(); // no more addresses to check
       // immediately use socket for I/O
       setFd(socketFD);
       // call handler if defined
@@ -678,13 +833,32 @@ ErrorPtr SocketComm::connectNextAddress()
       }
     }
   }
-  // clean up if list processed
-  freeAddressInfo();
   // return status
   return err;
 }
 
 
+void SocketComm::connectAttemptTimeout()
+{
+  FOCUSLOG("SocketComm: connection attempt to %s not yet successful, trying next address in parallel", mHostNameOrAddress.c_str());
+  // Note: as other attempts are pending, this cannot fail
+  startConnectAttempt();
+}
+
+
+void SocketComm::abandonConnectAttempts(int aExceptFd)
+{
+  mConnectAttemptTicket.cancel();
+  for (std::vector<int>::iterator pos = mConnectAttemptFds.begin(); pos!=mConnectAttemptFds.end(); ++pos) {
+    if (*pos!=aExceptFd) {
+      mMainLoop.unregisterPollHandler(*pos);
+      close(*pos);
+    }
+  }
+  mConnectAttemptFds.clear();
+}
+
+
 // MARK: - general connection handling
 
 
@@ -720,11 +894,12 @@ bool SocketComm::connectionMonitorHandler(int aFd, int aPollFlags)
   }
   // now check if successful
   if (Error::isOK(err)) {
-    // successfully connected
+    // successfully connected, other attempts still in progress are not needed any more
+    abandonConnectAttempts(aFd);
+    mConnectionFd = aFd;
     mConnectionOpen = true;
     mIsConnecting = false;
-    mCurrentAddressInfo = NULL; // no more addresses to check
-    freeAddressInfo();
+    mAddresses.clear(); // no more addresses to check
     LOG(LOG_DEBUG, "Connection to %s:%s established", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str());
     // first set FD to let FdComm base class operate open connection (will replace existing connection monitor with data monitoring)
     setFd(aFd);
@@ -737,15 +912,26 @@ bool SocketComm::connectionMonitorHandler(int aFd, int aPollFlags)
   else {
     // this attempt has failed, try next (if any)
     LOG(LOG_DEBUG, "- Connection attempt failed: %s", err->text());
-    // this will return no error if we have another address to try
-    err = connectNextAddress();
+    mMainLoop.unregisterPollHandler(aFd);
+    close(aFd);
+    for (std::vector<int>::iterator pos = mConnectAttemptFds.begin(); pos!=mConnectAttemptFds.end(); ++pos) {
+      if (*pos==aFd) {
+        mConnectAttemptFds.erase(pos);
+        break;
+      }
+    }
+    if (mConnectionFd==aFd) mConnectionFd = mConnectAttemptFds.empty() ? -1 : mConnectAttemptFds.back();
+    // start next attempt right away, no need to wait for the parallel attempt delay
+    mConnectAttemptTicket.cancel();
+    // this will return no error if we have another address to try, or other attempts are still in progress
+    err = startConnectAttempt();
     if (err) {
       // no next attempt started, report error
       LOG(LOG_WARNING, "Connection to %s port %s failed: %s", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str(), err->text());
       if (mConnectionStatusHandler) {
         mConnectionStatusHandler(this, err);
       }
-      freeAddressInfo();
+      mAddresses.clear();
       internalCloseConnection();
     }
   }
@@ -776,12 +962,23 @@ void SocketComm::closeConnection()
     // close the connection
     internalCloseConnection();
   }
+  else if (mIsConnecting && !mIsClosing) {
+    // abort connecting (or resolving the host name)
+    LOG(LOG_DEBUG, "Connecting to %s:%s aborted", mHostNameOrAddress.c_str(), mServiceOrPortOrSocket.c_str());
+    internalCloseConnection();
+  }
+  else if (mServing && !mConnectionLess && !mIsClosing) {
+    // stop server, close all client connections
+    LOG(LOG_DEBUG, "Server on port %s stopping", mServiceOrPortOrSocket.c_str());
+    internalCloseConnection();
+  }
 }
 
 
 void SocketComm::internalCloseConnection()
 {
   mIsClosing = true; // prevent doing it more than once due to handlers called
+  mResolveSerial++; // results of name resolution still in progress are no longer of interest
   if (!mConnectionLess && mServing) {
     // serving TCP socket
     // - close listening socket
@@ -797,6 +994,8 @@ void SocketComm::internalCloseConnection()
     }
   }
   else if (mConnectionOpen || mIsConnecting) {
+    // abandon parallel connection attempts other than the current one (which is closed below)
+    abandonConnectAttempts(mConnectionFd);
     // stop monitoring data connection and close descriptor
     if (mConnectionFd==getFd()) mConnectionFd = -1; // is the same descriptor, don't double-close
     stopMonitoringAndClose(); // close the data connection
@@ -868,6 +1067,32 @@ size_t SocketComm::transmitBytes(size_t aNumBytes, const uint8_t *aBytes, ErrorP
 }
 
 
+size_t SocketComm::transmitBuffers(const struct iovec *aIov, int aIovCnt, ErrorPtr &aError)
+{
+  if (mConnectionLess) {
+    if (mDataFd<0)
+      return 0; // not ready yet
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = mCurrentSockAddrP;
+    msg.msg_namelen = mCurrentSockAddrLen;
+    msg.msg_iov = (struct iovec *)aIov;
+    msg.msg_iovlen = aIovCnt;
+    ssize_t res = sendmsg(mDataFd, &msg, 0);
+    if (res<0) {
+      if (errno==EAGAIN || errno==EWOULDBLOCK)
+        return 0; // not ready to accept data, is not an error
+      aError = SysError::errNo("SocketComm::transmitBuffers (connectionless): ");
+      return 0; // nothing transmitted
+    }
+    return (size_t)res;
+  }
+  else {
+    return inherited::transmitBuffers(aIov, aIovCnt, aError);
+  }
+}
+
+
 size_t SocketComm::receiveBytes(size_t aNumBytes, uint8_t *aBytes, ErrorPtr &aError)
 {
   if (mConnectionLess) {
@@ -899,29 +1124,203 @@ size_t SocketComm::receiveBytes(size_t aNumBytes, uint8_t *aBytes, ErrorPtr &aEr
 }
 
 
+static bool sockAddrStrings(const struct sockaddr *aSockAddrP, socklen_t aSockAddrLen, string &aAddress, string &aPort)
+{
+  // get address and port of incoming connection
+  #ifdef ESP_PLATFORM
+  #warning "%%% ESP32 version of getnameinfo missing"
+  // TODO: find how to use getnameinfo on ESP32
+  #else
+  char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+  int s = getnameinfo(
+    aSockAddrP, aSockAddrLen,
+    hbuf, sizeof hbuf,
+    sbuf, sizeof sbuf,
+    NI_NUMERICHOST | NI_NUMERICSERV
+  );
+  if (s==0) {
+    aAddress = hbuf;
+    aPort = sbuf;
+    return true;
+  }
+  #endif
+  return false;
+}
+
+
 bool SocketComm::getDatagramOrigin(string &aAddress, string &aPort)
 {
   if (mPeerSockAddrP) {
-    // get address and port of incoming connection
-    #ifdef ESP_PLATFORM
-    #warning "%%% ESP32 version of getnameinfo missing"
-    // TODO: find how to use getnameinfo on ESP32
+    return sockAddrStrings(mPeerSockAddrP, mPeerSockAddrLen, aAddress, aPort);
+  }
+  return false;
+}
+
+
+bool SocketComm::getDatagramOrigin(const Datagram &aDatagram, string &aAddress, string &aPort)
+{
+  if (aDatagram.addressLen==0) return false;
+  return sockAddrStrings((const struct sockaddr *)&aDatagram.address, aDatagram.addressLen, aAddress, aPort);
+}
+
+
+// MARK: - batched datagram exchange
+
+void SocketComm::setDatagramBatchHandler(DatagramBatchCB aDatagramBatchHandler, size_t aMaxBatch, size_t aMaxDatagramSize)
+{
+  mDatagramBatchHandler = aDatagramBatchHandler;
+  if (!mDatagramBatchHandler) {
+    setReceiveHandler(NoOP);
+    return;
+  }
+  if (aMaxBatch<1) aMaxBatch = 1;
+  if (aMaxBatch!=mMaxBatch || aMaxDatagramSize!=mMaxDatagramSize) {
+    // (re)allocate receive buffers
+    mMaxBatch = aMaxBatch;
+    mMaxDatagramSize = aMaxDatagramSize;
+    if (mBatchBuffer) free(mBatchBuffer);
+    mBatchBuffer = (uint8_t *)malloc(mMaxBatch*mMaxDatagramSize);
+    mBatch.clear();
+    mBatch.resize(mMaxBatch); // Note: from now on, mBatch is never resized beyond this, so msg_name pointers into it remain valid
+    mBatchIovs.resize(mMaxBatch);
+    mBatchMsgs.resize(mMaxBatch);
+    for (size_t i=0; i<mMaxBatch; i++) {
+      mBatchIovs[i].iov_base = mBatchBuffer+i*mMaxDatagramSize;
+      mBatchIovs[i].iov_len = mMaxDatagramSize;
+      #if ENABLE_DATAGRAM_BATCHING
+      struct msghdr &hdr = mBatchMsgs[i].msg_hdr;
+      #else
+      struct msghdr &hdr = mBatchMsgs[i];
+      #endif
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_name = &mBatch[i].address;
+      hdr.msg_iov = &mBatchIovs[i];
+      hdr.msg_iovlen = 1;
+    }
+  }
+  setReceiveHandler(boost::bind(&SocketComm::datagramsReady, this, _1));
+}
+
+
+void SocketComm::datagramsReady(ErrorPtr aError)
+{
+  SocketCommPtr keepMyselfAlive(this);
+  if (Error::notOK(aError)) {
+    if (mDatagramBatchHandler) mDatagramBatchHandler(this, aError, DatagramList());
+    return;
+  }
+  // drain the socket, but limit the number of batches to not starve other mainloop handlers
+  for (int i=0; i<DATAGRAM_MAX_BATCHES_PER_CYCLE && mDatagramBatchHandler && mDataFd>=0; i++) {
+    ErrorPtr err;
+    size_t maxBatch = mMaxBatch;
+    size_t n = receiveDatagramBatch(err);
+    if (n==0 && Error::isOK(err)) break; // nothing (more) to read
+    mDatagramBatchHandler(this, err, mBatch);
+    if (Error::notOK(err) || n<maxBatch) break; // error or socket drained
+  }
+}
+
+
+size_t SocketComm::receiveDatagramBatch(ErrorPtr &aError)
+{
+  mBatch.resize(mMaxBatch); // Note: within capacity, no reallocation
+  for (size_t i=0; i<mMaxBatch; i++) {
+    #if ENABLE_DATAGRAM_BATCHING
+    struct msghdr &hdr = mBatchMsgs[i].msg_hdr;
     #else
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-    int s = getnameinfo(
-      mPeerSockAddrP, mPeerSockAddrLen,
-      hbuf, sizeof hbuf,
-      sbuf, sizeof sbuf,
-      NI_NUMERICHOST | NI_NUMERICSERV
-    );
-    if (s==0) {
-      aAddress = hbuf;
-      aPort = sbuf;
-      return true;
+    struct msghdr &hdr = mBatchMsgs[i];
+    #endif
+    hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    hdr.msg_flags = 0;
+  }
+  size_t n = 0;
+  #if ENABLE_DATAGRAM_BATCHING
+  int res = recvmmsg(mDataFd, &mBatchMsgs[0], (unsigned int)mMaxBatch, MSG_DONTWAIT, NULL);
+  if (res<0) {
+    if (errno!=EAGAIN && errno!=EWOULDBLOCK) aError = SysError::errNo("SocketComm::receiveDatagramBatch: ");
+  }
+  else {
+    n = (size_t)res;
+    for (size_t i=0; i<n; i++) {
+      mBatch[i].size = mBatchMsgs[i].msg_len;
+      mBatch[i].addressLen = mBatchMsgs[i].msg_hdr.msg_namelen;
+      mBatch[i].truncated = (mBatchMsgs[i].msg_hdr.msg_flags & MSG_TRUNC)!=0;
+      mBatch[i].data = (const uint8_t *)mBatchIovs[i].iov_base;
     }
+  }
+  #else
+  while (n<mMaxBatch) {
+    ssize_t res = recvmsg(mDataFd, &mBatchMsgs[n], MSG_DONTWAIT);
+    if (res<0) {
+      if (errno!=EAGAIN && errno!=EWOULDBLOCK) aError = SysError::errNo("SocketComm::receiveDatagramBatch: ");
+      break;
+    }
+    mBatch[n].size = (size_t)res;
+    mBatch[n].addressLen = mBatchMsgs[n].msg_namelen;
+    mBatch[n].truncated = (mBatchMsgs[n].msg_flags & MSG_TRUNC)!=0;
+    mBatch[n].data = (const uint8_t *)mBatchIovs[n].iov_base;
+    n++;
+  }
+  #endif
+  mBatch.resize(n);
+  return n;
+}
+
+
+size_t SocketComm::sendDatagrams(const DatagramList &aDatagrams, ErrorPtr &aError)
+{
+  if (!mConnectionLess) {
+    aError = Error::err<SocketCommError>(SocketCommError::Unsupported, "sendDatagrams() needs a datagram socket");
+    return 0;
+  }
+  if (mDataFd<0) return 0; // not ready yet
+  size_t sent = 0;
+  while (sent<aDatagrams.size()) {
+    size_t n = aDatagrams.size()-sent;
+    if (n>DATAGRAM_SEND_CHUNK) n = DATAGRAM_SEND_CHUNK;
+    struct iovec iovs[DATAGRAM_SEND_CHUNK];
+    #if ENABLE_DATAGRAM_BATCHING
+    struct mmsghdr msgs[DATAGRAM_SEND_CHUNK];
+    #else
+    struct msghdr msgs[DATAGRAM_SEND_CHUNK];
+    #endif
+    memset(msgs, 0, n*sizeof(msgs[0]));
+    for (size_t i=0; i<n; i++) {
+      const Datagram &dg = aDatagrams[sent+i];
+      iovs[i].iov_base = (void *)dg.data;
+      iovs[i].iov_len = dg.size;
+      #if ENABLE_DATAGRAM_BATCHING
+      struct msghdr &hdr = msgs[i].msg_hdr;
+      #else
+      struct msghdr &hdr = msgs[i];
+      #endif
+      if (dg.addressLen>0) {
+        hdr.msg_name = (void *)&dg.address;
+        hdr.msg_namelen = dg.addressLen;
+      }
+      else {
+        hdr.msg_name = mCurrentSockAddrP;
+        hdr.msg_namelen = mCurrentSockAddrLen;
+      }
+      hdr.msg_iov = &iovs[i];
+      hdr.msg_iovlen = 1;
+    }
+    size_t done = 0;
+    #if ENABLE_DATAGRAM_BATCHING
+    int res = sendmmsg(mDataFd, msgs, (unsigned int)n, MSG_DONTWAIT);
+    if (res>0) done = (size_t)res;
+    #else
+    int res = 0;
+    while (done<n && (res = (int)sendmsg(mDataFd, &msgs[done], MSG_DONTWAIT))>=0) done++;
     #endif
+    sent += done;
+    if (res<0) {
+      if (errno!=EAGAIN && errno!=EWOULDBLOCK) aError = SysError::errNo("SocketComm::sendDatagrams: ");
+      break;
+    }
+    if (done<n) break; // socket cannot take more at the moment
   }
-  return false;
+  return sent;
 }
 
 
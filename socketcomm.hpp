@@ -26,6 +26,9 @@
 #include "p44utils_main.hpp"
 
 #include "fdcomm.hpp" // includes all unix/linux I/O and network includes
+#include "dnsresolver.hpp"
+
+#include <atomic>
 
 #ifdef ESP_PLATFORM
   #define  NI_MAXHOST  1025
@@ -34,6 +37,14 @@
   #include <sys/un.h>
 #endif
 
+#ifndef ENABLE_DATAGRAM_BATCHING
+  #if defined(__linux__) && !defined(ESP_PLATFORM)
+    #define ENABLE_DATAGRAM_BATCHING 1 // use recvmmsg()/sendmmsg() to receive/send multiple datagrams per system call
+  #else
+    #define ENABLE_DATAGRAM_BATCHING 0 // batches are received/sent with one system call per datagram
+  #endif
+#endif
+
 #if ENABLE_P44SCRIPT && !defined(ENABLE_SOCKET_SCRIPT_FUNCS)
   #define ENABLE_SOCKET_SCRIPT_FUNCS 1
 #endif
@@ -95,6 +106,56 @@ namespace p44 {
   /// @return must return a new SocketComm connection object which will handle the connection
   typedef boost::function<SocketCommPtr (SocketCommPtr aServerSocketComm)> ServerConnectionCB;
 
+  /// Group of listening sockets serving the same port
+  /// - all listeners of a group bind with SO_REUSEPORT, so the kernel distributes incoming connections among them.
+  ///   This allows spreading accepting and handling connections over multiple mainloops (threads).
+  /// - the max number of simultaneous connections is enforced for the group as a whole
+  /// @note as the group is shared between threads, it is not a P44Obj (non-atomic refcount), but
+  ///   is managed via boost::shared_ptr, and its connection counting is lock-free.
+  class SocketServerGroup
+  {
+    friend class SocketComm;
+    std::atomic<int> mConnections;
+    const int mMaxConnections;
+
+    /// count a new connection
+    /// @return false if the group's limit is reached (and the connection was not counted)
+    bool addConnection()
+    {
+      int n = mConnections.load();
+      do {
+        if (n>=mMaxConnections) return false;
+      } while (!mConnections.compare_exchange_weak(n, n+1));
+      return true;
+    }
+
+    /// count a closed connection
+    void removeConnection() { mConnections--; };
+
+  public:
+    /// @param aMaxConnections max number of simultaneous connections for all listeners together
+    SocketServerGroup(int aMaxConnections) : mConnections(0), mMaxConnections(aMaxConnections) {};
+    /// @return current number of connections for all listeners together
+    int connections() { return mConnections; };
+  };
+  typedef boost::shared_ptr<SocketServerGroup> SocketServerGroupPtr;
+
+
+  /// a datagram, as received or to be sent in a batch
+  typedef struct {
+    const uint8_t *data; ///< payload (for received datagrams, only valid during the batch handler call)
+    size_t size; ///< size of the payload
+    struct sockaddr_storage address; ///< origin (received) or destination (to send)
+    socklen_t addressLen; ///< length of address. When sending, 0 means destination as set with setConnectionParams()
+    bool truncated; ///< set when a received datagram was larger than the max datagram size and has been truncated
+  } Datagram;
+  typedef std::vector<Datagram> DatagramList;
+
+  /// callback for batched reception of datagrams
+  /// @param aError set if receiving failed
+  /// @param aDatagrams the datagrams received
+  typedef boost::function<void (SocketCommPtr aSocketComm, ErrorPtr aError, const DatagramList &aDatagrams)> DatagramBatchCB;
+
 
   /// A class providing socket communication (client and server)
   class SocketComm : public FdComm
@@ -115,8 +176,13 @@ namespace p44 {
     // connection making fd (for server to listen, for clients or server handlers for opening connection)
     int mConnectionFd;
     // client connection internals
-    struct addrinfo *mAddressInfoList; ///< list of possible connection addresses
-    struct addrinfo *mCurrentAddressInfo; ///< address currently connecting to
+    DnsAddressList mAddresses; ///< list of possible connection addresses
+    size_t mNextAddress; ///< index of next address in mAddresses to try
+    std::vector<int> mConnectAttemptFds; ///< sockets of connection attempts in progress (in parallel, "happy eyeballs")
+    MLTicket mConnectAttemptTicket; ///< timer for starting next parallel connection attempt
+    int mResolveSerial; ///< to identify the current name resolution, outdated results are ignored
+    bool mInitiating; ///< set while in initiateConnection()
+    ErrorPtr mInitiateErr; ///< error from synchronously completed resolution
     struct sockaddr *mCurrentSockAddrP; ///< address info as currently in use by open connection
     socklen_t mCurrentSockAddrLen; ///< length of current sockAddr struct
     struct sockaddr *mPeerSockAddrP; ///< address info of last UDP receive
@@ -126,11 +192,26 @@ namespace p44 {
     bool mConnectionOpen; ///< regular data connection is open
     bool mClearHandlersAtClose; ///< when socket closes, all handlers are cleared (to break retain cycles)
     SocketCommCB mConnectionStatusHandler;
+    // batched datagram reception
+    DatagramBatchCB mDatagramBatchHandler;
+    size_t mMaxBatch; ///< max number of datagrams per batch
+    size_t mMaxDatagramSize; ///< max size of a received datagram
+    uint8_t *mBatchBuffer; ///< receive buffer for mMaxBatch datagrams of mMaxDatagramSize each
+    DatagramList mBatch; ///< received datagrams, pointing into mBatchBuffer
+    #if ENABLE_DATAGRAM_BATCHING
+    std::vector<struct mmsghdr> mBatchMsgs;
+    #else
+    std::vector<struct msghdr> mBatchMsgs;
+    #endif
+    std::vector<struct iovec> mBatchIovs;
     // server connection internals
     int mMaxServerConnections;
     ServerConnectionCB mServerConnectionHandler;
     SocketCommList mClientConnections;
     SocketCommPtr mServerConnection;
+    SocketServerGroupPtr mServerGroup;
+    long mAcceptedConnections;
+    long mRejectedConnections;
   public:
 
     SocketComm(MainLoop &aMainLoop = MainLoop::currentMainLoop());
@@ -178,6 +259,30 @@ namespace p44 {
     /// @note only works for SOCK_DGRAM type connections, and is valid only after a successful receiveBytes() operation
     bool getDatagramOrigin(string &aAddress, string &aPort);
 
+    /// get datagram origin information from a datagram received in a batch
+    /// @param aDatagram the datagram
+    /// @param aAddress will be set to address of datagram origin
+    /// @param aPort will be set to port of datagram origin
+    /// @return true if origin information is available
+    static bool getDatagramOrigin(const Datagram &aDatagram, string &aAddress, string &aPort);
+
+    /// receive datagrams in batches rather than one by one via receiveBytes()
+    /// @param aDatagramBatchHandler will be called with all datagrams that could be received in one go.
+    ///   Pass NoOP to return to non-batched reception.
+    /// @param aMaxBatch max number of datagrams to receive per batch
+    /// @param aMaxDatagramSize max size of a datagram, larger datagrams are truncated (and marked so)
+    /// @note replaces a receive handler set with setReceiveHandler()
+    /// @note only works for SOCK_DGRAM type connections
+    void setDatagramBatchHandler(DatagramBatchCB aDatagramBatchHandler, size_t aMaxBatch = 32, size_t aMaxDatagramSize = 1536);
+
+    /// send multiple datagrams at once (non-blocking)
+    /// @param aDatagrams the datagrams to send, each to its own destination address or (with addressLen==0) to the
+    ///   host/port specified in setConnectionParams()
+    /// @param aError reference to ErrorPtr. Will be left untouched if no error occurs
+    /// @return number of datagrams actually sent, can be less than aDatagrams.size() when the socket cannot take more at the moment
+    /// @note only works for SOCK_DGRAM type connections
+    size_t sendDatagrams(const DatagramList &aDatagrams, ErrorPtr &aError);
+
     /// start the server
     /// @param aServerConnectionHandler will be called when a server connection is accepted
     ///   The SocketComm object passed in the handler is a new SocketComm object for that particular connection
@@ -185,6 +290,19 @@ namespace p44 {
     ///   local connections are accepted
     ErrorPtr startServer(ServerConnectionCB aServerConnectionHandler, int aMaxConnections);
 
+    /// make this server one of a group of listeners for the same port
+    /// @param aServerGroup the group. The aMaxConnections parameter of startServer() is ignored, the group's limit applies.
+    /// @note must be called before startServer().
+    /// @note to distribute load over multiple threads, create one SocketComm per thread's mainloop, and call startServer()
+    ///   from the thread running that mainloop.
+    void setServerGroup(SocketServerGroupPtr aServerGroup) { mServerGroup = aServerGroup; };
+
+    /// @return number of connections accepted by this server so far
+    long acceptedConnections() { return mAcceptedConnections; };
+
+    /// @return number of connections rejected by this server so far (max connections reached, or not taken by handler)
+    long rejectedConnections() { return mRejectedConnections; };
+
     /// @return true if socket is serving (is listening for connections made from outside)
     bool isServing() { return mServing; }
 
@@ -231,6 +349,14 @@ namespace p44 {
     /// @note for UDP, the host/port specified in setConnectionParams() will be used to send datagrams to
     virtual size_t transmitBytes(size_t aNumBytes, const uint8_t *aBytes, ErrorPtr &aError);
 
+    /// write data from multiple buffers at once (non-blocking)
+    /// @param aIov array of buffer pointers/sizes
+    /// @param aIovCnt number of entries in aIov
+    /// @param aError reference to ErrorPtr. Will be left untouched if no error occurs
+    /// @return number ob bytes actually written
+    /// @note for UDP, all buffers are sent as one datagram to the host/port specified in setConnectionParams()
+    virtual size_t transmitBuffers(const struct iovec *aIov, int aIovCnt, ErrorPtr &aError) P44_OVERRIDE;
+
     /// read data (non-blocking)
     /// @param aNumBytes max number of bytes to receive
     /// @param aBytes pointer to buffer to store received bytes
@@ -240,7 +366,7 @@ namespace p44 {
 
     /// clear all callbacks
     /// @note this is important because handlers might cause retain cycles when they have smart ptr arguments
-    virtual void clearCallbacks() { mConnectionStatusHandler = NoOP; mServerConnectionHandler = NoOP; inherited::clearCallbacks(); }
+    virtual void clearCallbacks() { mConnectionStatusHandler = NoOP; mServerConnectionHandler = NoOP; mDatagramBatchHandler = NoOP; inherited::clearCallbacks(); }
 
     /// make sure handlers are cleared as soon as connection closes
     /// @note this is for connections that only live by themselves and should deallocate when they close. As handlers might hold
@@ -259,14 +385,24 @@ namespace p44 {
     size_t numClients();
 
   private:
-    void freeAddressInfo();
     ErrorPtr socketError(int aSocketFd);
+    ErrorPtr servicePort(uint16_t &aPort);
+    #if ENABLE_ASYNC_DNS
+    void addressesResolved(int aResolveSerial, uint16_t aPort, ErrorPtr aError, const DnsAddressList &aAddresses);
+    #endif
+    ErrorPtr setAddresses(const DnsAddressList &aAddresses, uint16_t aPort);
     ErrorPtr connectNextAddress();
+    ErrorPtr startConnectAttempt();
+    void connectAttemptTimeout();
+    void abandonConnectAttempts(int aExceptFd);
     bool connectionMonitorHandler(int aFd, int aPollFlags);
     void internalCloseConnection();
     virtual void dataExceptionHandler(int aFd, int aPollFlags);
+    void datagramsReady(ErrorPtr aError);
+    size_t receiveDatagramBatch(ErrorPtr &aError);
 
     bool connectionAcceptHandler(int aFd, int aPollFlags);
+    void acceptClientConnection(int aClientFd, const struct sockaddr_storage &aAddr, socklen_t aAddrLen);
     void passClientConnection(int aFD, SocketCommPtr aServerConnection); // used by listening SocketComm to pass accepted client connection to child SocketComm
     SocketCommPtr returnClientConnection(SocketCommPtr aClientConnection); // used to notify listening SocketComm when client connection ends
 
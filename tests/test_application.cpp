@@ -0,0 +1,146 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+#include "application.hpp"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+
+using namespace p44;
+
+
+class JsonResourceFixture
+{
+public:
+
+  string mDir;
+
+  JsonResourceFixture()
+  {
+    mDir = string_format("/tmp/p44utils_jsonresource_%d", getpid());
+    mkdir(mDir.c_str(), 0700);
+  }
+
+  virtual ~JsonResourceFixture()
+  {
+    for (int i=0; i<5; i++) unlink(path(i).c_str());
+    rmdir(mDir.c_str());
+  }
+
+  string path(int aIndex)
+  {
+    return string_format("%s/res%d.json", mDir.c_str(), aIndex);
+  }
+
+  void write(int aIndex, const string aText)
+  {
+    // write to temp file and rename, like config updates usually do (new inode)
+    string tmp = path(aIndex)+".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    REQUIRE(f);
+    fputs(aText.c_str(), f);
+    fclose(f);
+    REQUIRE(rename(tmp.c_str(), path(aIndex).c_str())==0);
+  }
+
+};
+
+
+TEST_CASE_METHOD(JsonResourceFixture, "json resource cache", "[application]")
+{
+  JsonResourceCache cache(3);
+  ErrorPtr err;
+
+  SECTION("hits and changes") {
+    write(0, "{ \"version\": 1 /* comment */ }");
+    JsonObjectPtr j1 = cache.get(path(0), &err);
+    REQUIRE(Error::isOK(err));
+    REQUIRE(j1);
+    REQUIRE(j1->get("version")->int32Value()==1);
+    REQUIRE(cache.misses()==1);
+    JsonObjectPtr j2 = cache.get(path(0), &err);
+    REQUIRE(j2==j1); // shared
+    REQUIRE(cache.hits()==1);
+    // replaced file
+    write(0, "{ \"version\": 2 }");
+    j2 = cache.get(path(0), &err);
+    REQUIRE(j2!=j1);
+    REQUIRE(j2->get("version")->int32Value()==2);
+    REQUIRE(cache.reloads()==1);
+    // modified in place, same size
+    FILE *f = fopen(path(0).c_str(), "r+");
+    fputs("{ \"version\": 3 }", f);
+    fclose(f);
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { time(NULL)+10, 0 } }; // make sure mtime differs
+    utimensat(AT_FDCWD, path(0).c_str(), ts, 0);
+    REQUIRE(cache.get(path(0), &err)->get("version")->int32Value()==3);
+    REQUIRE(cache.reloads()==2);
+    REQUIRE(cache.entries()==1);
+  }
+
+  SECTION("errors are not cached") {
+    JsonObjectPtr j = cache.get(path(1), &err);
+    REQUIRE(!j);
+    REQUIRE(Error::notOK(err));
+    write(1, "{ \"broken\": ");
+    err.reset();
+    REQUIRE(!cache.get(path(1), &err));
+    REQUIRE(Error::isError(err, JsonError::domain(), json_tokener_error_parse_eof));
+    REQUIRE(cache.entries()==0);
+    write(1, "[ 42 ]");
+    err.reset();
+    REQUIRE(cache.get(path(1), &err)->arrayGet(0)->int32Value()==42);
+    REQUIRE(Error::isOK(err));
+    REQUIRE(cache.entries()==1);
+    unlink(path(1).c_str());
+    REQUIRE(!cache.get(path(1), &err));
+    REQUIRE(Error::notOK(err));
+    REQUIRE(cache.entries()==0);
+  }
+
+  SECTION("eviction and invalidation") {
+    for (int i=0; i<5; i++) write(i, string_format("{ \"file\": %d }", i));
+    for (int i=0; i<4; i++) REQUIRE(cache.get(path(i), &err));
+    REQUIRE(cache.entries()==3);
+    REQUIRE(cache.evictions()==1);
+    REQUIRE(cache.get(path(1), &err)); // still cached, now most recently used
+    REQUIRE(cache.hits()==1);
+    REQUIRE(cache.get(path(4), &err)); // evicts 2
+    REQUIRE(cache.get(path(1), &err));
+    REQUIRE(cache.hits()==2);
+    REQUIRE(cache.get(path(2), &err));
+    REQUIRE(cache.misses()==6);
+    cache.invalidate(path(2));
+    REQUIRE(cache.entries()==2);
+    REQUIRE(cache.get(path(2), &err));
+    REQUIRE(cache.misses()==7);
+    cache.invalidate();
+    REQUIRE(cache.entries()==0);
+    cache.setMaxEntries(0);
+    REQUIRE(cache.get(path(0), &err)->get("file")->int32Value()==0);
+    REQUIRE(cache.entries()==0);
+  }
+}
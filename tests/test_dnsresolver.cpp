@@ -0,0 +1,481 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+#include "dnsresolver.hpp"
+#include "socketcomm.hpp"
+
+#if ENABLE_ASYNC_DNS
+
+using namespace p44;
+
+
+/// minimal DNS server on the loopback, answering A queries from a table
+class DnsStubFixture
+{
+public:
+
+  int mServerFd;
+  string mServerAddr;
+  std::map<string, std::vector<string> > mRecords; ///< name -> IPv4 addresses
+  std::map<string, string> mCnames; ///< name -> canonical name
+  std::vector<std::pair<string, string> > mInjected; ///< unrelated (name, IPv4 address) records added to positive answers
+  uint32_t mTTL;
+  bool mMute; ///< if set, queries are not answered
+  bool mTruncate; ///< if set, answers have the TC bit set
+  int mNumQueries;
+  std::vector<string> mQueriedNames;
+  std::vector<uint16_t> mQueryIds;
+  std::set<uint16_t> mSourcePorts;
+
+  MLTicket mTick;
+
+  // results
+  bool mGotResult;
+  int mNumResults;
+  ErrorPtr mError;
+  DnsAddressList mAddresses;
+
+  DnsStubFixture() :
+    mTTL(60),
+    mMute(false),
+    mTruncate(false),
+    mNumQueries(0),
+    mGotResult(false),
+    mNumResults(0)
+  {
+    mServerFd = socket(AF_INET, SOCK_DGRAM, 0);
+    REQUIRE(mServerFd>=0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(::bind(mServerFd, (struct sockaddr *)&sin, sizeof(sin))==0);
+    socklen_t len = sizeof(sin);
+    REQUIRE(getsockname(mServerFd, (struct sockaddr *)&sin, &len)==0);
+    mServerAddr = string_format("127.0.0.1:%d", ntohs(sin.sin_port));
+    MainLoop::currentMainLoop().startupMainLoop(true);
+    MainLoop::currentMainLoop().registerPollHandler(mServerFd, POLLIN, boost::bind(&DnsStubFixture::serverHandler, this, _1, _2));
+    REQUIRE(Error::isOK(DnsResolver::sharedResolver().setNameServers(mServerAddr)));
+    DnsResolver::sharedResolver().setTimeout(200*MilliSecond, 1);
+  }
+
+  virtual ~DnsStubFixture()
+  {
+    // back to system configuration
+    DnsResolver::sharedResolver().setNameServers("");
+    DnsResolver::sharedResolver().setTimeout(2*Second, 2);
+    MainLoop::currentMainLoop().unregisterPollHandler(mServerFd);
+    close(mServerFd);
+  }
+
+  static void put16(string &aMsg, uint16_t aVal) { aMsg.push_back((char)(aVal>>8)); aMsg.push_back((char)(aVal & 0xFF)); }
+  static void put32(string &aMsg, uint32_t aVal) { put16(aMsg, (uint16_t)(aVal>>16)); put16(aMsg, (uint16_t)aVal); }
+
+  static void putName(string &aMsg, const string &aName)
+  {
+    size_t i = 0;
+    while (i<aName.size()) {
+      size_t e = aName.find('.', i);
+      if (e==string::npos) e = aName.size();
+      aMsg.push_back((char)(e-i));
+      aMsg.append(aName, i, e-i);
+      i = e+1;
+    }
+    aMsg.push_back(0);
+  }
+
+  void putA(string &aMsg, const string &aOwner, const string &aQName, const string &aAddr)
+  {
+    if (aOwner==aQName) put16(aMsg, 0xC00C); // name = pointer to question
+    else putName(aMsg, aOwner);
+    put16(aMsg, 1); // A
+    put16(aMsg, 1); // IN
+    put32(aMsg, mTTL);
+    put16(aMsg, 4);
+    struct in_addr a;
+    inet_pton(AF_INET, aAddr.c_str(), &a);
+    aMsg.append((const char *)&a, 4);
+  }
+
+  bool serverHandler(int aFd, int aPollFlags)
+  {
+    uint8_t buf[512];
+    struct sockaddr_storage from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t n = recvfrom(aFd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromLen);
+    if (n<12) return true;
+    mNumQueries++;
+    mQueryIds.push_back((uint16_t)((buf[0]<<8) | buf[1]));
+    if (from.ss_family==AF_INET) mSourcePorts.insert(ntohs(((struct sockaddr_in *)&from)->sin_port));
+    // decode question
+    size_t pos = 12;
+    string name;
+    while (pos<(size_t)n && buf[pos]) {
+      if (!name.empty()) name += ".";
+      name.append((const char *)buf+pos+1, buf[pos]);
+      pos += buf[pos]+1;
+    }
+    pos++; // terminating zero label
+    if (pos+4>(size_t)n) return true;
+    uint16_t qtype = (uint16_t)((buf[pos]<<8) | buf[pos+1]);
+    pos += 4;
+    mQueriedNames.push_back(name);
+    if (mMute) return true;
+    int ancount = 0;
+    string records;
+    // CNAME chain
+    string target = name;
+    while (qtype==1 && mCnames.find(target)!=mCnames.end()) {
+      if (target==name) put16(records, 0xC00C);
+      else putName(records, target);
+      string next = mCnames[target];
+      string rdata;
+      putName(rdata, next);
+      put16(records, 5); // CNAME
+      put16(records, 1); // IN
+      put32(records, mTTL);
+      put16(records, (uint16_t)rdata.size());
+      records += rdata;
+      ancount++;
+      target = next;
+    }
+    std::map<string, std::vector<string> >::iterator rec = mRecords.find(target);
+    string answer((const char *)buf, pos); // ID, flags, counts and question
+    answer[2] = (char)(mTruncate ? 0x83 : 0x81); // QR, (TC), RD
+    answer[3] = (char)(rec==mRecords.end() ? 0x83 : 0x80); // RA, NXDOMAIN or NOERROR
+    if (rec!=mRecords.end() && qtype==1) {
+      for (size_t i=0; i<rec->second.size(); i++) {
+        putA(records, target, name, rec->second[i]);
+        ancount++;
+      }
+      for (size_t i=0; i<mInjected.size(); i++) {
+        putA(records, mInjected[i].first, name, mInjected[i].second);
+        ancount++;
+      }
+    }
+    else {
+      // SOA in authority section for negative caching
+      put16(records, 0xC00C);
+      put16(records, 6); // SOA
+      put16(records, 1); // IN
+      put32(records, mTTL);
+      put16(records, 22);
+      records.push_back(0); // MNAME = root
+      records.push_back(0); // RNAME = root
+      put32(records, 1); // serial
+      put32(records, 3600); // refresh
+      put32(records, 600); // retry
+      put32(records, 86400); // expire
+      put32(records, mTTL); // minimum
+    }
+    answer[6] = 0; answer[7] = (char)ancount;
+    answer[8] = 0; answer[9] = (char)(ancount ? 0 : 1);
+    answer[10] = 0; answer[11] = 0;
+    answer += records;
+    sendto(aFd, answer.c_str(), answer.size(), 0, (struct sockaddr *)&from, fromLen);
+    return true;
+  }
+
+  void resolved(ErrorPtr aError, const DnsAddressList &aAddresses)
+  {
+    mGotResult = true;
+    mNumResults++;
+    mError = aError;
+    mAddresses = aAddresses;
+  }
+
+  void tick(MLTimer &aTimer)
+  {
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, 10*MilliSecond);
+  }
+
+  void runUntil(const bool &aDone, MLMicroSeconds aTimeout)
+  {
+    // Note: periodic timer makes sure mainLoopCycle() returns even if nothing else is pending
+    mTick.executeOnce(boost::bind(&DnsStubFixture::tick, this, _1), 10*MilliSecond);
+    MLMicroSeconds timeout = MainLoop::now()+aTimeout;
+    while (!aDone && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+    mTick.cancel();
+  }
+
+  void resolve(const string aName, int aFamily = PF_INET)
+  {
+    mGotResult = false;
+    DnsResolver::sharedResolver().resolve(aName, aFamily, boost::bind(&DnsStubFixture::resolved, this, _1, _2));
+    runUntil(mGotResult, 5*Second);
+  }
+
+  string address(size_t aIndex)
+  {
+    if (aIndex>=mAddresses.size() || mAddresses[aIndex].ss_family!=AF_INET) return "";
+    char buf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&mAddresses[aIndex])->sin_addr, buf, sizeof(buf));
+    return buf;
+  }
+
+};
+
+
+TEST_CASE_METHOD(DnsStubFixture, "DnsResolver", "[dns]")
+{
+  mRecords["host.example"].push_back("192.0.2.1");
+  mRecords["host.example"].push_back("192.0.2.2");
+
+  SECTION("numeric addresses resolve without query") {
+    resolve("192.0.2.99");
+    REQUIRE(mGotResult);
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(address(0)=="192.0.2.99");
+    REQUIRE(mNumQueries==0);
+  }
+
+  SECTION("query and cache") {
+    long hits = DnsResolver::sharedResolver().cacheHits();
+    resolve("host.example");
+    REQUIRE(mGotResult);
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mAddresses.size()==2);
+    REQUIRE(address(0)=="192.0.2.1");
+    REQUIRE(address(1)=="192.0.2.2");
+    REQUIRE(mNumQueries==1);
+    // second lookup (case insensitive) must come from cache, synchronously
+    mGotResult = false;
+    DnsResolver::sharedResolver().resolve("HOST.example", PF_INET, boost::bind(&DnsStubFixture::resolved, this, _1, _2));
+    REQUIRE(mGotResult);
+    REQUIRE(mAddresses.size()==2);
+    REQUIRE(mNumQueries==1);
+    REQUIRE(DnsResolver::sharedResolver().cacheHits()==hits+1);
+  }
+
+  SECTION("concurrent lookups share one query") {
+    DnsResolver::sharedResolver().resolve("host.example", PF_INET, boost::bind(&DnsStubFixture::resolved, this, _1, _2));
+    resolve("host.example");
+    REQUIRE(mNumResults==2);
+    REQUIRE(mNumQueries==1);
+  }
+
+  SECTION("zero TTL is not cached") {
+    mTTL = 0;
+    resolve("host.example");
+    REQUIRE(Error::isOK(mError));
+    resolve("host.example");
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mNumQueries==2);
+  }
+
+  SECTION("negative answers are cached") {
+    resolve("nonexisting.example");
+    REQUIRE(mGotResult);
+    REQUIRE(Error::isError(mError, DnsError::domain(), DnsError::NotFound));
+    REQUIRE(mNumQueries==1);
+    resolve("nonexisting.example");
+    REQUIRE(Error::isError(mError, DnsError::domain(), DnsError::NotFound));
+    REQUIRE(mNumQueries==1);
+  }
+
+  SECTION("search domains") {
+    DnsResolver::sharedResolver().setNameServers(mServerAddr, "other.example example");
+    resolve("host");
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mAddresses.size()==2);
+    REQUIRE(mQueriedNames.size()==2);
+    REQUIRE(mQueriedNames[0]=="host.other.example");
+    REQUIRE(mQueriedNames[1]=="host.example");
+  }
+
+  SECTION("timeout") {
+    mMute = true;
+    long timeouts = DnsResolver::sharedResolver().timeouts();
+    MLMicroSeconds start = MainLoop::now();
+    resolve("host.example");
+    REQUIRE(mGotResult);
+    REQUIRE(Error::isError(mError, DnsError::domain(), DnsError::Timeout));
+    REQUIRE(MainLoop::now()-start>=200*MilliSecond);
+    REQUIRE(DnsResolver::sharedResolver().timeouts()==timeouts+1);
+  }
+
+  SECTION("CNAME chain") {
+    mCnames["alias.example"] = "middle.example";
+    mCnames["middle.example"] = "host.example";
+    resolve("alias.example");
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mAddresses.size()==2);
+    REQUIRE(address(0)=="192.0.2.1");
+    REQUIRE(address(1)=="192.0.2.2");
+  }
+
+  SECTION("records not belonging to the queried name are ignored") {
+    mInjected.push_back(std::make_pair("victim.example", "203.0.113.66"));
+    mCnames["alias.example"] = "host.example";
+    mInjected.push_back(std::make_pair("alias.example", "203.0.113.67")); // alias has a CNAME, cannot have an address
+    resolve("alias.example");
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mAddresses.size()==2);
+    REQUIRE(address(0)=="192.0.2.1");
+    REQUIRE(address(1)=="192.0.2.2");
+    // injected record must not have been cached
+    resolve("victim.example");
+    REQUIRE(Error::isError(mError, DnsError::domain(), DnsError::NotFound));
+    REQUIRE(mNumQueries==2);
+  }
+
+  SECTION("truncated answers are not used") {
+    mTruncate = true;
+    resolve("host.example");
+    REQUIRE(mGotResult);
+    REQUIRE(Error::isError(mError, DnsError::domain(), DnsError::ServerFailure));
+  }
+
+  SECTION("random query IDs and source ports") {
+    for (int i=0; i<40; i++) {
+      string name = string_format("host%d.example", i);
+      mRecords[name].push_back("192.0.2.3");
+      resolve(name);
+      REQUIRE(Error::isOK(mError));
+    }
+    REQUIRE(mNumQueries==40);
+    // IDs must not be sequential
+    int sequential = 0;
+    for (size_t i=1; i<mQueryIds.size(); i++) if (mQueryIds[i]==(uint16_t)(mQueryIds[i-1]+1)) sequential++;
+    REQUIRE(sequential<2);
+    // source port changes every few queries
+    REQUIRE(mSourcePorts.size()>=3);
+  }
+}
+
+
+static void* resolverOfThread(void* aArg)
+{
+  *static_cast<DnsResolver**>(aArg) = &DnsResolver::sharedResolver();
+  return NULL;
+}
+
+
+TEST_CASE("DnsResolver per thread", "[dns]")
+{
+  DnsResolver* other = NULL;
+  pthread_t t;
+  REQUIRE(pthread_create(&t, NULL, resolverOfThread, &other)==0);
+  pthread_join(t, NULL);
+  REQUIRE(other!=NULL);
+  REQUIRE(other!=&DnsResolver::sharedResolver()); // each thread has its own, bound to its own mainloop
+}
+
+
+class ConnectFixture : public DnsStubFixture
+{
+public:
+
+  SocketCommPtr mServer;
+  SocketCommPtr mClient;
+  bool mConnected;
+  ErrorPtr mStatus;
+
+  ConnectFixture() :
+    mConnected(false)
+  {
+  }
+
+  virtual ~ConnectFixture()
+  {
+    if (mClient) { mClient->clearCallbacks(); mClient->closeConnection(); }
+    if (mServer) { mServer->clearCallbacks(); mServer->closeConnection(); }
+  }
+
+  SocketCommPtr serverConnection(SocketCommPtr aServerSocketComm)
+  {
+    return SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  }
+
+  void clientStatus(SocketCommPtr aSocketComm, ErrorPtr aError)
+  {
+    mConnected = true;
+    mStatus = aError;
+  }
+
+  int freePort()
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+    socklen_t len = sizeof(sin);
+    getsockname(fd, (struct sockaddr *)&sin, &len);
+    close(fd);
+    return ntohs(sin.sin_port);
+  }
+
+};
+
+
+TEST_CASE_METHOD(ConnectFixture, "SocketComm connect with DNS", "[dns]")
+{
+  string port = string_format("%d", freePort());
+  mServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  mServer->setConnectionParams(NULL, port.c_str(), SOCK_STREAM, PF_INET);
+  mServer->setAllowNonlocalConnections(false); // 127.0.0.1 only
+  REQUIRE(Error::isOK(mServer->startServer(boost::bind(&ConnectFixture::serverConnection, this, _1), 3)));
+  mClient = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  mClient->setConnectionStatusHandler(boost::bind(&ConnectFixture::clientStatus, this, _1, _2));
+
+  SECTION("falls back to next address") {
+    // first address has no listener
+    mRecords["server.example"].push_back("127.0.0.2");
+    mRecords["server.example"].push_back("127.0.0.1");
+    mClient->setConnectionParams("server.example", port.c_str(), SOCK_STREAM, PF_INET);
+    REQUIRE(Error::isOK(mClient->initiateConnection()));
+    REQUIRE(mClient->connecting());
+    runUntil(mConnected, 5*Second);
+    REQUIRE(mConnected);
+    REQUIRE(Error::isOK(mStatus));
+    REQUIRE(mClient->connected());
+  }
+
+  SECTION("unresolvable host") {
+    mClient->setConnectionParams("nowhere.example", port.c_str(), SOCK_STREAM, PF_INET);
+    REQUIRE(Error::isOK(mClient->initiateConnection()));
+    runUntil(mConnected, 5*Second);
+    REQUIRE(mConnected);
+    REQUIRE(Error::isError(mStatus, SocketCommError::domain(), SocketCommError::CannotResolve));
+    REQUIRE(!mClient->connecting());
+  }
+
+  SECTION("closing while resolving") {
+    mMute = true;
+    mClient->setConnectionParams("server.example", port.c_str(), SOCK_STREAM, PF_INET);
+    REQUIRE(Error::isOK(mClient->initiateConnection()));
+    REQUIRE(mClient->connecting());
+    mClient->closeConnection();
+    REQUIRE(!mClient->connecting());
+    runUntil(mConnected, 500*MilliSecond);
+    REQUIRE(!mConnected);
+  }
+}
+
+#endif // ENABLE_ASYNC_DNS
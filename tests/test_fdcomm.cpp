@@ -0,0 +1,241 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+#include "fdcomm.hpp"
+
+using namespace p44;
+
+
+class FdCommFixture
+{
+public:
+
+  int mPeerFd;
+  FdCommPtr mComm;
+  std::vector<string> mLines;
+  size_t mNumRecords;
+  size_t mNumBytes;
+  bool mZeroCopy;
+  std::vector<bool> mFlowEvents;
+  string mPeerReceived;
+
+  FdCommFixture() :
+    mNumRecords(0),
+    mNumBytes(0),
+    mZeroCopy(false)
+  {
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)==0);
+    mPeerFd = fds[1];
+    mComm = FdCommPtr(new FdComm(MainLoop::currentMainLoop()));
+    mComm->makeNonBlocking(fds[0]);
+    mComm->setFd(fds[0]);
+    MainLoop::currentMainLoop().startupMainLoop(true);
+  }
+
+  virtual ~FdCommFixture()
+  {
+    mComm->clearCallbacks();
+    mComm->stopMonitoringAndClose();
+    close(mPeerFd);
+  }
+
+  void collectLines(ErrorPtr aError)
+  {
+    string line;
+    if (mComm->receiveDelimitedString(line)) mLines.push_back(line);
+  }
+
+  void countRecords(ErrorPtr aError)
+  {
+    if (mZeroCopy) {
+      const char *rec;
+      size_t len;
+      if (mComm->receiveDelimitedRecord(rec, len)) { mNumRecords++; mNumBytes += len; }
+    }
+    else {
+      string line;
+      if (mComm->receiveDelimitedString(line)) { mNumRecords++; mNumBytes += line.size(); }
+    }
+  }
+
+  void flowEvent(bool aAboveHighWatermark)
+  {
+    mFlowEvents.push_back(aAboveHighWatermark);
+  }
+
+  bool peerReadable(int aFd, int aPollFlags)
+  {
+    char buf[4096];
+    ssize_t n = read(mPeerFd, buf, sizeof(buf));
+    if (n>0) mPeerReceived.append(buf, n);
+    return true;
+  }
+
+  void receiveAtPeer(size_t aNumBytes)
+  {
+    MainLoop::currentMainLoop().registerPollHandler(mPeerFd, POLLIN, boost::bind(&FdCommFixture::peerReadable, this, _1, _2));
+    MLMicroSeconds timeout = MainLoop::now()+5*Second;
+    while (mPeerReceived.size()<aNumBytes && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+    MainLoop::currentMainLoop().unregisterPollHandler(mPeerFd);
+  }
+
+  void send(const string aData)
+  {
+    REQUIRE(write(mPeerFd, aData.c_str(), aData.size())==(ssize_t)aData.size());
+  }
+
+  void runUntilRecords(size_t aNumRecords)
+  {
+    MLMicroSeconds timeout = MainLoop::now()+5*Second;
+    while (mLines.size()+mNumRecords<aNumRecords && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+  }
+
+  void runUntilPending(size_t aNumBytes)
+  {
+    MLMicroSeconds timeout = MainLoop::now()+5*Second;
+    while (mComm->delimitedBytesPending()<aNumBytes && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+  }
+
+};
+
+
+TEST_CASE_METHOD(FdCommFixture, "delimited receive", "[fdcomm]") {
+  mComm->setReceiveHandler(boost::bind(&FdCommFixture::collectLines, this, _1), '\n');
+
+  SECTION("many lines per read") {
+    send("one\ntwo\r\nthree\n\nfive\n");
+    runUntilRecords(5);
+    REQUIRE(mLines.size()==5);
+    REQUIRE(mLines[0]=="one");
+    REQUIRE(mLines[1]=="two");
+    REQUIRE(mLines[2]=="three");
+    REQUIRE(mLines[3]=="");
+    REQUIRE(mLines[4]=="five");
+    REQUIRE(mComm->delimitedBytesPending()==0);
+  }
+
+  SECTION("lines split across reads") {
+    send("fir");
+    runUntilPending(3);
+    REQUIRE(mLines.size()==0);
+    REQUIRE(mComm->delimitedBytesPending()==3);
+    send("st\nsec");
+    runUntilRecords(1);
+    REQUIRE(mLines.size()==1);
+    send("ond\nthird");
+    runUntilRecords(2);
+    REQUIRE(mLines.size()==2);
+    REQUIRE(mLines[0]=="first");
+    REQUIRE(mLines[1]=="second");
+    REQUIRE(mComm->delimitedBytesPending()==5);
+  }
+
+  SECTION("large burst") {
+    string burst;
+    for (int i=0; i<2000; i++) burst += string_format("line %d with some payload\n", i);
+    send(burst);
+    runUntilRecords(2000);
+    REQUIRE(mLines.size()==2000);
+    REQUIRE(mLines[0]=="line 0 with some payload");
+    REQUIRE(mLines[1999]=="line 1999 with some payload");
+  }
+}
+
+
+TEST_CASE_METHOD(FdCommFixture, "zero-copy delimited receive", "[fdcomm]") {
+  mZeroCopy = true;
+  mComm->setReceiveHandler(boost::bind(&FdCommFixture::countRecords, this, _1), ';');
+  send("a;bb;ccc;dd");
+  runUntilRecords(3);
+  REQUIRE(mNumRecords==3);
+  REQUIRE(mNumBytes==6);
+  send("dd;");
+  runUntilRecords(4);
+  REQUIRE(mNumRecords==4);
+  REQUIRE(mNumBytes==10);
+}
+
+
+TEST_CASE_METHOD(FdCommFixture, "transmit queue", "[fdcomm]") {
+  fcntl(mPeerFd, F_SETFL, fcntl(mPeerFd, F_GETFL, 0) | O_NONBLOCK);
+
+  SECTION("small writes go out immediately") {
+    mComm->sendString("hello ");
+    mComm->sendBuffer(TxBufferPtr(new StaticTxBuffer("static ", 7)), true);
+    mComm->sendBuffer(TxBufferPtr(new StringTxBuffer("world")));
+    REQUIRE(mComm->transmitQueueBytes()==0);
+    receiveAtPeer(18);
+    REQUIRE(mPeerReceived=="hello static world");
+  }
+
+  SECTION("backpressure and partial writes") {
+    mComm->setTransmitFlowHandler(100000, 10000, boost::bind(&FdCommFixture::flowEvent, this, _1));
+    string expected;
+    for (int i=0; i<2000; i++) {
+      // non-persistent data, must be copied when queued
+      string msg = string_format("message #%d with some more payload to fill the socket buffer quickly\n", i);
+      expected += msg;
+      mComm->sendString(msg);
+    }
+    REQUIRE(mComm->transmitQueueBytes()>0); // socket buffer must be full by now
+    REQUIRE(mFlowEvents.size()==1);
+    REQUIRE(mFlowEvents[0]==true);
+    receiveAtPeer(expected.size());
+    REQUIRE(mPeerReceived==expected);
+    REQUIRE(mComm->transmitQueueBytes()==0);
+    REQUIRE(mFlowEvents.size()==2);
+    REQUIRE(mFlowEvents[1]==false);
+  }
+}
+
+
+TEST_CASE_METHOD(FdCommFixture, "delimited receive throughput", "[fdcomm][benchmark][slow]") {
+  string burst;
+  const size_t lines = 1000;
+  for (size_t i=0; i<lines; i++) burst += string_format("%04zu: short line-based protocol record\r\n", i);
+  mComm->setReceiveHandler(boost::bind(&FdCommFixture::countRecords, this, _1), '\n');
+
+  BENCHMARK("1000 lines, string copy") {
+    mNumRecords = 0;
+    send(burst);
+    runUntilRecords(lines);
+    return mNumRecords;
+  };
+
+  mZeroCopy = true;
+  BENCHMARK("1000 lines, zero-copy") {
+    mNumRecords = 0;
+    send(burst);
+    runUntilRecords(lines);
+    return mNumRecords;
+  };
+}
@@ -24,6 +24,7 @@
 
 #include "p44utils_common.hpp"
 #include "httpcomm.hpp"
+#include "jsonwebclient.hpp"
 
 using namespace p44;
 
@@ -369,3 +370,760 @@ TEST_CASE_METHOD(HttpFixture, "http 304 not modified test", "[http]") {
 
 
 
+
+
+// MARK: - keep-alive connection pool, against local server
+
+static int localRequestHandler(struct mg_connection *aConn, void *aCbData);
+static int localChunkedHandler(struct mg_connection *aConn, void *aCbData);
+static int localUntilCloseHandler(struct mg_connection *aConn, void *aCbData);
+static int localEchoHandler(struct mg_connection *aConn, void *aCbData);
+static int localBigHandler(struct mg_connection *aConn, void *aCbData);
+static int localJsonStreamHandler(struct mg_connection *aConn, void *aCbData);
+static int localCachedHandler(struct mg_connection *aConn, void *aCbData);
+
+#define BIG_BODY_SIZE (4*1024*1024)
+static uint8_t bigBodyByte(size_t aOffset) { return (uint8_t)((aOffset*7)>>3); }
+
+class LocalServerFixture {
+
+public:
+
+  struct mg_context *mServerCtx;
+  int mPort;
+  pthread_mutex_t mPortsMutex;
+  std::set<int> mClientPorts; ///< remote ports seen by the server = distinct connections
+  int mServed;
+  MLTicket mTick;
+
+  LocalServerFixture() :
+    mServerCtx(NULL),
+    mServed(0)
+  {
+    pthread_mutex_init(&mPortsMutex, NULL);
+    MainLoop::currentMainLoop().startupMainLoop(true);
+    HttpConnectionPool::sharedPool().closeIdleConnections();
+    HttpConnectionPool::sharedPool().setLimits(4, 30*Second);
+  }
+
+  virtual ~LocalServerFixture()
+  {
+    HttpConnectionPool::sharedPool().closeIdleConnections();
+    HttpConnectionPool::sharedPool().setLimits(4, 30*Second);
+    if (mServerCtx) mg_stop(mServerCtx);
+    pthread_mutex_destroy(&mPortsMutex);
+  }
+
+  void startServer(int aKeepAliveMs)
+  {
+    // find a free port
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+    socklen_t len = sizeof(sin);
+    getsockname(fd, (struct sockaddr *)&sin, &len);
+    close(fd);
+    mPort = ntohs(sin.sin_port);
+    string ports = string_format("127.0.0.1:%d", mPort);
+    string keepAliveMs = string_format("%d", aKeepAliveMs);
+    const char *options[] = {
+      "listening_ports", ports.c_str(),
+      "enable_keep_alive", "yes",
+      "keep_alive_timeout_ms", keepAliveMs.c_str(),
+      "num_threads", "4",
+      NULL
+    };
+    struct mg_callbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    mServerCtx = mg_start(&callbacks, this, options);
+    REQUIRE(mServerCtx!=NULL);
+    mg_set_request_handler(mServerCtx, "/test", localRequestHandler, this);
+    mg_set_request_handler(mServerCtx, "/chunked", localChunkedHandler, this);
+    mg_set_request_handler(mServerCtx, "/untilclose", localUntilCloseHandler, this);
+    mg_set_request_handler(mServerCtx, "/echo", localEchoHandler, this);
+    mg_set_request_handler(mServerCtx, "/big", localBigHandler, this);
+    mg_set_request_handler(mServerCtx, "/jsonstream", localJsonStreamHandler, this);
+    mg_set_request_handler(mServerCtx, "/cached", localCachedHandler, this);
+  }
+
+  // cacheable resource
+
+  string mCacheControl; ///< Cache-Control header value to send
+  int mVersion; ///< content version, also used as ETag
+  int mFullResponses;
+  int mNotModified;
+
+  int handleCachedRequest(struct mg_connection *aConn)
+  {
+    const char *inm = mg_get_header(aConn, "If-None-Match");
+    string etag = string_format("\"v%d\"", mVersion);
+    if (inm && etag==inm) {
+      mNotModified++;
+      mg_printf(aConn,
+        "HTTP/1.1 304 Not Modified\r\n"
+        "ETag: %s\r\n"
+        "Cache-Control: %s\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n",
+        etag.c_str(), mCacheControl.c_str()
+      );
+      return 304;
+    }
+    mFullResponses++;
+    string body = string_format("{\"version\":%d,\"uri\":\"%s\"}", mVersion, mg_get_request_info(aConn)->local_uri);
+    mg_printf(aConn,
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: " CONTENT_TYPE_JSON "\r\n"
+      "ETag: %s\r\n"
+      "Cache-Control: %s\r\n"
+      "Content-Length: %d\r\n"
+      "\r\n"
+      "%s",
+      etag.c_str(), mCacheControl.c_str(), (int)body.size(), body.c_str()
+    );
+    return 200;
+  }
+
+  JsonObjectPtr mJsonAnswer;
+
+  void cachedDone(JsonObjectPtr aJsonResponse, ErrorPtr aError)
+  {
+    mJsonAnswer = aJsonResponse;
+    mError = aError;
+    mResponses++;
+  }
+
+  void cachedRequest(const string &aURL)
+  {
+    mResponses = 0;
+    mJsonAnswer.reset();
+    REQUIRE(mClient->jsonRequest(aURL.c_str(), boost::bind(&LocalServerFixture::cachedDone, this, _1, _2)));
+    runUntil(mResponses, 1);
+    REQUIRE(mResponses==1);
+    REQUIRE(Error::isOK(mError));
+  }
+
+  int handleRequest(struct mg_connection *aConn)
+  {
+    const struct mg_request_info *ri = mg_get_request_info(aConn);
+    pthread_mutex_lock(&mPortsMutex);
+    mClientPorts.insert(ri->remote_port);
+    int n = ++mServed;
+    pthread_mutex_unlock(&mPortsMutex);
+    string body = string_format("{\"served\":%d}", n);
+    mg_printf(aConn,
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: " CONTENT_TYPE_JSON "\r\n"
+      "Content-Length: %d\r\n"
+      "\r\n"
+      "%s",
+      (int)body.size(), body.c_str()
+    );
+    return 200;
+  }
+
+  size_t connections()
+  {
+    pthread_mutex_lock(&mPortsMutex);
+    size_t n = mClientPorts.size();
+    pthread_mutex_unlock(&mPortsMutex);
+    return n;
+  }
+
+  string url(const char *aPath = "/test") { return string_format("http://127.0.0.1:%d%s", mPort, aPath); }
+
+  void tick(MLTimer &aTimer)
+  {
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, 10*MilliSecond);
+  }
+
+  void runUntil(const int &aDone, int aCount, MLMicroSeconds aMaxTime = 5*Second)
+  {
+    mTick.executeOnce(boost::bind(&LocalServerFixture::tick, this, _1), 10*MilliSecond);
+    MLMicroSeconds timeout = MainLoop::now()+aMaxTime;
+    while (aDone<aCount && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+    mTick.cancel();
+  }
+
+  // sequential JSON requests
+
+  JsonWebClientPtr mClient;
+  int mResponses;
+  int mErrors;
+  int mLastServed;
+
+  void jsonDone(JsonObjectPtr aJsonResponse, ErrorPtr aError, int aRemaining)
+  {
+    mResponses++;
+    JsonObjectPtr o;
+    if (Error::notOK(aError) || !aJsonResponse || !aJsonResponse->get("served", o)) mErrors++;
+    else mLastServed = o->int32Value();
+    if (aRemaining>0) {
+      mClient->jsonRequest(url().c_str(), boost::bind(&LocalServerFixture::jsonDone, this, _1, _2, aRemaining-1));
+    }
+  }
+
+  void sequentialRequests(bool aKeepAlive, int aCount)
+  {
+    mResponses = 0;
+    mErrors = 0;
+    mLastServed = 0;
+    mClient = JsonWebClientPtr(new JsonWebClient(MainLoop::currentMainLoop()));
+    mClient->setTimeout(5*Second);
+    mClient->setKeepAlive(aKeepAlive);
+    mClient->jsonRequest(url().c_str(), boost::bind(&LocalServerFixture::jsonDone, this, _1, _2, aCount-1));
+    runUntil(mResponses, aCount);
+  }
+
+  // concurrent raw requests
+
+  int mHttpDone;
+
+  void httpDone(const string &aResponse, ErrorPtr aError)
+  {
+    mHttpDone++;
+    if (Error::notOK(aError) || aResponse.find("served")==string::npos) mErrors++;
+  }
+
+  // single requests with full result
+
+  HttpCommPtr mHttp;
+  string mResponse;
+  ErrorPtr mError;
+  int mCallbacks;
+  bool mStreamEnded;
+
+  void responseReceived(const string &aResponse, ErrorPtr aError, bool aStream)
+  {
+    mCallbacks++;
+    mError = aError;
+    if (aStream) {
+      if (aResponse.empty()) mStreamEnded = true;
+      mResponse += aResponse;
+    }
+    else {
+      mResponse = aResponse;
+      mStreamEnded = true;
+    }
+    if (mStreamEnded) mHttpDone++;
+  }
+
+  // downloads into sinks
+
+  size_t mBytes;
+  size_t mMaxChunk;
+  size_t mChunks;
+  bool mPatternOk;
+  int mPauseEvery;
+  std::vector<JsonObjectPtr> mValues;
+
+  bool chunkReceived(const uint8_t *aData, size_t aSize)
+  {
+    for (size_t i=0; i<aSize; i++) {
+      if (aData[i]!=bigBodyByte(mBytes+i)) { mPatternOk = false; break; }
+    }
+    mBytes += aSize;
+    mChunks++;
+    if (aSize>mMaxChunk) mMaxChunk = aSize;
+    if (mPauseEvery>0 && mChunks%mPauseEvery==0) {
+      // simulate slow sink, e.g. flash erase
+      mResumeTicket.executeOnce(boost::bind(&HttpComm::resumeBody, mHttp.get()), 5*MilliSecond);
+      return false;
+    }
+    return true;
+  }
+
+  void jsonValue(JsonObjectPtr aJsonObject)
+  {
+    mValues.push_back(aJsonObject);
+  }
+
+  MLTicket mResumeTicket;
+
+  void download(HttpComm::Engine aEngine, const string &aURL, HttpBodySinkPtr aSink, size_t aMaxBuffer = 32*1024)
+  {
+    mHttp = HttpCommPtr(new HttpComm(MainLoop::currentMainLoop()));
+    mHttp->setEngine(aEngine);
+    mHttp->setTimeout(10*Second);
+    mHttp->setBufferSize(1024);
+    mHttp->setMaxBufferSize(aMaxBuffer);
+    mResponse.clear();
+    mError.reset();
+    mCallbacks = 0;
+    mHttpDone = 0;
+    mStreamEnded = false;
+    REQUIRE(mHttp->httpDownload(aURL.c_str(), aSink, boost::bind(&LocalServerFixture::responseReceived, this, _1, _2, false)));
+    runUntil(mHttpDone, 1, 20*Second);
+    mResumeTicket.cancel();
+  }
+
+  void request(const string &aURL, const char *aMethod = "GET", const char *aBody = NULL, bool aStream = false)
+  {
+    mHttp = HttpCommPtr(new HttpComm(MainLoop::currentMainLoop()));
+    mHttp->setEngine(HttpComm::engine_mainloop);
+    mHttp->setTimeout(5*Second);
+    mResponse.clear();
+    mError.reset();
+    mCallbacks = 0;
+    mHttpDone = 0;
+    mStreamEnded = false;
+    REQUIRE(mHttp->httpRequest(aURL.c_str(), boost::bind(&LocalServerFixture::responseReceived, this, _1, _2, aStream), aMethod, aBody, NULL, -1, true, aStream));
+    runUntil(mHttpDone, 1);
+  }
+
+};
+
+
+static int localRequestHandler(struct mg_connection *aConn, void *aCbData)
+{
+  return static_cast<LocalServerFixture *>(aCbData)->handleRequest(aConn);
+}
+
+static int localChunkedHandler(struct mg_connection *aConn, void *aCbData)
+{
+  mg_send_http_ok(aConn, "text/plain", -1);
+  mg_send_chunk(aConn, "Hello ", 6);
+  usleep(20000);
+  mg_send_chunk(aConn, "chunked ", 8);
+  usleep(20000);
+  mg_send_chunk(aConn, "world", 5);
+  mg_send_chunk(aConn, "", 0);
+  return 200;
+}
+
+static int localUntilCloseHandler(struct mg_connection *aConn, void *aCbData)
+{
+  mg_printf(aConn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nuntil closed");
+  return 200;
+}
+
+static int localBigHandler(struct mg_connection *aConn, void *aCbData)
+{
+  mg_send_http_ok(aConn, "application/octet-stream", BIG_BODY_SIZE);
+  uint8_t buf[16*1024];
+  for (size_t o=0; o<BIG_BODY_SIZE; o+=sizeof(buf)) {
+    for (size_t i=0; i<sizeof(buf); i++) buf[i] = bigBodyByte(o+i);
+    if (mg_write(aConn, buf, sizeof(buf))<=0) break;
+  }
+  return 200;
+}
+
+static int localJsonStreamHandler(struct mg_connection *aConn, void *aCbData)
+{
+  mg_send_http_ok(aConn, CONTENT_TYPE_JSON, -1);
+  for (int i=0; i<100; i++) {
+    string v = string_format("{\"n\":%d,\"text\":\"value number %d\"}\n", i, i);
+    // split values across chunks
+    mg_send_chunk(aConn, v.c_str(), 10);
+    mg_send_chunk(aConn, v.c_str()+10, (unsigned int)v.size()-10);
+  }
+  mg_send_chunk(aConn, "42", 2); // number as last value, with no delimiter following
+  mg_send_chunk(aConn, "", 0);
+  return 200;
+}
+
+static int localCachedHandler(struct mg_connection *aConn, void *aCbData)
+{
+  return static_cast<LocalServerFixture *>(aCbData)->handleCachedRequest(aConn);
+}
+
+static int localEchoHandler(struct mg_connection *aConn, void *aCbData)
+{
+  char buf[256];
+  int n = mg_read(aConn, buf, sizeof(buf));
+  if (n<0) n = 0;
+  mg_send_http_ok(aConn, "text/plain", n);
+  mg_write(aConn, buf, n);
+  return 200;
+}
+
+
+TEST_CASE_METHOD(LocalServerFixture, "keep-alive connection pool", "[httppool]") {
+  HttpConnectionPool &pool = HttpConnectionPool::sharedPool();
+
+  SECTION("without keep-alive") {
+    startServer(5000);
+    sequentialRequests(false, 3);
+    REQUIRE(mResponses==3);
+    REQUIRE(mErrors==0);
+    REQUIRE(connections()==3);
+    REQUIRE(pool.idleConnections()==0);
+  }
+
+  SECTION("reuse") {
+    startServer(5000);
+    long req0 = pool.requests();
+    long reused0 = pool.reusedConnections();
+    long new0 = pool.newConnections();
+    sequentialRequests(true, 5);
+    REQUIRE(mResponses==5);
+    REQUIRE(mErrors==0);
+    REQUIRE(mLastServed==5);
+    REQUIRE(connections()==1);
+    REQUIRE(pool.requests()-req0==5);
+    REQUIRE(pool.reusedConnections()-reused0==4);
+    REQUIRE(pool.newConnections()-new0==1);
+    REQUIRE(pool.reuseRate()>0);
+    REQUIRE(pool.handshakeTimeSaved()>0);
+    REQUIRE(pool.idleConnections()==1);
+  }
+
+  SECTION("idle timeout") {
+    startServer(5000);
+    pool.setLimits(4, 100*MilliSecond);
+    sequentialRequests(true, 2);
+    REQUIRE(mResponses==2);
+    REQUIRE(pool.idleConnections()==1);
+    int dummy = 0;
+    runUntil(dummy, 1, 300*MilliSecond);
+    REQUIRE(pool.idleConnections()==0);
+  }
+
+  SECTION("connection closed by server") {
+    // server closes idle connections after 100mS, so pooled connection is stale
+    startServer(100);
+    sequentialRequests(true, 1);
+    REQUIRE(pool.idleConnections()==1);
+    int dummy = 0;
+    runUntil(dummy, 1, 400*MilliSecond);
+    long new0 = pool.newConnections();
+    sequentialRequests(true, 1);
+    REQUIRE(mResponses==1);
+    REQUIRE(mErrors==0); // transparently retried on a new connection
+    REQUIRE(pool.newConnections()-new0==1);
+    REQUIRE(connections()==2);
+  }
+
+  SECTION("non-idempotent request does not use connection closed by server") {
+    startServer(100);
+    mHttp = HttpCommPtr(new HttpComm(MainLoop::currentMainLoop()));
+    mHttp->setTimeout(5*Second);
+    mHttp->setKeepAlive(true);
+    mHttpDone = 0;
+    REQUIRE(mHttp->httpRequest(url("/echo").c_str(), boost::bind(&LocalServerFixture::responseReceived, this, _1, _2, false), "POST", "first"));
+    runUntil(mHttpDone, 1);
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(pool.idleConnections()==1);
+    int dummy = 0;
+    runUntil(dummy, 1, 400*MilliSecond);
+    long new0 = pool.newConnections();
+    mHttpDone = 0;
+    REQUIRE(mHttp->httpRequest(url("/echo").c_str(), boost::bind(&LocalServerFixture::responseReceived, this, _1, _2, false), "POST", "second"));
+    runUntil(mHttpDone, 1);
+    REQUIRE(mHttpDone==1);
+    // stale connection must have been detected before sending, as a failed POST cannot be sent again
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mResponse=="second");
+    REQUIRE(pool.newConnections()-new0==1);
+  }
+
+  SECTION("max connections per host") {
+    startServer(5000);
+    pool.setLimits(1, 30*Second);
+    mHttpDone = 0;
+    mErrors = 0;
+    std::vector<HttpCommPtr> clients;
+    for (int i=0; i<3; i++) {
+      HttpCommPtr h = HttpCommPtr(new HttpComm(MainLoop::currentMainLoop()));
+      h->setTimeout(5*Second);
+      h->setKeepAlive(true);
+      REQUIRE(h->httpRequest(url().c_str(), boost::bind(&LocalServerFixture::httpDone, this, _1, _2)));
+      clients.push_back(h);
+    }
+    runUntil(mHttpDone, 3);
+    REQUIRE(mHttpDone==3);
+    REQUIRE(mErrors==0);
+    REQUIRE(connections()==1); // requests had to wait for the single connection
+  }
+}
+
+
+TEST_CASE_METHOD(LocalServerFixture, "mainloop engine", "[httppool]") {
+  startServer(5000);
+
+  SECTION("content length") {
+    request(url());
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mHttp->mResponseStatus==200);
+    REQUIRE(mResponse=="{\"served\":1}");
+    REQUIRE(mHttp->mResponseHeaders);
+    REQUIRE((*mHttp->mResponseHeaders)["Content-Type"]==CONTENT_TYPE_JSON);
+  }
+
+  SECTION("chunked") {
+    request(url("/chunked"));
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mResponse=="Hello chunked world");
+  }
+
+  SECTION("until closed") {
+    request(url("/untilclose"));
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mResponse=="until closed");
+  }
+
+  SECTION("request body") {
+    request(url("/echo"), "POST", "posted data");
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mResponse=="posted data");
+  }
+
+  SECTION("stream") {
+    request(url("/chunked"), "GET", NULL, true);
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mStreamEnded);
+    REQUIRE(mResponse=="Hello chunked world");
+    REQUIRE(mCallbacks>=3); // data in more than one piece, plus end of stream
+  }
+
+  SECTION("non-ok status") {
+    request(url("/missing"));
+    REQUIRE(Error::isError(mError, WebError::domain(), 404));
+    REQUIRE(mHttp->mResponseStatus==404);
+  }
+
+  SECTION("connection refused") {
+    mg_stop(mServerCtx);
+    mServerCtx = NULL;
+    request(url());
+    REQUIRE(mHttpDone==1);
+    REQUIRE(Error::notOK(mError));
+  }
+
+  SECTION("JSON") {
+    mClient = JsonWebClientPtr(new JsonWebClient(MainLoop::currentMainLoop()));
+    mClient->setEngine(HttpComm::engine_mainloop);
+    mResponses = 0;
+    mErrors = 0;
+    mClient->jsonRequest(url().c_str(), boost::bind(&LocalServerFixture::jsonDone, this, _1, _2, 2));
+    runUntil(mResponses, 3);
+    REQUIRE(mResponses==3);
+    REQUIRE(mErrors==0);
+    REQUIRE(mLastServed==3);
+  }
+
+  SECTION("many concurrent requests") {
+    const int numRequests = 200;
+    mHttpDone = 0;
+    mErrors = 0;
+    std::vector<HttpCommPtr> clients;
+    for (int i=0; i<numRequests; i++) {
+      HttpCommPtr h = HttpCommPtr(new HttpComm(MainLoop::currentMainLoop()));
+      h->setEngine(HttpComm::engine_mainloop);
+      h->setTimeout(10*Second);
+      REQUIRE(h->httpRequest(url().c_str(), boost::bind(&LocalServerFixture::httpDone, this, _1, _2)));
+      clients.push_back(h);
+    }
+    runUntil(mHttpDone, numRequests, 15*Second);
+    REQUIRE(mHttpDone==numRequests);
+    REQUIRE(mErrors==0);
+    REQUIRE(mServed==numRequests);
+  }
+}
+
+
+TEST_CASE_METHOD(LocalServerFixture, "download into sinks", "[httppool]") {
+  startServer(5000);
+  mBytes = 0;
+  mMaxChunk = 0;
+  mChunks = 0;
+  mPatternOk = true;
+  mPauseEvery = 0;
+  HttpComm::Engine engine = GENERATE(HttpComm::engine_thread, HttpComm::engine_mainloop);
+  INFO("engine " << (int)engine);
+
+  SECTION("callback sink with backpressure") {
+    mPauseEvery = 16;
+    download(engine, url("/big"), HttpBodySinkPtr(new HttpCallbackSink(boost::bind(&LocalServerFixture::chunkReceived, this, _1, _2))));
+    REQUIRE(mHttpDone==1);
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mResponse.empty()); // body is not collected
+    REQUIRE(mBytes==BIG_BODY_SIZE);
+    REQUIRE(mPatternOk);
+    REQUIRE(mMaxChunk<=32*1024); // bounded memory
+    REQUIRE(mMaxChunk>1024); // buffer has grown
+  }
+
+  SECTION("fd sink") {
+    char path[] = "/tmp/p44httpsinkXXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd>=0);
+    unlink(path);
+    HttpFdSink *sink = new HttpFdSink(fd, true);
+    HttpBodySinkPtr sinkPtr(sink);
+    download(engine, url("/big"), sinkPtr);
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(sink->bytesWritten()==BIG_BODY_SIZE);
+    REQUIRE(lseek(fd, 0, SEEK_END)==BIG_BODY_SIZE);
+    uint8_t buf[256];
+    REQUIRE(pread(fd, buf, sizeof(buf), 1000000)==sizeof(buf));
+    bool ok = true;
+    for (size_t i=0; i<sizeof(buf); i++) if (buf[i]!=bigBodyByte(1000000+i)) ok = false;
+    REQUIRE(ok);
+  }
+
+  SECTION("incremental JSON") {
+    download(engine, url("/jsonstream"), HttpBodySinkPtr(new JsonBodySink(boost::bind(&LocalServerFixture::jsonValue, this, _1))));
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mValues.size()==101);
+    JsonObjectPtr o;
+    REQUIRE(mValues[50]->get("n", o));
+    REQUIRE(o->int32Value()==50);
+    REQUIRE(mValues[100]->int32Value()==42);
+  }
+}
+
+
+TEST_CASE_METHOD(LocalServerFixture, "json response cache", "[httppool]") {
+  startServer(5000);
+  mVersion = 1;
+  mFullResponses = 0;
+  mNotModified = 0;
+  HttpComm::Engine engine = GENERATE(HttpComm::engine_thread, HttpComm::engine_mainloop);
+  INFO("engine " << (int)engine);
+  mClient = JsonWebClientPtr(new JsonWebClient(MainLoop::currentMainLoop()));
+  mClient->setEngine(engine);
+  mClient->setTimeout(5*Second);
+  JsonWebCachePtr cache = JsonWebCachePtr(new JsonWebCache);
+  mClient->setCache(cache);
+  JsonObjectPtr o;
+
+  SECTION("fresh entries are served from cache") {
+    mCacheControl = "public, max-age=60";
+    cachedRequest(url("/cached"));
+    JsonObjectPtr first = mJsonAnswer;
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==1);
+    REQUIRE(mJsonAnswer!=first); // a copy...
+    REQUIRE(mJsonAnswer->json_str()==first->json_str()); // ...of the same content
+    REQUIRE(cache->hits()==1);
+    REQUIRE(cache->misses()==1);
+  }
+
+  SECTION("modifying answers does not affect the cache") {
+    mCacheControl = "no-cache";
+    cachedRequest(url("/cached"));
+    mJsonAnswer->add("version", JsonObject::newInt32(42));
+    cachedRequest(url("/cached")); // revalidated
+    REQUIRE(mNotModified==1);
+    REQUIRE(mJsonAnswer->get("version", o));
+    REQUIRE(o->int32Value()==1);
+    mJsonAnswer->add("version", JsonObject::newInt32(43));
+    mCacheControl = "max-age=60";
+    mVersion = 2;
+    cachedRequest(url("/cached")); // stored
+    mJsonAnswer->add("version", JsonObject::newInt32(44));
+    cachedRequest(url("/cached")); // fresh, from cache
+    REQUIRE(mFullResponses==2);
+    REQUIRE(mJsonAnswer->get("version", o));
+    REQUIRE(o->int32Value()==2);
+  }
+
+  SECTION("stale entries are revalidated") {
+    mCacheControl = "no-cache";
+    cachedRequest(url("/cached"));
+    JsonObjectPtr first = mJsonAnswer;
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==1);
+    REQUIRE(mNotModified==1);
+    REQUIRE(mJsonAnswer->json_str()==first->json_str());
+    REQUIRE(cache->revalidations()==1);
+    // modified resource
+    mVersion = 2;
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==2);
+    REQUIRE(mJsonAnswer->get("version", o));
+    REQUIRE(o->int32Value()==2);
+    REQUIRE(cache->misses()==2);
+    REQUIRE(cache->hits()==0);
+  }
+
+  SECTION("no-store is not cached") {
+    mCacheControl = "no-store";
+    cachedRequest(url("/cached"));
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==2);
+    REQUIRE(mNotModified==0);
+    REQUIRE(cache->entries()==0);
+  }
+
+  SECTION("LRU eviction") {
+    mCacheControl = "max-age=60";
+    cache->setLimits(2, 100000);
+    cachedRequest(url("/cached/a"));
+    cachedRequest(url("/cached/b"));
+    cachedRequest(url("/cached/a")); // a is now most recently used
+    cachedRequest(url("/cached/c")); // evicts b
+    REQUIRE(cache->entries()==2);
+    REQUIRE(cache->evictions()==1);
+    REQUIRE(mFullResponses==3);
+    cachedRequest(url("/cached/a"));
+    REQUIRE(mFullResponses==3);
+    cachedRequest(url("/cached/b"));
+    REQUIRE(mFullResponses==4);
+  }
+
+  SECTION("entry evicted during revalidation is fetched again") {
+    mCacheControl = "no-cache";
+    cachedRequest(url("/cached"));
+    mResponses = 0;
+    REQUIRE(mClient->jsonRequest(url("/cached").c_str(), boost::bind(&LocalServerFixture::cachedDone, this, _1, _2)));
+    cache->clear(); // evicted while revalidation request is in flight
+    runUntil(mResponses, 1);
+    REQUIRE(mResponses==1);
+    REQUIRE(Error::isOK(mError));
+    REQUIRE(mNotModified==1);
+    REQUIRE(mFullResponses==2);
+    REQUIRE(mJsonAnswer->get("version", o));
+    REQUIRE(o->int32Value()==1);
+    REQUIRE(cache->entries()==1);
+  }
+
+  SECTION("request headers and credentials") {
+    mCacheControl = "max-age=60";
+    mClient->addRequestHeader("Authorization", "Bearer secret");
+    cachedRequest(url("/cached"));
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==2);
+    REQUIRE(cache->entries()==0);
+    mClient->clearRequestHeaders();
+    mClient->setHttpAuthCredentials("user", "secret");
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==3);
+    REQUIRE(cache->entries()==0);
+    mClient->setHttpAuthCredentials("", "");
+    mClient->addRequestHeader("Accept-Language", "de");
+    cachedRequest(url("/cached"));
+    mClient->addRequestHeader("Accept-Language", "en");
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==5);
+    REQUIRE(cache->entries()==2);
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==5);
+    REQUIRE(cache->hits()==1);
+  }
+
+  SECTION("persistence") {
+    char dir[] = "/tmp/p44jsoncacheXXXXXX";
+    REQUIRE(mkdtemp(dir)!=NULL);
+    mCacheControl = "no-cache";
+    REQUIRE(Error::isOK(cache->setPersistence(dir)));
+    cachedRequest(url("/cached"));
+    // new cache using the same directory, as after a restart
+    JsonWebCachePtr cache2 = JsonWebCachePtr(new JsonWebCache);
+    REQUIRE(Error::isOK(cache2->setPersistence(dir)));
+    mClient->setCache(cache2);
+    cachedRequest(url("/cached"));
+    REQUIRE(mFullResponses==1);
+    REQUIRE(mNotModified==1);
+    REQUIRE(mJsonAnswer->get("version", o));
+    REQUIRE(o->int32Value()==1);
+    cache2->clear();
+    REQUIRE(rmdir(dir)==0); // clear() must have removed the persisted files
+  }
+}
@@ -0,0 +1,448 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+#include "httpserver.hpp"
+
+#include <sys/stat.h>
+
+using namespace p44;
+
+
+class HttpServerFixture
+{
+public:
+
+  HttpServerPtr mServer;
+  int mPort;
+  std::vector<int> mClientFds;
+  MLTicket mTick;
+  MLTicket mDelayedResponse;
+  std::vector<HttpServerRequestPtr> mSlowRequests;
+  HttpServerWebSocketPtr mWebSocket;
+  ErrorPtr mWebSocketError;
+  string mDocRoot;
+
+  HttpServerFixture()
+  {
+    MainLoop::currentMainLoop().startupMainLoop(true);
+    // find a free port
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+    socklen_t len = sizeof(sin);
+    getsockname(fd, (struct sockaddr *)&sin, &len);
+    close(fd);
+    mPort = ntohs(sin.sin_port);
+    mServer = HttpServerPtr(new HttpServer());
+    mServer->setRequestHandler(boost::bind(&HttpServerFixture::handleRequest, this, _1));
+    REQUIRE(Error::isOK(mServer->start(string_format("%d", mPort))));
+  }
+
+  virtual ~HttpServerFixture()
+  {
+    for (size_t i=0; i<mClientFds.size(); i++) close(mClientFds[i]);
+    mServer->clearCallbacks();
+    mServer->stop();
+    if (!mDocRoot.empty()) {
+      unlink((mDocRoot+"/index.html").c_str());
+      unlink((mDocRoot+"/data.bin").c_str());
+      rmdir(mDocRoot.c_str());
+    }
+  }
+
+  void handleRequest(HttpServerRequestPtr aRequest)
+  {
+    if (aRequest->path()=="/slow") {
+      // respond later
+      mSlowRequests.push_back(aRequest);
+      mDelayedResponse.executeOnce(boost::bind(&HttpServerFixture::slowResponse, this), 50*MilliSecond);
+    }
+    else if (aRequest->path()=="/api") {
+      JsonObjectPtr j = aRequest->jsonBody();
+      if (!j) {
+        aRequest->respondStatus(400);
+        return;
+      }
+      j->add("method", JsonObject::newString(aRequest->method()));
+      aRequest->respondJson(j);
+    }
+    else if (aRequest->path().substr(0, 7)=="/static") {
+      aRequest->respondStatus(404);
+    }
+    else {
+      string q;
+      aRequest->queryParam("q", q);
+      aRequest->respond(200, aRequest->path()+q);
+    }
+  }
+
+  void slowResponse()
+  {
+    for (size_t i=0; i<mSlowRequests.size(); i++) mSlowRequests[i]->respond(200, "/slow");
+    mSlowRequests.clear();
+  }
+
+  void webSocketOpened(HttpServerWebSocketPtr aWebSocket, HttpServerRequestPtr aRequest)
+  {
+    mWebSocket = aWebSocket;
+    mWebSocket->setMessageHandler(boost::bind(&HttpServerFixture::webSocketMessage, this, _1, _2, _3));
+  }
+
+  void webSocketMessage(HttpServerWebSocketPtr aWebSocket, const string &aMessage, ErrorPtr aError)
+  {
+    if (Error::notOK(aError)) {
+      mWebSocketError = aError;
+      return;
+    }
+    aWebSocket->send("echo:"+aMessage);
+  }
+
+  int connectClient()
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(mPort);
+    REQUIRE(connect(fd, (struct sockaddr *)&sin, sizeof(sin))==0);
+    mClientFds.push_back(fd);
+    return fd;
+  }
+
+  void sendRaw(int aFd, const string &aData)
+  {
+    REQUIRE(write(aFd, aData.data(), aData.size())==(ssize_t)aData.size());
+  }
+
+  void tick(MLTimer &aTimer)
+  {
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, 10*MilliSecond);
+  }
+
+  /// @return number of complete responses in aData
+  static size_t completeResponses(const string &aData, bool aHeadOnly)
+  {
+    size_t n = 0;
+    size_t pos = 0;
+    while (true) {
+      size_t e = aData.find("\r\n\r\n", pos);
+      if (e==string::npos) break;
+      size_t bodySz = 0;
+      size_t cl = aData.find("Content-Length: ", pos);
+      if (!aHeadOnly && cl!=string::npos && cl<e) bodySz = atoi(aData.c_str()+cl+16);
+      if (aData.size()<e+4+bodySz) break;
+      pos = e+4+bodySz;
+      n++;
+    }
+    return n;
+  }
+
+  /// run mainloop and collect data from client until aCount responses are complete or the connection closes
+  /// @return true if the connection was closed by the server
+  bool receive(int aFd, string &aData, size_t aCount, bool aHeadOnly = false, MLMicroSeconds aTimeout = 3*Second)
+  {
+    bool closed = false;
+    mTick.executeOnce(boost::bind(&HttpServerFixture::tick, this, _1), 10*MilliSecond);
+    MLMicroSeconds timeout = MainLoop::now()+aTimeout;
+    while (MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+      char buf[8192];
+      ssize_t n;
+      while ((n = recv(aFd, buf, sizeof(buf), MSG_DONTWAIT))>0) aData.append(buf, n);
+      if (n==0) { closed = true; break; }
+      if (aCount>0 && completeResponses(aData, aHeadOnly)>=aCount) break;
+    }
+    mTick.cancel();
+    return closed;
+  }
+
+  static string body(const string &aResponse)
+  {
+    size_t e = aResponse.find("\r\n\r\n");
+    return e==string::npos ? "" : aResponse.substr(e+4);
+  }
+
+  void makeDocRoot()
+  {
+    char tmpl[] = "/tmp/p44httptestXXXXXX";
+    REQUIRE(mkdtemp(tmpl)!=NULL);
+    mDocRoot = tmpl;
+    FILE *f = fopen((mDocRoot+"/index.html").c_str(), "w");
+    fputs("<html>index</html>", f);
+    fclose(f);
+    f = fopen((mDocRoot+"/data.bin").c_str(), "w");
+    for (int i=0; i<200000; i++) fputc(i & 0xFF, f);
+    fclose(f);
+    mServer->setDocumentRoot(mDocRoot, "/static/");
+  }
+
+  /// build a masked client frame
+  static string clientFrame(uint8_t aFirstByte, const string &aPayload)
+  {
+    string f;
+    f += (char)aFirstByte;
+    if (aPayload.size()<126) {
+      f += (char)(0x80|aPayload.size());
+    }
+    else {
+      f += (char)(0x80|126);
+      f += (char)(aPayload.size()>>8);
+      f += (char)(aPayload.size()&0xFF);
+    }
+    const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    f.append((const char *)mask, 4);
+    for (size_t i=0; i<aPayload.size(); i++) f += (char)(aPayload[i]^mask[i&3]);
+    return f;
+  }
+
+  /// extract the next unmasked server frame
+  static bool serverFrame(string &aData, uint8_t &aOpcode, string &aPayload)
+  {
+    if (aData.size()<2) return false;
+    size_t len = aData[1] & 0x7F;
+    size_t hl = 2;
+    if (len==126) {
+      if (aData.size()<4) return false;
+      len = ((uint8_t)aData[2]<<8) | (uint8_t)aData[3];
+      hl = 4;
+    }
+    if (aData.size()<hl+len) return false;
+    aOpcode = aData[0] & 0x0F;
+    aPayload = aData.substr(hl, len);
+    aData.erase(0, hl+len);
+    return true;
+  }
+
+};
+
+
+TEST_CASE_METHOD(HttpServerFixture, "http server requests", "[httpserver]")
+{
+  SECTION("keep-alive") {
+    int fd = connectClient();
+    string resp;
+    sendRaw(fd, "GET /first?q=%41+b HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    REQUIRE(!receive(fd, resp, 1));
+    REQUIRE(resp.substr(0, 15)=="HTTP/1.1 200 OK");
+    REQUIRE(body(resp)=="/firstA b");
+    resp.clear();
+    sendRaw(fd, "GET /second HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    REQUIRE(!receive(fd, resp, 1));
+    REQUIRE(body(resp)=="/second");
+    REQUIRE(mServer->requestsServed()==2);
+    REQUIRE(mServer->keepAliveReuses()==1);
+    REQUIRE(mServer->connections()==1);
+  }
+
+  SECTION("pipelining in order") {
+    int fd = connectClient();
+    string resp;
+    sendRaw(fd,
+      "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "GET /fast1 HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "POST /api HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\nContent-Length: 9\r\n\r\n{\"a\":42}\n"
+    );
+    REQUIRE(!receive(fd, resp, 3));
+    REQUIRE(completeResponses(resp, false)==3);
+    size_t p1 = resp.find("/slow");
+    size_t p2 = resp.find("/fast1");
+    size_t p3 = resp.find("\"method\"");
+    REQUIRE(p1!=string::npos);
+    REQUIRE(p1<p2);
+    REQUIRE(p2<p3);
+    REQUIRE(p3!=string::npos);
+    REQUIRE(resp.find("application/json")!=string::npos);
+    REQUIRE(mServer->maxPipelineDepth()>=2);
+  }
+
+  SECTION("pipeline limit") {
+    mServer->setLimits(16*1024, 1024*1024, 2);
+    int fd = connectClient();
+    string req;
+    for (int i=0; i<10; i++) req += "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    sendRaw(fd, req);
+    string resp;
+    REQUIRE(!receive(fd, resp, 10, false, 5*Second));
+    REQUIRE(completeResponses(resp, false)==10);
+    REQUIRE(mServer->maxPipelineDepth()<=2);
+  }
+
+  SECTION("connection close") {
+    int fd = connectClient();
+    string resp;
+    sendRaw(fd, "GET /bye HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    REQUIRE(receive(fd, resp, 0));
+    REQUIRE(resp.find("Connection: close\r\n")!=string::npos);
+    REQUIRE(body(resp)=="/bye");
+    REQUIRE(mServer->connections()==0);
+  }
+
+  SECTION("http/1.0") {
+    int fd = connectClient();
+    string resp;
+    sendRaw(fd, "GET /old HTTP/1.0\r\n\r\n");
+    REQUIRE(receive(fd, resp, 0));
+    REQUIRE(body(resp)=="/old");
+  }
+
+  SECTION("limits") {
+    mServer->setLimits(256, 100, 4);
+    int fd = connectClient();
+    string resp;
+    sendRaw(fd, "GET / HTTP/1.1\r\nX-Big: "+string(300, 'x')+"\r\n\r\n");
+    REQUIRE(receive(fd, resp, 0));
+    REQUIRE(resp.substr(0, 12)=="HTTP/1.1 431");
+    fd = connectClient();
+    resp.clear();
+    sendRaw(fd, "POST /api HTTP/1.1\r\nContent-Length: 1000\r\n\r\n");
+    REQUIRE(receive(fd, resp, 0));
+    REQUIRE(resp.substr(0, 12)=="HTTP/1.1 413");
+  }
+
+  SECTION("idle timeout") {
+    mServer->setKeepAliveTimeout(100*MilliSecond);
+    int fd = connectClient();
+    string resp;
+    sendRaw(fd, "GET /x HTTP/1.1\r\n\r\n");
+    REQUIRE(receive(fd, resp, 0, false, 2*Second));
+    REQUIRE(body(resp)=="/x");
+    REQUIRE(mServer->connections()==0);
+  }
+}
+
+
+TEST_CASE_METHOD(HttpServerFixture, "http server static files", "[httpserver]")
+{
+  makeDocRoot();
+  int fd = connectClient();
+  string resp;
+  SECTION("index") {
+    sendRaw(fd, "GET /static/ HTTP/1.1\r\n\r\n");
+    REQUIRE(!receive(fd, resp, 1));
+    REQUIRE(resp.find("Content-Type: text/html")!=string::npos);
+    REQUIRE(body(resp)=="<html>index</html>");
+    REQUIRE(mServer->filesServed()==1);
+  }
+  SECTION("large file via sendfile") {
+    sendRaw(fd, "GET /static/data.bin HTTP/1.1\r\n\r\nGET /after HTTP/1.1\r\n\r\n");
+    REQUIRE(!receive(fd, resp, 2));
+    REQUIRE(resp.find("Content-Length: 200000\r\n")!=string::npos);
+    string b = body(resp);
+    REQUIRE(b.size()>200000);
+    bool ok = true;
+    for (int i=0; i<200000; i++) if ((uint8_t)b[i]!=(i & 0xFF)) { ok = false; break; }
+    REQUIRE(ok);
+    // next pipelined response follows the file
+    REQUIRE(b.substr(200000, 15)=="HTTP/1.1 200 OK");
+    REQUIRE(body(b.substr(200000))=="/after");
+  }
+  SECTION("head") {
+    sendRaw(fd, "HEAD /static/data.bin HTTP/1.1\r\n\r\n");
+    REQUIRE(!receive(fd, resp, 1, true));
+    receive(fd, resp, 0, true, 100*MilliSecond);
+    REQUIRE(resp.find("Content-Length: 200000\r\n")!=string::npos);
+    REQUIRE(body(resp).empty());
+  }
+  SECTION("not found and escaping") {
+    sendRaw(fd, "GET /static/missing.txt HTTP/1.1\r\n\r\nGET /static/../etc/passwd HTTP/1.1\r\n\r\nGET /static/%2e%2e/x HTTP/1.1\r\n\r\n");
+    REQUIRE(!receive(fd, resp, 3));
+    REQUIRE(resp.find("HTTP/1.1 200")==string::npos);
+    REQUIRE(mServer->filesServed()==0);
+  }
+  SECTION("mime types") {
+    REQUIRE(string(HttpServer::mimeType("a/b.JSON"))=="application/json");
+    REQUIRE(string(HttpServer::mimeType("a.b/c"))=="application/octet-stream");
+  }
+}
+
+
+TEST_CASE_METHOD(HttpServerFixture, "http server websocket", "[httpserver]")
+{
+  mServer->setWebSocketHandler(boost::bind(&HttpServerFixture::webSocketOpened, this, _1, _2));
+  int fd = connectClient();
+  string resp;
+  // upgrade with the example key from RFC 6455, and a first frame right away
+  sendRaw(fd,
+    "GET /ws HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: keep-alive, Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n"+
+    clientFrame(0x81, "hello")
+  );
+  REQUIRE(!receive(fd, resp, 1));
+  REQUIRE(resp.substr(0, 12)=="HTTP/1.1 101");
+  REQUIRE(resp.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n")!=string::npos);
+  REQUIRE(mWebSocket);
+  REQUIRE(mServer->webSocketsOpened()==1);
+  string frames = body(resp);
+  uint8_t opcode;
+  string payload;
+  for (int i=0; i<50 && !serverFrame(frames, opcode, payload); i++) {
+    REQUIRE(!receive(fd, frames, 0, false, 20*MilliSecond));
+  }
+  REQUIRE(opcode==0x1);
+  REQUIRE(payload=="echo:hello");
+  SECTION("fragments and ping") {
+    sendRaw(fd, clientFrame(0x01, "frag")+clientFrame(0x89, "png")+clientFrame(0x80, string(200, 'm')));
+    std::vector<string> got;
+    MLMicroSeconds timeout = MainLoop::now()+2*Second;
+    while (got.size()<2 && MainLoop::now()<timeout) {
+      if (serverFrame(frames, opcode, payload)) {
+        got.push_back(string_format("%d:", opcode)+payload);
+        continue;
+      }
+      receive(fd, frames, 0, false, 20*MilliSecond);
+    }
+    REQUIRE(got.size()==2);
+    REQUIRE(got[0]=="10:png"); // pong comes first, as the message is not complete before
+    REQUIRE(got[1]=="1:echo:frag"+string(200, 'm'));
+  }
+  SECTION("server send") {
+    REQUIRE(Error::isOK(mWebSocket->send(string(70000, 'x'))));
+    for (int i=0; i<50 && frames.size()<70010; i++) {
+      REQUIRE(!receive(fd, frames, 0, false, 20*MilliSecond));
+    }
+    REQUIRE((uint8_t)frames[1]==127);
+    REQUIRE(frames.size()==70010);
+  }
+  SECTION("client close") {
+    string cp;
+    cp += (char)0x03; cp += (char)0xE8; // 1000
+    sendRaw(fd, clientFrame(0x88, cp));
+    REQUIRE(receive(fd, frames, 0));
+    REQUIRE(serverFrame(frames, opcode, payload));
+    REQUIRE(opcode==0x8);
+    REQUIRE(payload==cp);
+    REQUIRE(Error::isError(mWebSocketError, HttpServerError::domain(), HttpServerError::closed));
+    REQUIRE(!mWebSocket->isOpen());
+  }
+}
@@ -0,0 +1,422 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+#include "jsoncomm.hpp"
+#include "jsonrpccomm.hpp"
+
+using namespace p44;
+
+
+class JsonCommFixture
+{
+public:
+
+  JsonCommPtr mA;
+  JsonCommPtr mB;
+  std::vector<JsonObjectPtr> mMessages;
+  std::vector<ErrorPtr> mErrors;
+
+  JsonCommFixture()
+  {
+    MainLoop::currentMainLoop().startupMainLoop(true);
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)==0);
+    mA = JsonCommPtr(new JsonComm(MainLoop::currentMainLoop()));
+    mA->makeNonBlocking(fds[0]);
+    mA->setFd(fds[0]);
+    mB = JsonCommPtr(new JsonComm(MainLoop::currentMainLoop()));
+    mB->makeNonBlocking(fds[1]);
+    mB->setFd(fds[1]);
+    mB->setMessageHandler(boost::bind(&JsonCommFixture::messageReceived, this, _1, _2));
+  }
+
+  virtual ~JsonCommFixture()
+  {
+    mA->clearCallbacks();
+    mA->stopMonitoringAndClose();
+    mB->clearCallbacks();
+    mB->stopMonitoringAndClose();
+  }
+
+  void messageReceived(ErrorPtr aError, JsonObjectPtr aJsonObject)
+  {
+    if (Error::notOK(aError)) mErrors.push_back(aError);
+    else mMessages.push_back(aJsonObject);
+  }
+
+  void runUntil(size_t aCount)
+  {
+    MLMicroSeconds timeout = MainLoop::now()+5*Second;
+    while (mMessages.size()+mErrors.size()<aCount && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+  }
+
+  void sendRaw(const string aData)
+  {
+    REQUIRE(write(mA->getFd(), aData.c_str(), aData.size())==(ssize_t)aData.size());
+  }
+
+  JsonObjectPtr bigMessage(int aIndex, size_t aSize)
+  {
+    JsonObjectPtr o = JsonObject::newObj();
+    o->add("index", JsonObject::newInt32(aIndex));
+    o->add("data", JsonObject::newString(string(aSize, 'x')));
+    return o;
+  }
+
+};
+
+
+TEST_CASE_METHOD(JsonCommFixture, "json framing", "[jsoncomm]")
+{
+  JsonObjectPtr o;
+
+  SECTION("end of message delimited") {
+    sendRaw("{\"a\":1}\n{\"a\":");
+    runUntil(1);
+    sendRaw("2}\n\n{\"a\"\r:3}\n");
+    runUntil(3);
+    REQUIRE(mErrors.empty());
+    REQUIRE(mMessages.size()==3);
+    REQUIRE(mMessages[1]->get("a", o));
+    REQUIRE(o->int32Value()==2);
+    REQUIRE(mMessages[2]->get("a", o));
+    REQUIRE(o->int32Value()==3);
+    // large messages
+    for (int i=0; i<5; i++) mA->sendMessage(bigMessage(i, 100000));
+    runUntil(8);
+    REQUIRE(mMessages.size()==8);
+    REQUIRE(mMessages[7]->get("index", o));
+    REQUIRE(o->int32Value()==4);
+    REQUIRE(mMessages[7]->get("data", o));
+    REQUIRE(o->stringValue().size()==100000);
+  }
+
+  SECTION("length prefixed") {
+    mA->setLengthPrefixed(true);
+    mB->setLengthPrefixed(true);
+    for (int i=0; i<5; i++) mA->sendMessage(bigMessage(i, 100000));
+    mA->sendMessage(JsonObject::newInt32(42)); // needs no delimiter to be complete
+    runUntil(6);
+    REQUIRE(mErrors.empty());
+    REQUIRE(mMessages.size()==6);
+    REQUIRE(mMessages[4]->get("index", o));
+    REQUIRE(o->int32Value()==4);
+    REQUIRE(mMessages[4]->get("data", o));
+    REQUIRE(o->stringValue().size()==100000);
+    REQUIRE(mMessages[5]->int32Value()==42);
+  }
+
+  SECTION("length prefixed message too large") {
+    mA->setLengthPrefixed(true);
+    mB->setLengthPrefixed(true, 1000);
+    mA->sendMessage(bigMessage(0, 2000));
+    runUntil(1);
+    REQUIRE(mMessages.empty());
+    REQUIRE(mErrors.size()==1);
+    REQUIRE(Error::isError(mErrors[0], JsonError::domain(), json_tokener_error_size));
+  }
+
+  SECTION("binary encoding negotiated") {
+    mA->setMessageHandler(boost::bind(&JsonCommFixture::messageReceived, this, _1, _2));
+    mA->setBinaryEncoding(true);
+    mB->setBinaryEncoding(true);
+    mA->sendMessage(bigMessage(0, 1000)); // offer is sent before first message, which is still text
+    runUntil(1);
+    REQUIRE(mB->binaryActive());
+    mB->sendMessage(JsonObject::newBool(true)); // preceded by B's offer, sent when A's offer arrived
+    runUntil(2);
+    REQUIRE(mA->binaryActive());
+    mMessages.clear();
+    for (int i=0; i<5; i++) mA->sendMessage(bigMessage(i, 1000));
+    mA->sendMessage(JsonObject::newNull());
+    runUntil(6);
+    REQUIRE(mErrors.empty());
+    REQUIRE(mMessages.size()==6);
+    REQUIRE(mMessages[4]->get("index", o));
+    REQUIRE(o->int32Value()==4);
+    REQUIRE(mMessages[4]->get("data", o));
+    REQUIRE(o->stringValue().size()==1000);
+    REQUIRE(mMessages[5]->json_str()=="null");
+  }
+
+  SECTION("binary encoding offered to text-only peer") {
+    mA->setBinaryEncoding(true);
+    mB->setLengthPrefixed(true);
+    for (int i=0; i<3; i++) mA->sendMessage(bigMessage(i, 1000));
+    runUntil(3);
+    REQUIRE(mErrors.empty());
+    REQUIRE(mMessages.size()==3);
+    REQUIRE(!mA->binaryActive());
+    REQUIRE(!mB->binaryActive());
+  }
+}
+
+
+static JsonObjectPtr jsonCorpus(int aIndex)
+{
+  JsonObjectPtr o = JsonObject::newObj();
+  o->add("id", JsonObject::newInt32(aIndex));
+  o->add("name", JsonObject::newString(string_format("device #%d \xC3\xA4\xE2\x82\xAC", aIndex)));
+  o->add("active", JsonObject::newBool(aIndex%2==0));
+  o->add("value", JsonObject::newDouble(aIndex*3.14159));
+  o->add("big", JsonObject::newInt64(-1234567890123456789LL+aIndex));
+  o->add("none", JsonObject::newNull());
+  JsonObjectPtr a = JsonObject::newArray();
+  for (int i=0; i<10; i++) a->arrayAppend(JsonObject::newInt32(i*(i-5)*1000));
+  o->add("samples", a);
+  JsonObjectPtr n = JsonObject::newObj();
+  n->add("empty", JsonObject::newArray());
+  n->add("emptyobj", JsonObject::newObj());
+  n->add("", JsonObject::newString(""));
+  o->add("nested", n);
+  return o;
+}
+
+
+TEST_CASE("json binary encoding", "[jsoncomm]")
+{
+  SECTION("round trip") {
+    JsonObjectPtr o = jsonCorpus(42);
+    string tlv = o->tlvEncoded();
+    ErrorPtr err;
+    JsonObjectPtr d = JsonObject::objFromTLV(tlv.data(), tlv.size(), &err);
+    REQUIRE(Error::isOK(err));
+    REQUIRE(d);
+    REQUIRE(d->json_str()==o->json_str());
+    JsonObjectPtr v;
+    REQUIRE(d->get("big", v));
+    REQUIRE(v->isType(json_type_int));
+    REQUIRE(v->int64Value()==-1234567890123456789LL+42);
+    REQUIRE(d->get("value", v));
+    REQUIRE(v->isType(json_type_double));
+    REQUIRE(v->doubleValue()==42*3.14159);
+    REQUIRE(d->get("active", v));
+    REQUIRE(v->isType(json_type_boolean));
+    REQUIRE(d->get("none", v, false));
+    REQUIRE(!v);
+    REQUIRE(tlv.size()<o->json_str().size());
+  }
+
+  SECTION("scalars") {
+    string tlv = JsonObject::newString("just a string")->tlvEncoded();
+    REQUIRE(JsonObject::objFromTLV(tlv.data(), tlv.size())->stringValue()=="just a string");
+    tlv = JsonObject::newInt64(0x7FFFFFFFFFFFFFFFLL)->tlvEncoded();
+    REQUIRE(JsonObject::objFromTLV(tlv.data(), tlv.size())->int64Value()==0x7FFFFFFFFFFFFFFFLL);
+    tlv = JsonObject::newInt32(-1)->tlvEncoded();
+    REQUIRE(tlv.size()==3); // tag, length, one byte value
+    REQUIRE(JsonObject::objFromTLV(tlv.data(), tlv.size())->int32Value()==-1);
+  }
+
+  SECTION("invalid data") {
+    ErrorPtr err;
+    string tlv = jsonCorpus(1)->tlvEncoded();
+    REQUIRE(!JsonObject::objFromTLV(tlv.data(), tlv.size()-1, &err));
+    REQUIRE(Error::isError(err, JsonError::domain(), json_tokener_error_parse_unexpected));
+    tlv += '\x00';
+    err.reset();
+    REQUIRE(!JsonObject::objFromTLV(tlv.data(), tlv.size(), &err)); // trailing garbage
+    REQUIRE(Error::notOK(err));
+    JsonObjectPtr deepObj = JsonObject::newArray();
+    for (int i=0; i<200; i++) { JsonObjectPtr a = JsonObject::newArray(); a->arrayAppend(deepObj); deepObj = a; }
+    string deep = deepObj->tlvEncoded(); // too deeply nested to be decoded
+    err.reset();
+    REQUIRE(!JsonObject::objFromTLV(deep.data(), deep.size(), &err));
+    REQUIRE(Error::notOK(err));
+  }
+}
+
+
+TEST_CASE("json binary encoding throughput", "[jsoncomm][benchmark][slow]")
+{
+  JsonObjectPtr corpus = JsonObject::newArray();
+  for (int i=0; i<100; i++) corpus->arrayAppend(jsonCorpus(i));
+  string text = corpus->json_str();
+  string tlv = corpus->tlvEncoded();
+  WARN("text JSON: " << text.size() << " bytes, binary: " << tlv.size() << " bytes");
+  REQUIRE(tlv.size()<text.size());
+
+  BENCHMARK("encode text") {
+    return corpus->json_str().size();
+  };
+  BENCHMARK("encode binary") {
+    return corpus->tlvEncoded().size();
+  };
+  BENCHMARK("decode text") {
+    return JsonObject::objFromText(text.c_str(), text.size())->arrayLength();
+  };
+  BENCHMARK("decode binary") {
+    return JsonObject::objFromTLV(tlv.data(), tlv.size())->arrayLength();
+  };
+}
+
+
+class JsonRpcFixture
+{
+public:
+
+  JsonRpcCommPtr mClient;
+  JsonRpcCommPtr mServer;
+  int mRequestsHandled;
+  bool mAnswer;
+  int mResults;
+  std::vector<ErrorPtr> mErrors;
+
+  JsonRpcFixture() :
+    mRequestsHandled(0),
+    mAnswer(true),
+    mResults(0)
+  {
+    MainLoop::currentMainLoop().startupMainLoop(true);
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)==0);
+    mClient = JsonRpcCommPtr(new JsonRpcComm(MainLoop::currentMainLoop()));
+    mClient->makeNonBlocking(fds[0]);
+    mClient->setFd(fds[0]);
+    mServer = JsonRpcCommPtr(new JsonRpcComm(MainLoop::currentMainLoop()));
+    mServer->makeNonBlocking(fds[1]);
+    mServer->setFd(fds[1]);
+    mServer->setRequestHandler(boost::bind(&JsonRpcFixture::requestReceived, this, _1, _2, _3));
+  }
+
+  virtual ~JsonRpcFixture()
+  {
+    mClient->clearCallbacks();
+    mClient->stopMonitoringAndClose();
+    mServer->clearCallbacks();
+    mServer->stopMonitoringAndClose();
+  }
+
+  void requestReceived(const char *aMethod, const JsonObjectPtr aJsonRpcId, JsonObjectPtr aParams)
+  {
+    mRequestsHandled++;
+    if (!aJsonRpcId || !mAnswer) return; // notification, or simulating lost answer
+    if (strcmp(aMethod, "fail")==0) {
+      mServer->sendError(aJsonRpcId, JsonRpcError::InvalidParams, "failing as requested");
+    }
+    else {
+      mServer->sendResult(aJsonRpcId, aParams);
+    }
+  }
+
+  void responseReceived(int32_t aResponseId, ErrorPtr &aError, JsonObjectPtr aResultOrErrorData)
+  {
+    if (Error::notOK(aError)) mErrors.push_back(aError);
+    else mResults++;
+  }
+
+  MLTicket mTick;
+
+  void tick(MLTimer &aTimer)
+  {
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, 10*MilliSecond);
+  }
+
+  void runUntil(int aCount, MLMicroSeconds aMaxTime = 5*Second)
+  {
+    mTick.executeOnce(boost::bind(&JsonRpcFixture::tick, this, _1), 10*MilliSecond);
+    MLMicroSeconds timeout = MainLoop::now()+aMaxTime;
+    while (mResults+(int)mErrors.size()<aCount && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+    mTick.cancel();
+  }
+
+  void sendRequests(int aCount, MLMicroSeconds aTimeout = Never)
+  {
+    for (int i=0; i<aCount; i++) {
+      JsonObjectPtr params = JsonObject::newObj();
+      params->add("n", JsonObject::newInt32(i));
+      REQUIRE(Error::isOK(mClient->sendRequest("echo", params, boost::bind(&JsonRpcFixture::responseReceived, this, _1, _2, _3), aTimeout)));
+    }
+  }
+
+};
+
+
+TEST_CASE_METHOD(JsonRpcFixture, "json-rpc batches and timeouts", "[jsoncomm]")
+{
+  SECTION("single requests") {
+    sendRequests(5);
+    runUntil(5);
+    REQUIRE(mResults==5);
+    REQUIRE(mServer->batchesReceived()==0);
+    REQUIRE(mClient->responsesReceived()==5);
+    REQUIRE(mClient->outstandingRequests()==0);
+  }
+
+  SECTION("coalesced requests") {
+    mClient->setBatching(true);
+    sendRequests(10);
+    mClient->sendRequest("note", JsonObjectPtr()); // notification in same batch
+    mClient->sendRequest("fail", JsonObjectPtr(), boost::bind(&JsonRpcFixture::responseReceived, this, _1, _2, _3));
+    REQUIRE(mClient->outstandingRequests()==11);
+    runUntil(11);
+    REQUIRE(mResults==10);
+    REQUIRE(mErrors.size()==1);
+    REQUIRE(Error::isError(mErrors[0], JsonRpcError::domain(), JsonRpcError::InvalidParams));
+    REQUIRE(mRequestsHandled==12);
+    REQUIRE(mClient->batchesSent()==1);
+    REQUIRE(mServer->batchesReceived()==1);
+    REQUIRE(mServer->batchesSent()==1); // answers returned as one batch
+    REQUIRE(mClient->batchesReceived()==1);
+    REQUIRE(mClient->outstandingRequests()==0);
+    REQUIRE(mClient->responsesReceived()==11);
+    REQUIRE(mClient->averageRoundTrip()>0);
+    REQUIRE(mClient->maxRoundTrip()>=mClient->averageRoundTrip());
+  }
+
+  SECTION("request timeouts") {
+    mAnswer = false;
+    mClient->setRequestTimeout(50*MilliSecond);
+    sendRequests(3);
+    sendRequests(1, 20*MilliSecond);
+    sendRequests(1, Infinite);
+    runUntil(4, 1*Second);
+    REQUIRE(mErrors.size()==4);
+    REQUIRE(Error::isError(mErrors[0], JsonRpcError::domain(), JsonRpcError::RequestTimeout));
+    REQUIRE(mClient->timeouts()==4);
+    REQUIRE(mClient->outstandingRequests()==1);
+    REQUIRE(mRequestsHandled==5);
+  }
+
+  SECTION("failing to send a batch fails its requests") {
+    mClient->setBatching(true);
+    sendRequests(3, Infinite);
+    mClient->sendRequest("note", JsonObjectPtr());
+    REQUIRE(mClient->outstandingRequests()==3);
+    // replace connection by read end of a pipe, so sending the batch will fail
+    int p[2];
+    REQUIRE(pipe(p)==0);
+    mClient->stopMonitoringAndClose();
+    mClient->setFd(p[0]);
+    runUntil(3, 1*Second);
+    close(p[1]);
+    REQUIRE(mErrors.size()==3);
+    REQUIRE(mResults==0);
+    REQUIRE(mClient->outstandingRequests()==0);
+  }
+}
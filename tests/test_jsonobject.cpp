@@ -0,0 +1,224 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+using namespace p44;
+
+
+// reference: parse and render with json-c only
+static string jsoncText(const string &aText, int aFlags = 0)
+{
+  struct json_object *o = json_tokener_parse(aText.c_str());
+  string r = json_object_to_json_string_ext(o, aFlags);
+  json_object_put(o);
+  return r;
+}
+
+
+static string jsoncParsed(const string &aText, int aFlags = 0)
+{
+  JsonObjectPtr o = JsonObject::objFromText(aText.c_str());
+  if (!o) return "<parse error>";
+  return json_object_to_json_string_ext(const_cast<struct json_object *>(o->jsoncObj()), aFlags);
+}
+
+
+static const int testFlags[] = {
+  JSON_C_TO_STRING_PLAIN,
+  JSON_C_TO_STRING_SPACED,
+  JSON_C_TO_STRING_PRETTY,
+  JSON_C_TO_STRING_PRETTY|JSON_C_TO_STRING_SPACED,
+  JSON_C_TO_STRING_NOZERO,
+  #ifdef JSON_C_TO_STRING_NOSLASHESCAPE
+  JSON_C_TO_STRING_NOSLASHESCAPE,
+  #endif
+  #ifdef JSON_C_TO_STRING_PRETTY_TAB
+  JSON_C_TO_STRING_PRETTY|JSON_C_TO_STRING_PRETTY_TAB,
+  #endif
+};
+
+
+// generated corpus resembling device descriptions and API responses
+static string jsonCorpus(int aNumItems, int aFlags)
+{
+  JsonObjectPtr corpus = JsonObject::newObj();
+  corpus->add("version", JsonObject::newString("1.2.3"));
+  corpus->add("generated", JsonObject::newInt64(1760781600123LL));
+  JsonObjectPtr items = JsonObject::newArray();
+  for (int i=0; i<aNumItems; i++) {
+    JsonObjectPtr d = JsonObject::newObj();
+    d->add("dSUID", JsonObject::newString(string_format("%032X%02X", i*7919, i%256)));
+    d->add("name", JsonObject::newString(string_format("Light #%d in \"Wohnzimmer\" \xC3\xA4\xE2\x82\xAC", i)));
+    d->add("path", JsonObject::newString(string_format("/api/devices/%d/state\tok\n", i)));
+    d->add("active", JsonObject::newBool(i%3!=0));
+    d->add("brightness", JsonObject::newDouble(i*0.37));
+    d->add("counter", JsonObject::newInt64(-i*1234567LL));
+    d->add("zone", i%5==0 ? JsonObject::newNull() : JsonObject::newInt32(i%17));
+    JsonObjectPtr ch = JsonObject::newArray();
+    for (int c=0; c<4; c++) {
+      JsonObjectPtr chn = JsonObject::newObj();
+      chn->add("id", JsonObject::newString(string_format("ch%d", c)));
+      chn->add("value", JsonObject::newDouble(c*i*1.5));
+      chn->add("min", JsonObject::newInt32(0));
+      chn->add("max", JsonObject::newInt32(100));
+      ch->arrayAppend(chn);
+    }
+    d->add("channels", ch);
+    items->arrayAppend(d);
+  }
+  corpus->add("devices", items);
+  return json_object_to_json_string_ext(const_cast<struct json_object *>(corpus->jsoncObj()), aFlags);
+}
+
+
+TEST_CASE("json fast path", "[jsonobject]")
+{
+  SECTION("same results as json-c") {
+    const char *texts[] = {
+      "{}", "[]", " \n\t{ } ",
+      "{\"a\":1,\"b\":-2,\"c\":0,\"d\":-0,\"e\":9223372036854775807,\"f\":-9223372036854775808}",
+      "[1.5,1.50,-0.0,1e10,1E-5,2.5e+3,0.1,123456789.123456789]",
+      "[true,false,null,[null],{\"n\":null}]",
+      "{\"s\":\"plain\",\"e\":\"\\\"\\\\\\/\\b\\f\\n\\r\\t\",\"u\":\"\\u00e4\\u20ac\\ud83d\\ude00\",\"z\":\"a\\u0000b\",\"c\":\"\\u001f\"}",
+      "{\"dup\":1,\"other\":2,\"dup\":3}",
+      "{\"nested\":{\"deeper\":{\"deepest\":[[[[1]]]]}}}",
+      "{\"utf8\":\"\xC3\xA4\xE2\x82\xAC\xF0\x9F\x98\x80 and a long string to have the vectorized scanner at work, with a slash / near the end\"}",
+      // handled by json-c
+      "[1,2,]", "{\"a\":1,}", "[01]", "[12345678901234567890]", "[-12345678901234567890]", "[TRUE,Null]",
+      "{\"lonely\":\"\\ud83d\"}", "['single']"
+    };
+    for (size_t i=0; i<sizeof(texts)/sizeof(texts[0]); i++) {
+      INFO(texts[i]);
+      string t = texts[i];
+      for (size_t f=0; f<sizeof(testFlags)/sizeof(testFlags[0]); f++) {
+        INFO("flags=" << testFlags[f]);
+        REQUIRE(jsoncParsed(t, testFlags[f])==jsoncText(t, testFlags[f]));
+        JsonObjectPtr o = JsonObject::objFromText(t.c_str());
+        REQUIRE(o);
+        REQUIRE(o->json_str(testFlags[f])==json_object_to_json_string_ext(const_cast<struct json_object *>(o->jsoncObj()), testFlags[f]));
+      }
+    }
+    string corpus = jsonCorpus(50, JSON_C_TO_STRING_PRETTY);
+    for (size_t f=0; f<sizeof(testFlags)/sizeof(testFlags[0]); f++) {
+      REQUIRE(jsoncParsed(corpus, testFlags[f])==jsoncText(corpus, testFlags[f]));
+      REQUIRE(JsonObject::objFromText(corpus.c_str())->json_str(testFlags[f])==jsoncText(corpus, testFlags[f]));
+    }
+  }
+
+  SECTION("strings and numbers") {
+    JsonObjectPtr o = JsonObject::objFromText("{\"u\":\"\\u00e4\\ud83d\\ude00\",\"big\":-9223372036854775808,\"d\":0.1}");
+    REQUIRE(o);
+    REQUIRE(o->get("u")->stringValue()=="\xC3\xA4\xF0\x9F\x98\x80");
+    REQUIRE(o->get("big")->int64Value()==INT64_MIN);
+    REQUIRE(o->get("d")->isType(json_type_double));
+    REQUIRE(o->get("d")->json_str()=="0.1"); // original text is kept
+    o = JsonObject::objFromText("[\"a\\u0000b\"]");
+    REQUIRE(json_object_get_string_len(const_cast<struct json_object *>(o->arrayGet(0)->jsoncObj()))==3);
+  }
+
+  SECTION("comments") {
+    JsonObjectPtr o = JsonObject::objFromText("/* head */ {\"a\" /* x */ : /**/ 1, /* y */\"b\":[2/* z */]} /* tail", -1, NULL, true);
+    REQUIRE(o);
+    REQUIRE(o->json_str()=="{\"a\":1,\"b\":[2]}");
+    // legacy behaviour: comments are removed even within strings
+    o = JsonObject::objFromText("{\"a\":\"x/*y*/z\"}", -1, NULL, true);
+    REQUIRE(o);
+    REQUIRE(o->get("a")->stringValue()=="xz");
+    REQUIRE(JsonObject::objFromText("{\"a\":1 /* json-c's own */}")); // json-c also knows comments (but not in strings)
+  }
+
+  SECTION("errors and parsed length") {
+    ErrorPtr err;
+    REQUIRE(!JsonObject::objFromText("{\n\"a\":\n}", -1, &err));
+    REQUIRE(Error::notOK(err));
+    REQUIRE(strstr(err->getErrorMessage(), "in line 3"));
+    err.reset();
+    string deep = string(40, '[')+string(40, ']');
+    REQUIRE(!JsonObject::objFromText(deep.c_str(), -1, &err));
+    REQUIRE(Error::isError(err, JsonError::domain(), json_tokener_error_depth));
+    const char *two = " {\"a\":1}  [2]";
+    ssize_t parsed = 0;
+    REQUIRE(JsonObject::objFromText(two, -1, NULL, false, &parsed));
+    struct json_tokener *tok = json_tokener_new();
+    struct json_object *ref = json_tokener_parse_ex(tok, two, (int)strlen(two));
+    REQUIRE(parsed==tok->char_offset);
+    json_object_put(ref);
+    json_tokener_free(tok);
+    REQUIRE(JsonObject::objFromText(two+parsed, -1, NULL, false, &parsed)->arrayGet(0)->int32Value()==2);
+    REQUIRE(!JsonObject::objFromText("{\"a\":1", 5)); // truncated by max chars
+  }
+
+  SECTION("file") {
+    string fn = string_format("/tmp/p44utils_test_%d.json", getpid());
+    string corpus = jsonCorpus(20, JSON_C_TO_STRING_SPACED);
+    FILE *f = fopen(fn.c_str(), "w");
+    REQUIRE(f);
+    fputs(corpus.c_str(), f);
+    fclose(f);
+    JsonObjectPtr o = JsonObject::objFromFile(fn.c_str());
+    REQUIRE(o);
+    REQUIRE(o->json_str(JSON_C_TO_STRING_SPACED)==corpus);
+    f = fopen(fn.c_str(), "w");
+    fputs("{\"a\":1,}", f); // lenient, json-c only
+    fclose(f);
+    o = JsonObject::objFromFile(fn.c_str());
+    REQUIRE(o);
+    REQUIRE(o->get("a")->int32Value()==1);
+    unlink(fn.c_str());
+  }
+}
+
+
+TEST_CASE("json fast path throughput", "[jsonobject][benchmark][slow]")
+{
+  string corpus = jsonCorpus(500, JSON_C_TO_STRING_PRETTY);
+  JsonObjectPtr obj = JsonObject::objFromText(corpus.c_str());
+  REQUIRE(obj);
+  struct json_object *jo = const_cast<struct json_object *>(obj->jsoncObj());
+  WARN("corpus: " << corpus.size() << " bytes pretty, " << obj->json_str().size() << " bytes plain");
+
+  BENCHMARK("parse json-c") {
+    struct json_object *o = json_tokener_parse(corpus.c_str());
+    json_object_put(o);
+    return o;
+  };
+  BENCHMARK("parse fast path") {
+    return JsonObject::objFromText(corpus.c_str(), corpus.size());
+  };
+  BENCHMARK("serialize json-c") {
+    return string(json_object_to_json_string_ext(jo, 0)).size();
+  };
+  BENCHMARK("serialize fast path") {
+    return obj->json_str().size();
+  };
+  BENCHMARK("serialize pretty json-c") {
+    return string(json_object_to_json_string_ext(jo, JSON_C_TO_STRING_PRETTY)).size();
+  };
+  BENCHMARK("serialize pretty fast path") {
+    return obj->json_str(JSON_C_TO_STRING_PRETTY).size();
+  };
+}
@@ -0,0 +1,560 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2025 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+
+using namespace p44;
+
+#define TEST_LOGFILE "/tmp/p44utils_test_logger.log"
+
+class LoggerFixture
+{
+public:
+  Logger l;
+
+  LoggerFixture()
+  {
+    unlink(TEST_LOGFILE);
+    l.setLogLevel(LOG_INFO);
+    l.setLogFile(TEST_LOGFILE);
+  };
+
+  ~LoggerFixture()
+  {
+    l.setLogFile(NULL);
+    unlink(TEST_LOGFILE);
+  }
+
+  /// @return the lines containing aMarker in the log file, in order of appearance
+  std::vector<string> logLines(const char* aMarker)
+  {
+    std::vector<string> lines;
+    FILE* f = fopen(TEST_LOGFILE, "r");
+    if (f) {
+      string line;
+      while (string_fgetline(f, line)) {
+        if (line.find(aMarker)!=string::npos) lines.push_back(line);
+      }
+      fclose(f);
+    }
+    return lines;
+  }
+
+};
+
+
+TEST_CASE_METHOD(LoggerFixture, "synchronous logging", "[logger]") {
+  l.log(LOG_NOTICE, "line #%d", 1);
+  l.log(LOG_DEBUG, "line #%d", 2); // not enabled
+  l.log(LOG_INFO, "line #%d\nsecond part", 3);
+  std::vector<string> lines = logLines("line #");
+  REQUIRE(lines.size() == 2);
+  REQUIRE(lines[0].find(" N] line #1")!=string::npos);
+  REQUIRE(lines[1].find(" I] line #3")!=string::npos);
+  REQUIRE(logLines("second part").size() == 1);
+}
+
+
+class RateTestObj : public P44LoggingObj
+{
+public:
+  virtual string contextType() const P44_OVERRIDE { return "ratetest"; }
+};
+
+static void collectLine(std::vector<string>* aLines, int aLevel, const char* aLinePrefix, const char* aLogMessage)
+{
+  aLines->push_back(aLogMessage);
+}
+
+static int countContaining(const std::vector<string>& aLines, const char* aMarker)
+{
+  int n = 0;
+  for (size_t i=0; i<aLines.size(); i++) if (aLines[i].find(aMarker)!=string::npos) n++;
+  return n;
+}
+
+
+TEST_CASE_METHOD(LoggerFixture, "rate limiting and deduplication", "[logger]") {
+
+  SECTION("rate limiting per call site") {
+    l.setRateLimit(5, 1);
+    for (int i=0; i<20; i++) {
+      l.log(LOG_WARNING, "flapping #%d", i);
+      if (i%2==0) l.log(LOG_WARNING, "other #%d", i);
+    }
+    REQUIRE(logLines("flapping #").size() == 5);
+    REQUIRE(logLines("other #").size() == 5);
+    REQUIRE(l.suppressedLines() == 20);
+    l.log(LOG_CRIT, "critical #%d", 1); // never limited
+    usleep(1100000);
+    l.log(LOG_WARNING, "flapping #%d", 99);
+    std::vector<string> lines = logLines("similar messages were suppressed");
+    REQUIRE(lines.size() == 1);
+    REQUIRE(lines[0].find("15 similar")!=string::npos);
+    REQUIRE(logLines("flapping #99").size() == 1);
+  }
+
+  SECTION("log level offset controls rate limiting of objects") {
+    std::vector<string> lines;
+    globalLogger.setLogHandler(boost::bind(&collectLine, &lines, _1, _2, _3), false);
+    globalLogger.setRateLimit(4, 60);
+    RateTestObj normal, elevated, reduced;
+    elevated.setLogLevelOffset(1);
+    reduced.setLogLevelOffset(-1);
+    lines.clear();
+    for (int i=0; i<10; i++) {
+      SOLOG(normal, LOG_WARNING, "normal #%d", i);
+      SOLOG(elevated, LOG_WARNING, "elevated #%d", i);
+      SOLOG(reduced, LOG_WARNING, "reduced #%d", i);
+    }
+    globalLogger.setRateLimit(0);
+    globalLogger.setLogHandler(NoOP, false);
+    REQUIRE(countContaining(lines, "normal #") == 4);
+    REQUIRE(countContaining(lines, "elevated #") == 10); // positive offset: not limited
+    REQUIRE(countContaining(lines, "reduced #") == 2); // negative offset: stricter limit
+  }
+
+  SECTION("deduplication") {
+    l.setDeduplicate(true);
+    for (int i=0; i<10; i++) {
+      l.log(LOG_NOTICE, "same line");
+    }
+    l.log(LOG_NOTICE, "different line");
+    l.log(LOG_NOTICE, "same line");
+    l.log(LOG_NOTICE, "same line");
+    l.flush();
+    REQUIRE(logLines("same line").size() == 2);
+    std::vector<string> lines = logLines("last message repeated");
+    REQUIRE(lines.size() == 2);
+    REQUIRE(lines[0].find("repeated 9 times")!=string::npos);
+    REQUIRE(lines[1].find("repeated 1 times")!=string::npos);
+  }
+
+}
+
+
+#if ENABLE_LOG_ROTATION
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_ROTLOGFILE "/tmp/p44utils_test_rotating.log"
+
+static void removeRotatedLogs()
+{
+  for (int i=0; i<5; i++) {
+    string p = i==0 ? TEST_ROTLOGFILE : string_format(TEST_ROTLOGFILE ".%d", i);
+    unlink(p.c_str());
+    unlink((p+".gz").c_str());
+  }
+}
+
+static bool fileExists(const string& aPath)
+{
+  struct stat st;
+  return stat(aPath.c_str(), &st)==0;
+}
+
+static size_t fileSize(const string& aPath)
+{
+  struct stat st;
+  if (stat(aPath.c_str(), &st)!=0) return 0;
+  return st.st_size;
+}
+
+static int countLines(const string& aPath, const char* aMarker, bool* aHasNULsP = NULL)
+{
+  string content;
+  FILE* f = fopen(aPath.c_str(), "r");
+  if (!f) return -1;
+  string_fgetfile(f, content);
+  fclose(f);
+  if (aHasNULsP) *aHasNULsP = content.find('\0')!=string::npos;
+  int n = 0;
+  size_t pos = 0;
+  while ((pos = content.find(aMarker, pos))!=string::npos) { n++; pos++; }
+  return n;
+}
+
+
+TEST_CASE("rotating log files", "[logger]") {
+
+  removeRotatedLogs();
+
+  SECTION("size bound and rotation") {
+    Logger rl;
+    rl.setLogFileRotation(4096, 3);
+    rl.setLogFile(TEST_ROTLOGFILE);
+    REQUIRE(fileSize(TEST_ROTLOGFILE) == 4096); // preallocated
+    for (int i=0; i<400; i++) {
+      rl.log(LOG_NOTICE, "rotation test line #%d with some padding text", i);
+    }
+    rl.setLogFile(NULL);
+    bool hasNULs;
+    REQUIRE(fileExists(TEST_ROTLOGFILE));
+    REQUIRE(fileExists(TEST_ROTLOGFILE ".1"));
+    REQUIRE(fileExists(TEST_ROTLOGFILE ".2"));
+    REQUIRE(!fileExists(TEST_ROTLOGFILE ".3"));
+    REQUIRE(fileSize(TEST_ROTLOGFILE ".1") <= 4096);
+    REQUIRE(countLines(TEST_ROTLOGFILE, "rotation test line #", &hasNULs) > 0);
+    REQUIRE(!hasNULs); // truncated to actual content when closed
+    REQUIRE(countLines(TEST_ROTLOGFILE, "line #399") == 1);
+  }
+
+  SECTION("crash-safe tail") {
+    pid_t pid = fork();
+    if (pid==0) {
+      // child: log some lines, then "crash" without closing the log
+      Logger* cl = new Logger;
+      cl->setLogFileRotation(8192, 2);
+      cl->setLogFile(TEST_ROTLOGFILE);
+      for (int i=0; i<10; i++) cl->log(LOG_NOTICE, "before crash #%d", i);
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    bool hasNULs;
+    REQUIRE(countLines(TEST_ROTLOGFILE, "before crash #", &hasNULs) == 10);
+    REQUIRE(hasNULs); // still preallocated
+    // reopening continues after last line
+    Logger rl;
+    rl.setLogFileRotation(8192, 2);
+    rl.setLogFile(TEST_ROTLOGFILE);
+    rl.log(LOG_NOTICE, "after restart");
+    rl.setLogFile(NULL);
+    REQUIRE(countLines(TEST_ROTLOGFILE, "before crash #", &hasNULs) == 10);
+    REQUIRE(!hasNULs);
+    REQUIRE(countLines(TEST_ROTLOGFILE, "after restart") == 1);
+  }
+
+  #if ENABLE_LOG_ASYNC
+  SECTION("asynchronous writing to rotating log") {
+    Logger rl;
+    rl.setLogFileRotation(64*1024, 2);
+    rl.setLogFile(TEST_ROTLOGFILE);
+    rl.setAsync(16*1024, logoverflow_block);
+    for (int i=0; i<500; i++) rl.log(LOG_NOTICE, "async rotating #%d", i);
+    rl.setAsync(0);
+    rl.setLogFile(NULL);
+    REQUIRE(countLines(TEST_ROTLOGFILE, "async rotating #") == 500);
+  }
+
+  SECTION("emergency flush does not rotate") {
+    pid_t pid = fork();
+    if (pid==0) {
+      // child: fill the segment almost completely, then "crash" with async lines pending
+      Logger* cl = new Logger;
+      cl->setLogFileRotation(4096, 2);
+      cl->setLogFile(TEST_ROTLOGFILE);
+      for (int i=0; i<50; i++) cl->log(LOG_NOTICE, "filler #%d", i);
+      cl->setAsync(16*1024);
+      for (int i=0; i<40; i++) cl->log(LOG_NOTICE, "pending at crash #%d", i);
+      cl->emergencyFlush();
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    // async writer might have written (and rotated) some of the lines before, and a few lines might appear twice
+    REQUIRE(countLines(TEST_ROTLOGFILE, "pending at crash #39") >= 1);
+    int rotated = fileExists(TEST_ROTLOGFILE ".1") ? countLines(TEST_ROTLOGFILE ".1", "pending at crash #") : 0;
+    REQUIRE(countLines(TEST_ROTLOGFILE, "pending at crash #")+rotated >= 40);
+  }
+
+  SECTION("switching log files while async writer is busy") {
+    Logger rl;
+    rl.setLogFileRotation(64*1024, 2);
+    rl.setLogFile(TEST_ROTLOGFILE);
+    rl.setAsync(4*1024, logoverflow_block);
+    int total = 0;
+    for (int r=0; r<10; r++) {
+      for (int i=0; i<50; i++) rl.log(LOG_NOTICE, "switching #%d", total++);
+      // reopening must not pull the rotating log from under the writer thread
+      rl.setLogFile(r & 1 ? TEST_ROTLOGFILE : TEST_ROTLOGFILE ".1");
+    }
+    rl.setAsync(0);
+    rl.setLogFile(NULL);
+    REQUIRE(countLines(TEST_ROTLOGFILE, "switching #")+countLines(TEST_ROTLOGFILE ".1", "switching #") == total);
+  }
+  #endif
+
+  #if ENABLE_LOG_COMPRESSION
+  SECTION("compression of rotated files") {
+    Logger* rl = new Logger;
+    rl->setLogFileRotation(4096, 3, true);
+    rl->setLogFile(TEST_ROTLOGFILE);
+    for (int i=0; i<400; i++) {
+      rl->log(LOG_NOTICE, "compression test line #%d with some padding text", i);
+    }
+    delete rl; // waits for compression to complete
+    REQUIRE(fileExists(TEST_ROTLOGFILE ".1.gz"));
+    REQUIRE(!fileExists(TEST_ROTLOGFILE ".1"));
+    REQUIRE(fileExists(TEST_ROTLOGFILE ".2.gz"));
+    REQUIRE(fileSize(TEST_ROTLOGFILE ".1.gz") < 4096/2);
+  }
+  #endif
+
+  removeRotatedLogs();
+}
+
+#endif // ENABLE_LOG_ROTATION
+
+
+#if ENABLE_LOG_BINARY
+
+#define TEST_BINLOGFILE "/tmp/p44utils_test_logger.blog"
+
+class TestLoggingObj : public P44LoggingObj
+{
+public:
+  virtual string contextType() const P44_OVERRIDE { return "testobj"; }
+  void logSomething(int aNum) { BOLOG(LOG_ERR, "object message #%d", aNum); }
+  void logUnprefixed() { BOLOG(LOG_ERR, "\rno prefix"); }
+};
+
+static void logAtLevel(int aLevel, int aNum)
+{
+  BLOG(aLevel, "variable level #%d", aNum);
+}
+
+
+TEST_CASE_METHOD(LoggerFixture, "binary logging", "[logger]") {
+
+  #define BINTESTFMT "int=%d uint=%u hex=%08X long=%ld ll=%lld size=%zu str='%s' dbl=%.2f/%g width=[%*d] prec=[%.*s] char=%c pct=100%%"
+  #define BINTESTARGS -42, 42u, 0xBEEFu, -1234567L, 9876543210LL, (size_t)77, "hello", 3.14159, 1e-3, 5, 7, 3, "abcdef", 'x'
+  static LogCallSite cs(BINTESTFMT, __FILE__, __LINE__);
+  string expected = string_format(BINTESTFMT, BINTESTARGS);
+
+  SECTION("without binary log file, call sites log as usual") {
+    l.logCallSite(cs, LOG_NOTICE, "ctx", BINTESTFMT, BINTESTARGS);
+    std::vector<string> lines = logLines("int=");
+    REQUIRE(lines.size() == 1);
+    REQUIRE(lines[0].find("ctx: "+expected)!=string::npos);
+  }
+
+  SECTION("binary records decode to the same text") {
+    unlink(TEST_BINLOGFILE);
+    Logger bl;
+    REQUIRE(bl.setBinaryLogFile(TEST_BINLOGFILE));
+    bl.logCallSite(cs, LOG_NOTICE, "ctx", BINTESTFMT, BINTESTARGS);
+    bl.logCallSite(cs, LOG_NOTICE, NULL, BINTESTFMT, BINTESTARGS);
+    bl.setBinaryLogFile(NULL);
+    // second session appended to same file, with call site IDs valid for that session only
+    REQUIRE(bl.setBinaryLogFile(TEST_BINLOGFILE));
+    bl.logCallSite(cs, LOG_NOTICE, "ctx2", BINTESTFMT, BINTESTARGS);
+    bl.setBinaryLogFile(NULL);
+    REQUIRE(logLines("int=").size() == 0); // nothing formatted
+    REQUIRE(l.decodeBinaryLog(TEST_BINLOGFILE));
+    std::vector<string> lines = logLines("int=");
+    REQUIRE(lines.size() == 3);
+    REQUIRE(lines[0].find(" N] ctx: "+expected)!=string::npos);
+    REQUIRE(lines[1].find(" N] "+expected)!=string::npos);
+    REQUIRE(lines[2].find(" N] ctx2: "+expected)!=string::npos);
+    unlink(TEST_BINLOGFILE);
+  }
+
+  SECTION("BLOG and BOLOG macros") {
+    unlink(TEST_BINLOGFILE);
+    REQUIRE(globalLogger.setBinaryLogFile(TEST_BINLOGFILE));
+    TestLoggingObj obj;
+    for (int i=0; i<3; i++) {
+      BLOG(LOG_ERR, "global message #%d", i);
+      obj.logSomething(i);
+    }
+    obj.logUnprefixed();
+    globalLogger.setBinaryLogFile(NULL);
+    REQUIRE(l.decodeBinaryLog(TEST_BINLOGFILE));
+    std::vector<string> lines = logLines("message #");
+    REQUIRE(lines.size() == 6);
+    REQUIRE(lines[0].find(" E] global message #0")!=string::npos);
+    REQUIRE(lines[1].find(" E] testobj: object message #0")!=string::npos);
+    REQUIRE(lines[5].find(" E] testobj: object message #2")!=string::npos);
+    lines = logLines("no prefix");
+    REQUIRE(lines.size() == 1);
+    REQUIRE(lines[0].find(" E] no prefix")!=string::npos);
+    unlink(TEST_BINLOGFILE);
+  }
+
+  SECTION("same call site with varying levels") {
+    unlink(TEST_BINLOGFILE);
+    REQUIRE(globalLogger.setBinaryLogFile(TEST_BINLOGFILE));
+    logAtLevel(LOG_ERR, 1);
+    logAtLevel(LOG_WARNING, 2);
+    logAtLevel(LOG_NOTICE, 3);
+    globalLogger.setBinaryLogFile(NULL);
+    REQUIRE(l.decodeBinaryLog(TEST_BINLOGFILE));
+    std::vector<string> lines = logLines("variable level #");
+    REQUIRE(lines.size() == 3);
+    REQUIRE(lines[0].find(" E] variable level #1")!=string::npos);
+    REQUIRE(lines[1].find(" W] variable level #2")!=string::npos);
+    REQUIRE(lines[2].find(" N] variable level #3")!=string::npos);
+    unlink(TEST_BINLOGFILE);
+  }
+
+  SECTION("not a binary log") {
+    REQUIRE(!l.decodeBinaryLog(TEST_LOGFILE));
+  }
+
+  SECTION("corrupt binary log") {
+    unlink(TEST_BINLOGFILE);
+    REQUIRE(globalLogger.setBinaryLogFile(TEST_BINLOGFILE));
+    logAtLevel(LOG_ERR, 1);
+    globalLogger.setBinaryLogFile(NULL);
+    string good;
+    REQUIRE(Error::isOK(string_fromfile(TEST_BINLOGFILE, good)));
+    // huge record length
+    string bad = good + string("L\xF0\xFF\xFF\xFF", 5);
+    REQUIRE(Error::isOK(string_tofile(TEST_BINLOGFILE, bad)));
+    REQUIRE(!l.decodeBinaryLog(TEST_BINLOGFILE));
+    // huge call site ID
+    uint32_t len = 4+1+4+4;
+    uint32_t id = 0x7FFFFFF0;
+    uint32_t line = 1;
+    bad = good + "S" + string((char*)&len, 4) + string((char*)&id, 4) + "\x03" + string((char*)&line, 4) + string("x\0y\0", 4);
+    REQUIRE(Error::isOK(string_tofile(TEST_BINLOGFILE, bad)));
+    REQUIRE(!l.decodeBinaryLog(TEST_BINLOGFILE));
+    REQUIRE(logLines("variable level #").size() == 2); // valid part was decoded both times
+    unlink(TEST_BINLOGFILE);
+  }
+
+}
+
+
+TEST_CASE_METHOD(LoggerFixture, "binary log throughput", "[logger][benchmark][slow]") {
+
+  #define BENCHFMT "benchmark line #%d: value=%.3f name=%s"
+  static LogCallSite cs(BENCHFMT, __FILE__, __LINE__);
+
+  BENCHMARK("text, 1000 lines") {
+    int i;
+    for (i=0; i<1000; i++) l.logCallSite(cs, LOG_INFO, "ctx", BENCHFMT, i, i*0.1, "name");
+    return i;
+  };
+
+  unlink(TEST_BINLOGFILE);
+  l.setBinaryLogFile(TEST_BINLOGFILE);
+
+  BENCHMARK("binary, 1000 lines") {
+    int i;
+    for (i=0; i<1000; i++) l.logCallSite(cs, LOG_INFO, "ctx", BENCHFMT, i, i*0.1, "name");
+    return i;
+  };
+
+  l.setBinaryLogFile(NULL);
+  unlink(TEST_BINLOGFILE);
+}
+
+#endif // ENABLE_LOG_BINARY
+
+
+#if ENABLE_LOG_ASYNC
+
+#include <signal.h>
+
+TEST_CASE_METHOD(LoggerFixture, "asynchronous logging", "[logger]") {
+
+  SECTION("lines arrive in order") {
+    l.setAsync(64*1024);
+    REQUIRE(l.isAsync());
+    for (int i=0; i<1000; i++) {
+      l.log(LOG_INFO, "line #%d", i);
+    }
+    l.flush();
+    std::vector<string> lines = logLines("line #");
+    REQUIRE(lines.size() == 1000);
+    REQUIRE(lines[0].find("line #0")!=string::npos);
+    REQUIRE(lines[999].find("line #999")!=string::npos);
+    REQUIRE(l.droppedLines() == 0);
+  }
+
+  SECTION("blocking overflow policy does not lose lines") {
+    l.setAsync(1024, logoverflow_block);
+    for (int i=0; i<5000; i++) {
+      l.log(LOG_INFO, "line #%d with some extra text to fill the buffer quickly", i);
+    }
+    l.flush();
+    REQUIRE(logLines("line #").size() == 5000);
+    REQUIRE(l.droppedLines() == 0);
+  }
+
+  SECTION("dropping overflow policy counts dropped lines") {
+    l.setAsync(1024, logoverflow_drop);
+    for (int i=0; i<5000; i++) {
+      l.log(LOG_INFO, "line #%d with some extra text to fill the buffer quickly", i);
+    }
+    l.flush();
+    uint64_t dropped = l.droppedLines();
+    REQUIRE(logLines("line #").size()+dropped == 5000);
+    if (dropped>0) {
+      // next line written reports the dropped lines
+      l.log(LOG_INFO, "after overflow");
+      l.flush();
+      REQUIRE(logLines("log lines dropped").size() > 0);
+    }
+  }
+
+  SECTION("switching back to synchronous mode writes pending lines") {
+    l.setAsync(64*1024);
+    for (int i=0; i<100; i++) {
+      l.log(LOG_INFO, "line #%d", i);
+    }
+    l.setAsync(0);
+    REQUIRE(!l.isAsync());
+    l.log(LOG_INFO, "line #%d", 100);
+    std::vector<string> lines = logLines("line #");
+    REQUIRE(lines.size() == 101);
+    REQUIRE(lines[100].find("line #100")!=string::npos);
+  }
+
+  SECTION("crash flush handlers are only installed on request") {
+    struct sigaction before, act;
+    sigaction(SIGSEGV, NULL, &before); // note: test framework might have its own handler installed
+    l.setAsync(64*1024);
+    sigaction(SIGSEGV, NULL, &act);
+    REQUIRE(act.sa_handler == before.sa_handler);
+    l.setAsync(0);
+  }
+
+}
+
+
+TEST_CASE_METHOD(LoggerFixture, "log-heavy throughput", "[logger][benchmark][slow]") {
+
+  BENCHMARK("synchronous, 1000 lines") {
+    int i;
+    for (i=0; i<1000; i++) l.log(LOG_INFO, "benchmark line #%d: value=%.3f", i, i*0.1);
+    return i;
+  };
+
+  l.setAsync(256*1024, logoverflow_block);
+
+  BENCHMARK("asynchronous, 1000 lines") {
+    int i;
+    for (i=0; i<1000; i++) l.log(LOG_INFO, "benchmark line #%d: value=%.3f", i, i*0.1);
+    return i;
+  };
+
+  l.flush();
+}
+
+#endif // ENABLE_LOG_ASYNC
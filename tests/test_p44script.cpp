@@ -29,6 +29,8 @@
 #include "utils.hpp"
 #include "httpcomm.hpp"
 #include "socketcomm.hpp"
+#include "httpserver.hpp"
+#include "application.hpp"
 
 #define LOGLEVELOFFSET 0
 
@@ -150,6 +152,9 @@ public:
     #if ENABLE_SOCKET_SCRIPT_FUNCS
     StandardScriptingDomain::sharedDomain().addGlobalBuiltins(p44::P44Script::socketGlobals());
     #endif
+    #if ENABLE_HTTP_SERVER_SCRIPT_FUNCS
+    StandardScriptingDomain::sharedDomain().addGlobalBuiltins(p44::P44Script::httpServerGlobals());
+    #endif
     mainContext = StandardScriptingDomain::sharedDomain().newContext();
     s.setSharedMainContext(mainContext);
   };
@@ -916,6 +921,260 @@ TEST_CASE_METHOD(ScriptingCodeFixture, "statements", "[scripting]" )
 
 }
 
+// MARK: - Incremental compilation
+
+static void runMainLoopFor(MLMicroSeconds aDuration)
+{
+  MLTicket tick;
+  MLMicroSeconds end = MainLoop::now()+aDuration;
+  while (MainLoop::now()<end) {
+    // Note: timer makes sure mainLoopCycle() returns even if nothing else is pending
+    tick.executeOnce(NoOP, 10*MilliSecond);
+    MainLoop::currentMainLoop().mainLoopCycle();
+  }
+}
+
+
+TEST_CASE_METHOD(ScriptingCodeFixture, "incremental recompile", "[scripting]") {
+
+  ScriptHost src(sourcecode, "incremental");
+  src.setSharedMainContext(s.sharedMainContext());
+  double handlers = s.test(scriptbody, "elements(globalhandlers())")->doubleValue();
+  src.setSource("global on (every(100)) { log(7, 'A') }\nglobal on (every(200)) { log(7, 'B') }\n");
+  REQUIRE(src.getExecutable()->isErr() == false);
+  REQUIRE(src.reusedHandlers() == 0);
+  REQUIRE(s.test(scriptbody, "elements(globalhandlers())")->doubleValue() == handlers+2);
+  // moving handler A and changing handler B must keep A
+  src.setSource("// added line\nglobal on (every(100)) { log(7, 'A') }\nglobal on (every(200)) { log(7, 'B changed') }\n");
+  REQUIRE(src.reusedHandlers() == 1);
+  REQUIRE(s.test(scriptbody, "elements(globalhandlers())")->doubleValue() == handlers+2);
+  REQUIRE(s.test(scriptbody, "find(string(globalhandlers()), 'incremental:2,')")->defined()); // relocated A reports new position
+  // changing the trigger mode is a change, removed handler must be gone
+  src.setSource("// added line\nglobal on (every(100)) changing { log(7, 'A') }\n");
+  REQUIRE(src.reusedHandlers() == 0);
+  REQUIRE(s.test(scriptbody, "elements(globalhandlers())")->doubleValue() == handlers+1);
+  src.setSource("");
+  REQUIRE(s.test(scriptbody, "elements(globalhandlers())")->doubleValue() == handlers);
+}
+
+
+TEST_CASE_METHOD(ScriptingCodeFixture, "incremental recompile keeps trigger state", "[scripting]") {
+
+  MainLoop::currentMainLoop().startupMainLoop(true);
+  ScriptHost src(sourcecode, "triggerstate");
+  src.setSharedMainContext(s.sharedMainContext());
+  REQUIRE(s.test(sourcecode, "glob ticks; glob changes; glob level; ticks = 0; changes = 0; level = 1")->isErr() == false);
+  src.setSource(
+    "global on (every(10)) { ticks = ticks+1 }\n"
+    "global on (level>0) changing { changes = changes+1 }\n"
+  );
+  REQUIRE(src.getExecutable()->isErr() == false);
+  runMainLoopFor(100*MilliSecond);
+  // both fire once initially
+  REQUIRE(s.test(scriptbody, "ticks")->intValue() == 1);
+  REQUIRE(s.test(scriptbody, "changes")->intValue() == 1);
+  // unchanged handlers moved by an added line must not be re-initialized (which would fire them again)
+  src.setSource(
+    "// added line\n"
+    "global on (every(10)) { ticks = ticks+1 }\n"
+    "global on (level>0) changing { changes = changes+1 }\n"
+  );
+  REQUIRE(src.getExecutable()->isErr() == false);
+  REQUIRE(src.reusedHandlers() == 2);
+  runMainLoopFor(100*MilliSecond);
+  REQUIRE(s.test(scriptbody, "ticks")->intValue() == 1);
+  REQUIRE(s.test(scriptbody, "changes")->intValue() == 1);
+  // changed handler is a new one, and fires initially again
+  src.setSource(
+    "// added line\n"
+    "global on (every(10)) { ticks = ticks+2 }\n"
+    "global on (level>0) changing { changes = changes+1 }\n"
+  );
+  REQUIRE(src.getExecutable()->isErr() == false);
+  REQUIRE(src.reusedHandlers() == 1);
+  runMainLoopFor(100*MilliSecond);
+  REQUIRE(s.test(scriptbody, "ticks")->intValue() == 3);
+  REQUIRE(s.test(scriptbody, "changes")->intValue() == 1);
+  src.setSource("");
+}
+
+
+// MARK: - Memory accounting
+
+#if P44SCRIPT_MEMORY_ACCOUNTING
+
+TEST_CASE_METHOD(ScriptingCodeFixture, "memory accounting", "[scripting]") {
+
+  ScriptMemoryAccountPtr acct = s.sharedMainContext()->memoryAccount();
+  REQUIRE(acct);
+
+  SECTION("statistics") {
+    uint64_t allocs = acct->allocations();
+    REQUIRE(s.test(scriptbody, "var a = []; for (var i=0; i<100; i++) { a[i] = 'element'+i }; return elements(a)")->doubleValue() == 100);
+    REQUIRE(acct->allocations()>allocs+100);
+    REQUIRE(acct->peakBytes()>=acct->liveBytes());
+    REQUIRE(s.test(scriptbody, "contextmemory().objects")->doubleValue() > 0);
+    REQUIRE(s.test(scriptbody, "contextmemory().peakbytes>=contextmemory().bytes")->boolValue() == true);
+    REQUIRE(s.test(scriptbody, "contextmemory().maxbytes")->doubleValue() == 0); // no limit
+  }
+
+  SECTION("global statistics sum up all contexts") {
+    ScriptMemoryAccountPtr total = StandardScriptingDomain::sharedDomain().totalMemoryAccount();
+    REQUIRE(total);
+    uint64_t totalAllocs = total->allocations();
+    uint64_t allocs = acct->allocations();
+    REQUIRE(s.test(scriptbody, "var g = []; for (var i=0; i<100; i++) { g[i] = 'element'+i }; return elements(g)")->doubleValue() == 100);
+    REQUIRE(total->allocations()-totalAllocs>=acct->allocations()-allocs);
+    REQUIRE(total->liveObjects()>=acct->liveObjects());
+    // a second context adds to the total, too
+    ScriptMainContextPtr other = StandardScriptingDomain::sharedDomain().newContext();
+    ScriptHost src(scriptbody);
+    src.setSharedMainContext(other);
+    totalAllocs = total->allocations();
+    REQUIRE(src.test(scriptbody, "var o = []; for (var i=0; i<50; i++) { o[i] = 'other'+i }; return elements(o)")->doubleValue() == 50);
+    REQUIRE(other->memoryAccount()->allocations()>=50);
+    REQUIRE(total->allocations()-totalAllocs>=other->memoryAccount()->allocations());
+    // script sees the total
+    double before = s.test(scriptbody, "globalmemory().allocations")->doubleValue();
+    double after = s.test(scriptbody, "var h = []; for (var i=0; i<100; i++) { h[i] = 'element'+i }; return globalmemory().allocations")->doubleValue();
+    REQUIRE(after>=before+100);
+    REQUIRE(s.test(scriptbody, "globalmemory().objects>=contextmemory().objects")->boolValue() == true);
+    s.test(scriptbody, "unset g; unset h");
+  }
+
+  SECTION("soft limits") {
+    acct->setLimits(0, acct->liveObjects()+500);
+    ScriptObjPtr res = s.test(scriptbody, "var a = []; for (var i=0; i<10000; i++) { a[i] = 'element'+i }; return elements(a)");
+    REQUIRE(Error::isError(res->errorValue(), ScriptError::domain(), ScriptError::MemoryLimit) == true);
+    // aborted thread must have released its objects again
+    s.test(scriptbody, "unset a");
+    REQUIRE(acct->overLimit() == false);
+    REQUIRE(s.test(scriptbody, "42")->doubleValue() == 42);
+    acct->setLimits(0, 0);
+  }
+
+}
+
+#endif // P44SCRIPT_MEMORY_ACCOUNTING
+
+
+#if P44SCRIPT_WORKER_THREADS
+
+// Note: the mainloop is not terminated between jobs here, because terminating it would
+//   clear the I/O handler receiving the worker's signals.
+class ScriptWorkerFixture
+{
+public:
+  ScriptWorkerPtr worker;
+  JsonObjectPtr result;
+  ErrorPtr error;
+  JsonObjectPtr message;
+  bool done;
+
+  ScriptWorkerFixture()
+  {
+    SETDAEMONMODE(false);
+    SETLOGLEVEL(LOG_NOTICE);
+    StandardScriptingDomain::sharedDomain().setMemberByName("mainvalue", new NumericValue(1234));
+    worker = new ScriptWorker("test worker");
+    worker->setMessageHandler(boost::bind(&ScriptWorkerFixture::messageCapture, this, _1));
+    REQUIRE(Error::isOK(worker->start()));
+    MainLoop::currentMainLoop().startupMainLoop(true);
+  };
+
+  virtual ~ScriptWorkerFixture()
+  {
+    worker->stop();
+    while (worker->isRunning()) MainLoop::currentMainLoop().mainLoopCycle();
+  }
+
+  void resultCapture(JsonObjectPtr aResult, ErrorPtr aError)
+  {
+    result = aResult;
+    error = aError;
+    done = true;
+  }
+
+  void messageCapture(JsonObjectPtr aMessage)
+  {
+    message = aMessage;
+  }
+
+  void waitDone()
+  {
+    while (!done) MainLoop::currentMainLoop().mainLoopCycle();
+  }
+
+  JsonObjectPtr workerTest(const string aSource, JsonObjectPtr aArgs = JsonObjectPtr())
+  {
+    result.reset();
+    error.reset();
+    done = false;
+    worker->execute(aSource, aArgs, boost::bind(&ScriptWorkerFixture::resultCapture, this, _1, _2));
+    waitDone();
+    return result;
+  }
+
+};
+
+
+TEST_CASE_METHOD(ScriptWorkerFixture, "script worker", "[scripting]") {
+
+  SECTION("execute") {
+    REQUIRE(workerTest("var x = 0; for (var i=1; i<=1000; i++) { x = x+i }; return x")->doubleValue() == 500500);
+    REQUIRE(workerTest("arg1.a*arg1.b", JsonObject::objFromText("{ \"a\":6, \"b\":7 }"))->doubleValue() == 42);
+  }
+
+  SECTION("isolation") {
+    // main domain globals are not directly visible, only via mainglobal()
+    workerTest("mainvalue");
+    REQUIRE(Error::isError(error, ScriptError::domain(), ScriptError::NotFound) == true);
+    REQUIRE(workerTest("mainglobal('mainvalue')")->doubleValue() == 1234);
+    workerTest("mainglobal('doesnotexist')");
+    REQUIRE(Error::isError(error, ScriptError::domain(), ScriptError::NotFound) == true);
+  }
+
+  SECTION("messages") {
+    REQUIRE(workerTest("postmessage({ 'progress': 50 }); 'done'")->stringValue() == "done");
+    REQUIRE(message);
+    REQUIRE(message->get("progress")->int32Value() == 50);
+  }
+
+  SECTION("worker script") {
+    done = false;
+    worker->loadScript("glob calls default 0; function twice(x) { calls++; return 2*x }", boost::bind(&ScriptWorkerFixture::resultCapture, this, _1, _2));
+    waitDone();
+    REQUIRE(Error::isOK(error));
+    REQUIRE(workerTest("twice(21)")->doubleValue() == 42);
+    REQUIRE(workerTest("twice(4)")->doubleValue() == 8);
+    REQUIRE(workerTest("calls")->doubleValue() == 2); // worker globals persist between jobs
+  }
+
+}
+
+#endif // P44SCRIPT_WORKER_THREADS
+
+
+// MARK: - Benchmarks
+
+// Note: run with and without P44SCRIPT_POOLED_ALLOCATION to compare allocator performance
+TEST_CASE_METHOD(ScriptingCodeFixture, "call-heavy scripts", "[scripting][benchmark][slow]") {
+
+  REQUIRE(s.test(sourcecode|ephemeralSource, "function fib(n) { if (n<2) return n; return fib(n-1)+fib(n-2); }")->isErr() == false);
+  REQUIRE(s.test(scriptbody, "fib(12)")->doubleValue() == 144);
+
+  BENCHMARK("script function calls") {
+    return s.test(scriptbody, "fib(12)");
+  };
+
+  BENCHMARK("builtin function calls") {
+    return s.test(scriptbody, "var x = 0; for (var i=0; i<200; i++) { x = x+abs(sin(i))+strlen(string(i)) }; return x");
+  };
+
+  REQUIRE(s.test(scriptbody|ephemeralSource, "undeclare()")->isErr() == false);
+}
+
+
 // MARK: - Async
 
 TEST_CASE_METHOD(AsyncScriptingFixture, "async", "[scripting][slow]") {
@@ -1055,3 +1314,30 @@ TEST_CASE_METHOD(AsyncScriptingFixture, "http scripting", "[scripting][http]") {
 
 #endif // ENABLE_HTTP_SCRIPT_FUNCS
 
+
+#if ENABLE_HTTP_SERVER_SCRIPT_FUNCS && ENABLE_HTTP_SCRIPT_FUNCS
+
+#define HTTP_SERVER_TEST_PORT "18744"
+
+TEST_CASE_METHOD(AsyncScriptingFixture, "http server scripting", "[scripting][httpserver]") {
+
+  SECTION("request and respond") {
+    REQUIRE(scriptTest(sourcecode,
+      "var srv = httpserver(" HTTP_SERVER_TEST_PORT "); "
+      "on (srv.request()) as req { req.respond({ path: req.path, method: req.method, q: req.query }) } "
+      "var res = json(geturl('http://127.0.0.1:" HTTP_SERVER_TEST_PORT "/api/test?x=1')); "
+      "srv.stop(); "
+      "return res.path + ',' + res.method + ',' + res.q"
+    )->stringValue() == "/api/test,GET,x=1");
+  }
+
+  SECTION("document root requires privileges") {
+    Application app; // default user level, no free paths allowed
+    REQUIRE(Error::isError(scriptTest(sourcecode, "return httpserver(" HTTP_SERVER_TEST_PORT ", '/', true)")->errorValue(), ScriptError::domain(), ScriptError::NoPrivilege));
+    REQUIRE(Error::isError(scriptTest(sourcecode, "return httpserver(" HTTP_SERVER_TEST_PORT ", '../www')")->errorValue(), ScriptError::domain(), ScriptError::NoPrivilege));
+    REQUIRE(scriptTest(sourcecode, "var srv = httpserver(" HTTP_SERVER_TEST_PORT ", '_/www'); srv.stop(); return true")->boolValue());
+  }
+
+}
+
+#endif // ENABLE_HTTP_SERVER_SCRIPT_FUNCS && ENABLE_HTTP_SCRIPT_FUNCS
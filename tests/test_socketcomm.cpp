@@ -0,0 +1,371 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+#include "socketcomm.hpp"
+
+using namespace p44;
+
+
+class DatagramFixture
+{
+public:
+
+  SocketCommPtr mReceiver;
+  SocketCommPtr mSender;
+  string mPort;
+  MLTicket mTick;
+
+  size_t mNumBatches;
+  std::vector<string> mReceived;
+  std::vector<string> mOrigins;
+  bool mTruncated;
+  std::vector<string> mReplies;
+
+  DatagramFixture() :
+    mNumBatches(0),
+    mTruncated(false)
+  {
+    MainLoop::currentMainLoop().startupMainLoop(true);
+    // find a free port
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+    socklen_t len = sizeof(sin);
+    getsockname(fd, (struct sockaddr *)&sin, &len);
+    close(fd);
+    mPort = string_format("%d", ntohs(sin.sin_port));
+    // receiving socket
+    mReceiver = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    mReceiver->setConnectionParams("127.0.0.1", mPort.c_str(), SOCK_DGRAM, PF_INET);
+    mReceiver->setAllowNonlocalConnections(false);
+    mReceiver->setDatagramOptions(true, false);
+    REQUIRE(Error::isOK(mReceiver->initiateConnection()));
+    // sending socket
+    mSender = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    mSender->setConnectionParams("127.0.0.1", mPort.c_str(), SOCK_DGRAM, PF_INET);
+    REQUIRE(Error::isOK(mSender->initiateConnection()));
+  }
+
+  virtual ~DatagramFixture()
+  {
+    mReceiver->clearCallbacks();
+    mReceiver->closeConnection();
+    mSender->clearCallbacks();
+    mSender->closeConnection();
+  }
+
+  void batchReceived(SocketCommPtr aSocketComm, ErrorPtr aError, const DatagramList &aDatagrams)
+  {
+    REQUIRE(Error::isOK(aError));
+    mNumBatches++;
+    for (size_t i=0; i<aDatagrams.size(); i++) {
+      mReceived.push_back(string((const char *)aDatagrams[i].data, aDatagrams[i].size));
+      string addr, port;
+      if (SocketComm::getDatagramOrigin(aDatagrams[i], addr, port)) mOrigins.push_back(addr);
+      if (aDatagrams[i].truncated) mTruncated = true;
+    }
+  }
+
+  void echoBatch(SocketCommPtr aSocketComm, ErrorPtr aError, const DatagramList &aDatagrams)
+  {
+    // send back all datagrams to their origin in one batch
+    ErrorPtr err;
+    REQUIRE(aSocketComm->sendDatagrams(aDatagrams, err)==aDatagrams.size());
+    REQUIRE(Error::isOK(err));
+  }
+
+  void replyReceived(SocketCommPtr aSocketComm, ErrorPtr aError, const DatagramList &aDatagrams)
+  {
+    for (size_t i=0; i<aDatagrams.size(); i++) {
+      mReplies.push_back(string((const char *)aDatagrams[i].data, aDatagrams[i].size));
+    }
+  }
+
+  void tick(MLTimer &aTimer)
+  {
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, 10*MilliSecond);
+  }
+
+  void runUntil(const std::vector<string> &aCollected, size_t aCount)
+  {
+    mTick.executeOnce(boost::bind(&DatagramFixture::tick, this, _1), 10*MilliSecond);
+    MLMicroSeconds timeout = MainLoop::now()+5*Second;
+    while (aCollected.size()<aCount && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+    mTick.cancel();
+  }
+
+  void sendNumbered(size_t aCount, size_t aSize = 0)
+  {
+    std::vector<string> payloads;
+    DatagramList dgs;
+    for (size_t i=0; i<aCount; i++) {
+      string p = string_format("dgram#%zu", i);
+      if (p.size()<aSize) p.append(aSize-p.size(), '.');
+      payloads.push_back(p);
+    }
+    dgs.resize(aCount);
+    for (size_t i=0; i<aCount; i++) {
+      dgs[i].data = (const uint8_t *)payloads[i].c_str();
+      dgs[i].size = payloads[i].size();
+      dgs[i].addressLen = 0; // default destination
+    }
+    ErrorPtr err;
+    REQUIRE(mSender->sendDatagrams(dgs, err)==aCount);
+    REQUIRE(Error::isOK(err));
+  }
+
+};
+
+
+TEST_CASE_METHOD(DatagramFixture, "datagram batches", "[socketcomm]")
+{
+  SECTION("batched receive") {
+    mReceiver->setDatagramBatchHandler(boost::bind(&DatagramFixture::batchReceived, this, _1, _2, _3), 16);
+    sendNumbered(100);
+    runUntil(mReceived, 100);
+    REQUIRE(mReceived.size()==100);
+    REQUIRE(mReceived[0]=="dgram#0");
+    REQUIRE(mReceived[99]=="dgram#99");
+    REQUIRE(mOrigins.size()==100);
+    REQUIRE(mOrigins[0]=="127.0.0.1");
+    REQUIRE(mNumBatches<100); // must have received more than one datagram per batch
+    REQUIRE(!mTruncated);
+  }
+
+  SECTION("truncation") {
+    mReceiver->setDatagramBatchHandler(boost::bind(&DatagramFixture::batchReceived, this, _1, _2, _3), 4, 16);
+    sendNumbered(2, 100);
+    runUntil(mReceived, 2);
+    REQUIRE(mReceived.size()==2);
+    REQUIRE(mReceived[0].size()==16);
+    REQUIRE(mTruncated);
+  }
+
+  SECTION("batched send to origins") {
+    mReceiver->setDatagramBatchHandler(boost::bind(&DatagramFixture::echoBatch, this, _1, _2, _3));
+    mSender->setDatagramBatchHandler(boost::bind(&DatagramFixture::replyReceived, this, _1, _2, _3));
+    sendNumbered(50);
+    runUntil(mReplies, 50);
+    REQUIRE(mReplies.size()==50);
+    REQUIRE(mReplies[49]=="dgram#49");
+  }
+}
+
+
+class ServerFixture
+{
+public:
+
+  int mPort;
+  std::vector<int> mClientFds;
+  MLTicket mTick;
+
+  ServerFixture()
+  {
+    MainLoop::currentMainLoop().startupMainLoop(true);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+    socklen_t len = sizeof(sin);
+    getsockname(fd, (struct sockaddr *)&sin, &len);
+    close(fd);
+    mPort = ntohs(sin.sin_port);
+  }
+
+  virtual ~ServerFixture()
+  {
+    for (size_t i=0; i<mClientFds.size(); i++) close(mClientFds[i]);
+  }
+
+  SocketCommPtr newServer(SocketServerGroupPtr aGroup, int aMaxConnections)
+  {
+    SocketCommPtr server = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    server->setConnectionParams(NULL, string_format("%d", mPort).c_str(), SOCK_STREAM, PF_INET);
+    server->setAllowNonlocalConnections(false);
+    if (aGroup) server->setServerGroup(aGroup);
+    REQUIRE(Error::isOK(server->startServer(boost::bind(&ServerFixture::serverConnection, this, _1), aMaxConnections)));
+    return server;
+  }
+
+  SocketCommPtr serverConnection(SocketCommPtr aServerSocketComm)
+  {
+    return SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  }
+
+  void connectClients(int aCount)
+  {
+    for (int i=0; i<aCount; i++) {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      struct sockaddr_in sin;
+      memset(&sin, 0, sizeof(sin));
+      sin.sin_family = AF_INET;
+      sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      sin.sin_port = htons(mPort);
+      REQUIRE(connect(fd, (struct sockaddr *)&sin, sizeof(sin))==0);
+      mClientFds.push_back(fd);
+    }
+  }
+
+  void tick(MLTimer &aTimer)
+  {
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, 10*MilliSecond);
+  }
+
+  void runFor(MLMicroSeconds aDuration)
+  {
+    mTick.executeOnce(boost::bind(&ServerFixture::tick, this, _1), 10*MilliSecond);
+    MLMicroSeconds end = MainLoop::now()+aDuration;
+    while (MainLoop::now()<end) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+    mTick.cancel();
+  }
+
+};
+
+
+TEST_CASE_METHOD(ServerFixture, "server accept", "[socketcomm]")
+{
+  SECTION("connection burst and limit") {
+    SocketCommPtr server = newServer(SocketServerGroupPtr(), 3);
+    connectClients(5);
+    runFor(200*MilliSecond);
+    REQUIRE(server->acceptedConnections()==3);
+    REQUIRE(server->rejectedConnections()==2);
+    REQUIRE(server->numClients()==3);
+    server->closeConnection();
+    REQUIRE(server->numClients()==0);
+  }
+
+  #ifdef SO_REUSEPORT
+  SECTION("listener group") {
+    SocketServerGroupPtr group = SocketServerGroupPtr(new SocketServerGroup(4));
+    SocketCommPtr server1 = newServer(group, 0);
+    SocketCommPtr server2 = newServer(group, 0);
+    connectClients(6);
+    runFor(200*MilliSecond);
+    REQUIRE(server1->acceptedConnections()+server2->acceptedConnections()==4);
+    REQUIRE(server1->rejectedConnections()+server2->rejectedConnections()==2);
+    REQUIRE(group->connections()==4);
+    server1->closeConnection();
+    server2->closeConnection();
+    REQUIRE(group->connections()==0);
+  }
+  #endif
+}
+
+
+#ifdef SO_REUSEPORT
+
+/// a listener of a group, accepting on its own thread and mainloop
+class AcceptThread
+{
+public:
+  ServerFixture &mFixture;
+  SocketServerGroupPtr mGroup;
+  std::atomic<bool> mRunning;
+  std::atomic<bool> mStop;
+  bool mStarted;
+  long mAccepted;
+  long mRejected;
+  pthread_t mThread;
+
+  AcceptThread(ServerFixture &aFixture, SocketServerGroupPtr aGroup) :
+    mFixture(aFixture), mGroup(aGroup), mRunning(false), mStop(false), mStarted(false), mAccepted(0), mRejected(0)
+  {
+    pthread_create(&mThread, NULL, &AcceptThread::threadRoutine, this);
+    while (!mRunning.load()) usleep(1000);
+  }
+
+  void stop()
+  {
+    mStop = true;
+    pthread_join(mThread, NULL);
+  }
+
+  static void* threadRoutine(void* aArg)
+  {
+    static_cast<AcceptThread*>(aArg)->run();
+    return NULL;
+  }
+
+  void run()
+  {
+    // Note: no REQUIREs here, Catch2 assertions are not thread safe
+    MainLoop &ml = MainLoop::currentMainLoop(); // this thread's own mainloop
+    ml.startupMainLoop(true);
+    SocketCommPtr server = SocketCommPtr(new SocketComm(ml));
+    server->setConnectionParams(NULL, string_format("%d", mFixture.mPort).c_str(), SOCK_STREAM, PF_INET);
+    server->setAllowNonlocalConnections(false);
+    server->setServerGroup(mGroup);
+    mStarted = Error::isOK(server->startServer(boost::bind(&ServerFixture::serverConnection, &mFixture, _1), 0));
+    mRunning = true;
+    MLTicket tick;
+    tick.executeOnce(boost::bind(&ServerFixture::tick, &mFixture, _1), 10*MilliSecond);
+    while (!mStop.load()) ml.mainLoopCycle();
+    tick.cancel();
+    mAccepted = server->acceptedConnections();
+    mRejected = server->rejectedConnections();
+    server->closeConnection();
+    server.reset();
+  }
+};
+
+
+TEST_CASE_METHOD(ServerFixture, "multi-threaded accept", "[socketcomm]")
+{
+  const int numThreads = 4;
+  SocketServerGroupPtr group = SocketServerGroupPtr(new SocketServerGroup(20));
+  std::vector<AcceptThread*> threads;
+  for (int i=0; i<numThreads; i++) threads.push_back(new AcceptThread(*this, group));
+  for (int i=0; i<numThreads; i++) REQUIRE(threads[i]->mStarted);
+  connectClients(30);
+  // wait until all connection attempts are processed by the threads
+  MLMicroSeconds timeout = MainLoop::now()+5*Second;
+  while (group->connections()<20 && MainLoop::now()<timeout) usleep(10000);
+  usleep(200000);
+  REQUIRE(group->connections()==20);
+  long accepted = 0;
+  long rejected = 0;
+  for (int i=0; i<numThreads; i++) {
+    threads[i]->stop();
+    accepted += threads[i]->mAccepted;
+    rejected += threads[i]->mRejected;
+    delete threads[i];
+  }
+  REQUIRE(accepted==20);
+  REQUIRE(rejected==10);
+  REQUIRE(group->connections()==0); // all threads' connections closed
+}
+
+#endif // SO_REUSEPORT
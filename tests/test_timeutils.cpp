@@ -97,3 +97,48 @@ TEST_CASE( "sun rise and set", "[timeutils]" ) {
 
 }
 
+
+TEST_CASE( "cached sun params", "[timeutils]" ) {
+  setenv("TZ", TZ, 1);
+  tzset();
+  p44::SunParams p, c;
+  struct tm tim;
+  tim.tm_year = 2019-1900;
+  tim.tm_mon = 6-1;
+  tim.tm_mday = 11;
+  tim.tm_hour = 0;
+  tim.tm_min = 0;
+  tim.tm_sec = 30;
+  tim.tm_isdst = -1;
+  time_t t = mktime(&tim);
+  p44::GeoLocation zurich(LAT, LONG);
+  p44::getSunParams(t, zurich, p);
+
+  SECTION("same day, same location") {
+    p44::getCachedSunParams(t, zurich, c);
+    REQUIRE( c.sunrise == p.sunrise );
+    p44::getCachedSunParams(t+20*3600, zurich, c); // later same day
+    REQUIRE( c.sunrise == p.sunrise );
+    REQUIRE( c.sunset == p.sunset );
+  }
+
+  SECTION("other day and location") {
+    p44::getCachedSunParams(t, zurich, c);
+    p44::getCachedSunParams(t-60, zurich, c); // day before
+    REQUIRE( c.sunrise != p.sunrise );
+    p44::GeoLocation elsewhere(LAT+10, LONG);
+    p44::getCachedSunParams(t, elsewhere, c);
+    REQUIRE( c.sunset != p.sunset );
+  }
+
+  SECTION("timezone change") {
+    p44::getCachedSunParams(t, zurich, c);
+    REQUIRE( c.sunrise == Catch::Approx(5+29.0/60).margin(PRECISION) );
+    setenv("TZ", "UTC0", 1);
+    tzset();
+    p44::getCachedSunParams(t, zurich, c);
+    REQUIRE( c.sunrise == Catch::Approx(5+29.0/60-SUMMEROFFS).margin(PRECISION) );
+    setenv("TZ", TZ, 1);
+    tzset();
+  }
+}
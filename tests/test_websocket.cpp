@@ -0,0 +1,561 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2026 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "catch_amalgamated.hpp"
+
+#include "p44utils_common.hpp"
+#include "websocket.hpp"
+
+#if ENABLE_UWSC
+
+extern "C" {
+  #include <uwsc/sha1.h>
+  #include <uwsc/utils.h>
+}
+
+#if ENABLE_WEBSOCKET_COMPRESSION
+  #include <zlib.h>
+#endif
+
+using namespace p44;
+
+
+/// minimal blocking websocket echo server, running in its own thread
+class WebSocketEchoServer
+{
+public:
+
+  typedef struct {
+    int opCode;
+    bool fin;
+    bool rsv1;
+    size_t len;
+  } FrameInfo;
+
+  int mPort;
+  bool mDeflate; ///< accept permessage-deflate
+  bool mOffered; ///< client offered permessage-deflate
+  std::vector<FrameInfo> mFrames;
+  std::vector<string> mMessages; ///< reassembled (and inflated) messages
+  pthread_mutex_t mMutex;
+
+  WebSocketEchoServer(bool aDeflate) :
+    mDeflate(aDeflate),
+    mOffered(false),
+    mListenFd(-1),
+    mConnFd(-1)
+  {
+    pthread_mutex_init(&mMutex, NULL);
+    mListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::bind(mListenFd, (struct sockaddr *)&sin, sizeof(sin));
+    socklen_t len = sizeof(sin);
+    getsockname(mListenFd, (struct sockaddr *)&sin, &len);
+    mPort = ntohs(sin.sin_port);
+    listen(mListenFd, 1);
+    pthread_create(&mThread, NULL, &WebSocketEchoServer::threadFunc, this);
+  }
+
+  ~WebSocketEchoServer()
+  {
+    shutdown(mListenFd, SHUT_RDWR);
+    pthread_mutex_lock(&mMutex);
+    if (mConnFd>=0) shutdown(mConnFd, SHUT_RDWR);
+    pthread_mutex_unlock(&mMutex);
+    pthread_join(mThread, NULL);
+    close(mListenFd);
+    pthread_mutex_destroy(&mMutex);
+  }
+
+  size_t numMessages()
+  {
+    pthread_mutex_lock(&mMutex);
+    size_t n = mMessages.size();
+    pthread_mutex_unlock(&mMutex);
+    return n;
+  }
+
+private:
+
+  int mListenFd;
+  int mConnFd;
+  pthread_t mThread;
+
+  static void* threadFunc(void* aArg)
+  {
+    ((WebSocketEchoServer*)aArg)->serve();
+    return NULL;
+  }
+
+  bool readAll(void* aBuf, size_t aLen)
+  {
+    return aLen==0 || recv(mConnFd, aBuf, aLen, MSG_WAITALL)==(ssize_t)aLen;
+  }
+
+  void writeAll(const string &aData)
+  {
+    size_t done = 0;
+    while (done<aData.size()) {
+      ssize_t n = ::send(mConnFd, aData.data()+done, aData.size()-done, MSG_NOSIGNAL);
+      if (n<=0) return;
+      done += n;
+    }
+  }
+
+  void serve()
+  {
+    int fd = accept(mListenFd, NULL, NULL);
+    if (fd<0) return;
+    pthread_mutex_lock(&mMutex);
+    mConnFd = fd;
+    pthread_mutex_unlock(&mMutex);
+    if (handshake()) {
+      #if ENABLE_WEBSOCKET_COMPRESSION
+      z_stream inf, def;
+      memset(&inf, 0, sizeof(inf));
+      memset(&def, 0, sizeof(def));
+      inflateInit2(&inf, -15);
+      deflateInit2(&def, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+      #endif
+      string msg;
+      int msgOpCode = 0;
+      #if ENABLE_WEBSOCKET_COMPRESSION
+      bool msgCompressed = false;
+      #endif
+      while (true) {
+        uint8_t h[2];
+        if (!readAll(h, 2)) break;
+        FrameInfo fi;
+        fi.opCode = h[0] & 0x0F;
+        fi.fin = (h[0] & 0x80)!=0;
+        fi.rsv1 = (h[0] & 0x40)!=0;
+        uint64_t len = h[1] & 0x7F;
+        if (len==126) {
+          uint8_t l[2];
+          if (!readAll(l, 2)) break;
+          len = (l[0]<<8) | l[1];
+        }
+        else if (len==127) {
+          uint8_t l[8];
+          if (!readAll(l, 8)) break;
+          len = 0;
+          for (int i=0; i<8; i++) len = (len<<8) | l[i];
+        }
+        uint8_t mk[4];
+        if (!readAll(mk, 4)) break;
+        string payload;
+        payload.resize(len);
+        if (!readAll(&payload[0], len)) break;
+        for (size_t i=0; i<len; i++) payload[i] ^= mk[i & 3];
+        fi.len = len;
+        pthread_mutex_lock(&mMutex);
+        mFrames.push_back(fi);
+        pthread_mutex_unlock(&mMutex);
+        if (fi.opCode==UWSC_OP_CLOSE) {
+          writeAll(string("\x88\x02", 2)+payload.substr(0, 2));
+          break;
+        }
+        if (fi.opCode>=UWSC_OP_CLOSE) continue; // ignore ping/pong
+        if (fi.opCode!=UWSC_OP_CONTINUE) {
+          msg.clear();
+          msgOpCode = fi.opCode;
+          #if ENABLE_WEBSOCKET_COMPRESSION
+          msgCompressed = fi.rsv1;
+          #endif
+        }
+        msg += payload;
+        if (!fi.fin) continue;
+        #if ENABLE_WEBSOCKET_COMPRESSION
+        if (msgCompressed) {
+          // client does not take over context, so every message can be inflated on its own
+          msg.append("\x00\x00\xff\xff", 4);
+          inflateReset(&inf);
+          string out;
+          uint8_t buf[4096];
+          inf.next_in = (Bytef*)msg.data();
+          inf.avail_in = (uInt)msg.size();
+          do {
+            inf.next_out = buf;
+            inf.avail_out = sizeof(buf);
+            inflate(&inf, Z_SYNC_FLUSH);
+            out.append((char*)buf, sizeof(buf)-inf.avail_out);
+          } while (inf.avail_out==0);
+          msg = out;
+        }
+        #endif
+        pthread_mutex_lock(&mMutex);
+        mMessages.push_back(msg);
+        pthread_mutex_unlock(&mMutex);
+        // echo back, compressed again if it came compressed
+        string reply = msg;
+        uint8_t head = 0x80 | msgOpCode;
+        #if ENABLE_WEBSOCKET_COMPRESSION
+        if (msgCompressed) {
+          deflateReset(&def);
+          string out;
+          out.resize(msg.size()+64);
+          def.next_in = (Bytef*)msg.data();
+          def.avail_in = (uInt)msg.size();
+          def.next_out = (Bytef*)&out[0];
+          def.avail_out = (uInt)out.size();
+          deflate(&def, Z_SYNC_FLUSH);
+          out.resize(out.size()-def.avail_out-4);
+          reply = out;
+          head |= 0x40;
+        }
+        #endif
+        string frame;
+        frame += (char)head;
+        if (reply.size()<126) {
+          frame += (char)reply.size();
+        }
+        else if (reply.size()<65536) {
+          frame += (char)126;
+          frame += (char)(reply.size()>>8);
+          frame += (char)(reply.size() & 0xFF);
+        }
+        else {
+          frame += (char)127;
+          for (int i=7; i>=0; i--) frame += (char)((uint64_t)reply.size()>>(8*i));
+        }
+        writeAll(frame+reply);
+      }
+      #if ENABLE_WEBSOCKET_COMPRESSION
+      inflateEnd(&inf);
+      deflateEnd(&def);
+      #endif
+    }
+    pthread_mutex_lock(&mMutex);
+    mConnFd = -1;
+    pthread_mutex_unlock(&mMutex);
+    close(fd);
+  }
+
+  bool handshake()
+  {
+    string req;
+    char c;
+    while (req.find("\r\n\r\n")==string::npos) {
+      if (recv(mConnFd, &c, 1, 0)!=1) return false;
+      req += c;
+    }
+    size_t p = req.find("Sec-WebSocket-Key: ");
+    if (p==string::npos) return false;
+    p += 19;
+    string key = req.substr(p, req.find("\r\n", p)-p);
+    static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    struct sha1_ctx ctx;
+    uint8_t sha[20];
+    char accept[64];
+    sha1_init(&ctx);
+    sha1_update(&ctx, key.c_str(), key.size());
+    sha1_update(&ctx, magic, strlen(magic));
+    sha1_final(&ctx, sha);
+    b64_encode(sha, sizeof(sha), accept, sizeof(accept));
+    mOffered = req.find("permessage-deflate")!=string::npos;
+    string resp = string_format(
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: %s\r\n",
+      accept
+    );
+    if (mOffered && mDeflate) {
+      resp += "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; client_no_context_takeover\r\n";
+    }
+    resp += "\r\n";
+    writeAll(resp);
+    return true;
+  }
+
+};
+
+
+class WebSocketFixture
+{
+public:
+
+  WebSocketClientPtr mWebSocket;
+  WebSocketEchoServer* mServer;
+  MLTicket mTick;
+  bool mOpened;
+  bool mSendReady;
+  std::vector<string> mReceived;
+  ErrorPtr mError;
+
+  WebSocketFixture() :
+    mServer(NULL),
+    mOpened(false),
+    mSendReady(false)
+  {
+    MainLoop::currentMainLoop().startupMainLoop(true);
+  }
+
+  virtual ~WebSocketFixture()
+  {
+    if (mWebSocket) {
+      mWebSocket->clearCallbacks();
+      mWebSocket.reset();
+    }
+    delete mServer;
+  }
+
+  void opened(ErrorPtr aError)
+  {
+    REQUIRE(Error::isOK(aError));
+    mOpened = true;
+  }
+
+  void messageReceived(const string aMessage, ErrorPtr aError)
+  {
+    if (Error::notOK(aError)) mError = aError;
+    else mReceived.push_back(aMessage);
+  }
+
+  void sendReady()
+  {
+    mSendReady = true;
+  }
+
+  void tick(MLTimer &aTimer)
+  {
+    MainLoop::currentMainLoop().retriggerTimer(aTimer, 10*MilliSecond);
+  }
+
+  template<typename F> void runUntil(F aCondition)
+  {
+    mTick.executeOnce(boost::bind(&WebSocketFixture::tick, this, _1), 10*MilliSecond);
+    MLMicroSeconds timeout = MainLoop::now()+5*Second;
+    while (!aCondition() && MainLoop::now()<timeout) {
+      MainLoop::currentMainLoop().mainLoopCycle();
+    }
+    mTick.cancel();
+  }
+
+  void connect(bool aServerDeflate = false, bool aClientDeflate = false)
+  {
+    mServer = new WebSocketEchoServer(aServerDeflate);
+    mWebSocket = WebSocketClientPtr(new WebSocketClient);
+    mWebSocket->setMessageHandler(boost::bind(&WebSocketFixture::messageReceived, this, _1, _2));
+    mWebSocket->setSendReadyHandler(boost::bind(&WebSocketFixture::sendReady, this));
+    #if ENABLE_WEBSOCKET_COMPRESSION
+    mWebSocket->setCompression(aClientDeflate, 64);
+    #endif
+    mWebSocket->connectTo(boost::bind(&WebSocketFixture::opened, this, _1), string_format("ws://127.0.0.1:%d/", mServer->mPort), 60*Second, "");
+    runUntil([this]{ return mOpened; });
+    REQUIRE(mOpened);
+  }
+
+  void runUntilReceived(size_t aCount)
+  {
+    runUntil([this, aCount]{ return mReceived.size()>=aCount; });
+  }
+
+  void runUntilServerGot(size_t aCount)
+  {
+    runUntil([this, aCount]{ return mServer->numMessages()>=aCount; });
+  }
+
+  string numbered(int aNum, size_t aSize)
+  {
+    string s = string_format("msg#%d:", aNum);
+    s.append(aSize-s.size(), 'x');
+    return s;
+  }
+
+};
+
+
+TEST_CASE_METHOD(WebSocketFixture, "websocket send queue", "[websocket]")
+{
+  SECTION("echo") {
+    connect();
+    REQUIRE(Error::isOK(mWebSocket->send("hello")));
+    runUntilReceived(1);
+    REQUIRE(mReceived.size()==1);
+    REQUIRE(mReceived[0]=="hello");
+    REQUIRE(mWebSocket->messagesSent()==1);
+    REQUIRE(mWebSocket->framesSent()==1);
+    REQUIRE(mWebSocket->payloadBytesSent()==5);
+    REQUIRE(mWebSocket->wireBytesSent()==5+6); // 2 header + 4 mask key bytes
+    REQUIRE(mWebSocket->queuedMessages()==0);
+  }
+
+  SECTION("fragmentation") {
+    connect();
+    mWebSocket->setFragmentSize(1000);
+    string big = numbered(1, 4500);
+    REQUIRE(Error::isOK(mWebSocket->send(big)));
+    REQUIRE(Error::isOK(mWebSocket->send("small")));
+    runUntilReceived(2);
+    REQUIRE(mReceived.size()==2);
+    REQUIRE(mReceived[0]==big);
+    REQUIRE(mReceived[1]=="small");
+    REQUIRE(mWebSocket->framesSent()==6);
+    pthread_mutex_lock(&mServer->mMutex);
+    REQUIRE(mServer->mFrames.size()==6);
+    REQUIRE(mServer->mFrames[0].opCode==UWSC_OP_TEXT);
+    REQUIRE(!mServer->mFrames[0].fin);
+    REQUIRE(mServer->mFrames[0].len==1000);
+    REQUIRE(mServer->mFrames[1].opCode==UWSC_OP_CONTINUE);
+    REQUIRE(mServer->mFrames[4].opCode==UWSC_OP_CONTINUE);
+    REQUIRE(mServer->mFrames[4].fin);
+    REQUIRE(mServer->mFrames[4].len==500);
+    REQUIRE(mServer->mFrames[5].opCode==UWSC_OP_TEXT);
+    REQUIRE(mServer->mFrames[5].fin);
+    pthread_mutex_unlock(&mServer->mMutex);
+  }
+
+  SECTION("batching") {
+    connect();
+    mWebSocket->setBatching(100);
+    for (int i=0; i<10; i++) {
+      REQUIRE(Error::isOK(mWebSocket->send(string_format("m%d", i))));
+    }
+    REQUIRE(Error::isOK(mWebSocket->send("binary", UWSC_OP_BINARY))); // never batched
+    REQUIRE(mWebSocket->queuedMessages()==11); // nothing sent before end of mainloop cycle
+    runUntilReceived(2);
+    REQUIRE(mReceived.size()==2);
+    REQUIRE(mReceived[0]=="m0\nm1\nm2\nm3\nm4\nm5\nm6\nm7\nm8\nm9");
+    REQUIRE(mReceived[1]=="binary");
+    REQUIRE(mWebSocket->messagesSent()==11);
+    REQUIRE(mWebSocket->framesSent()==2);
+    REQUIRE(mWebSocket->batchesSent()==1);
+  }
+
+  SECTION("high watermark rejects new messages") {
+    connect();
+    mWebSocket->setSendQueueLimits(200000, 20000, WebSocketClient::rejectNew);
+    int accepted = 0;
+    int rejected = 0;
+    for (int i=0; i<100; i++) {
+      ErrorPtr err = mWebSocket->send(numbered(i, 10000));
+      if (Error::isOK(err)) accepted++;
+      else {
+        REQUIRE(Error::isError(err, WebSocketError::domain(), WebSocketError::SendQueueFull));
+        rejected++;
+      }
+    }
+    REQUIRE(accepted>=19); // frame headers count towards pending bytes, too
+    REQUIRE(accepted<=20);
+    REQUIRE(mWebSocket->sendQueueFull());
+    REQUIRE(mWebSocket->messagesDropped()==rejected);
+    REQUIRE(mWebSocket->maxQueuedBytes()<=200000);
+    runUntil([this]{ return mSendReady; });
+    REQUIRE(mSendReady);
+    REQUIRE(!mWebSocket->sendQueueFull());
+    REQUIRE(mWebSocket->pendingBytes()<=20000);
+    runUntilReceived(accepted);
+    REQUIRE(mReceived.size()==(size_t)accepted);
+    REQUIRE(mReceived.back()==numbered(accepted-1, 10000));
+  }
+
+  SECTION("high watermark drops oldest messages") {
+    connect();
+    mWebSocket->setSendQueueLimits(200000, 20000, WebSocketClient::dropOldest);
+    for (int i=0; i<100; i++) {
+      REQUIRE(Error::isOK(mWebSocket->send(numbered(i, 10000))));
+    }
+    long dropped = mWebSocket->messagesDropped();
+    REQUIRE(dropped>=70);
+    REQUIRE(mWebSocket->maxQueuedBytes()<=200000);
+    runUntilReceived(100-dropped);
+    REQUIRE(mReceived.size()==(size_t)(100-dropped));
+    REQUIRE(mReceived.back()==numbered(99, 10000)); // newest messages survive
+    REQUIRE(mSendReady);
+  }
+
+  #if ENABLE_WEBSOCKET_COMPRESSION
+  SECTION("permessage-deflate") {
+    connect(true, true);
+    REQUIRE(mServer->mOffered);
+    REQUIRE(mWebSocket->compressionActive());
+    string text;
+    for (int i=0; i<200; i++) string_format_append(text, "{\"item\":%d,\"name\":\"some repeated text\"},", i);
+    REQUIRE(Error::isOK(mWebSocket->send(text)));
+    REQUIRE(Error::isOK(mWebSocket->send("tiny"))); // below minimum size, not compressed
+    runUntilReceived(2);
+    REQUIRE(mReceived.size()==2);
+    REQUIRE(mReceived[0]==text); // server echoes compressed, client must inflate
+    REQUIRE(mReceived[1]=="tiny");
+    REQUIRE(Error::isOK(mError));
+    pthread_mutex_lock(&mServer->mMutex);
+    REQUIRE(mServer->mMessages[0]==text);
+    REQUIRE(mServer->mFrames[0].rsv1);
+    REQUIRE(mServer->mFrames[0].len<text.size()/4);
+    REQUIRE(!mServer->mFrames[1].rsv1);
+    pthread_mutex_unlock(&mServer->mMutex);
+    REQUIRE(mWebSocket->bytesSaved()==text.size()-mServer->mFrames[0].len);
+    REQUIRE(mWebSocket->payloadBytesSent()==text.size()+4);
+  }
+
+  SECTION("permessage-deflate with fragmentation") {
+    connect(true, true);
+    mWebSocket->setFragmentSize(100);
+    string text;
+    for (int i=0; i<500; i++) string_format_append(text, "%d,", i*i);
+    REQUIRE(Error::isOK(mWebSocket->send(text)));
+    runUntilReceived(1);
+    REQUIRE(mReceived.size()==1);
+    REQUIRE(mReceived[0]==text);
+    pthread_mutex_lock(&mServer->mMutex);
+    REQUIRE(mServer->mFrames.size()>1);
+    REQUIRE(mServer->mFrames[0].rsv1);
+    REQUIRE(!mServer->mFrames[1].rsv1); // RSV1 only on first frame
+    pthread_mutex_unlock(&mServer->mMutex);
+  }
+
+  SECTION("inflated message size is limited") {
+    connect(true, true);
+    mWebSocket->setMaxMessageSize(10000);
+    string text(100000, 'a'); // compresses to a few hundred bytes
+    REQUIRE(Error::isOK(mWebSocket->send(text)));
+    runUntil([this]{ return Error::notOK(mError); });
+    REQUIRE(Error::isError(mError, WebSocketError::domain(), WebSocketError::MessageTooLarge));
+    REQUIRE(mReceived.empty());
+    // connection and inflater remain usable
+    mError.reset();
+    string text2(5000, 'b');
+    REQUIRE(Error::isOK(mWebSocket->send(text2)));
+    runUntilReceived(1);
+    REQUIRE(mReceived.size()==1);
+    REQUIRE(mReceived[0]==text2);
+    REQUIRE(Error::isOK(mError));
+  }
+
+  SECTION("permessage-deflate declined by server") {
+    connect(false, true);
+    REQUIRE(mServer->mOffered);
+    REQUIRE(!mWebSocket->compressionActive());
+    string text(1000, 'a');
+    REQUIRE(Error::isOK(mWebSocket->send(text)));
+    runUntilReceived(1);
+    REQUIRE(mReceived[0]==text);
+    REQUIRE(mWebSocket->bytesSaved()==0);
+  }
+  #endif // ENABLE_WEBSOCKET_COMPRESSION
+}
+
+#endif // ENABLE_UWSC
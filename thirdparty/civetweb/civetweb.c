@@ -18379,13 +18379,14 @@ int create_authorization_header(struct wah *wah,
 }
 
 
-struct mg_connection *
-mg_download_secure(const struct mg_client_options *client_options,
-                   int use_ssl,
-                   const char *method, const char *requesturi,
-                   const char *username, const char *password, void **opaqueauthP, int allowbasicauth,
-                   char *ebuf, size_t ebuf_len,
-                   const char *fmt, ...)
+static struct mg_connection *
+download_secure_impl(const struct mg_client_options *client_options,
+                     int use_ssl,
+                     struct mg_keepalive_info *keepalive,
+                     const char *method, const char *requesturi,
+                     const char *username, const char *password, void **opaqueauthP, int allowbasicauth,
+                     char *ebuf, size_t ebuf_len,
+                     const char *fmt, va_list ap)
 {
     struct mg_connection *conn;
     char *authorization = NULL;
@@ -18394,9 +18395,16 @@ mg_download_secure(const struct mg_client_options *client_options,
     char *reqText = NULL;
     int httperr = 0;
     size_t reqLen = 0;
-    va_list ap;
-    va_start(ap, fmt);
+    int reused_conn = 0;
+    int send_failed;
+    const struct mg_http_method_info *method_info = get_http_method_info(method);
+    struct timespec connect_start, connect_end;
+    va_list aq;
 
+    if (keepalive) {
+        keepalive->reused = 0;
+        keepalive->connect_time = 0;
+    }
     /* make sure everything is initialized we need for downloading */
     if (!mg_download_init(use_ssl, ebuf, ebuf_len)) return NULL;
 
@@ -18417,16 +18425,47 @@ mg_download_secure(const struct mg_client_options *client_options,
         ebuf[0] = '\0';
         /*  produce main message (so it will be sent with a single mg_printf/mg_write below) */
         reqText = NULL;
-        reqLen = alloc_vprintf(&reqText, NULL, 0, fmt, ap);
-        if ((conn = mg_connect_client_impl(client_options, use_ssl, ebuf, ebuf_len)) == NULL) {
+        va_copy(aq, ap); /* format might be needed more than once (auth, reconnect) */
+        reqLen = alloc_vprintf(&reqText, NULL, 0, fmt, aq);
+        va_end(aq);
+        reused_conn = 0;
+        send_failed = 0;
+        if (keepalive && keepalive->reuse_conn) {
+            /*  use idle connection left open by a previous request */
+            conn = keepalive->reuse_conn;
+            keepalive->reuse_conn = NULL; /*  we own it now */
+            conn->data_len = 0;
+            conn->request_len = 0;
+            reused_conn = 1;
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &connect_start);
+            conn = mg_connect_client_impl(client_options, use_ssl, ebuf, ebuf_len);
+            clock_gettime(CLOCK_MONOTONIC, &connect_end);
+            if (keepalive) keepalive->connect_time += mg_difftimespec(&connect_end, &connect_start);
+        }
+        if (conn == NULL) {
         } else if (
             mg_printf(conn, "%s %s HTTP/1.1\r\nHost: %s\r\n%s%s", method, requesturi, client_options->host, authorization ? authorization : "", reqText) <= 0
         ) {
             mg_snprintf(conn, NULL, ebuf, ebuf_len, "%s", "Error sending request");
+            send_failed = 1;
         } else {
             get_response(conn, ebuf, ebuf_len, &httperr);
         }
         if (reqText) { mg_free(reqText); reqText = NULL; }
+        if (
+            reused_conn && (ebuf[0] != '\0' || httperr != 0) &&
+            (send_failed || conn->data_len == 0) &&
+            method_info && method_info->is_idempotent
+        ) {
+            /*  server has closed the idle connection in the meantime: retry once on a new connection.
+             *  Only safe when the server cannot have processed the request (not sent, or closed without
+             *  any response byte), and even then only for idempotent methods */
+            mg_close_connection(conn);
+            conn = NULL;
+            httperr = 0;
+            continue;
+        }
         if (ebuf[0] != '\0' && conn != NULL) {
             mg_close_connection(conn);
             conn = NULL;
@@ -18475,10 +18514,99 @@ mg_download_secure(const struct mg_client_options *client_options,
             mg_free(wah); /*  nobody to take ownership, free it */
         }
     }
+    if (keepalive && conn) keepalive->reused = reused_conn;
     return conn;
 }
 
 
+struct mg_connection *
+mg_download_secure(const struct mg_client_options *client_options,
+                   int use_ssl,
+                   const char *method, const char *requesturi,
+                   const char *username, const char *password, void **opaqueauthP, int allowbasicauth,
+                   char *ebuf, size_t ebuf_len,
+                   const char *fmt, ...)
+{
+    struct mg_connection *conn;
+    va_list ap;
+
+    va_start(ap, fmt);
+    conn = download_secure_impl(client_options, use_ssl, NULL, method, requesturi, username, password, opaqueauthP, allowbasicauth, ebuf, ebuf_len, fmt, ap);
+    va_end(ap);
+    return conn;
+}
+
+
+struct mg_connection *
+mg_download_keepalive(const struct mg_client_options *client_options,
+                      int use_ssl,
+                      struct mg_keepalive_info *keepalive,
+                      const char *method, const char *requesturi,
+                      const char *username, const char *password, void **opaqueauthP, int allowbasicauth,
+                      char *ebuf, size_t ebuf_len,
+                      const char *fmt, ...)
+{
+    struct mg_connection *conn;
+    va_list ap;
+
+    va_start(ap, fmt);
+    conn = download_secure_impl(client_options, use_ssl, keepalive, method, requesturi, username, password, opaqueauthP, allowbasicauth, ebuf, ebuf_len, fmt, ap);
+    va_end(ap);
+    return conn;
+}
+
+
+int
+mg_client_connection_reusable(const struct mg_connection *conn)
+{
+    const char *header;
+    const char *http_version;
+
+    if ((conn == NULL) || conn->must_close || (conn->connection_type != CONNECTION_TYPE_RESPONSE)) {
+        return 0;
+    }
+    /*  server's explicit wish */
+    header = get_header(conn->response_info.http_headers, conn->response_info.num_headers, "Connection");
+    if (header) {
+        if (header_has_option(header, "close")) return 0;
+    }
+    else {
+        /*  HTTP 1.1 default is keep alive, 1.0 default is close */
+        http_version = conn->response_info.http_version;
+        if (!http_version || strcmp(http_version, "1.1") != 0) return 0;
+    }
+    /*  response body must be completely consumed, otherwise the next response would be garbled */
+    if (conn->is_chunked) return conn->is_chunked == 4;
+    return (conn->content_len >= 0) && (conn->consumed_content >= conn->content_len);
+}
+
+
+int
+mg_client_connection_alive(const struct mg_connection *conn)
+{
+    char c;
+    int n;
+
+    if ((conn == NULL) || (conn->client.sock == INVALID_SOCKET)) {
+        return 0;
+    }
+#if defined(MSG_DONTWAIT)
+    /*  idle connection must neither be closed by the server (EOF) nor have any data pending
+        (such as an error response or a TLS alert sent before closing) */
+    n = (int)recv(conn->client.sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0) {
+        int err = ERRNO;
+        return (err == EAGAIN) || (err == EWOULDBLOCK) || (err == EINTR);
+    }
+    return 0;
+#else
+    (void)c;
+    (void)n;
+    return 1; /* cannot check without blocking, assume alive */
+#endif
+}
+
+
 
 
 
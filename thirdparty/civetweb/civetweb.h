@@ -1276,6 +1276,49 @@ mg_download_secure(const struct mg_client_options *client_options,
 
 
 
+/* Keep-alive state for mg_download_keepalive() */
+struct mg_keepalive_info {
+  struct mg_connection *reuse_conn; /* in: idle connection to the same server left open by a previous request, or NULL. Ownership passes to mg_download_keepalive() */
+  int reused; /* out: 1 if request was sent over reuse_conn, 0 if a new connection was opened */
+  double connect_time; /* out: seconds spent opening new connection(s) (TCP connect and TLS handshake) */
+};
+
+
+/* Same as mg_download_secure(), but can send the request over an already open
+   connection (HTTP/1.1 keep-alive).
+     keepalive: keep-alive state, see struct mg_keepalive_info. If sending over
+       keepalive->reuse_conn fails (e.g. because the server has closed it in the meantime),
+       the request is retried once on a new connection.
+   Return:
+     same as mg_download_secure(). When the response is completely read, check
+     mg_client_connection_reusable() to see if the connection can be passed as
+     reuse_conn to a later request instead of closing it.
+ */
+CIVETWEB_API struct mg_connection *
+mg_download_keepalive(const struct mg_client_options *client_options,
+                      int use_ssl,
+                      struct mg_keepalive_info *keepalive,
+                      const char *method, const char *requesturi,
+                      const char *username, const char *password, void **opaqueauthP, int allowbasicauth,
+                      char *ebuf, size_t ebuf_len,
+                      PRINTF_FORMAT_STRING(const char *fmt),
+                      ...) PRINTF_ARGS(12, 13);
+
+
+/* Check if a client connection can be used for another request.
+   Return:
+     1 if server allows keep-alive and the response body has been read completely,
+     0 otherwise */
+CIVETWEB_API int mg_client_connection_reusable(const struct mg_connection *conn);
+
+
+/* Check (without blocking) if an idle client connection is still usable, i.e. the
+   server has not closed it and has not sent any unexpected data.
+   Return:
+     1 if connection seems alive, 0 if it should be closed */
+CIVETWEB_API int mg_client_connection_alive(const struct mg_connection *conn);
+
+
 /* Close the connection opened by mg_download(). */
 CIVETWEB_API void mg_close_connection(struct mg_connection *conn);
 
@@ -90,6 +90,7 @@ static bool parse_header(struct uwsc_client *cl)
 
     fin = (head & 0x80) ? true : false;
     frame->opcode = head & 0x0F;
+    frame->rsv1 = (head & 0x40) ? true : false;
 
     if (!fin || frame->opcode == UWSC_OP_CONTINUE) {
         uwsc_error(cl, UWSC_ERROR_NOT_SUPPORT, "Not support fragment");
@@ -235,6 +236,11 @@ static int parse_http_header(struct uwsc_client *cl)
         if (!strcasecmp(k, "Connection") && !strcasecmp(v, "upgrade"))
             has_connection = true;
 
+        if (!strcasecmp(k, "Sec-WebSocket-Extensions")) {
+            strncpy(cl->extensions, v, sizeof(cl->extensions) - 1);
+            cl->extensions[sizeof(cl->extensions) - 1] = 0;
+        }
+
         if (!strcasecmp(k, "Sec-WebSocket-Accept")) {
             static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
             struct sha1_ctx ctx;
@@ -399,6 +405,9 @@ static void uwsc_io_write_cb(struct ev_loop *loop, struct ev_io *w, int revents)
 
     if (buffer_length(&cl->wb) < 1)
         ev_io_stop(loop, w);
+
+    if (cl->onwrite && cl->state > CLIENT_STATE_HANDSHAKE)
+        cl->onwrite(cl);
 }
 
 static int uwsc_send(struct uwsc_client *cl, const void *data, size_t len, int op)
@@ -82,6 +82,7 @@ enum {
 
 struct uwsc_frame {
     uint8_t opcode;
+    bool rsv1;              /* RSV1 bit, set for compressed messages with permessage-deflate */
     size_t payloadlen;
 };
 
@@ -101,6 +102,7 @@ struct uwsc_client {
     ev_tstamp last_ping;    /* Time stamp of last ping */
     int ntimeout;           /* Number of timeouts */
     char key[256];          /* Sec-WebSocket-Key */
+    char extensions[256];   /* Sec-WebSocket-Extensions accepted by the server, empty if none */
     void *ssl;              /* Context wrap of openssl, wolfssl and mbedtls */
 
     void (*onopen)(struct uwsc_client *cl);
@@ -108,6 +110,7 @@ struct uwsc_client {
     void (*onmessage)(struct uwsc_client *cl, void *data, size_t len, bool binary);
     void (*onerror)(struct uwsc_client *cl, int err, const char *msg);
     void (*onclose)(struct uwsc_client *cl, int code, const char *reason);
+    void (*onwrite)(struct uwsc_client *cl);    /* called after data from wb has been written to the socket */
 
     int (*send)(struct uwsc_client *cl, const void *data, size_t len, int op);
     int (*send_ex)(struct uwsc_client *cl, int op, int num, ...);
@@ -30,6 +30,7 @@
 #include "timeutils.hpp"
 
 #include <math.h>
+#include <stdint.h>
 
 
 using namespace p44;
@@ -164,10 +165,69 @@ void p44::getSunParams(time_t aTime, const GeoLocation &aGeoLocation, SunParams
 }
 
 
+long p44::timeZoneSignature()
+{
+  #ifndef ESP_PLATFORM
+  // tzset() updates these globals (and re-points tzname to the names of the new zone)
+  return timezone ^ ((long)daylight<<20) ^ (long)(intptr_t)tzname[0] ^ ((long)(intptr_t)tzname[1]<<1);
+  #else
+  return 0; // no TZ support on ESP32 at this time, see getSunParams()
+  #endif
+}
+
+
+/// cached sun parameters for one local day
+typedef struct {
+  time_t dayStart; ///< unix time of the start of the local day
+  time_t dayEnd; ///< unix time of the start of the following local day
+  long tzSignature; ///< timezone signature at the time of calculation
+  double latitude; ///< latitude the params were calculated for
+  double longitude; ///< longitude the params were calculated for
+  SunParams params; ///< the cached parameters
+} SunParamsCacheEntry;
+
+// a few entries to support more than one location (or a specific day in addition to today) without thrashing
+#define SUNPARAMS_CACHE_ENTRIES 4
+
+static __thread SunParamsCacheEntry tSunParamsCache[SUNPARAMS_CACHE_ENTRIES];
+static __thread int tSunParamsCacheNext = 0;
+
+void p44::getCachedSunParams(time_t aTime, const GeoLocation &aGeoLocation, SunParams &aSunParams)
+{
+  long tzs = timeZoneSignature();
+  for (int i=0; i<SUNPARAMS_CACHE_ENTRIES; i++) {
+    SunParamsCacheEntry& e = tSunParamsCache[i];
+    if (
+      aTime>=e.dayStart && aTime<e.dayEnd &&
+      e.tzSignature==tzs &&
+      e.latitude==aGeoLocation.latitude && e.longitude==aGeoLocation.longitude
+    ) {
+      aSunParams = e.params;
+      return;
+    }
+  }
+  // not cached, calculate and store in the next slot (round robin)
+  SunParamsCacheEntry& e = tSunParamsCache[tSunParamsCacheNext];
+  tSunParamsCacheNext = (tSunParamsCacheNext+1) % SUNPARAMS_CACHE_ENTRIES;
+  getSunParams(aTime, aGeoLocation, e.params);
+  // determine the local day's boundaries (not necessarily 24h apart on DST change days)
+  struct tm lt;
+  localtime_r(&aTime, &lt);
+  lt.tm_hour = 0; lt.tm_min = 0; lt.tm_sec = 0; lt.tm_isdst = -1;
+  e.dayStart = mktime(&lt);
+  lt.tm_mday += 1; lt.tm_isdst = -1;
+  e.dayEnd = mktime(&lt);
+  e.tzSignature = tzs;
+  e.latitude = aGeoLocation.latitude;
+  e.longitude = aGeoLocation.longitude;
+  aSunParams = e.params;
+}
+
+
 double p44::sunrise(time_t aTime, const GeoLocation &aGeoLocation, bool aTwilight)
 {
   SunParams p;
-  getSunParams(aTime, aGeoLocation, p);
+  getCachedSunParams(aTime, aGeoLocation, p);
   return p.sunrise - (aTwilight ? p.twilight : 0);
 }
 
@@ -175,6 +235,6 @@ double p44::sunrise(time_t aTime, const GeoLocation &aGeoLocation, bool aTwiligh
 double p44::sunset(time_t aTime, const GeoLocation &aGeoLocation, bool aTwilight)
 {
   SunParams p;
-  getSunParams(aTime, aGeoLocation, p);
+  getCachedSunParams(aTime, aGeoLocation, p);
   return p.sunset + (aTwilight ? p.twilight : 0);
 }
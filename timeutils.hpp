@@ -68,6 +68,18 @@ namespace p44 {
   /// @param aSunParams will get the sun parameters for the given day, place and timezone
   void getSunParams(time_t aTime, const GeoLocation &aGeoLocation, SunParams &aSunParams);
 
+  /// get sun parameters for a given day from a per-thread cache
+  /// @param aTime unix time of the day
+  /// @param aGeoLocation geolocation with latitude/longitude set
+  /// @param aSunParams will get the sun parameters for the given day, place and timezone
+  /// @note the parameters are calculated via getSunParams() only once per local day, location and timezone.
+  ///   Subsequent calls for the same day are answered without calling localtime() or doing any trigonometry.
+  void getCachedSunParams(time_t aTime, const GeoLocation &aGeoLocation, SunParams &aSunParams);
+
+  /// @return a value that changes when the local timezone is changed (TZ changed and tzset() called)
+  /// @note used to invalidate caches of calendar/localtime dependent values
+  long timeZoneSignature();
+
   /// get sunrise info
   /// @param aTime unix time of the day
   /// @param aGeoLocation geolocation with latitude/longitude set
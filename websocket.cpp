@@ -31,30 +31,69 @@
 
 #if ENABLE_UWSC
 
+extern "C" {
+  #include <uwsc/utils.h>
+}
+
+#if ENABLE_WEBSOCKET_COMPRESSION
+  #include <zlib.h>
+#endif
+
 using namespace p44;
 
+#define MAX_IN_FLIGHT_BYTES (64*1024) ///< framed bytes waiting in uwsc's write buffer before the queue holds back
+#define DEFAULT_MAX_MESSAGE_SIZE (1024*1024) ///< default limit for received (and inflated) messages
+
+struct uwsc_client_wrapper {
+  struct uwsc_client uwscClient;
+  WebSocketClient* webSocketClientP;
+};
+
 WebSocketClient::WebSocketClient(MainLoop &aMainLoop) :
-  inherited(aMainLoop),
-  mUwscClient(NULL)
+  mUwscClient(NULL),
+  mQueuedBytes(0),
+  mHighWatermark(0),
+  mLowWatermark(0),
+  mDropPolicy(rejectNew),
+  mAboveHighWatermark(false),
+  mFragmentSize(0),
+  mMaxBatchSize(0),
+  mMaskPoolUsed(sizeof(mMaskPool)),
+  mMaxMessageSize(DEFAULT_MAX_MESSAGE_SIZE),
+  #if ENABLE_WEBSOCKET_COMPRESSION
+  mCompression(false),
+  mMinCompressSize(128),
+  mDeflater(NULL),
+  mInflater(NULL),
+  mServerNoContextTakeover(false),
+  #endif
+  mMaxQueuedBytes(0),
+  mMessagesSent(0),
+  mFramesSent(0),
+  mBatchesSent(0),
+  mMessagesDropped(0),
+  mPayloadBytesSent(0),
+  mWireBytesSent(0),
+  mBytesSaved(0)
 {
 }
 
 
 WebSocketClient::~WebSocketClient()
 {
+  #if ENABLE_WEBSOCKET_COMPRESSION
+  endCompression();
+  #endif
   if (mUwscClient) {
     // Note: send_close eventually causes freeing uwsc_client automatically
     mUwscClient->send_close(mUwscClient, UWSC_CLOSE_STATUS_ABNORMAL_CLOSE, "websocket object deleted");
+    // detach, the closing handshake or connection loss will still cause uwsc callbacks
+    ((struct uwsc_client_wrapper*)mUwscClient)->webSocketClientP = NULL;
     mUwscClient = NULL;
   }
 }
 
 
-struct uwsc_client_wrapper {
-  struct uwsc_client uwscClient;
-  WebSocketClient* webSocketClientP;
-};
-
 static struct uwsc_client *wrapped_uwsc_new(
   WebSocketClient* aWebSocketClientP,
   struct ev_loop *aLoop, const char *aUrl,
@@ -85,34 +124,47 @@ static WebSocketClient* wsclient(struct uwsc_client* aCl)
 
 static void uwsc_onopen(struct uwsc_client *cl)
 {
-  wsclient(cl)->cb_onopen();
+  WebSocketClient* ws = wsclient(cl);
+  if (ws) ws->cb_onopen();
 }
 
 
 static void uwsc_onmessage(struct uwsc_client *cl, void *data, size_t len, bool binary)
 {
+  WebSocketClient* ws = wsclient(cl);
+  if (!ws) return;
   string msg;
   msg.assign((char *)data, len);
-  wsclient(cl)->cb_onmessage(msg);
+  ws->cb_onmessage(msg, cl->frame.rsv1);
+}
+
+static void uwsc_onwrite(struct uwsc_client *cl)
+{
+  WebSocketClient* ws = wsclient(cl);
+  if (ws) ws->cb_onwrite();
 }
 
 static void uwsc_onerror(struct uwsc_client *cl, int err, const char *msg)
 {
-  ErrorPtr errobj = Error::err<WebSocketError>(err, "%s", msg);
   ev_break(cl->loop, EVBREAK_ALL);
-  wsclient(cl)->cb_onerror(errobj);
+  WebSocketClient* ws = wsclient(cl);
+  if (ws) ws->cb_onerror(Error::err<WebSocketError>(err, "%s", msg));
 }
 
 static void uwsc_onclose(struct uwsc_client *cl, int code, const char *reason)
 {
   ev_break(cl->loop, EVBREAK_ALL);
-  wsclient(cl)->cb_onclose();
+  WebSocketClient* ws = wsclient(cl);
+  if (ws) ws->cb_onclose();
 }
 
 
 void WebSocketClient::cb_onopen()
 {
   DBGLOG(LOG_NOTICE,"onopen");
+  #if ENABLE_WEBSOCKET_COMPRESSION
+  startCompression();
+  #endif
   if (mOnOpenCloseCB) {
     StatusCB cb = mOnOpenCloseCB;
     mOnOpenCloseCB = NoOP;
@@ -125,6 +177,10 @@ void WebSocketClient::cb_onclose()
 {
   DBGLOG(LOG_NOTICE,"onclose");
   mUwscClient = NULL; // note: it frees itself on close, make sure we don't interact with it any more
+  discardSendQueue();
+  #if ENABLE_WEBSOCKET_COMPRESSION
+  endCompression();
+  #endif
   if (mOnOpenCloseCB) {
     StatusCB cb = mOnOpenCloseCB;
     mOnOpenCloseCB = NoOP;
@@ -133,18 +189,44 @@ void WebSocketClient::cb_onclose()
 }
 
 
-void WebSocketClient::cb_onmessage(const string aMessage)
+void WebSocketClient::cb_onmessage(const string aMessage, bool aCompressed)
 {
-  DBGLOG(LOG_NOTICE,"onmessage: %s", aMessage.c_str());
+  ErrorPtr err;
+  string msg = aMessage;
+  if (mMaxMessageSize>0 && msg.size()>mMaxMessageSize) {
+    err = Error::err<WebSocketError>(WebSocketError::MessageTooLarge, "received message exceeds %zu bytes", mMaxMessageSize);
+  }
+  else if (aCompressed) {
+    #if ENABLE_WEBSOCKET_COMPRESSION
+    if (mInflater) err = inflateMessage(msg);
+    else
+    #endif
+    err = Error::err<WebSocketError>(UWSC_ERROR_NOT_SUPPORT, "compressed message, but permessage-deflate not negotiated");
+  }
+  DBGLOG(LOG_NOTICE,"onmessage: %s", msg.c_str());
   if (mOnMessageCB) {
-    mOnMessageCB(aMessage, ErrorPtr());
+    if (Error::notOK(err)) mOnMessageCB("", err);
+    else mOnMessageCB(msg, ErrorPtr());
   }
 }
 
 
+void WebSocketClient::cb_onwrite()
+{
+  // uwsc has written (part of) its buffer, so there might be room for more of the queue now
+  if (mFlushTicket) return; // batch flush already scheduled
+  if (!mSendQueue.empty() || mAboveHighWatermark) flushSendQueue(false);
+}
+
+
 void WebSocketClient::cb_onerror(ErrorPtr aError)
 {
   DBGLOG(LOG_NOTICE,"onerror: %s", Error::text(aError));
+  mUwscClient = NULL; // uwsc has shut down the connection, must not write to it any more
+  discardSendQueue();
+  #if ENABLE_WEBSOCKET_COMPRESSION
+  endCompression();
+  #endif
   if (mOnMessageCB) {
     mOnMessageCB("", aError);
   }
@@ -155,6 +237,7 @@ void WebSocketClient::clearCallbacks()
 {
   mOnOpenCloseCB = NoOP;
   mOnMessageCB = NoOP;
+  mSendReadyCB = NoOP;
 }
 
 
@@ -166,7 +249,14 @@ void WebSocketClient::connectTo(StatusCB aOnOpenCB, const string aUrl, MLMicroSe
     err = Error::err<WebSocketError>(UWSC_ERROR_CONNECT, "already connected");
   }
   else {
-    mUwscClient = wrapped_uwsc_new(this, MainLoop::currentMainLoop().libevLoop(), aUrl.c_str(), (int)(aPingInterval/Second), aExtraHeaders.empty() ? NULL : aExtraHeaders.c_str());
+    string extraHeaders = aExtraHeaders;
+    #if ENABLE_WEBSOCKET_COMPRESSION
+    if (mCompression) {
+      // we always reset our compressor per message, which keeps client memory low and allows skipping small messages
+      extraHeaders += "Sec-WebSocket-Extensions: permessage-deflate; client_no_context_takeover\r\n";
+    }
+    #endif
+    mUwscClient = wrapped_uwsc_new(this, MainLoop::currentMainLoop().libevLoop(), aUrl.c_str(), (int)(aPingInterval/Second), extraHeaders.empty() ? NULL : extraHeaders.c_str());
     if (!mUwscClient) {
       err = Error::err<WebSocketError>(UWSC_ERROR_NOT_SUPPORT);
     }
@@ -175,6 +265,7 @@ void WebSocketClient::connectTo(StatusCB aOnOpenCB, const string aUrl, MLMicroSe
       mUwscClient->onmessage = uwsc_onmessage;
       mUwscClient->onerror = uwsc_onerror;
       mUwscClient->onclose = uwsc_onclose;
+      mUwscClient->onwrite = uwsc_onwrite;
       mOnOpenCloseCB = aOnOpenCB;
       return;
     }
@@ -195,6 +286,8 @@ void WebSocketClient::close(StatusCB aOnCloseCB, int aWebSocketCloseCode, const
     cb(Error::err<WebSocketError>(UWSC_ERROR_CONNECT, "closing before finished opening"));
   }
   if (mUwscClient) {
+    // close frame must come after all data frames
+    flushSendQueue(true);
     mOnOpenCloseCB = aOnCloseCB;
     mUwscClient->send_close(mUwscClient, aWebSocketCloseCode, aReason);
   }
@@ -208,20 +301,291 @@ void WebSocketClient::close(StatusCB aOnCloseCB, int aWebSocketCloseCode, const
 
 ErrorPtr WebSocketClient::send(const string aMessage, int aWebSocketOpCode)
 {
-  ErrorPtr err;
-  if (mUwscClient && !mOnOpenCloseCB) {
-    int res = mUwscClient->send(mUwscClient, aMessage.c_str(), aMessage.size(), aWebSocketOpCode);
-    if (res<0) {
-      err = Error::err<WebSocketError>(UWSC_ERROR_IO, "cannot send");
+  if (!isOpen()) {
+    return Error::err<WebSocketError>(UWSC_ERROR_CONNECT, "websocket is not (yet) connected");
+  }
+  size_t pending = pendingBytes();
+  if (mHighWatermark>0 && pending>0 && pending+aMessage.size()>mHighWatermark) {
+    mAboveHighWatermark = true;
+    if (mDropPolicy==dropOldest) {
+      SendQueue::iterator pos = mSendQueue.begin();
+      while (pos!=mSendQueue.end() && pending+aMessage.size()>mHighWatermark) {
+        if (pos->started) { ++pos; continue; } // partially sent, must complete
+        mQueuedBytes -= pos->data.size();
+        pending -= pos->data.size();
+        mMessagesDropped += pos->count;
+        pos = mSendQueue.erase(pos);
+      }
+    }
+    else {
+      mMessagesDropped++;
+      return Error::err<WebSocketError>(WebSocketError::SendQueueFull, "send queue full (%zu bytes pending)", pending);
+    }
+  }
+  QueuedMessage msg;
+  msg.data = aMessage;
+  msg.opCode = aWebSocketOpCode;
+  msg.count = 1;
+  msg.sent = 0;
+  msg.started = false;
+  msg.compressed = false;
+  mSendQueue.push_back(msg);
+  mQueuedBytes += aMessage.size();
+  if (mHighWatermark>0 && pending+aMessage.size()>mHighWatermark) mAboveHighWatermark = true;
+  if (pending+aMessage.size()>mMaxQueuedBytes) mMaxQueuedBytes = pending+aMessage.size();
+  if (mMaxBatchSize>0) {
+    // give other messages sent in this mainloop cycle a chance to join the batch
+    if (!mFlushTicket) scheduleFlush(0);
+  }
+  else {
+    flushSendQueue(false);
+  }
+  return ErrorPtr();
+}
+
+
+void WebSocketClient::setSendQueueLimits(size_t aHighWatermark, size_t aLowWatermark, DropPolicy aDropPolicy)
+{
+  mHighWatermark = aHighWatermark;
+  mLowWatermark = aLowWatermark<aHighWatermark ? aLowWatermark : aHighWatermark;
+  mDropPolicy = aDropPolicy;
+}
+
+
+size_t WebSocketClient::pendingBytes()
+{
+  return mQueuedBytes + (mUwscClient ? buffer_length(&mUwscClient->wb) : 0);
+}
+
+
+void WebSocketClient::scheduleFlush(MLMicroSeconds aDelay)
+{
+  mFlushTicket.executeOnce(boost::bind(&WebSocketClient::flushSendQueue, this, false), aDelay);
+}
+
+
+void WebSocketClient::flushSendQueue(bool aAll)
+{
+  mFlushTicket.cancel();
+  if (!mUwscClient) return;
+  // uwsc writes its buffer whenever the socket is writable. Only keep a limited amount of data in that
+  // buffer, so messages remain in our queue, where they can be batched, dropped and accounted for.
+  while (!mSendQueue.empty() && (aAll || buffer_length(&mUwscClient->wb)<MAX_IN_FLIGHT_BYTES)) {
+    QueuedMessage &msg = mSendQueue.front();
+    bool first = !msg.started;
+    if (first) startMessage(msg);
+    size_t n = msg.data.size()-msg.sent;
+    bool fin = true;
+    if (mFragmentSize>0 && n>mFragmentSize) {
+      n = mFragmentSize;
+      fin = false;
+    }
+    uint8_t head = (first ? msg.opCode : UWSC_OP_CONTINUE) & 0x0F;
+    if (fin) head |= 0x80;
+    if (first && msg.compressed) head |= 0x40; // RSV1 marks compressed message (first frame only)
+    writeFrame(head, msg.data.data()+msg.sent, n);
+    msg.sent += n;
+    mQueuedBytes -= n;
+    if (fin) {
+      mMessagesSent += msg.count;
+      if (msg.count>1) mBatchesSent++;
+      mSendQueue.pop_front();
+    }
+  }
+  // Note: when anything remains, uwsc is still writing, and will call cb_onwrite() when it makes progress
+  checkSendReady();
+}
+
+
+void WebSocketClient::startMessage(QueuedMessage &aMsg)
+{
+  aMsg.started = true;
+  if (mMaxBatchSize>0 && aMsg.opCode==UWSC_OP_TEXT) {
+    // join subsequent text messages into this one
+    SendQueue::iterator pos = mSendQueue.begin();
+    ++pos; // aMsg is the front
+    while (pos!=mSendQueue.end() && pos->opCode==UWSC_OP_TEXT && aMsg.data.size()+mBatchSeparator.size()+pos->data.size()<=mMaxBatchSize) {
+      aMsg.data += mBatchSeparator;
+      aMsg.data += pos->data;
+      aMsg.count += pos->count;
+      mQueuedBytes += mBatchSeparator.size();
+      pos = mSendQueue.erase(pos);
+    }
+  }
+  mPayloadBytesSent += aMsg.data.size();
+  #if ENABLE_WEBSOCKET_COMPRESSION
+  if (mDeflater && aMsg.opCode==UWSC_OP_TEXT && aMsg.data.size()>=mMinCompressSize) {
+    size_t before = aMsg.data.size();
+    if (deflateMessage(aMsg.data)) {
+      aMsg.compressed = true;
+      mQueuedBytes -= before-aMsg.data.size();
+      mBytesSaved += before-aMsg.data.size();
     }
   }
+  #endif
+}
+
+
+void WebSocketClient::writeFrame(uint8_t aHead, const char* aData, size_t aLen)
+{
+  struct buffer *wb = &mUwscClient->wb;
+  size_t before = buffer_length(wb);
+  buffer_put_u8(wb, aHead);
+  if (aLen<126) {
+    buffer_put_u8(wb, 0x80 | aLen);
+  }
+  else if (aLen<65536) {
+    buffer_put_u8(wb, 0x80 | 126);
+    buffer_put_u16(wb, htobe16(aLen));
+  }
   else {
-    err = Error::err<WebSocketError>(UWSC_ERROR_CONNECT, "websocket is not (yet) connected");
+    buffer_put_u8(wb, 0x80 | 127);
+    buffer_put_u64(wb, htobe64(aLen));
+  }
+  // client frames must be masked with a random key. Fetch random bytes in chunks rather than per frame.
+  if (mMaskPoolUsed+4>sizeof(mMaskPool)) {
+    get_nonce(mMaskPool, sizeof(mMaskPool));
+    mMaskPoolUsed = 0;
+  }
+  const uint8_t* mk = mMaskPool+mMaskPoolUsed;
+  mMaskPoolUsed += 4;
+  buffer_put_data(wb, mk, 4);
+  uint8_t* p = (uint8_t*)buffer_put(wb, aLen);
+  if (p) {
+    for (size_t i=0; i<aLen; i++) p[i] = (uint8_t)aData[i] ^ mk[i & 3];
+  }
+  mFramesSent++;
+  mWireBytesSent += buffer_length(wb)-before;
+  ev_io_start(mUwscClient->loop, &mUwscClient->iow);
+}
+
+
+void WebSocketClient::discardSendQueue()
+{
+  mFlushTicket.cancel();
+  for (SendQueue::iterator pos = mSendQueue.begin(); pos!=mSendQueue.end(); ++pos) {
+    mMessagesDropped += pos->count;
+  }
+  mSendQueue.clear();
+  mQueuedBytes = 0;
+  mAboveHighWatermark = false;
+}
+
+
+void WebSocketClient::checkSendReady()
+{
+  if (mAboveHighWatermark && pendingBytes()<=mLowWatermark) {
+    mAboveHighWatermark = false;
+    if (mSendReadyCB) mSendReadyCB();
+  }
+}
+
+
+#if ENABLE_WEBSOCKET_COMPRESSION
+
+// MARK: - permessage-deflate (RFC 7692)
+
+void WebSocketClient::startCompression()
+{
+  endCompression();
+  if (!mCompression || !mUwscClient) return;
+  string ext = lowerCase(mUwscClient->extensions);
+  if (ext.find("permessage-deflate")==string::npos) {
+    DBGLOG(LOG_INFO, "server did not accept permessage-deflate");
+    return;
+  }
+  mServerNoContextTakeover = ext.find("server_no_context_takeover")!=string::npos;
+  mDeflater = new z_stream;
+  memset(mDeflater, 0, sizeof(z_stream));
+  // raw deflate (no zlib header), server can only ask for smaller windows for its own side
+  if (deflateInit2(mDeflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)!=Z_OK) {
+    delete mDeflater;
+    mDeflater = NULL;
+    return;
+  }
+  mInflater = new z_stream;
+  memset(mInflater, 0, sizeof(z_stream));
+  if (inflateInit2(mInflater, -15)!=Z_OK) {
+    delete mInflater;
+    mInflater = NULL;
+    endCompression();
+    return;
+  }
+  DBGLOG(LOG_INFO, "permessage-deflate active: %s", mUwscClient->extensions);
+}
+
+
+void WebSocketClient::endCompression()
+{
+  if (mDeflater) {
+    deflateEnd(mDeflater);
+    delete mDeflater;
+    mDeflater = NULL;
+  }
+  if (mInflater) {
+    inflateEnd(mInflater);
+    delete mInflater;
+    mInflater = NULL;
   }
-  return err;
 }
 
 
+bool WebSocketClient::deflateMessage(string &aData)
+{
+  // we offered client_no_context_takeover, so every message starts with a fresh dictionary
+  deflateReset(mDeflater);
+  string out;
+  out.resize(aData.size()+4); // no point in output larger than input (+4 for the flush marker to be removed)
+  mDeflater->next_in = (Bytef*)aData.data();
+  mDeflater->avail_in = (uInt)aData.size();
+  mDeflater->next_out = (Bytef*)&out[0];
+  mDeflater->avail_out = (uInt)out.size();
+  if (deflate(mDeflater, Z_SYNC_FLUSH)!=Z_OK || mDeflater->avail_in>0 || mDeflater->avail_out==0) {
+    return false; // error or no gain
+  }
+  size_t n = out.size()-mDeflater->avail_out;
+  // remove the empty stored block marker the sync flush appends (RFC 7692, 7.2.1)
+  if (n<4 || memcmp(out.data()+n-4, "\x00\x00\xff\xff", 4)!=0) return false;
+  n -= 4;
+  if (n>=aData.size()) return false;
+  out.resize(n);
+  aData.swap(out);
+  return true;
+}
+
+
+ErrorPtr WebSocketClient::inflateMessage(string &aData)
+{
+  aData.append("\x00\x00\xff\xff", 4); // re-append the marker removed by the sender
+  string out;
+  uint8_t buf[16384];
+  mInflater->next_in = (Bytef*)aData.data();
+  mInflater->avail_in = (uInt)aData.size();
+  do {
+    mInflater->next_out = buf;
+    mInflater->avail_out = sizeof(buf);
+    int ret = inflate(mInflater, Z_SYNC_FLUSH);
+    if (ret!=Z_OK && ret!=Z_BUF_ERROR && ret!=Z_STREAM_END) {
+      ErrorPtr err = Error::err<WebSocketError>(UWSC_ERROR_IO, "cannot inflate message: %s", mInflater->msg ? mInflater->msg : "invalid data");
+      inflateReset(mInflater);
+      return err;
+    }
+    size_t n = sizeof(buf)-mInflater->avail_out;
+    if (mMaxMessageSize>0 && out.size()+n>mMaxMessageSize) {
+      // do not let a small compressed message expand without limit
+      inflateReset(mInflater);
+      return Error::err<WebSocketError>(WebSocketError::MessageTooLarge, "inflated message exceeds %zu bytes", mMaxMessageSize);
+    }
+    out.append((char*)buf, n);
+  } while (mInflater->avail_out==0);
+  if (mServerNoContextTakeover) inflateReset(mInflater);
+  aData.swap(out);
+  return ErrorPtr();
+}
+
+#endif // ENABLE_WEBSOCKET_COMPRESSION
+
+
 // MARK: - script support
 
 #if ENABLE_WEBSOCKET_SCRIPT_FUNCS && ENABLE_P44SCRIPT
@@ -31,6 +31,14 @@ extern "C" {
   #include <uwsc/uwsc.h>
 }
 
+#ifndef ENABLE_WEBSOCKET_COMPRESSION
+  #define ENABLE_WEBSOCKET_COMPRESSION 0 // permessage-deflate (RFC 7692) for text messages, requires zlib
+#endif
+
+#if ENABLE_WEBSOCKET_COMPRESSION
+  struct z_stream_s;
+#endif
+
 #if ENABLE_P44SCRIPT && !defined(ENABLE_WEBSOCKET_SCRIPT_FUNCS)
   #define ENABLE_WEBSOCKET_SCRIPT_FUNCS 1
 #endif
@@ -52,8 +60,12 @@ namespace p44 {
   {
   public:
     // Errors
-    typedef int ErrorCodes; // using UWSC_ERROR_xxx
-    static const int numErrorCodes = UWSC_ERROR_SSL_HANDSHAKE+1;
+    typedef int ErrorCodes; // using UWSC_ERROR_xxx, plus:
+    enum {
+      SendQueueFull = UWSC_ERROR_SSL_HANDSHAKE+1, ///< message rejected because send queue is above high watermark
+      MessageTooLarge, ///< received message (after inflating) exceeds the maximum message size
+    };
+    static const int numErrorCodes = MessageTooLarge+1;
 
     static const char *domain() { return "websocket"; }
     virtual const char *getErrorDomain() const P44_OVERRIDE { return WebSocketError::domain(); };
@@ -62,7 +74,7 @@ namespace p44 {
   protected:
     virtual const char* errorName() const P44_OVERRIDE { return errNames[getErrorCode()]; };
   private:
-    // must match 
+    // must match UWSC_ERROR_xxx
     static constexpr const char* const errNames[numErrorCodes] = {
       "OK",
       "IOError",
@@ -72,6 +84,8 @@ namespace p44 {
       "PingTimeout",
       "Connect",
       "SSLHandshake",
+      "SendQueueFull",
+      "MessageTooLarge",
     };
     #endif // ENABLE_NAMED_ERRORS
   };
@@ -96,6 +110,59 @@ namespace p44 {
     StatusCB mOnOpenCloseCB;
     WebSocketMessageCB mOnMessageCB;
 
+  public:
+
+    /// what to do with new messages when the send queue is above its high watermark
+    typedef enum {
+      rejectNew, ///< send() returns a SendQueueFull error for new messages
+      dropOldest, ///< discard the oldest messages not yet started sending to make room for new ones
+    } DropPolicy;
+
+  private:
+
+    // send queue
+    typedef struct {
+      string data; ///< the payload (compressed once sending has started and compressed is set)
+      int opCode; ///< websocket opcode
+      int count; ///< number of messages (>1 when batched)
+      size_t sent; ///< number of payload bytes already framed
+      bool started; ///< set when first frame has been written
+      bool compressed; ///< set when data is deflated
+    } QueuedMessage;
+    typedef std::list<QueuedMessage> SendQueue;
+    SendQueue mSendQueue;
+    size_t mQueuedBytes; ///< payload bytes in mSendQueue not yet framed
+    size_t mHighWatermark; ///< 0 = unlimited
+    size_t mLowWatermark;
+    DropPolicy mDropPolicy;
+    bool mAboveHighWatermark;
+    SimpleCB mSendReadyCB;
+    size_t mFragmentSize; ///< 0 = do not fragment
+    size_t mMaxBatchSize; ///< 0 = no batching
+    string mBatchSeparator;
+    MLTicket mFlushTicket;
+    uint8_t mMaskPool[64]; ///< random bytes for frame masking keys
+    size_t mMaskPoolUsed;
+    size_t mMaxMessageSize; ///< 0 = unlimited
+
+    #if ENABLE_WEBSOCKET_COMPRESSION
+    bool mCompression; ///< offer permessage-deflate when connecting
+    size_t mMinCompressSize;
+    struct z_stream_s* mDeflater; ///< set when permessage-deflate was negotiated
+    struct z_stream_s* mInflater;
+    bool mServerNoContextTakeover;
+    #endif
+
+    // statistics
+    size_t mMaxQueuedBytes;
+    long mMessagesSent;
+    long mFramesSent;
+    long mBatchesSent;
+    long mMessagesDropped;
+    uint64_t mPayloadBytesSent;
+    uint64_t mWireBytesSent;
+    uint64_t mBytesSaved;
+
   public:
 
     WebSocketClient(MainLoop &aMainLoop = MainLoop::currentMainLoop());
@@ -117,8 +184,69 @@ namespace p44 {
     /// send a message
     /// @param aMessage the message to send
     /// @param aWebSocketOpCode the websocket opcode (see RFC 6455, Section 11.8), defaults to text frame
+    /// @return error if not connected, or SendQueueFull if the message was rejected by the rejectNew policy
+    /// @note messages are queued and written to the connection as fast as it accepts them.
+    ///   When batching is enabled, messages are written at the end of the current mainloop cycle.
     ErrorPtr send(const string aMessage, int aWebSocketOpCode = UWSC_OP_TEXT);
 
+    /// set send queue limits
+    /// @param aHighWatermark when this many bytes are pending (queued + not yet written to the socket),
+    ///   new messages are handled according to aDropPolicy. 0 means unlimited (default)
+    /// @param aLowWatermark when pending bytes drop to this level after exceeding the high watermark,
+    ///   the send ready handler is called
+    /// @param aDropPolicy what to do with messages that would exceed the high watermark
+    /// @note a single message is always accepted when nothing else is pending, even if larger than aHighWatermark
+    void setSendQueueLimits(size_t aHighWatermark, size_t aLowWatermark, DropPolicy aDropPolicy = rejectNew);
+
+    /// set callback for when the send queue has drained below the low watermark after having exceeded the high watermark
+    void setSendReadyHandler(SimpleCB aSendReadyCB) { mSendReadyCB = aSendReadyCB; };
+
+    /// @return true when the send queue is above the high watermark (and not yet drained down to the low watermark)
+    bool sendQueueFull() { return mAboveHighWatermark; };
+
+    /// set fragment size
+    /// @param aFragmentSize messages with larger payloads are sent as multiple frames of at most this size.
+    ///   0 means never fragment (default)
+    /// @note fragmenting large messages allows pings and other control frames to be interleaved
+    void setFragmentSize(size_t aFragmentSize) { mFragmentSize = aFragmentSize; };
+
+    /// enable batching of small text messages
+    /// @param aMaxBatchSize text messages sent within the same mainloop cycle are joined into a single frame
+    ///   of up to this size. 0 disables batching (default)
+    /// @param aSeparator inserted between batched messages. The receiver must split batches at the separator.
+    void setBatching(size_t aMaxBatchSize, const string aSeparator = "\n") { mMaxBatchSize = aMaxBatchSize; mBatchSeparator = aSeparator; };
+
+    /// set maximum size of received messages
+    /// @param aMaxMessageSize larger messages (or compressed messages inflating to more than this) are not
+    ///   delivered, but reported as MessageTooLarge error to the message handler. 0 means unlimited.
+    void setMaxMessageSize(size_t aMaxMessageSize) { mMaxMessageSize = aMaxMessageSize; };
+
+    #if ENABLE_WEBSOCKET_COMPRESSION
+    /// enable permessage-deflate compression (RFC 7692)
+    /// @param aEnable if set, permessage-deflate is offered to the server on the next connectTo()
+    /// @param aMinSize text messages smaller than this are not compressed
+    /// @note only text messages are sent compressed, but compressed messages are accepted for all message types
+    void setCompression(bool aEnable, size_t aMinSize = 128) { mCompression = aEnable; mMinCompressSize = aMinSize; };
+
+    /// @return true when permessage-deflate has been negotiated for the current connection
+    bool compressionActive() { return mDeflater!=NULL; };
+    #endif
+
+    /// @name send queue statistics
+    /// @{
+    size_t queuedMessages() { return mSendQueue.size(); }; ///< number of messages (or batches) in the send queue
+    size_t queuedBytes() { return mQueuedBytes; }; ///< payload bytes in the send queue not yet written
+    size_t pendingBytes(); ///< queued bytes plus framed bytes not yet written to the socket
+    size_t maxQueuedBytes() { return mMaxQueuedBytes; }; ///< peak number of pending bytes
+    long messagesSent() { return mMessagesSent; }; ///< number of messages completely written
+    long framesSent() { return mFramesSent; }; ///< number of data frames written
+    long batchesSent() { return mBatchesSent; }; ///< number of frames carrying more than one message
+    long messagesDropped() { return mMessagesDropped; }; ///< number of messages rejected, discarded or lost at close
+    uint64_t payloadBytesSent() { return mPayloadBytesSent; }; ///< uncompressed message bytes sent
+    uint64_t wireBytesSent() { return mWireBytesSent; }; ///< bytes written including frame headers, after compression
+    uint64_t bytesSaved() { return mBytesSaved; }; ///< bytes saved by compression
+    /// @}
+
     /// set callback for receiving messages and errors
     /// @param aOnMessageCB is called when messages arrive or errors occur
     void setMessageHandler(WebSocketMessageCB aOnMessageCB) { mOnMessageCB = aOnMessageCB; };
@@ -130,9 +258,26 @@ namespace p44 {
     // helpers
     void cb_onopen();
     void cb_onclose();
-    void cb_onmessage(const string aMessage);
+    void cb_onmessage(const string aMessage, bool aCompressed);
+    void cb_onwrite();
     void cb_onerror(ErrorPtr aError);
 
+  private:
+
+    bool isOpen() { return mUwscClient && !mOnOpenCloseCB; };
+    void flushSendQueue(bool aAll);
+    void scheduleFlush(MLMicroSeconds aDelay);
+    void startMessage(QueuedMessage &aMsg);
+    void writeFrame(uint8_t aHead, const char* aData, size_t aLen);
+    void discardSendQueue();
+    void checkSendReady();
+    #if ENABLE_WEBSOCKET_COMPRESSION
+    void startCompression();
+    void endCompression();
+    bool deflateMessage(string &aData);
+    ErrorPtr inflateMessage(string &aData);
+    #endif
+
   };
 
 